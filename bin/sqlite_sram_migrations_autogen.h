@@ -22,6 +22,12 @@ CREATE TABLE IF NOT EXISTS snapshot_tombstones (
 	snapshot_id INTEGER PRIMARY KEY,
 	ts_ms INTEGER NOT NULL
 );
+)__MIG__"},
+	{"202602180004_add_snapshot_deltas.sql", R"__MIG__(
+ALTER TABLE snapshots ADD COLUMN base_id INTEGER DEFAULT NULL;
+ALTER TABLE snapshots ADD COLUMN size INTEGER DEFAULT NULL;
+UPDATE snapshots SET size = length(sram);
+CREATE INDEX IF NOT EXISTS snapshots_base_id ON snapshots(base_id) WHERE base_id IS NOT NULL;
 )__MIG__"},
 };
 
@@ -0,0 +1,636 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "capture.h"
+#include "scaler.h"
+#include "file_io.h"
+#include "menu.h"
+#include "video.h"
+#include "hardware.h"
+#include "miniz.h"
+
+// Frames in flight. Snapshots are taken into a free slot and the slot is
+// handed to the capture thread; with none free a recording frame is
+// dropped, so memory stays at CAPTURE_SLOTS frames however slow the card is.
+// Encoding has its own thread so a slow card doesn't hold up the write-back
+// and SRAM flushes on the offload lanes.
+#define CAPTURE_SLOTS   3
+#define CAPTURE_JOBS    8   // frames plus the header and close of a recording
+#define CAPTURE_NICE    10
+#define RECORD_FPS      10
+#define RECORD_FPS_MAX  60
+
+enum
+{
+	SLOT_FREE = 0,
+	SLOT_BUSY,   // owned by the capture thread
+	SLOT_DONE,   // screenshot written, waiting for capture_poll()
+	SLOT_FAILED
+};
+
+enum
+{
+	JOB_PNG = 0,
+	JOB_HEADER,
+	JOB_FRAME,
+	JOB_CLOSE
+};
+
+struct capture_slot_t
+{
+	uint8_t *data;      // packed RGB24
+	size_t size;
+	int width;
+	int height;
+	int out_width;      // screenshot rescale target, 0 to keep the size
+	int out_height;
+	int state;
+	capture_done_t done;
+	char path[1024];
+	char name[1024];
+};
+
+struct capture_job_t
+{
+	int type;
+	capture_slot_t *slot;
+	int fd;
+	int width;
+	int height;
+	int fps;
+	int raw;
+};
+
+struct record_t
+{
+	int active;
+	int fd;
+	int raw;
+	int fps;
+	int width;
+	int height;
+	uint64_t period_us;
+	uint64_t next_us;
+	mister_scaler *ms;
+};
+
+static capture_slot_t slots[CAPTURE_SLOTS] = {};
+static record_t rec = {};
+
+static capture_job_t jobs[CAPTURE_JOBS];
+static uint32_t job_head = 0;
+static uint32_t job_tail = 0;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_free = PTHREAD_COND_INITIALIZER;
+static int worker_state = 0;  // 1 running, -1 no thread, jobs run inline
+
+// used only by the capture thread
+static uint8_t *yuv_buf = NULL;
+static size_t yuv_size = 0;
+
+// the written, encode and frame fields are updated by the capture thread
+static struct
+{
+	uint64_t shots;
+	uint64_t shots_failed;
+	uint64_t frames;
+	uint64_t dropped;
+	uint64_t written;
+	uint64_t snap_us;
+	uint64_t snap_max_us;
+	uint64_t snaps;
+	uint64_t encode_us;
+	uint64_t encode_max_us;
+	uint64_t frame_us;
+	uint64_t frame_max_us;
+} stats;
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t*)buf;
+	while (len)
+	{
+		ssize_t n = write(fd, p, len);
+		if (n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+// Takes the current frame into a free slot. Runs on the main thread and
+// only does the bulk copy out of the scaler.
+static capture_slot_t *snapshot(mister_scaler *ms)
+{
+	capture_slot_t *slot = NULL;
+	for (int i = 0; i < CAPTURE_SLOTS; i++)
+	{
+		if (__atomic_load_n(&slots[i].state, __ATOMIC_ACQUIRE) == SLOT_FREE)
+		{
+			slot = &slots[i];
+			break;
+		}
+	}
+	if (!slot || ms->width <= 0 || ms->height <= 0) return NULL;
+
+	uint64_t t = time_us();
+
+	size_t size = (size_t)ms->width * ms->height * 3;
+	if (slot->size < size)
+	{
+		free(slot->data);
+		slot->data = (uint8_t*)malloc(size);
+		slot->size = slot->data ? size : 0;
+		if (!slot->data) return NULL;
+	}
+
+	mister_scaler_read(ms, slot->data);
+	slot->width = ms->width;
+	slot->height = ms->height;
+	slot->out_width = 0;
+	slot->out_height = 0;
+	slot->done = NULL;
+
+	t = time_us() - t;
+	stats.snaps++;
+	stats.snap_us += t;
+	if (t > stats.snap_max_us) stats.snap_max_us = t;
+
+	return slot;
+}
+
+// Bilinear, 8 bit weights, sampling at pixel centres.
+static void resize_rgb(const uint8_t *src, int sw, int sh, uint8_t *dst, int dw, int dh)
+{
+	int *xo = (int*)malloc(dw * 2 * sizeof(int));
+	if (!xo) return;
+
+	for (int x = 0; x < dw; x++)
+	{
+		int64_t fx = (((int64_t)(2 * x + 1) * sw) << 15) / dw - 32768;
+		if (fx < 0) fx = 0;
+		int x0 = fx >> 16;
+		if (x0 >= sw - 1)
+		{
+			x0 = sw - 1;
+			fx = (int64_t)x0 << 16;
+		}
+		xo[x * 2] = x0;
+		xo[x * 2 + 1] = (fx >> 8) & 0xFF;
+	}
+
+	for (int y = 0; y < dh; y++)
+	{
+		int64_t fy = (((int64_t)(2 * y + 1) * sh) << 15) / dh - 32768;
+		if (fy < 0) fy = 0;
+		int y0 = fy >> 16;
+		int wy = (fy >> 8) & 0xFF;
+		if (y0 >= sh - 1)
+		{
+			y0 = sh - 1;
+			wy = 0;
+		}
+
+		const uint8_t *r0 = src + (size_t)y0 * sw * 3;
+		const uint8_t *r1 = (y0 < sh - 1) ? r0 + sw * 3 : r0;
+		uint8_t *out = dst + (size_t)y * dw * 3;
+
+		for (int x = 0; x < dw; x++)
+		{
+			int x0 = xo[x * 2];
+			int wx = xo[x * 2 + 1];
+			int x1 = (x0 < sw - 1) ? x0 + 1 : x0;
+
+			for (int c = 0; c < 3; c++)
+			{
+				int top = r0[x0 * 3 + c] * (256 - wx) + r0[x1 * 3 + c] * wx;
+				int bot = r1[x0 * 3 + c] * (256 - wx) + r1[x1 * 3 + c] * wx;
+				*out++ = (top * (256 - wy) + bot * wy + 32768) >> 16;
+			}
+		}
+	}
+
+	free(xo);
+}
+
+// runs on the capture thread
+static void encode_png(capture_slot_t *slot)
+{
+	uint64_t t = time_us();
+
+	const uint8_t *img = slot->data;
+	int w = slot->width;
+	int h = slot->height;
+
+	uint8_t *scaled = NULL;
+	if (slot->out_width > 0 && slot->out_height > 0 && (slot->out_width != w || slot->out_height != h))
+	{
+		scaled = (uint8_t*)malloc((size_t)slot->out_width * slot->out_height * 3);
+		if (scaled)
+		{
+			resize_rgb(img, w, h, scaled, slot->out_width, slot->out_height);
+			img = scaled;
+			w = slot->out_width;
+			h = slot->out_height;
+		}
+	}
+
+	size_t len = 0;
+	void *png = tdefl_write_image_to_png_file_in_memory_ex(img, w, h, 3, &len, MZ_DEFAULT_LEVEL, 0);
+	free(scaled);
+
+	int ok = 0;
+	if (png)
+	{
+		int fd = open(slot->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+		if (fd >= 0)
+		{
+			ok = write_all(fd, png, len);
+			if (close(fd)) ok = 0;
+			if (!ok) unlink(slot->path);
+		}
+		mz_free(png);
+	}
+
+	t = time_us() - t;
+	__atomic_fetch_add(&stats.encode_us, t, __ATOMIC_RELAXED);
+	if (t > __atomic_load_n(&stats.encode_max_us, __ATOMIC_RELAXED)) __atomic_store_n(&stats.encode_max_us, t, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&slot->state, ok ? SLOT_DONE : SLOT_FAILED, __ATOMIC_RELEASE);
+}
+
+static void record_header(int fd, int width, int height, int fps, int raw);
+static void record_frame(capture_slot_t *slot, int fd, int raw);
+static void record_close(int fd);
+
+static void run_job(const capture_job_t *job)
+{
+	switch (job->type)
+	{
+	case JOB_PNG:
+		encode_png(job->slot);
+		break;
+
+	case JOB_HEADER:
+		record_header(job->fd, job->width, job->height, job->fps, job->raw);
+		break;
+
+	case JOB_FRAME:
+		record_frame(job->slot, job->fd, job->raw);
+		break;
+
+	case JOB_CLOSE:
+		record_close(job->fd);
+		break;
+	}
+}
+
+static void *capture_thread(void *)
+{
+	// bulk work, the offload workers on the same core go first
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), CAPTURE_NICE);
+
+	for (;;)
+	{
+		pthread_mutex_lock(&job_lock);
+		while (job_head == job_tail) pthread_cond_wait(&job_ready, &job_lock);
+		capture_job_t job = jobs[job_tail % CAPTURE_JOBS];
+		pthread_mutex_unlock(&job_lock);
+
+		run_job(&job);
+
+		pthread_mutex_lock(&job_lock);
+		job_tail++;
+		pthread_cond_signal(&job_free);
+		pthread_mutex_unlock(&job_lock);
+	}
+
+	return NULL;
+}
+
+// Jobs run in submission order. Frames are bounded by the slots, so the
+// queue only fills when recordings are started and stopped faster than they
+// are written; the caller waits then.
+static void queue_job(const capture_job_t &job)
+{
+	if (!worker_state)
+	{
+		// core #0 next to the offload workers since main runs on core #1
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(0, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+		pthread_t thread;
+		worker_state = pthread_create(&thread, &attr, capture_thread, NULL) ? -1 : 1;
+		pthread_attr_destroy(&attr);
+
+		if (worker_state > 0) pthread_detach(thread);
+		else printf("capture: no thread, encoding inline.\n");
+	}
+
+	if (worker_state < 0)
+	{
+		run_job(&job);
+		return;
+	}
+
+	pthread_mutex_lock(&job_lock);
+	while (job_head - job_tail == CAPTURE_JOBS) pthread_cond_wait(&job_free, &job_lock);
+	jobs[job_head++ % CAPTURE_JOBS] = job;
+	pthread_cond_signal(&job_ready);
+	pthread_mutex_unlock(&job_lock);
+}
+
+bool capture_screenshot(const char *name, int rescale, capture_done_t done)
+{
+	mister_scaler *ms = mister_scaler_init();
+	if (ms == NULL)
+	{
+		printf("problem with scaler, maybe not a new enough version\n");
+		Info("Scaler not compatible");
+		return false;
+	}
+
+	int scwidth = ms->output_width;
+	int scheight = ms->output_height;
+
+	if (video_get_rotated())
+	{
+		//If the video is rotated, the scaled output resolution results in a squished image.
+		//Calculate the scaled output res using the original AR
+		scwidth = scheight * ((float)ms->width / ms->height);
+	}
+
+	capture_slot_t *slot = snapshot(ms);
+	mister_scaler_free(ms);
+
+	if (!slot)
+	{
+		printf("Screenshot: no free buffer, previous screenshots are still being saved.\n");
+		Info("Screenshot busy");
+		return false;
+	}
+
+	if (rescale)
+	{
+		slot->out_width = scwidth;
+		slot->out_height = scheight;
+	}
+
+	FileGenerateScreenshotName(name ? name : "", slot->name, sizeof(slot->name));
+	snprintf(slot->path, sizeof(slot->path), "%s", getFullPath(slot->name));
+
+	stats.shots++;
+	slot->done = done;
+	slot->state = SLOT_BUSY;
+
+	capture_job_t job = { JOB_PNG, slot, -1, 0, 0, 0, 0 };
+	queue_job(job);
+	return true;
+}
+
+// runs on the capture thread
+static void record_header(int fd, int width, int height, int fps, int raw)
+{
+	if (raw) return;
+
+	char hdr[128];
+	int len = snprintf(hdr, sizeof(hdr), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, fps);
+	if (write_all(fd, hdr, len)) __atomic_fetch_add(&stats.written, len, __ATOMIC_RELAXED);
+}
+
+// runs on the capture thread
+static void record_frame(capture_slot_t *slot, int fd, int raw)
+{
+	uint64_t t = time_us();
+	size_t plane = (size_t)slot->width * slot->height;
+
+	if (raw)
+	{
+		if (write_all(fd, slot->data, plane * 3)) __atomic_fetch_add(&stats.written, plane * 3, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		if (yuv_size < plane * 3)
+		{
+			free(yuv_buf);
+			yuv_buf = (uint8_t*)malloc(plane * 3);
+			yuv_size = yuv_buf ? plane * 3 : 0;
+		}
+
+		if (yuv_buf)
+		{
+			uint8_t *y = yuv_buf;
+			uint8_t *u = y + plane;
+			uint8_t *v = u + plane;
+			for (int i = 0; i < slot->height; i++)
+			{
+				size_t off = (size_t)i * slot->width;
+				mister_scaler_rgb_to_yuv(slot->data + off * 3, slot->width, y + off, u + off, v + off);
+			}
+
+			if (write_all(fd, "FRAME\n", 6) && write_all(fd, yuv_buf, plane * 3)) __atomic_fetch_add(&stats.written, 6 + plane * 3, __ATOMIC_RELAXED);
+		}
+	}
+
+	t = time_us() - t;
+	__atomic_fetch_add(&stats.frame_us, t, __ATOMIC_RELAXED);
+	if (t > __atomic_load_n(&stats.frame_max_us, __ATOMIC_RELAXED)) __atomic_store_n(&stats.frame_max_us, t, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&slot->state, SLOT_FREE, __ATOMIC_RELEASE);
+}
+
+// runs on the capture thread, after the last frame
+static void record_close(int fd)
+{
+	close(fd);
+	free(yuv_buf);
+	yuv_buf = NULL;
+	yuv_size = 0;
+}
+
+bool capture_record_start(int fps, int raw)
+{
+	if (rec.active) capture_record_stop();
+
+	if (fps <= 0) fps = RECORD_FPS;
+	if (fps > RECORD_FPS_MAX) fps = RECORD_FPS_MAX;
+
+	mister_scaler *ms = mister_scaler_init();
+	if (!ms)
+	{
+		Info("Scaler not compatible");
+		return false;
+	}
+
+	// same naming as screenshots, with the extension swapped
+	char name[1024];
+	FileGenerateScreenshotName("", name, sizeof(name) - 32);
+	char *ext = strrchr(name, '.');
+	if (ext) *ext = 0;
+	if (raw) sprintf(name + strlen(name), "_%dx%d_%dfps.rgb", ms->width, ms->height, fps);
+	else strcat(name, ".y4m");
+
+	int fd = open(getFullPath(name), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd < 0)
+	{
+		printf("Record: couldn't create %s\n", name);
+		mister_scaler_free(ms);
+		Info("Recording failed");
+		return false;
+	}
+
+	rec.active = 1;
+	rec.fd = fd;
+	rec.raw = raw;
+	rec.fps = fps;
+	rec.width = ms->width;
+	rec.height = ms->height;
+	rec.ms = ms;
+	rec.period_us = 1000000 / fps;
+	rec.next_us = time_us();
+
+	int w = rec.width, h = rec.height;
+	capture_job_t job = { JOB_HEADER, NULL, fd, w, h, fps, raw };
+	queue_job(job);
+
+	printf("Record: %s, %dx%d %s at %d fps\n", name, w, h, raw ? "RGB24" : "Y4M 4:4:4", fps);
+	char msg[1200];
+	snprintf(msg, sizeof(msg), "Recording to\n%s", name + strlen(SCREENSHOT_DIR"/"));
+	Info(msg);
+	return true;
+}
+
+void capture_record_stop()
+{
+	if (!rec.active) return;
+
+	capture_job_t job = { JOB_CLOSE, NULL, rec.fd, 0, 0, 0, 0 };
+	queue_job(job);
+	mister_scaler_free(rec.ms);
+	rec.active = 0;
+	rec.ms = NULL;
+
+	printf("Record: stopped, %llu frames, %llu dropped\n", stats.frames, stats.dropped);
+	Info("Recording stopped");
+}
+
+int capture_recording()
+{
+	return rec.active;
+}
+
+void capture_record_cmd(const char *cmd)
+{
+	if (strncmp(cmd, "record", 6)) return;
+
+	cmd += 6;
+	while (*cmd == ' ' || *cmd == '\t') cmd++;
+
+	if (!strncmp(cmd, "stop", 4))
+	{
+		capture_record_stop();
+		return;
+	}
+
+	int fps = atoi(cmd);
+	capture_record_start(fps, strstr(cmd, "raw") != NULL);
+}
+
+static void record_poll()
+{
+	uint64_t now = time_us();
+	if (now < rec.next_us) return;
+
+	rec.next_us += rec.period_us;
+	if (rec.next_us <= now) rec.next_us = now + rec.period_us;
+
+	if (!mister_scaler_refresh(rec.ms) || rec.ms->width != rec.width || rec.ms->height != rec.height)
+	{
+		printf("Record: resolution changed to %dx%d.\n", rec.ms->width, rec.ms->height);
+		capture_record_stop();
+		return;
+	}
+
+	capture_slot_t *slot = snapshot(rec.ms);
+	if (!slot)
+	{
+		stats.dropped++;
+		return;
+	}
+
+	stats.frames++;
+	slot->state = SLOT_BUSY;
+
+	capture_job_t job = { JOB_FRAME, slot, rec.fd, 0, 0, 0, rec.raw };
+	queue_job(job);
+}
+
+void capture_poll()
+{
+	if (rec.active) record_poll();
+
+	for (int i = 0; i < CAPTURE_SLOTS; i++)
+	{
+		int state = __atomic_load_n(&slots[i].state, __ATOMIC_ACQUIRE);
+		if (state != SLOT_DONE && state != SLOT_FAILED) continue;
+
+		bool ok = (state == SLOT_DONE);
+		if (!ok)
+		{
+			stats.shots_failed++;
+			printf("Screenshot Error: couldn't write %s\n", slots[i].name);
+		}
+
+		if (slots[i].done)
+		{
+			slots[i].done(slots[i].name, ok);
+		}
+		else if (ok)
+		{
+			char msg[1024];
+			snprintf(msg, sizeof(msg), "Screen saved to\n%s", slots[i].name + strlen(SCREENSHOT_DIR"/"));
+			Info(msg);
+		}
+		else
+		{
+			Info("error in saving png");
+		}
+
+		slots[i].state = SLOT_FREE;
+	}
+}
+
+void capture_print_stats()
+{
+	uint64_t encoded = stats.shots - stats.shots_failed;
+	uint64_t written = __atomic_load_n(&stats.written, __ATOMIC_RELAXED);
+	uint64_t encode_us = __atomic_load_n(&stats.encode_us, __ATOMIC_RELAXED);
+	uint64_t encode_max_us = __atomic_load_n(&stats.encode_max_us, __ATOMIC_RELAXED);
+	uint64_t frame_us = __atomic_load_n(&stats.frame_us, __ATOMIC_RELAXED);
+	uint64_t frame_max_us = __atomic_load_n(&stats.frame_max_us, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&job_lock);
+	uint32_t queued = job_head - job_tail;
+	pthread_mutex_unlock(&job_lock);
+
+	printf("capture: %llu screenshots (%llu failed), %llu frames recorded, %llu dropped, %llu MB written, %u jobs queued\n",
+		stats.shots, stats.shots_failed, stats.frames, stats.dropped, written >> 20, queued);
+	printf("capture: snapshot avg/max %llu/%llu us, png avg/max %llu/%llu ms, frame write avg/max %llu/%llu ms\n",
+		stats.snaps ? stats.snap_us / stats.snaps : 0, stats.snap_max_us,
+		encoded ? encode_us / encoded / 1000 : 0, encode_max_us / 1000,
+		stats.frames ? frame_us / stats.frames / 1000 : 0, frame_max_us / 1000);
+}
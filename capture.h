@@ -0,0 +1,32 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// Screenshots and frame recording from the scaler buffer. The frame is
+// copied out of the scaler on the calling thread; scaling, encoding and file
+// writes happen on a capture thread, so the main loop keeps running.
+
+// Called from capture_poll() once a screenshot is written or has failed.
+typedef void (*capture_done_t)(const char *name, bool ok);
+
+// Queues a PNG of the current frame. name is a base name or a .png path as
+// for FileGenerateScreenshotName(); rescale stretches it to the output size.
+// Returns false if it couldn't be queued. The outcome goes to done, or
+// without one, to an OSD message.
+bool capture_screenshot(const char *name, int rescale, capture_done_t done = NULL);
+
+// Starts streaming frames at fps to screenshots/<core>/ as Y4M (4:4:4) or
+// raw RGB24. Frames are dropped rather than queued while the writer lags.
+bool capture_record_start(int fps, int raw);
+void capture_record_stop();
+int capture_recording();
+
+// "record [fps] [raw|y4m]" starts, "record stop" stops.
+void capture_record_cmd(const char *cmd);
+
+// Called from the main loop: takes recording frames when due and reports
+// finished screenshots.
+void capture_poll();
+
+void capture_print_stats();
+
+#endif
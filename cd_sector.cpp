@@ -0,0 +1,97 @@
+#include <string.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "cd_sector.h"
+
+#define EDC_POLY      0xD8018001   // 0x8001801B reflected
+#define RING_START    12
+#define RING_END      2348
+
+struct cd_tables_t
+{
+	uint32_t edc[8][256];
+	uint8_t ring[RING_END - RING_START];
+
+	cd_tables_t()
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (int j = 0; j < 8; j++) c = (c >> 1) ^ ((c & 1) ? EDC_POLY : 0);
+			edc[0][i] = c;
+		}
+
+		for (int k = 1; k < 8; k++)
+		{
+			for (int i = 0; i < 256; i++) edc[k][i] = (edc[k - 1][i] >> 8) ^ edc[0][edc[k - 1][i] & 0xFF];
+		}
+
+		uint16_t lfsr = 1;
+		for (int i = RING_START; i < RING_END; i++)
+		{
+			uint8_t a = (i & 1) ? 0x59 : 0xa8;
+			for (int j = 0; j < 8; j++)
+			{
+				a ^= (lfsr & 1);
+				a = (a >> 1) | (a << 7);
+
+				uint16_t x = (lfsr >> 1) ^ lfsr;
+				lfsr |= x << 15;
+				lfsr >>= 1;
+			}
+			ring[i - RING_START] = a;
+		}
+	}
+};
+
+static const cd_tables_t &tables()
+{
+	static const cd_tables_t t;
+	return t;
+}
+
+uint32_t cd_sector_edc(uint32_t edc, const void *buf, size_t len)
+{
+	const uint32_t (*tab)[256] = tables().edc;
+	const uint8_t *p = (const uint8_t*)buf;
+
+	// slice-by-8, little endian
+	for (; len >= 8; p += 8, len -= 8)
+	{
+		uint32_t a, b;
+		memcpy(&a, p, 4);
+		memcpy(&b, p + 4, 4);
+		a ^= edc;
+
+		edc = tab[7][a & 0xFF] ^ tab[6][(a >> 8) & 0xFF] ^ tab[5][(a >> 16) & 0xFF] ^ tab[4][a >> 24] ^
+			tab[3][b & 0xFF] ^ tab[2][(b >> 8) & 0xFF] ^ tab[1][(b >> 16) & 0xFF] ^ tab[0][b >> 24];
+	}
+
+	for (; len; p++, len--) edc = (edc >> 8) ^ tab[0][(edc ^ *p) & 0xFF];
+	return edc;
+}
+
+void cd_sector_swap16(void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t*)buf;
+
+#ifdef __ARM_NEON
+	for (; len >= 16; p += 16, len -= 16) vst1q_u8(p, vrev16q_u8(vld1q_u8(p)));
+#endif
+
+	// the compiler vectorizes this plain loop better than word swaps
+	for (; len >= 2; p += 2, len -= 2)
+	{
+		uint8_t t = p[0];
+		p[0] = p[1];
+		p[1] = t;
+	}
+}
+
+void cd_sector_ring_data(uint8_t *sector)
+{
+	memcpy(sector + RING_START, tables().ring, RING_END - RING_START);
+}
@@ -0,0 +1,21 @@
+#ifndef CD_SECTOR_H
+#define CD_SECTOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Sector math shared by the CD drivers. Run these on cached buffers: the
+// shared memory windows are mapped uncached and every byte read from them
+// goes out to the FPGA bus.
+
+// CD-ROM EDC (CRC-32, polynomial 0x8001801B, reflected, no final xor).
+// Start with edc = 0; pass the result back in to continue a block.
+uint32_t cd_sector_edc(uint32_t edc, const void *buf, size_t len);
+
+// Swaps the bytes of every 16-bit word. CHD stores CD audio big-endian.
+void cd_sector_swap16(void *buf, size_t len);
+
+// Fills bytes 12..2347 of a Saturn security ring sector.
+void cd_sector_ring_data(uint8_t *sector);
+
+#endif
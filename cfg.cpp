@@ -8,17 +8,30 @@
 #include <string.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
 #include "cfg.h"
 #include "debug.h"
 #include "file_io.h"
 #include "user_io.h"
 #include "video.h"
 #include "support/arcade/mra_loader.h"
+#include "fpga_sim.h"
 
 cfg_t cfg;
 static FILE *orig_stdout = NULL;
 static FILE *dev_null = NULL;
 
+// where stdout goes when DEBUG is off. A simulated run is made for its log.
+static FILE *quiet_stdout()
+{
+#ifdef FPGA_SIM
+	if (fpga_sim_active()) return orig_stdout;
+#endif
+	return dev_null;
+}
+
 typedef enum
 {
 	UINT8 = 0, INT8, UINT16, INT16, UINT32, INT32, HEX8, HEX16, HEX32, FLOAT, STRING, UINT32ARR, HEX32ARR, STRINGARR
@@ -136,6 +149,10 @@ static const ini_var_t ini_vars[] =
 	{ "MAIN", (void*)(&(cfg.main)), STRING, 0, sizeof(cfg.main) - 1 },
 	{"VFILTER_INTERLACE_DEFAULT", (void*)(&(cfg.vfilter_interlace_default)), STRING, 0, sizeof(cfg.vfilter_interlace_default) - 1 },
 	{ "AUTOFIRE_RATES", (void *)(&(cfg.autofire_rates)), STRING, 0, sizeof(cfg.autofire_rates) - 1 },
+	{ "IDLE_SLEEP_US", (void *)(&(cfg.idle_sleep_us)), UINT16, 0, 20000 },
+	{ "SD_WRITEBACK", (void *)(&(cfg.sd_writeback)), UINT16, 0, 0xFFFF },
+	{ "IDE_WRITEBACK", (void *)(&(cfg.ide_writeback)), UINT8, 0, 15 },
+	{ "DIR_CACHE", (void *)(&(cfg.dir_cache)), UINT8, 0, 2 },
 
 };
 
@@ -164,18 +181,94 @@ static const int nvars = (int)(sizeof(ini_vars) / sizeof(ini_var_t));
 #define CHAR_IS_QUOTE(c)        (((c) == '"'))
 
 
-fileTYPE ini_file;
-
 static bool has_video_sections = false;
 static bool using_video_section = false;
 
-int ini_pt = 0;
+// The INI is compiled once per file version into records: section headers
+// split at load, keys resolved to ini_vars[] entries, numbers parsed and
+// range checked. cfg_parse() walks the records, so re-applying the INI on a
+// video mode change doesn't touch the file.
+enum
+{
+	INI_REC_SECTION = 0,
+	INI_REC_INCLUDE,
+	INI_REC_VAR
+};
+
+enum
+{
+	INI_OK = 0,
+	INI_ERR_NAN,
+	INI_ERR_RANGE,
+	INI_ERR_FORMAT
+};
+
+struct ini_rec_t
+{
+	uint8_t kind;
+	uint8_t err;         // numeric parse result, reported when applied
+	int16_t var_id;      // -1 for an unknown key
+	int16_t wc_pos;      // section name wildcard position
+	int16_t eq_pos;      // section name '=' position
+	uint32_t text;       // section name or key, offset into text
+	uint32_t value;      // value, offset into text
+	alignas(4) uint8_t val[4]; // parsed numeric value, stored as the var's type
+};
+
+static struct
+{
+	char name[64];
+	int64_t mtime;
+	int64_t size;
+	bool loaded;
+	std::vector<ini_rec_t> recs;
+	std::vector<char> text;
+} ini_index;
+
+#define INI_HASH_SIZE 512
+static int16_t ini_hash[INI_HASH_SIZE];
+
+static uint32_t ini_key_hash(const char *key)
+{
+	uint32_t h = 2166136261u;
+	for (; *key; key++) h = (h ^ (uint8_t)toupper((uint8_t)*key)) * 16777619u;
+	return h;
+}
+
+// open addressing over ini_vars[], built on first use
+static int ini_find_var(const char *key)
+{
+	static bool built = false;
+	if (!built)
+	{
+		built = true;
+		memset(ini_hash, -1, sizeof(ini_hash));
+		for (int j = 0; j < nvars; j++)
+		{
+			uint32_t h = ini_key_hash(ini_vars[j].name);
+			while (ini_hash[h & (INI_HASH_SIZE - 1)] >= 0) h++;
+			ini_hash[h & (INI_HASH_SIZE - 1)] = j;
+		}
+	}
+
+	uint32_t h = ini_key_hash(key);
+	while (1)
+	{
+		int j = ini_hash[h & (INI_HASH_SIZE - 1)];
+		if (j < 0) return -1;
+		if (!strcasecmp(key, ini_vars[j].name)) return j;
+		h++;
+	}
+}
+
+static const char *ini_buf = NULL;
+static int ini_size = 0;
+static int ini_pt = 0;
+
 static char ini_getch()
 {
-	static uint8_t buf[512];
-	if (!(ini_pt & 0x1ff)) FileReadSec(&ini_file, buf);
-	if (ini_pt >= ini_file.size) return 0;
-	return buf[(ini_pt++) & 0x1ff];
+	if (ini_pt >= ini_size) return 0;
+	return ini_buf[ini_pt++];
 }
 
 static int ini_getline(char* line)
@@ -196,37 +289,8 @@ static int ini_getline(char* line)
 	return c == 0;
 }
 
-static int ini_get_section(char* buf, const char *vmode)
+static int ini_section_match(const char *buf, int wc_pos, int eq_pos, int incl, const char *vmode)
 {
-	int i = 0;
-	int incl = (buf[0] == INCL_SECTION);
-
-	// get section start marker
-	if (buf[0] != INI_SECTION_START && buf[0] != INCL_SECTION)
-	{
-		return 0;
-	}
-	else buf++;
-
-	int wc_pos = -1;
-	int eq_pos = -1;
-
-	// get section stop marker
-	while (buf[i])
-	{
-		if (buf[i] == INI_SECTION_END)
-		{
-			buf[i] = 0;
-			break;
-		}
-
-		if (buf[i] == '*') wc_pos = i;
-		if (buf[i] == '=') eq_pos = i;
-
-		i++;
-		if (i >= INI_LINE_SIZE) return 0;
-	}
-
 	if (!strcasecmp(buf, "MiSTer") ||
 		(is_arcade() && !strcasecmp(buf, "arcade")) ||
 		(arcade_is_vertical() && !strcasecmp(buf, "arcade_vertical")) ||
@@ -261,7 +325,7 @@ static int ini_get_section(char* buf, const char *vmode)
 	return 0;
 }
 
-static void ini_parse_numeric(const ini_var_t *var, const char *text, void *out)
+static int ini_parse_numeric(const ini_var_t *var, const char *text, void *out)
 {
 	uint32_t u32 = 0;
 	int32_t i32 = 0;
@@ -311,10 +375,6 @@ static void ini_parse_numeric(const ini_var_t *var, const char *text, void *out)
 		break;
 	}
 
-	if (*endptr) cfg_error("%s: \'%s\' not a number", var->name, text);
-	else if (out_of_range) cfg_error("%s: \'%s\' out of range", var->name, text);
-	else if (invalid_format) cfg_error("%s: \'%s\' invalid format", var->name, text);
-
 	switch (var->type)
 	{
 	case HEX8:
@@ -331,12 +391,120 @@ static void ini_parse_numeric(const ini_var_t *var, const char *text, void *out)
 	case FLOAT: *(float*)out = f32; break;
 	default: break;
 	}
+
+	if (*endptr) return INI_ERR_NAN;
+	if (out_of_range) return INI_ERR_RANGE;
+	if (invalid_format) return INI_ERR_FORMAT;
+	return INI_OK;
+}
+
+static void ini_numeric_error(const ini_var_t *var, const char *text, int err)
+{
+	if (err == INI_ERR_NAN) cfg_error("%s: \'%s\' not a number", var->name, text);
+	else if (err == INI_ERR_RANGE) cfg_error("%s: \'%s\' out of range", var->name, text);
+	else if (err == INI_ERR_FORMAT) cfg_error("%s: \'%s\' invalid format", var->name, text);
+}
+
+static int ini_var_size(const ini_var_t *var)
+{
+	switch (var->type)
+	{
+	case UINT8: case INT8: case HEX8: return 1;
+	case UINT16: case INT16: case HEX16: return 2;
+	default: return 4;
+	}
 }
 
 // Used to determine if an array variable should be appended or restarted.
 static bool var_array_append[sizeof(ini_vars) / sizeof(ini_var_t)] = {};
 
-static void ini_parse_var(char* buf)
+static void ini_apply_var(const ini_rec_t *rec)
+{
+	const char *key = &ini_index.text[rec->text];
+	const char *value = &ini_index.text[rec->value];
+
+	if (rec->var_id == -1)
+	{
+		cfg_error("%s: unknown option", key);
+		return;
+	}
+
+	ini_parser_debugf("Got VAR '%s' with VALUE %s", key, value);
+
+	int var_id = rec->var_id;
+	const ini_var_t *var = &ini_vars[var_id];
+
+	switch (var->type)
+	{
+	case STRING:
+		memset(var->var, 0, var->max);
+		snprintf((char*)(var->var), var->max, "%s", value);
+		break;
+
+	case STRINGARR:
+		{
+			int item_sz = var->max;
+
+			if (!var_array_append[var_id])
+			{
+				var_array_append[var_id] = true;
+
+				for (int n = 0; n < var->min; n++)
+				{
+					char *str = ((char*)var->var) + (n * item_sz);
+					str[0] = 0;
+				}
+			}
+
+			for (int n = 0; n < var->min; n++)
+			{
+				char *str = ((char*)var->var) + (n * item_sz);
+				if (!strlen(str))
+				{
+					snprintf(str, item_sz, "%s", value);
+					break;
+				}
+			}
+		}
+		break;
+
+	case HEX32ARR:
+	case UINT32ARR:
+		{
+			if (!var_array_append[var_id])
+			{
+				var_array_append[var_id] = true;
+
+				uint32_t *arr = (uint32_t*)var->var;
+				arr[0] = 0;
+			}
+
+			uint32_t *arr = (uint32_t*)var->var;
+			uint32_t pos = ++arr[0];
+			memcpy(&arr[pos], rec->val, 4);
+			ini_numeric_error(var, value, rec->err);
+		}
+		break;
+
+	default:
+		memcpy(var->var, rec->val, ini_var_size(var));
+		ini_numeric_error(var, value, rec->err);
+		if (!strcasecmp(var->name, "DEBUG"))
+		{
+			stdout = cfg.debug ? orig_stdout : quiet_stdout();
+		}
+		break;
+	}
+}
+
+static uint32_t ini_add_text(const char *str)
+{
+	uint32_t pos = ini_index.text.size();
+	ini_index.text.insert(ini_index.text.end(), str, str + strlen(str) + 1);
+	return pos;
+}
+
+static void ini_compile_var(ini_rec_t *rec, char *buf)
 {
 	// find var
 	int i = 0;
@@ -351,92 +519,102 @@ static void ini_parse_var(char* buf)
 		i++;
 	}
 
-	// parse var
-	int var_id = -1;
-	for (int j = 0; j < (int)(sizeof(ini_vars) / sizeof(ini_var_t)); j++)
-	{
-		if (!strcasecmp(buf, ini_vars[j].name)) var_id = j;
-	}
+	i++;
+	while (buf[i] == '=' || CHAR_IS_SPACE(buf[i])) i++;
+
+	rec->var_id = ini_find_var(buf);
+	rec->text = ini_add_text(buf);
+	rec->value = ini_add_text(buf + i);
 
-	if (var_id == -1)
+	if (rec->var_id >= 0)
 	{
-		cfg_error("%s: unknown option", buf);
+		const ini_var_t *var = &ini_vars[rec->var_id];
+		if (var->type != STRING && var->type != STRINGARR) rec->err = ini_parse_numeric(var, buf + i, rec->val);
 	}
-	else // get data
-	{
-		i++;
-		while (buf[i] == '=' || CHAR_IS_SPACE(buf[i])) i++;
-		ini_parser_debugf("Got VAR '%s' with VALUE %s", buf, buf+i);
 
-		const ini_var_t *var = &ini_vars[var_id];
+	rec->kind = INI_REC_VAR;
+	ini_index.recs.push_back(*rec);
+}
+
+static void ini_compile_section(ini_rec_t *rec, char *buf, int kind)
+{
+	char *name = buf + 1;
+	int i = 0;
 
-		switch (var->type)
+	rec->wc_pos = -1;
+	rec->eq_pos = -1;
+
+	// get section stop marker
+	while (name[i])
+	{
+		if (name[i] == INI_SECTION_END)
 		{
-		case STRING:
-			memset(var->var, 0, var->max);
-			snprintf((char*)(var->var), var->max, "%s", buf+i);
+			name[i] = 0;
 			break;
+		}
 
-		case STRINGARR:
-			{
-				int item_sz = var->max;
+		if (name[i] == '*') rec->wc_pos = i;
+		if (name[i] == '=') rec->eq_pos = i;
+		i++;
+	}
 
-				if (!var_array_append[var_id])
-				{
-					var_array_append[var_id] = true;
+	rec->kind = kind;
+	rec->text = ini_add_text(name);
+	ini_index.recs.push_back(*rec);
+}
 
-					for (int n = 0; n < var->min; n++)
-					{
-						char *str = ((char*)var->var) + (n * item_sz);
-						str[0] = 0;
-					}
-				}
+static void ini_compile(const char *name)
+{
+	ini_index.recs.clear();
+	ini_index.text.clear();
 
-				for (int n = 0; n < var->min; n++)
-				{
-					char *str = ((char*)var->var) + (n * item_sz);
-					if (!strlen(str))
-					{
-						snprintf(str, item_sz, "%s", buf + i);
-						break;
-					}
-				}
-			}
-			break;
+	int size = FileLoad(name, 0, 0);
+	char *buf = size ? (char*)malloc(size) : NULL;
+	if (!buf || FileLoad(name, buf, size) != size)
+	{
+		free(buf);
+		return;
+	}
 
-		case HEX32ARR:
-		case UINT32ARR:
-			{
-				if (!var_array_append[var_id])
-				{
-					var_array_append[var_id] = true;
+	ini_parser_debugf("Compiling %s, %d bytes.", name, size);
 
-					uint32_t *arr = (uint32_t*)var->var;
-					arr[0] = 0;
-				}
+	static char line[INI_LINE_SIZE];
+	ini_buf = buf;
+	ini_size = size;
+	ini_pt = 0;
 
-				uint32_t *arr = (uint32_t*)var->var;
-				uint32_t pos = ++arr[0];
-				ini_parse_numeric(var, &buf[i], &arr[pos]);
-			}
-			break;
+	while (1)
+	{
+		int eof = ini_getline(line);
 
-		default:
-			ini_parse_numeric(var, &buf[i], var->var);
-			if (!strcasecmp(var->name, "DEBUG"))
-			{
-				stdout = cfg.debug ? orig_stdout : dev_null;
-			}
-			break;
+		ini_rec_t rec = {};
+		if (line[0] == INI_SECTION_START)
+		{
+			ini_compile_section(&rec, line, INI_REC_SECTION);
+		}
+		else if (line[0] == INCL_SECTION)
+		{
+			// inside a matched section this line is read as an option
+			char tmp[INI_LINE_SIZE];
+			strcpy(tmp, line);
+			ini_compile_var(&rec, tmp);
+			ini_compile_section(&rec, line, INI_REC_INCLUDE);
+		}
+		else
+		{
+			ini_compile_var(&rec, line);
 		}
+
+		if (eof) break;
 	}
+
+	ini_buf = NULL;
+	free(buf);
 }
 
 static void ini_parse(int alt, const char *vmode)
 {
-	static char line[INI_LINE_SIZE];
 	int section = 0;
-	int eof;
 
 	if (!orig_stdout) orig_stdout = stdout;
 	if (!dev_null)
@@ -446,57 +624,49 @@ static void ini_parse(int alt, const char *vmode)
 		{
 			int null_fd = fileno(dev_null);
 			if (null_fd >= 0) fcntl(null_fd, F_SETFD, FD_CLOEXEC);
-			stdout = dev_null;
+			stdout = quiet_stdout();
 		}
 	}
 
 	ini_parser_debugf("Start INI parser for core \"%s\"(%s), video mode \"%s\".", user_io_get_core_name(0), user_io_get_core_name(1), vmode);
 
-	memset(line, 0, sizeof(line));
-	memset(&ini_file, 0, sizeof(ini_file));
-
 	const char *name = cfg_get_name(alt);
-	if (!FileOpen(&ini_file, name))	return;
-
-	ini_parser_debugf("Opened file %s with size %llu bytes.", name, ini_file.size);
+	struct stat64 *st = getPathStat(name);
+	if (!st || !S_ISREG(st->st_mode))
+	{
+		ini_index.loaded = false;
+		return;
+	}
 
-	ini_pt = 0;
+	int64_t mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+	if (!ini_index.loaded || strcmp(ini_index.name, name) || ini_index.mtime != mtime || ini_index.size != st->st_size)
+	{
+		snprintf(ini_index.name, sizeof(ini_index.name), "%s", name);
+		ini_index.mtime = mtime;
+		ini_index.size = st->st_size;
+		ini_compile(name);
+		ini_index.loaded = true;
+	}
 
-	// parse ini
-	while (1)
+	for (const ini_rec_t &rec : ini_index.recs)
 	{
-		// get line
-		eof = ini_getline(line);
-		ini_parser_debugf("line(%d): \"%s\".", section, line);
+		const char *text = &ini_index.text[rec.text];
 
-		if (line[0] == INI_SECTION_START)
+		if (rec.kind == INI_REC_SECTION)
 		{
-			// if first char in line is INI_SECTION_START, get section
-			section = ini_get_section(line, vmode);
-			if (section)
-			{
-				memset(var_array_append, 0, sizeof(var_array_append));
-			}
+			section = ini_section_match(text, rec.wc_pos, rec.eq_pos, 0, vmode);
+			if (section) memset(var_array_append, 0, sizeof(var_array_append));
 		}
-		else if (line[0] == INCL_SECTION && !section)
+		else if (rec.kind == INI_REC_INCLUDE && !section)
 		{
-			section = ini_get_section(line, vmode);
-			if (section)
-			{
-				memset(var_array_append, 0, sizeof(var_array_append));
-			}
+			section = ini_section_match(text, rec.wc_pos, rec.eq_pos, 1, vmode);
+			if (section) memset(var_array_append, 0, sizeof(var_array_append));
 		}
-		else if(section)
+		else if (section && rec.kind != INI_REC_INCLUDE)
 		{
-			// otherwise this is a variable, get it
-			ini_parse_var(line);
+			ini_apply_var(&rec);
 		}
-
-		// if end of file, stop
-		if (eof) break;
 	}
-
-	FileClose(&ini_file);
 }
 
 static constexpr int CFG_ERRORS_MAX = 4;
@@ -602,6 +772,8 @@ void cfg_parse()
 	using_video_section = false;
 	cfg_error_count = 0;
 	strcpy(cfg.autofire_rates, "10,15,30");
+	cfg.idle_sleep_us = 1000;
+	cfg.dir_cache = 1;
 	ini_parse(altcfg(), video_get_core_mode_name(1));
 	if (has_video_sections && !using_video_section)
 	{
@@ -777,16 +949,23 @@ void yc_parse(yc_mode *yc_table, int max)
 	int eof;
 
 	memset(line, 0, sizeof(line));
-	memset(&ini_file, 0, sizeof(ini_file));
 
 	const char *corename = user_io_get_core_name(1);
 	int corename_len = strlen(corename);
 
 	const char *name = "yc.txt";
-	if (!FileOpen(&ini_file, name))	return;
+	int size = FileLoad(name, 0, 0);
+	char *buf = size ? (char*)malloc(size) : NULL;
+	if (!buf || FileLoad(name, buf, size) != size)
+	{
+		free(buf);
+		return;
+	}
 
-	ini_parser_debugf("Opened file %s with size %llu bytes.", name, ini_file.size);
+	ini_parser_debugf("Opened file %s with size %d bytes.", name, size);
 
+	ini_buf = buf;
+	ini_size = size;
 	ini_pt = 0;
 	int n = 0;
 
@@ -804,5 +983,6 @@ void yc_parse(yc_mode *yc_table, int max)
 		if (eof) break;
 	}
 
-	FileClose(&ini_file);
+	ini_buf = NULL;
+	free(buf);
 }
@@ -104,6 +104,10 @@ typedef struct {
 	char main[1024];
 	char vfilter_interlace_default[1023];
 	char autofire_rates[256];
+	uint16_t idle_sleep_us;
+	uint16_t sd_writeback;
+	uint8_t ide_writeback;
+	uint8_t dir_cache;
 
 } cfg_t;
 
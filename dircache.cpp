@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "dircache.h"
+#include "offload.h"
+#include "scheduler.h"
+#include "cfg.h"
+#include "hardware.h"
+#include "miniz.h"
+
+#define DC_MAGIC       0x3143444D // "MDC1"
+#define DC_MIN_ENTRIES 128        // smaller folders are scanned quickly enough
+#define DC_RACY_S      3          // a folder changed this recently may change again within its mtime granularity
+
+struct dc_header_t
+{
+	uint32_t magic;
+	uint32_t count;
+	uint32_t key_len;
+	uint32_t data_len;
+	dircache_stamp_t stamp;
+};
+
+struct dc_job_t
+{
+	char name[1024];
+	uint32_t len;
+	uint8_t data[];
+};
+
+static struct
+{
+	uint64_t scans;
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t stale;
+	uint64_t saved;
+	uint64_t scan_us;
+	uint64_t scan_max_us;
+	uint64_t cached_us;
+	uint64_t cached_max_us;
+	uint64_t start_us;
+} stats;
+
+static void cache_name(const char *key, char *name, size_t size)
+{
+	snprintf(name, size, "%s/" CONFIG_DIR "/dircache/%08X.bin", getRootDir(), (uint32_t)mz_crc32(0, (const uint8_t*)key, strlen(key)));
+}
+
+static void get_stamp(const char *dir, const char **deps, dircache_stamp_t *stamp)
+{
+	memset(stamp, 0, sizeof(dircache_stamp_t));
+
+	struct stat st;
+	if (stat(dir, &st)) return;
+	stamp->mtime = st.st_mtim.tv_sec;
+	stamp->mtime_ns = st.st_mtim.tv_nsec;
+
+	for (; deps && *deps; deps++)
+	{
+		uint64_t id[2] = {};
+		if (!stat(*deps, &st))
+		{
+			id[0] = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+			id[1] = st.st_size;
+		}
+		stamp->deps = mz_crc32(stamp->deps, (const uint8_t*)id, sizeof(id));
+	}
+
+	if (cfg.dir_cache != 1) return;
+
+	DIR *d = opendir(dir);
+	if (!d) return;
+
+	struct dirent64 *de;
+	while ((de = readdir64(d)))
+	{
+		if (++stamp->names % 1024 == 0) scheduler_yield();
+		stamp->names_crc = mz_crc32(stamp->names_crc, (const uint8_t*)de->d_name, strlen(de->d_name) + 1);
+		stamp->names_crc = mz_crc32(stamp->names_crc, &de->d_type, 1);
+	}
+	closedir(d);
+}
+
+static int parse(const uint8_t *p, const uint8_t *end, uint32_t count, std::vector<direntext_t> &items)
+{
+	items.resize(count);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (end - p < 5) return 0;
+
+		direntext_t *item = &items[i];
+		item->de.d_type = p[0];
+		item->flags = p[1];
+		uint32_t name_len = p[2], alt_len = p[3], date_len = p[4];
+		p += 5;
+
+		if (date_len >= sizeof(item->datecode) || (uint32_t)(end - p) < name_len + alt_len + date_len) return 0;
+		memcpy(item->de.d_name, p, name_len);
+		p += name_len;
+		memcpy(item->altname, p, alt_len);
+		p += alt_len;
+		memcpy(item->datecode, p, date_len);
+		p += date_len;
+	}
+
+	return p == end;
+}
+
+int dircache_load(const char *dir, const char **deps, const char *key, std::vector<direntext_t> &items, dircache_stamp_t *stamp)
+{
+	memset(stamp, 0, sizeof(dircache_stamp_t));
+	if (!cfg.dir_cache) return 0;
+
+	stats.lookups++;
+	get_stamp(dir, deps, stamp);
+
+	char name[1024];
+	cache_name(key, name, sizeof(name));
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	struct stat st;
+	uint8_t *buf = NULL;
+	int ok = !fstat(fd, &st) && st.st_size > (off_t)sizeof(dc_header_t) && (buf = (uint8_t*)malloc(st.st_size));
+	if (ok) ok = read(fd, buf, st.st_size) == st.st_size;
+	close(fd);
+
+	if (ok)
+	{
+		dc_header_t hdr;
+		memcpy(&hdr, buf, sizeof(hdr));
+		const uint8_t *p = buf + sizeof(hdr);
+
+		ok = hdr.magic == DC_MAGIC && sizeof(hdr) + hdr.key_len + hdr.data_len == (uint64_t)st.st_size &&
+			hdr.key_len == strlen(key) && !memcmp(p, key, hdr.key_len);
+
+		if (ok && memcmp(&hdr.stamp, stamp, sizeof(dircache_stamp_t)))
+		{
+			stats.stale++;
+			ok = 0;
+		}
+
+		if (ok)
+		{
+			p += hdr.key_len;
+			ok = parse(p, p + hdr.data_len, hdr.count, items);
+			if (!ok)
+			{
+				printf("dircache: %s is corrupted.\n", name);
+				items.clear();
+			}
+		}
+	}
+
+	free(buf);
+	if (ok) stats.hits++;
+	return ok;
+}
+
+// runs on a worker
+static void write_job(dc_job_t *job)
+{
+	char tmp[1040];
+	snprintf(tmp, sizeof(tmp), "%s", job->name);
+	char *p = strrchr(tmp, '/');
+	if (p)
+	{
+		*p = 0;
+		mkdir(tmp, S_IRWXU | S_IRWXG | S_IRWXO);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", job->name);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd < 0)
+	{
+		printf("dircache: couldn't create %s\n", tmp);
+	}
+	else
+	{
+		int ok = write(fd, job->data, job->len) == (ssize_t)job->len;
+		close(fd);
+
+		// readers see either the old or the new listing
+		if (!ok || rename(tmp, job->name))
+		{
+			printf("dircache: couldn't write %s\n", job->name);
+			unlink(tmp);
+		}
+	}
+
+	free(job);
+}
+
+void dircache_save(const char *key, const std::vector<direntext_t> &items, const dircache_stamp_t *stamp)
+{
+	if (!cfg.dir_cache || items.size() < DC_MIN_ENTRIES || !stamp->mtime) return;
+	if (llabs(time(NULL) - stamp->mtime) < DC_RACY_S) return;
+
+	uint32_t key_len = strlen(key);
+	uint32_t data_len = 0;
+	for (const direntext_t &item : items)
+	{
+		data_len += 5 + strnlen(item.de.d_name, 255) + strnlen(item.altname, 255) + strnlen(item.datecode, sizeof(item.datecode) - 1);
+	}
+
+	uint32_t len = sizeof(dc_header_t) + key_len + data_len;
+	dc_job_t *job = (dc_job_t*)malloc(sizeof(dc_job_t) + len);
+	if (!job) return;
+
+	cache_name(key, job->name, sizeof(job->name));
+	job->len = len;
+
+	dc_header_t hdr = { DC_MAGIC, (uint32_t)items.size(), key_len, data_len, *stamp };
+	uint8_t *p = job->data;
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	memcpy(p, key, key_len);
+	p += key_len;
+
+	for (const direntext_t &item : items)
+	{
+		uint8_t name_len = strnlen(item.de.d_name, 255);
+		uint8_t alt_len = strnlen(item.altname, 255);
+		uint8_t date_len = strnlen(item.datecode, sizeof(item.datecode) - 1);
+
+		*p++ = item.de.d_type;
+		*p++ = item.flags;
+		*p++ = name_len;
+		*p++ = alt_len;
+		*p++ = date_len;
+		memcpy(p, item.de.d_name, name_len);
+		p += name_len;
+		memcpy(p, item.altname, alt_len);
+		p += alt_len;
+		memcpy(p, item.datecode, date_len);
+		p += date_len;
+	}
+
+	stats.saved++;
+	offload_add_work([job]() { write_job(job); }, OFFLOAD_LOW);
+}
+
+void dircache_scan_start()
+{
+	stats.start_us = time_us();
+}
+
+void dircache_scan_done(int cached)
+{
+	uint64_t t = time_us() - stats.start_us;
+	stats.scans++;
+
+	if (cached)
+	{
+		stats.cached_us += t;
+		if (t > stats.cached_max_us) stats.cached_max_us = t;
+	}
+	else
+	{
+		stats.scan_us += t;
+		if (t > stats.scan_max_us) stats.scan_max_us = t;
+	}
+}
+
+void dircache_print_stats()
+{
+	uint64_t scanned = stats.scans - stats.hits;
+
+	printf("dircache: %llu scans, %llu lookups, %llu hits (%llu%%), %llu stale, %llu listings written\n",
+		stats.scans, stats.lookups, stats.hits, stats.lookups ? stats.hits * 100 / stats.lookups : 0, stats.stale, stats.saved);
+	printf("dircache: scanned avg/max %llu/%llu us, from cache avg/max %llu/%llu us\n",
+		scanned ? stats.scan_us / scanned : 0, stats.scan_max_us,
+		stats.hits ? stats.cached_us / stats.hits : 0, stats.cached_max_us);
+}
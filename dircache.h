@@ -0,0 +1,39 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <stdint.h>
+#include <vector>
+#include "file_io.h"
+
+// Persistent cache of the sorted listings built by ScanDirectory(), kept in
+// config/dircache/. A listing is looked up by the folder path and the scan
+// options and is only used while the folder (and the files the display
+// names come from) keep the mtime they had when it was stored. With
+// dir_cache=1 the raw entry names are compared as well, which catches folders
+// changed by systems that don't update the folder mtime.
+
+struct dircache_stamp_t
+{
+	int64_t  mtime;
+	uint32_t mtime_ns;
+	uint32_t deps;        // hash of mtime and size of the dependency files
+	uint32_t names_crc;   // raw entries, dir_cache=1 only
+	uint32_t names;
+};
+
+// Fills items and returns 1 if a valid listing is cached. dir is the full
+// path of the folder, deps a NULL terminated list of full paths the listing
+// depends on. The stamp is filled in for a following dircache_save().
+int dircache_load(const char *dir, const char **deps, const char *key, std::vector<direntext_t> &items, dircache_stamp_t *stamp);
+
+// Stores a freshly scanned and sorted listing. The file is written on the
+// offload workers.
+void dircache_save(const char *key, const std::vector<direntext_t> &items, const dircache_stamp_t *stamp);
+
+// Time every SCANF_INIT scan; cached tells whether the listing came from the cache.
+void dircache_scan_start();
+void dircache_scan_done(int cached);
+
+void dircache_print_stats();
+
+#endif
@@ -32,6 +32,7 @@
 #include "scheduler.h"
 #include "video.h"
 #include "support.h"
+#include "dircache.h"
 
 #define MIN(a,b) (((a)<(b)) ? (a) : (b))
 
@@ -86,14 +87,91 @@ int fileTYPE::opened()
 	return filp || zip;
 }
 
+// Seek index for zipped files: a snapshot of the inflate state and its
+// dictionary is taken every 'interval' bytes of output, so a seek resumes from
+// the nearest checkpoint instead of inflating the entry from the start.
+// Checkpoints are only recorded once the file is actually seeked.
+#define ZIP_CHECKPOINTS     128
+#define ZIP_CHECKPOINT_MIN  (512 * 1024)
+
+struct zipCheckpoint
+{
+	mz_zip_reader_extract_iter_state state;
+	uint8_t                          dict[TINFL_LZ_DICT_SIZE];
+};
+
 struct fileZipArchive
 {
 	mz_zip_archive                    archive;
 	int                               index;
 	mz_zip_reader_extract_iter_state* iter;
 	__off64_t                         offset;
+
+	int                               indexing;
+	__off64_t                         interval;
+	int                               cp_num;   // checkpoint k is at (k + 1) * interval
+	zipCheckpoint*                    cp[ZIP_CHECKPOINTS];
 };
 
+static void zip_index_free(fileZipArchive *z)
+{
+	for (int i = 0; i < z->cp_num; i++) free(z->cp[i]);
+	z->cp_num = 0;
+}
+
+static void zip_checkpoint(fileZipArchive *z)
+{
+	if (z->cp_num >= ZIP_CHECKPOINTS) return;
+
+	zipCheckpoint *cp = (zipCheckpoint*)malloc(sizeof(zipCheckpoint));
+	if (!cp) return;
+
+	cp->state = *z->iter;
+	if (z->iter->pWrite_buf) memcpy(cp->dict, z->iter->pWrite_buf, TINFL_LZ_DICT_SIZE);
+	z->cp[z->cp_num++] = cp;
+}
+
+static void zip_restore(fileZipArchive *z, const zipCheckpoint *cp)
+{
+	mz_zip_reader_extract_iter_state *iter = z->iter;
+	void *read_buf = iter->pRead_buf;
+	void *write_buf = iter->pWrite_buf;
+
+	*iter = cp->state;
+	iter->pRead_buf = read_buf;
+	iter->pWrite_buf = write_buf;
+	if (write_buf) memcpy(write_buf, cp->dict, TINFL_LZ_DICT_SIZE);
+
+	// the read buffer isn't saved; fetch the unconsumed input again
+	iter->cur_file_ofs -= iter->read_buf_avail;
+	iter->comp_remaining += iter->read_buf_avail;
+	iter->read_buf_avail = 0;
+	iter->read_buf_ofs = 0;
+
+	z->offset = iter->out_buf_ofs;
+}
+
+// mz_zip_reader_extract_iter_read() that stops at checkpoint positions
+static size_t zip_read(fileZipArchive *z, void *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len)
+	{
+		size_t want = len - done;
+		__off64_t next = (__off64_t)(z->cp_num + 1) * z->interval;
+		int at_cp = z->indexing && z->cp_num < ZIP_CHECKPOINTS && z->offset < next && (__off64_t)(z->offset + want) >= next;
+		if (at_cp) want = next - z->offset;
+
+		size_t ret = mz_zip_reader_extract_iter_read(z->iter, (uint8_t*)buf + done, want);
+		z->offset += ret;
+		done += ret;
+		if (ret < want) break;
+
+		if (at_cp) zip_checkpoint(z);
+	}
+	return done;
+}
+
 
 static int OpenZipfileCached(char *path, int flags)
 {
@@ -286,6 +364,7 @@ void FileClose(fileTYPE *file)
 		{
 			mz_zip_reader_extract_iter_free(file->zip->iter);
 		}
+		zip_index_free(file->zip);
 		mz_zip_reader_end(&file->zip->archive);
 
 		delete file->zip;
@@ -391,6 +470,41 @@ int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
 	return 1;
 }
 
+int FileLoadZip(const char *name, uint32_t crc32, uint8_t **data, uint32_t *size)
+{
+	char path[2100];
+	if (name[0] != '/') snprintf(path, sizeof(path), "%s/%s", getRootDir(), name);
+	else snprintf(path, sizeof(path), "%s", name);
+
+	char *zip_path, *file_path;
+	if (!FileIsZipped(path, &zip_path, &file_path)) return 0;
+
+	mz_zip_archive z = {};
+	if (!mz_zip_reader_init_file(&z, zip_path, 0))
+	{
+		printf("FileLoadZip(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path, mz_zip_get_error_string(mz_zip_get_last_error(&z)));
+		return 0;
+	}
+
+	int index = -1;
+	if (crc32) index = zip_search_by_crc(&z, crc32);
+	if (index < 0) index = mz_zip_reader_locate_file(&z, file_path, NULL, 0);
+
+	size_t len = 0;
+	void *buf = (index >= 0) ? mz_zip_reader_extract_to_heap(&z, index, &len, 0) : NULL;
+	if (!buf)
+	{
+		printf("FileLoadZip Zip:%s, file:%s, error:%s\n", zip_path, file_path, mz_zip_get_error_string(mz_zip_get_last_error(&z)));
+	}
+
+	mz_zip_reader_end(&z);
+	if (!buf) return 0;
+
+	*data = (uint8_t*)buf;
+	*size = len;
+	return 1;
+}
+
 int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zip)
 {
 	make_fullpath((char*)name, mode);
@@ -563,7 +677,21 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 			offset = file->size - offset;
 		}
 
-		if (offset < file->zip->offset)
+		fileZipArchive *z = file->zip;
+		if (!z->indexing && offset != z->offset)
+		{
+			z->indexing = 1;
+			z->interval = std::max((__off64_t)ZIP_CHECKPOINT_MIN, (file->size + ZIP_CHECKPOINTS - 1) / ZIP_CHECKPOINTS);
+		}
+
+		// nearest checkpoint at or before the target
+		int k = (z->interval ? offset / z->interval : 0);
+		if (k > z->cp_num) k = z->cp_num;
+		if (k && (offset < z->offset || k * z->interval > z->offset))
+		{
+			zip_restore(z, z->cp[k - 1]);
+		}
+		else if (offset < file->zip->offset)
 		{
 			mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
 			if (!iter)
@@ -582,8 +710,7 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 		while (file->zip->offset < offset)
 		{
 			const size_t want_len = MIN((__off64_t)sizeof(buf), offset - file->zip->offset);
-			const size_t read_len = mz_zip_reader_extract_iter_read(file->zip->iter, buf, want_len);
-			file->zip->offset += read_len;
+			const size_t read_len = zip_read(file->zip, buf, want_len);
 			if (read_len < want_len)
 			{
 				printf("FileSeek(mz_zip_reader_extract_iter_read) Failed to advance iterator, error:%s\n",
@@ -624,14 +751,13 @@ int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres)
 	}
 	else if (file->zip)
 	{
-		ret = mz_zip_reader_extract_iter_read(file->zip->iter, pBuffer, length);
+		ret = zip_read(file->zip, pBuffer, length);
 		if (!ret)
 		{
 			printf("FileReadEx(mz_zip_reader_extract_iter_read) Failed to read, error:%s\n",
 			       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
 			return failres;
 		}
-		file->zip->offset += ret;
 	}
 	else
 	{
@@ -1372,6 +1498,33 @@ static void get_display_name(direntext_t *dext, const char *ext, int options)
 	if (fext) *fext = 0;
 }
 
+static void SelectItem(const char *file_name)
+{
+	if (!file_name[0]) return;
+
+	int pos = -1;
+	for (int i = 0; i < flist_nDirEntries(); i++)
+	{
+		if (!strcmp(file_name, DirItem[i].de.d_name))
+		{
+			pos = i;
+			break;
+		}
+		else if (!strcasecmp(file_name, DirItem[i].de.d_name))
+		{
+			pos = i;
+		}
+	}
+
+	if(pos>=0)
+	{
+		iSelectedEntry = pos;
+		if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
+		else iFirstEntry = iSelectedEntry - (OsdGetSize() / 2) + 1;
+		if (iFirstEntry < 0) iFirstEntry = 0;
+	}
+}
+
 int ScanDirectory(char* path, int mode, const char *extension, int options, const char *prefix, const char *filter)
 {
 	static char file_name[1024];
@@ -1391,6 +1544,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 
 	if (mode == SCANF_INIT)
 	{
+		dircache_scan_start();
 		iFirstEntry = 0;
 		iSelectedEntry = 0;
 		DirItem.clear();
@@ -1432,6 +1586,27 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		printf("Start to scan %sdir: %s\n", is_zipped ? "zipped " : "", full_path);
 		printf("Position on item: %s\n", file_name);
 
+		// zip listings come from the central directory which is read once anyway
+		static char cache_key[2048];
+		dircache_stamp_t stamp = {};
+		if (!is_zipped)
+		{
+			static char names_txt[1024], romsets_xml[1024];
+			const char *deps[] = { names_txt, (options & SCANO_NEOGEO) ? romsets_xml : NULL, NULL };
+			snprintf(names_txt, sizeof(names_txt), "%s/names.txt", getRootDir());
+			snprintf(romsets_xml, sizeof(romsets_xml), "%s/romsets.xml", full_path);
+			if (!FileExists(romsets_xml)) snprintf(romsets_xml, sizeof(romsets_xml), "%s/%s/romsets.xml", getRootDir(), HomeDir());
+
+			snprintf(cache_key, sizeof(cache_key), "%s\n%d\n%s\n%s\n%s\n%d", path, options, extension, prefix ? prefix : "", filter ? filter : "", is_minimig());
+			if (dircache_load(full_path, deps, cache_key, DirItem, &stamp))
+			{
+				printf("Got %d dir entries from cache\n", flist_nDirEntries());
+				dircache_scan_done(1);
+				SelectItem(file_name);
+				return flist_nDirEntries();
+			}
+		}
+
 		char *zip_path, *file_path_in_zip = (char*)"";
 		FileIsZipped(full_path, &zip_path, &file_path_in_zip);
 
@@ -1722,30 +1897,10 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		if (!flist_nDirEntries()) return 0;
 
 		std::sort(DirItem.begin(), DirItem.end(), DirentComp());
-		if (file_name[0])
-		{
-			int pos = -1;
-			for (int i = 0; i < flist_nDirEntries(); i++)
-			{
-				if (!strcmp(file_name, DirItem[i].de.d_name))
-				{
-					pos = i;
-					break;
-				}
-				else if (!strcasecmp(file_name, DirItem[i].de.d_name))
-				{
-					pos = i;
-				}
-			}
+		if (!is_zipped) dircache_save(cache_key, DirItem, &stamp);
+		dircache_scan_done(0);
 
-			if(pos>=0)
-			{
-				iSelectedEntry = pos;
-				if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
-				else iFirstEntry = iSelectedEntry - (OsdGetSize() / 2) + 1;
-				if (iFirstEntry < 0) iFirstEntry = 0;
-			}
-		}
+		SelectItem(file_name);
 		return flist_nDirEntries();
 	}
 	else
@@ -83,6 +83,9 @@ void setStorage(int dev);
 int  isUSBMounted();
 
 int  FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32);
+// Whole zip member into a malloc'ed buffer, found like FileOpenZip() does.
+// Safe to call from the offload workers.
+int  FileLoadZip(const char *name, uint32_t crc32, uint8_t **data, uint32_t *size);
 int  FileOpenEx(fileTYPE *file, const char *name, int mode, char mute = 0, int use_zip = 1);
 int  FileOpen(fileTYPE *file, const char *name, char mute = 0);
 void FileClose(fileTYPE *file);
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "file_pipe.h"
+#include "hardware.h"
+#include "miniz.h"
+
+#define DEPTH 4
+
+struct file_pipe_t
+{
+	fileTYPE *f;
+	uint8_t *mem;
+	uint32_t size;
+	uint32_t pos;        // bytes read so far
+	uint32_t crc;
+	int do_crc;
+	uint32_t crc_skip;
+
+	uint32_t len[DEPTH];
+	uint32_t head;       // chunks filled by the reader
+	uint32_t tail;       // chunks given back by the consumer
+	int quit;
+	int threaded;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	// per stage time, in us
+	uint64_t start_us;
+	uint64_t read_us;
+	uint64_t crc_us;
+	uint64_t send_us;
+	uint64_t wait_us;
+	uint64_t next_us;
+};
+
+// reads the next chunk into slot head % DEPTH
+static void fill(file_pipe_t *p)
+{
+	uint8_t *buf = p->mem + (p->head % DEPTH) * FILE_PIPE_CHUNK;
+	uint32_t len = p->size - p->pos;
+	if (len > FILE_PIPE_CHUNK) len = FILE_PIPE_CHUNK;
+
+	uint64_t t = time_us();
+	int ret = FileReadAdv(p->f, buf, len);
+	if (ret < (int)len)
+	{
+		printf("file_pipe: short read at %u (%d of %u bytes)\n", p->pos, ret, len);
+		memset(buf + ((ret > 0) ? ret : 0), 0, len - ((ret > 0) ? ret : 0));
+	}
+	p->read_us += time_us() - t;
+
+	if (p->do_crc)
+	{
+		t = time_us();
+		uint32_t skip = (p->crc_skip > len) ? len : p->crc_skip;
+		p->crc = crc32(p->crc, buf + skip, len - skip);
+		p->crc_skip -= skip;
+		p->crc_us += time_us() - t;
+	}
+
+	p->len[p->head % DEPTH] = len;
+	p->pos += len;
+}
+
+static void *reader_thread(void *arg)
+{
+	file_pipe_t *p = (file_pipe_t *)arg;
+
+	while (p->pos < p->size)
+	{
+		pthread_mutex_lock(&p->lock);
+		while (p->head - p->tail == DEPTH && !p->quit) pthread_cond_wait(&p->cond, &p->lock);
+		int quit = p->quit;
+		pthread_mutex_unlock(&p->lock);
+		if (quit) break;
+
+		fill(p);
+
+		pthread_mutex_lock(&p->lock);
+		p->head++;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	return NULL;
+}
+
+file_pipe_t *file_pipe_open(fileTYPE *f, uint32_t size, int crc, uint32_t crc_skip)
+{
+	file_pipe_t *p = (file_pipe_t *)calloc(1, sizeof(file_pipe_t));
+	if (!p) return NULL;
+
+	p->mem = (uint8_t *)malloc(DEPTH * FILE_PIPE_CHUNK);
+	if (!p->mem)
+	{
+		free(p);
+		return NULL;
+	}
+
+	p->f = f;
+	p->size = size;
+	p->do_crc = crc;
+	p->crc_skip = crc_skip;
+	p->start_us = time_us();
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	// reader runs on core #0 next to the offload workers since main runs on core #1
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	p->threaded = !pthread_create(&p->thread, &attr, reader_thread, p);
+	pthread_attr_destroy(&attr);
+
+	if (!p->threaded) printf("file_pipe: no reader thread, reading inline.\n");
+	return p;
+}
+
+const uint8_t *file_pipe_next(file_pipe_t *p, uint32_t *len)
+{
+	if (p->tail * (uint64_t)FILE_PIPE_CHUNK >= p->size) return NULL;
+
+	uint64_t t = time_us();
+	if (p->threaded)
+	{
+		pthread_mutex_lock(&p->lock);
+		while (p->head == p->tail) pthread_cond_wait(&p->cond, &p->lock);
+		pthread_mutex_unlock(&p->lock);
+	}
+	else
+	{
+		fill(p);
+		p->head++;
+	}
+
+	p->next_us = time_us();
+	p->wait_us += p->next_us - t;
+
+	*len = p->len[p->tail % DEPTH];
+	return p->mem + (p->tail % DEPTH) * FILE_PIPE_CHUNK;
+}
+
+void file_pipe_release(file_pipe_t *p)
+{
+	p->send_us += time_us() - p->next_us;
+
+	pthread_mutex_lock(&p->lock);
+	p->tail++;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static uint32_t mbps(uint64_t bytes, uint64_t us)
+{
+	return us ? (uint32_t)(bytes / us) : 0;
+}
+
+uint32_t file_pipe_close(file_pipe_t *p)
+{
+	if (p->threaded)
+	{
+		pthread_mutex_lock(&p->lock);
+		p->quit = 1;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		pthread_join(p->thread, NULL);
+	}
+
+	uint64_t total = time_us() - p->start_us;
+	printf("file_pipe: %u bytes in %llu ms (%u MB/s): read %u MB/s, crc %u MB/s, send %u MB/s, waited for reader %llu ms\n",
+		p->pos, total / 1000, mbps(p->pos, total), mbps(p->pos, p->read_us),
+		p->do_crc ? mbps(p->pos, p->crc_us) : 0, mbps(p->pos, p->send_us), p->wait_us / 1000);
+
+	uint32_t crc = p->crc;
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->mem);
+	free(p);
+	return crc;
+}
@@ -0,0 +1,29 @@
+#ifndef FILE_PIPE_H
+#define FILE_PIPE_H
+
+#include <stdint.h>
+#include "file_io.h"
+
+// Streams a file through a ring of cached buffers filled by a reader thread,
+// so reading, CRC and the transfer to the FPGA overlap. The file belongs to
+// the pipe until file_pipe_close().
+
+#define FILE_PIPE_CHUNK (256 * 1024)
+
+struct file_pipe_t;
+
+// Reads size bytes from the current position of f. With crc set, CRC32 is
+// computed over everything after the first crc_skip bytes.
+file_pipe_t *file_pipe_open(fileTYPE *f, uint32_t size, int crc, uint32_t crc_skip);
+
+// Next chunk in file order (FILE_PIPE_CHUNK bytes, the last may be shorter).
+// Returns NULL once the whole file has been delivered.
+const uint8_t *file_pipe_next(file_pipe_t *p, uint32_t *len);
+
+// Gives the chunk returned by file_pipe_next() back to the reader.
+void file_pipe_release(file_pipe_t *p);
+
+// Stops the reader, prints per-stage throughput and returns the CRC32.
+uint32_t file_pipe_close(file_pipe_t *p);
+
+#endif
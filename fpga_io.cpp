@@ -6,9 +6,12 @@
 #include <signal.h>
 #include <ctype.h>
 #include <termios.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include "zstd.h"
+
 #include "fpga_io.h"
 #include "file_io.h"
 #include "input.h"
@@ -16,6 +19,11 @@
 #include "menu.h"
 #include "shmem.h"
 #include "offload.h"
+#include "writeback.h"
+#include "support/sram_store/sram_store.h"
+#include "fpga_sim.h"
+#include "scheduler.h"
+#include "hardware.h"
 
 #include "fpga_base_addr_ac5.h"
 #include "fpga_manager.h"
@@ -26,8 +34,8 @@
 #define FPGA_REG_BASE 0xFF000000
 #define FPGA_REG_SIZE 0x01000000
 
-#define MAP_ADDR(x) (volatile uint32_t*)(&map_base[(((uint32_t)(x)) & 0xFFFFFF)>>2])
-#define IS_REG(x) (((((uint32_t)(x))-1)>=(FPGA_REG_BASE - 1)) && ((((uint32_t)(x))-1)<(FPGA_REG_BASE + FPGA_REG_SIZE - 1)))
+#define MAP_ADDR(x) (volatile uint32_t*)(&map_base[(((uint32_t)(uintptr_t)(x)) & 0xFFFFFF)>>2])
+#define IS_REG(x) (((((uint32_t)(uintptr_t)(x))-1)>=(FPGA_REG_BASE - 1)) && ((((uint32_t)(uintptr_t)(x))-1)<(FPGA_REG_BASE + FPGA_REG_SIZE - 1)))
 
 #define fatal(x) munmap((void*)map_base, FPGA_REG_SIZE); close(fd); exit(x)
 
@@ -231,6 +239,7 @@ static int fpgamgr_program_init(void)
 /* Write the RBF data to FPGA Manager */
 static void fpgamgr_program_write(const void *rbf_data, size_t rbf_size)
 {
+#ifdef __arm__
 	uint32_t src = (uint32_t)rbf_data;
 	uint32_t dst = (uint32_t)MAP_ADDR(SOCFPGA_FPGAMGRDATA_ADDRESS);
 
@@ -256,6 +265,13 @@ static void fpgamgr_program_write(const void *rbf_data, size_t rbf_size)
 		"4: nop\n"
 		: "+r"(src), "+r"(dst), "+r"(loops32), "+r"(loops4) :
 		: "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "cc");
+#else
+	const uint32_t *src = (const uint32_t *)rbf_data;
+	volatile uint32_t *dst = MAP_ADDR(SOCFPGA_FPGAMGRDATA_ADDRESS);
+	uint32_t loops = DIV_ROUND_UP(rbf_size, 4);
+
+	while (loops--) *dst = *src++;
+#endif
 }
 
 /* Ensure the FPGA entering config done */
@@ -342,24 +358,19 @@ static int fpgamgr_program_poll_usermode(void)
 
 /*
 * FPGA Manager to program the FPGA. This is the interface used by FPGA driver.
+* The RBF data is written in between with fpgamgr_program_write(), in as many
+* pieces as needed. Every piece but the last must be a multiple of 4 bytes.
 * Return 0 for sucess, non-zero for error.
 */
-static int socfpga_load(const void *rbf_data, size_t rbf_size)
+static int socfpga_load_begin(void)
 {
-	unsigned long status;
-
-	if ((uint32_t)rbf_data & 0x3) {
-		printf("FPGA: Unaligned data, realign to 32bit boundary.\n");
-		return -EINVAL;
-	}
-
 	/* Initialize the FPGA Manager */
-	status = fpgamgr_program_init();
-	if (status)
-		return status;
+	return fpgamgr_program_init();
+}
 
-	/* Write the RBF data to FPGA Manager */
-	fpgamgr_program_write(rbf_data, rbf_size);
+static int socfpga_load_end(void)
+{
+	unsigned long status;
 
 	/* Ensure the FPGA entering config done */
 	status = fpgamgr_program_poll_cd();
@@ -423,6 +434,98 @@ static int make_env(const char *name, const char *cfg)
 	return 0;
 }
 
+#define RBF_CHUNK (512 * 1024)
+
+// Bitstream reader. Chunks are read (and decompressed for zstd files) on the
+// offload workers into one buffer while the other one is being programmed.
+struct rbf_stream_t
+{
+	int fd;
+	int eof;
+	int error;
+
+	ZSTD_DStream *zds;
+	ZSTD_inBuffer zin;
+	uint8_t *in;
+	size_t in_size;
+	size_t zret;
+
+	uint8_t *buf[2];
+	uint32_t len[2];
+
+	uint64_t bytes_in;
+	uint64_t fill_us;
+};
+
+// Fills buf[idx]. A chunk shorter than RBF_CHUNK is the last one.
+static void rbf_fill(rbf_stream_t *s, int idx)
+{
+	uint64_t t = time_us();
+	uint8_t *dst = s->buf[idx];
+	uint32_t len = 0;
+
+	if (!s->zds)
+	{
+		while (len < RBF_CHUNK && !s->eof)
+		{
+			ssize_t r = read(s->fd, dst + len, RBF_CHUNK - len);
+			if (r < 0) s->error = 1;
+			if (r <= 0) s->eof = 1;
+			else
+			{
+				len += r;
+				s->bytes_in += r;
+			}
+		}
+	}
+	else
+	{
+		ZSTD_outBuffer out = { dst, RBF_CHUNK, 0 };
+		while (out.pos < out.size && !s->error)
+		{
+			if (s->zin.pos == s->zin.size && !s->eof)
+			{
+				ssize_t r = read(s->fd, s->in, s->in_size);
+				if (r < 0) s->error = 1;
+				if (r <= 0) s->eof = 1;
+				else
+				{
+					s->zin.src = s->in;
+					s->zin.size = r;
+					s->zin.pos = 0;
+					s->bytes_in += r;
+				}
+			}
+
+			size_t pos = out.pos, in_pos = s->zin.pos;
+			size_t ret = ZSTD_decompressStream(s->zds, &out, &s->zin);
+			int idle = out.pos == pos && s->zin.pos == in_pos;
+			if (ZSTD_isError(ret))
+			{
+				printf("FPGA: zstd error: %s\n", ZSTD_getErrorName(ret));
+				s->error = 1;
+			}
+			else if (!idle)
+			{
+				// 0 once a frame is complete
+				s->zret = ret;
+			}
+
+			if (s->eof && idle) break;
+		}
+
+		len = out.pos;
+		if (len < RBF_CHUNK && s->zret && !s->error)
+		{
+			printf("FPGA: compressed bitstream is truncated.\n");
+			s->error = 1;
+		}
+	}
+
+	s->len[idx] = len;
+	s->fill_us += time_us() - t;
+}
+
 int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 {
 	OsdDisable();
@@ -442,6 +545,7 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 	if(name[0] == '/') strcpy(path, name);
 	else sprintf(path, "%s/%s", !strcasecmp(name, "menu.rbf") ? getStorageDir(0) : getRootDir(), name);
 
+	uint64_t start = time_us();
 	int rbf = open(path, O_RDONLY);
 	if (rbf < 0)
 	{
@@ -451,89 +555,215 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 		Info(error,5000);
 		return -1;
 	}
+
+	rbf_stream_t s = {};
+	s.fd = rbf;
+
+	struct stat64 st;
+	uint32_t magic = 0;
+	if (fstat64(rbf, &st)<0 || pread(rbf, &magic, 4, 0) != 4)
+	{
+		printf("Couldn't get info of file %s\n", path);
+		ret = -1;
+	}
 	else
 	{
-		struct stat64 st;
-		if (fstat64(rbf, &st)<0)
+		printf("Bitstream size: %lld bytes\n", st.st_size);
+
+		if (magic == ZSTD_MAGICNUMBER)
+		{
+			s.zds = ZSTD_createDStream();
+			s.in_size = ZSTD_DStreamInSize();
+			s.in = (uint8_t*)malloc(s.in_size);
+			if (!s.zds || !s.in || ZSTD_isError(ZSTD_initDStream(s.zds))) ret = -1;
+		}
+
+		// +4: the last word written may run past the data
+		s.buf[0] = (uint8_t*)malloc((RBF_CHUNK + 4) * 2);
+		s.buf[1] = s.buf[0] + RBF_CHUNK + 4;
+		if (!s.buf[0] || ret)
 		{
-			printf("Couldn't get info of file %s\n", path);
+			printf("Couldn't allocate bitstream buffers.\n");
 			ret = -1;
 		}
-		else
+	}
+
+	uint64_t first_us = 0, program_us = 0, stall_us = 0, config_us = 0;
+	uint64_t programmed = 0;
+	uint8_t *image = 0;
+	int configuring = 0;  // the running core is gone from here on
+
+	if (!ret)
+	{
+		// the first chunk is read before the running core is touched
+		rbf_fill(&s, 0);
+		first_us = time_us() - start;
+
+		if (s.error || s.len[0] < 16)
 		{
-			printf("Bitstream size: %lld bytes\n", st.st_size);
+			printf("Couldn't read file %s\n", name);
+			ret = -1;
+		}
+	}
 
-			void *buf = malloc(st.st_size);
-			if (!buf)
+	if (!ret)
+	{
+		uint32_t skip = 0;
+		uint64_t left = UINT64_MAX;
+		if (!memcmp(s.buf[0], "MiSTer", 6))
+		{
+			left = *(uint32_t*)(s.buf[0] + 12);
+			skip = 16;
+		}
+
+		fpga_core_reset(1);
+		do_bridge(0);
+		configuring = 1;
+
+#ifdef FPGA_SIM
+		if (!fpga_sim_active())
+#endif
+		ret = socfpga_load_begin();
+
+		int cur = 0;
+		while (!ret)
+		{
+			uint32_t len = s.len[cur] - skip;
+			if (len > left) len = left;
+			int more = s.len[cur] == RBF_CHUNK && left > len;
+
+			offload_handle_t h;
+			if (more)
 			{
-				printf("Couldn't allocate %llu bytes.\n", st.st_size);
-				ret = -1;
+				rbf_stream_t *sp = &s;
+				int next = cur ^ 1;
+				offload_add_work([sp, next]() { rbf_fill(sp, next); }, OFFLOAD_HIGH, &h);
+			}
+
+			uint64_t t = time_us();
+#ifdef FPGA_SIM
+			// the simulator takes the whole image at once
+			if (fpga_sim_active())
+			{
+				image = (uint8_t*)realloc(image, programmed + len);
+				memcpy(image + programmed, s.buf[cur] + skip, len);
 			}
 			else
+#endif
+			fpgamgr_program_write(s.buf[cur] + skip, len);
+			program_us += time_us() - t;
+
+			programmed += len;
+			left -= len;
+			skip = 0;
+			if (!more) break;
+
+			t = time_us();
+			offload_wait(&h);
+			stall_us += time_us() - t;
+
+			if (s.error)
 			{
-				fpga_core_reset(1);
-				if (read(rbf, buf, st.st_size)<st.st_size)
-				{
-					printf("Couldn't read file %s\n", name);
-					ret = -1;
-				}
-				else
-				{
-					void *p = buf;
-					__off64_t sz = st.st_size;
-					if (!memcmp(buf, "MiSTer", 6))
-					{
-						sz = *(uint32_t*)(((uint8_t*)buf) + 12);
-						p = (void*)(((uint8_t*)buf) + 16);
-					}
-					do_bridge(0);
-					ret = socfpga_load(p, sz);
-					if (ret)
-					{
-						printf("Error %d while loading %s\n", ret, path);
-					}
-					else
-					{
-						do_bridge(1);
-					}
-				}
-				free(buf);
+				printf("Couldn't read file %s\n", name);
+				ret = -1;
 			}
+			cur ^= 1;
+		}
+
+		if (!ret)
+		{
+			uint64_t t = time_us();
+#ifdef FPGA_SIM
+			if (fpga_sim_active()) ret = fpga_sim_load_rbf(image, programmed);
+			else
+#endif
+			ret = socfpga_load_end();
+			config_us = time_us() - t;
+		}
+
+		if (ret)
+		{
+			printf("Error %d while loading %s\n", ret, path);
+		}
+		else
+		{
+			do_bridge(1);
+			printf("FPGA: %s%llu bytes read, %llu programmed.\n", s.zds ? "zstd, " : "", s.bytes_in, programmed);
+			printf("FPGA: first chunk %llu ms, read %llu ms, program %llu ms, waited for data %llu ms, config %llu ms, total %llu ms.\n",
+				first_us / 1000, s.fill_us / 1000, program_us / 1000, stall_us / 1000, config_us / 1000, (time_us() - start) / 1000);
 		}
 	}
+
+	free(image);
+	free(s.buf[0]);
+	free(s.in);
+	if (s.zds) ZSTD_freeDStream(s.zds);
 	close(rbf);
 
+	// A read or decode error after the first chunk leaves the fabric partly
+	// programmed, so restarting would run on an unconfigured FPGA.
+	if (ret && configuring)
+	{
+		if (strcasecmp(name, "menu.rbf"))
+		{
+			printf("FPGA: loading %s failed midway, loading the menu instead.\n", name);
+			return fpga_load_rbf("menu.rbf");
+		}
+
+		printf("FPGA: menu.rbf failed to load, not restarting.\n");
+		return ret;
+	}
+
 	app_restart(!strcasecmp(name, "menu.rbf") ? "menu.rbf" : path, xml);
 	return ret;
 }
 
+#ifdef FPGA_SIM
+#define fpga_gpo_writeN(value) do { if (fpga_sim_active()) fpga_sim_gpo_write(value); else writel((value), (void*)(SOCFPGA_MGR_ADDRESS + 0x10)); } while(0)
+#define fpga_gpi_read() (int)(fpga_sim_active() ? fpga_sim_gpi_read() : readl((void*)(SOCFPGA_MGR_ADDRESS + 0x14)))
+#else
+#define fpga_gpo_writeN(value) writel((value), (void*)(SOCFPGA_MGR_ADDRESS + 0x10))
+#define fpga_gpi_read() (int)readl((void*)(SOCFPGA_MGR_ADDRESS + 0x14))
+#endif
+
 static uint32_t gpo_copy = 0;
 void inline fpga_gpo_write(uint32_t value)
 {
 	gpo_copy = value;
-	writel(value, (void*)(SOCFPGA_MGR_ADDRESS + 0x10));
+	fpga_gpo_writeN(value);
 }
 
-#define fpga_gpo_writeN(value) writel((value), (void*)(SOCFPGA_MGR_ADDRESS + 0x10))
 #define fpga_gpo_read() gpo_copy //readl((void*)(SOCFPGA_MGR_ADDRESS + 0x10))
-#define fpga_gpi_read() (int)readl((void*)(SOCFPGA_MGR_ADDRESS + 0x14))
 
 void fpga_core_write(uint32_t offset, uint32_t value)
 {
-	if (offset <= 0x1FFFFF) writel(value, (void*)(SOCFPGA_LWFPGASLAVES_ADDRESS + (offset & ~3)));
+	if (offset <= 0x1FFFFF) writel(value, (void*)(uintptr_t)(SOCFPGA_LWFPGASLAVES_ADDRESS + (offset & ~3)));
 }
 
 uint32_t fpga_core_read(uint32_t offset)
 {
-	if (offset <= 0x1FFFFF) return readl((void*)(SOCFPGA_LWFPGASLAVES_ADDRESS + (offset & ~3)));
+	if (offset <= 0x1FFFFF) return readl((void*)(uintptr_t)(SOCFPGA_LWFPGASLAVES_ADDRESS + (offset & ~3)));
 	return 0;
 }
 
 int fpga_io_init()
 {
+#ifdef FPGA_SIM
+	fpga_sim_init();
+#endif
+
 	map_base = (uint32_t*)shmem_map(FPGA_REG_BASE, FPGA_REG_SIZE);
 	if (!map_base) return -1;
 
+#ifdef FPGA_SIM
+	if (fpga_sim_active())
+	{
+		// simulated FPGA manager always reports a configured device in user mode
+		writel(FPGAMGRREGS_MODE_USERMODE, &fpgamgr_regs->stat);
+		writel(FPGAMGRREGS_MON_GPIO_EXT_PORTA_ID_MASK, &fpgamgr_regs->gpio_ext_porta);
+	}
+#endif
+
 	fpga_gpo_write(0);
 	return 0;
 }
@@ -582,6 +812,8 @@ int fpga_get_io_type()
 
 void reboot(int cold)
 {
+	sram_store_flush_all();
+	writeback_flush_all();
 	sync();
 	fpga_core_reset(1);
 
@@ -596,6 +828,15 @@ void reboot(int cold)
 		shmem_unmap(buf, 0x1000);
 	}
 
+#ifdef FPGA_SIM
+	if (fpga_sim_active())
+	{
+		fpga_sim_report();
+		printf("SIM: reboot requested, exiting.\n");
+		exit(0);
+	}
+#endif
+
 	writel(1, &reset_regs->ctrl);
 	while (1) sleep(1);
 }
@@ -614,6 +855,8 @@ char *getappname()
 
 void app_restart(const char *path, const char *xml, const char *exe)
 {
+	sram_store_flush_all();
+	writeback_flush_all();
 	sync();
 	fpga_core_reset(1);
 
@@ -715,6 +958,7 @@ uint16_t fpga_spi_fast(uint16_t word)
 
 void fpga_spi_fast_block_write(const uint16_t *buf, uint32_t length)
 {
+	scheduler_activity();
 	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t gpo = gpoH;
 
@@ -730,6 +974,7 @@ void fpga_spi_fast_block_write(const uint16_t *buf, uint32_t length)
 
 void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length)
 {
+	scheduler_activity();
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t rem = length % 16;
 	length /= 16;
@@ -813,6 +1058,7 @@ void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length)
 
 void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length)
 {
+	scheduler_activity();
 	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t gpo = gpoH;
 	uint32_t rem = length % 16;
@@ -899,6 +1145,7 @@ void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length)
 
 void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length)
 {
+	scheduler_activity();
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t rem = length % 16;
 	length /= 16;
@@ -982,6 +1229,7 @@ void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length)
 
 void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length)
 {
+	scheduler_activity();
 	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t gpo = gpoH;
 
@@ -999,6 +1247,7 @@ void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length)
 
 void fpga_spi_fast_block_read_be(uint16_t *buf, uint32_t length)
 {
+	scheduler_activity();
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 
 	// should be optimized for speed by compiler automatically
@@ -13,6 +13,8 @@ void fpga_spi_en(uint32_t mask, uint32_t en);
 uint16_t fpga_spi(uint16_t word);
 uint16_t fpga_spi_fast(uint16_t word);
 
+// Block transfers count as scheduler activity, so DMA such as IDE and x86
+// keeps the main loop from going idle.
 void fpga_spi_fast_block_write(const uint16_t *buf, uint32_t length);
 void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length);
 void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length);
@@ -0,0 +1,661 @@
+#ifdef FPGA_SIM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <vector>
+#include <string>
+
+#include "fpga_sim.h"
+#include "user_io.h"
+#include "hardware.h"
+
+#define SSPI_STROBE  (1<<17)
+#define SSPI_FPGA_EN (1<<18)
+#define SSPI_OSD_EN  (1<<19)
+#define SSPI_IO_EN   (1<<20)
+
+static int sim_on = 0;
+
+/* ------------------------------------------------------------------------- */
+/* Physical memory                                                            */
+/* ------------------------------------------------------------------------- */
+
+struct sim_window_t
+{
+	uint32_t base;
+	uint32_t size;
+	uint8_t *mem;
+};
+
+// Reserved lazily with MAP_NORESERVE, so only touched pages cost memory.
+static sim_window_t sim_windows[] =
+{
+	{ 0x1F000000, 0x21000000, 0 }, // HPS reserved area + FPGA DDR3 window
+	{ 0xFF000000, 0x01000000, 0 }, // HPS peripherals (FPGA manager, bridges, GPO/GPI)
+};
+
+void *fpga_sim_map(uint32_t address, uint32_t size)
+{
+	for (auto &w : sim_windows)
+	{
+		if (address < w.base || ((uint64_t)address + size) > ((uint64_t)w.base + w.size)) continue;
+
+		if (!w.mem)
+		{
+			void *mem = mmap(0, w.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (mem == MAP_FAILED)
+			{
+				printf("SIM: Unable to reserve window 0x%X (%u bytes)!\n", w.base, w.size);
+				return 0;
+			}
+			w.mem = (uint8_t*)mem;
+		}
+
+		return w.mem + (address - w.base);
+	}
+
+	printf("SIM: Address range 0x%X (%u bytes) is not simulated!\n", address, size);
+	return 0;
+}
+
+int fpga_sim_unmap(void *map, uint32_t size)
+{
+	(void)map;
+	(void)size;
+
+	// windows stay mapped for the life of the process.
+	return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Virtual core                                                               */
+/* ------------------------------------------------------------------------- */
+
+enum
+{
+	OP_MOUNT,
+	OP_LOAD,
+	OP_READ,
+	OP_RREAD,
+	OP_WRITE,
+	OP_CD,
+	OP_SLEEP,
+	OP_REPORT,
+	OP_RESET,
+	OP_QUIT
+};
+
+struct sim_op_t
+{
+	int type;
+	int disk;
+	uint32_t lba;
+	uint32_t count;
+	uint32_t blks;
+	uint32_t blksz;
+	uint16_t words[8];
+	int nwords;
+	std::string path;
+};
+
+struct sim_core_t
+{
+	uint8_t core_type;
+	uint8_t fio_size;
+	uint8_t io_ver;
+	uint8_t io_type;
+	char confstr[1024];
+};
+
+struct sim_sdreq_t
+{
+	int pending;
+	int seen;
+	int disk;
+	int op;
+	uint32_t lba;
+	uint32_t blks;
+	uint32_t blkpow;
+	uint32_t blksz;
+	uint32_t bytes;
+	uint64_t post_us;
+	uint64_t seen_us;
+};
+
+struct sim_dir_stats_t
+{
+	uint64_t reqs;
+	uint64_t bytes;
+	uint64_t wait_us;
+	uint64_t wait_max;
+	uint64_t service_us;
+	uint64_t service_max;
+	uint64_t first_us;
+	uint64_t last_us;
+};
+
+struct sim_stats_t
+{
+	sim_dir_stats_t sd[2]; // 0 - read, 1 - write
+	uint32_t read_hash;
+	uint64_t tx_files;
+	uint64_t tx_bytes;
+	uint64_t tx_us;
+	uint64_t ddr_bytes;
+	uint64_t cd_packets;
+	uint64_t cd_wait_us;
+	uint64_t strobes;
+	uint64_t start_us;
+};
+
+static sim_core_t core = { CORE_TYPE_8BIT, 1, 1, 1, "SIM;;" };
+static sim_stats_t stats = {};
+static sim_sdreq_t sdreq = {};
+
+static std::vector<sim_op_t> ops;
+static uint32_t op_pos = 0;
+static uint32_t op_done = 0;
+static uint64_t sleep_until = 0;
+static uint32_t rnd_seed = 1;
+
+// CD command packet queued for UIO_CD_GET
+static uint16_t cd_words[8];
+static uint8_t cd_req = 0;
+static int cd_pending = 0;
+static uint64_t cd_post_us = 0;
+
+// file transfer state
+static int tx_active = 0;
+static uint64_t tx_start = 0;
+static uint32_t tx_size = 0;
+
+static void sim_stats_reset()
+{
+	memset(&stats, 0, sizeof(stats));
+	stats.read_hash = 0x811C9DC5;
+	stats.start_us = time_us();
+}
+
+static uint16_t sim_pattern(uint32_t lba, uint32_t offset)
+{
+	uint32_t v = (lba * 0x9E3779B1) ^ (offset * 0x85EBCA77);
+	return (uint16_t)(v ^ (v >> 16));
+}
+
+static void sim_hash(uint16_t word, int bytes)
+{
+	stats.read_hash = (stats.read_hash ^ (word & 0xFF)) * 0x01000193;
+	if (bytes > 1) stats.read_hash = (stats.read_hash ^ (word >> 8)) * 0x01000193;
+}
+
+static void sim_post_sd(const sim_op_t &op)
+{
+	uint32_t blkpow = 0;
+	while ((128u << blkpow) < op.blksz && blkpow < 7) blkpow++;
+
+	memset(&sdreq, 0, sizeof(sdreq));
+	sdreq.disk = op.disk;
+	sdreq.op = (op.type == OP_WRITE) ? 2 : 1;
+	sdreq.blks = op.blks;
+	sdreq.blkpow = blkpow;
+	sdreq.blksz = op.blksz;
+
+	if (op.type == OP_RREAD)
+	{
+		sdreq.lba = op.lba ? (uint32_t)(rand_r(&rnd_seed) % op.lba) : 0;
+	}
+	else
+	{
+		sdreq.lba = op.lba + op_done * op.blks;
+	}
+
+	sdreq.post_us = time_us();
+	sdreq.pending = 1;
+}
+
+static void sim_complete_sd()
+{
+	uint64_t now = time_us();
+	sim_dir_stats_t *st = &stats.sd[sdreq.op == 2];
+
+	uint64_t wait = sdreq.seen_us - sdreq.post_us;
+	uint64_t service = now - sdreq.seen_us;
+
+	if (!st->reqs) st->first_us = sdreq.post_us;
+	st->last_us = now;
+	st->reqs++;
+	st->bytes += sdreq.bytes;
+	st->wait_us += wait;
+	st->service_us += service;
+	if (wait > st->wait_max) st->wait_max = wait;
+	if (service > st->service_max) st->service_max = service;
+
+	sdreq.pending = 0;
+}
+
+// Issue the next script step. SD requests are chained directly from the
+// bus handler so back-to-back transfers are not throttled by the poll rate,
+// everything else is deferred to fpga_sim_poll().
+static void sim_issue(int from_bus)
+{
+	while (!sdreq.pending && op_pos < ops.size())
+	{
+		if (sleep_until)
+		{
+			if (from_bus || time_us() < sleep_until) return;
+			sleep_until = 0;
+		}
+
+		const sim_op_t &op = ops[op_pos];
+
+		if (op.type == OP_READ || op.type == OP_RREAD || op.type == OP_WRITE)
+		{
+			if (op_done < op.count)
+			{
+				sim_post_sd(op);
+				op_done++;
+				return;
+			}
+
+			op_pos++;
+			op_done = 0;
+			continue;
+		}
+
+		if (from_bus) return;
+
+		op_pos++;
+		op_done = 0;
+
+		switch (op.type)
+		{
+		case OP_MOUNT:
+			printf("SIM: mount %d: %s\n", op.disk, op.path.c_str());
+			user_io_file_mount(op.path.c_str(), op.disk);
+			break;
+
+		case OP_LOAD:
+			printf("SIM: load %d: %s\n", op.disk, op.path.c_str());
+			user_io_file_tx(op.path.c_str(), op.disk);
+			break;
+
+		case OP_CD:
+			if (cd_pending) printf("SIM: CD packet dropped, previous one was not fetched.\n");
+			memcpy(cd_words, op.words, sizeof(cd_words));
+			cd_req++;
+			cd_pending = 1;
+			cd_post_us = time_us();
+			break;
+
+		case OP_SLEEP:
+			sleep_until = time_us() + op.count * 1000ULL;
+			return;
+
+		case OP_REPORT:
+			fpga_sim_report();
+			break;
+
+		case OP_RESET:
+			sim_stats_reset();
+			break;
+
+		case OP_QUIT:
+			fpga_sim_report();
+			printf("SIM: script finished.\n");
+			exit(0);
+			break;
+		}
+	}
+}
+
+// Script is a text file, one command per line, '#' starts a comment:
+//   confstr <string>                       config string returned by UIO_GET_STRING
+//   core <type> / fio16 <0|1> / iover <n>  core identification reported on GPI
+//   seed <n>                               seed for random reads
+//   mount <disk> <path>                    user_io_file_mount()
+//   load <index> <path>                    user_io_file_tx()
+//   read <disk> <lba> <count> [blks] [blksz]   sequential SD reads
+//   rread <disk> <maxlba> <count> [blks] [blksz] random SD reads
+//   write <disk> <lba> <count> [blks] [blksz]  sequential SD writes
+//   cd <w0> [w1..w7]                       queue a packet for UIO_CD_GET (hex words)
+//   sleep <ms> / report / reset / quit
+static int sim_load_script(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+	{
+		printf("SIM: Unable to open script %s\n", path);
+		return 0;
+	}
+
+	char line[1024];
+	int lnum = 0;
+	while (fgets(line, sizeof(line), fp))
+	{
+		lnum++;
+
+		char *p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		char *end = p + strlen(p);
+		while (end > p && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) *--end = 0;
+		if (!*p || *p == '#') continue;
+
+		char cmd[32] = {};
+		char arg[1024] = {};
+		int n = 0;
+		sscanf(p, "%31s%n", cmd, &n);
+		char *rest = p + n;
+		while (*rest == ' ' || *rest == '\t') rest++;
+
+		sim_op_t op = {};
+		op.blks = 1;
+		op.blksz = 512;
+		op.count = 1;
+
+		if (!strcasecmp(cmd, "confstr"))
+		{
+			snprintf(core.confstr, sizeof(core.confstr), "%s", rest);
+			continue;
+		}
+		else if (!strcasecmp(cmd, "core"))
+		{
+			core.core_type = strtoul(rest, 0, 0);
+			continue;
+		}
+		else if (!strcasecmp(cmd, "fio16"))
+		{
+			core.fio_size = strtoul(rest, 0, 0) ? 1 : 0;
+			continue;
+		}
+		else if (!strcasecmp(cmd, "iover"))
+		{
+			core.io_ver = strtoul(rest, 0, 0) & 3;
+			continue;
+		}
+		else if (!strcasecmp(cmd, "seed"))
+		{
+			rnd_seed = strtoul(rest, 0, 0);
+			continue;
+		}
+		else if (!strcasecmp(cmd, "mount") || !strcasecmp(cmd, "load"))
+		{
+			op.type = strcasecmp(cmd, "mount") ? OP_LOAD : OP_MOUNT;
+			if (sscanf(rest, "%d %1023[^\n]", &op.disk, arg) != 2) goto syntax;
+			op.path = arg;
+		}
+		else if (!strcasecmp(cmd, "read") || !strcasecmp(cmd, "rread") || !strcasecmp(cmd, "write"))
+		{
+			op.type = !strcasecmp(cmd, "read") ? OP_READ : !strcasecmp(cmd, "rread") ? OP_RREAD : OP_WRITE;
+			if (sscanf(rest, "%d %u %u %u %u", &op.disk, &op.lba, &op.count, &op.blks, &op.blksz) < 3) goto syntax;
+			if (!op.blks || op.blks > 64 || !op.blksz || op.disk < 0 || op.disk > 15) goto syntax;
+		}
+		else if (!strcasecmp(cmd, "cd"))
+		{
+			op.type = OP_CD;
+			unsigned int w[8] = {};
+			op.nwords = sscanf(rest, "%x %x %x %x %x %x %x %x", &w[0], &w[1], &w[2], &w[3], &w[4], &w[5], &w[6], &w[7]);
+			if (op.nwords < 1) goto syntax;
+			for (int i = 0; i < 8; i++) op.words[i] = (uint16_t)w[i];
+		}
+		else if (!strcasecmp(cmd, "sleep"))
+		{
+			op.type = OP_SLEEP;
+			op.count = strtoul(rest, 0, 0);
+		}
+		else if (!strcasecmp(cmd, "report")) op.type = OP_REPORT;
+		else if (!strcasecmp(cmd, "reset")) op.type = OP_RESET;
+		else if (!strcasecmp(cmd, "quit")) op.type = OP_QUIT;
+		else goto syntax;
+
+		ops.push_back(op);
+		continue;
+
+	syntax:
+		printf("SIM: %s:%d: cannot parse \"%s\"\n", path, lnum, p);
+	}
+
+	fclose(fp);
+	printf("SIM: %u script steps loaded from %s\n", (uint32_t)ops.size(), path);
+	return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+/* SPI bus                                                                    */
+/* ------------------------------------------------------------------------- */
+
+enum
+{
+	CH_NONE,
+	CH_FPGA,
+	CH_OSD,
+	CH_IO
+};
+
+static uint32_t gpo = 0;
+static uint16_t gpi_data = 0;
+static int ch = CH_NONE;
+static uint32_t ch_idx = 0;
+static uint16_t ch_cmd = 0;
+
+static int sim_channel(uint32_t value)
+{
+	if (value & SSPI_OSD_EN) return CH_OSD;
+	if (value & SSPI_IO_EN) return CH_IO;
+	if (value & SSPI_FPGA_EN) return CH_FPGA;
+	return CH_NONE;
+}
+
+static void sim_channel_end()
+{
+	if (ch == CH_IO && ch_idx > 1)
+	{
+		uint8_t cmd = (uint8_t)ch_cmd;
+		if ((cmd == UIO_SECTOR_RD || cmd == UIO_SECTOR_WR) && sdreq.pending && sdreq.seen)
+		{
+			sim_complete_sd();
+			sim_issue(1);
+		}
+	}
+}
+
+static uint16_t sim_io_word(uint32_t idx, uint16_t word)
+{
+	int bytes = core.fio_size ? 2 : 1;
+
+	switch ((uint8_t)ch_cmd)
+	{
+	case UIO_GET_STRING:
+		if (idx && (idx - 1) < strlen(core.confstr)) return (uint8_t)core.confstr[idx - 1];
+		return 0;
+
+	case UIO_GET_SDSTAT:
+		if (!sdreq.pending) return 0;
+		switch (idx)
+		{
+		case 0:
+			if (!sdreq.seen)
+			{
+				sdreq.seen = 1;
+				sdreq.seen_us = time_us();
+			}
+			return 0x8000 | (((sdreq.blks - 1) & 0x3F) << 9) | ((sdreq.blkpow & 7) << 6) | ((sdreq.disk & 0xF) << 2) | (sdreq.op & 3);
+		case 2: return (uint16_t)sdreq.lba;
+		case 3: return (uint16_t)(sdreq.lba >> 16);
+		}
+		return 0;
+
+	case UIO_SECTOR_RD:
+		if (idx && sdreq.pending)
+		{
+			sim_hash(word, bytes);
+			sdreq.bytes += bytes;
+		}
+		return 0;
+
+	case UIO_SECTOR_WR:
+		if (idx && sdreq.pending)
+		{
+			sdreq.bytes += bytes;
+			return sim_pattern(sdreq.lba, idx - 1);
+		}
+		return 0;
+
+	case UIO_CD_GET:
+		if (!idx) return cd_req;
+		if (idx == 2 && cd_pending)
+		{
+			stats.cd_packets++;
+			stats.cd_wait_us += time_us() - cd_post_us;
+			cd_pending = 0;
+		}
+		if (idx >= 2 && (idx - 2) < 8) return cd_words[idx - 2];
+		return 0;
+	}
+
+	return 0;
+}
+
+static uint16_t sim_fpga_word(uint32_t idx, uint16_t word)
+{
+	switch ((uint8_t)ch_cmd)
+	{
+	case FIO_FILE_TX:
+		if (idx == 1)
+		{
+			uint8_t en = (uint8_t)word;
+			if (en == 0xFF)
+			{
+				tx_active = 1;
+				tx_size = 0;
+				tx_start = time_us();
+			}
+			else if (!en && tx_active)
+			{
+				tx_active = 0;
+				stats.tx_files++;
+				stats.tx_us += time_us() - tx_start;
+				stats.ddr_bytes += tx_size;
+			}
+		}
+		else if (idx == 2 && tx_active) tx_size = word;
+		else if (idx == 3 && tx_active) tx_size |= ((uint32_t)word) << 16;
+		return 0;
+
+	case FIO_FILE_TX_DAT:
+		if (idx) stats.tx_bytes += core.fio_size ? 2 : 1;
+		return 0;
+	}
+
+	return 0;
+}
+
+void fpga_sim_gpo_write(uint32_t value)
+{
+	uint32_t prev = gpo;
+	gpo = value;
+
+	int nch = sim_channel(value);
+	if (nch != ch)
+	{
+		sim_channel_end();
+		ch = nch;
+		ch_idx = 0;
+	}
+
+	if ((value & SSPI_STROBE) && !(prev & SSPI_STROBE) && ch != CH_NONE)
+	{
+		uint16_t word = (uint16_t)value;
+		if (!ch_idx) ch_cmd = word;
+
+		stats.strobes++;
+		if (ch == CH_IO) gpi_data = sim_io_word(ch_idx, word);
+		else if (ch == CH_FPGA) gpi_data = sim_fpga_word(ch_idx, word);
+		else gpi_data = 0;
+
+		ch_idx++;
+	}
+}
+
+uint32_t fpga_sim_gpi_read()
+{
+	if (!(gpo & 0x80000000)) return 0x5CA62300 | core.core_type;
+
+	return gpi_data | (gpo & SSPI_STROBE) | (core.fio_size << 16) | (core.io_ver << 18) | (core.io_type << 28);
+}
+
+int fpga_sim_load_rbf(const void *rbf_data, uint32_t rbf_size)
+{
+	(void)rbf_data;
+	printf("SIM: bitstream of %u bytes accepted.\n", rbf_size);
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int fpga_sim_init()
+{
+	const char *env = getenv("MISTER_SIM");
+	if (!env || !env[0] || !strcmp(env, "0")) return 0;
+
+	sim_on = 1;
+	sim_stats_reset();
+	printf("SIM: simulated FPGA bridge is active.\n");
+
+	if (strcmp(env, "1")) sim_load_script(env);
+	return 1;
+}
+
+int fpga_sim_active()
+{
+	return sim_on;
+}
+
+void fpga_sim_poll()
+{
+	if (!sim_on) return;
+	sim_issue(0);
+}
+
+static void sim_report_dir(const char *name, const sim_dir_stats_t *st)
+{
+	if (!st->reqs) return;
+
+	uint64_t span = st->last_us - st->first_us;
+	printf("SIM: SD %-5s %8llu req %10llu bytes %8.2f MB/s  wait avg/max %llu/%llu us  service avg/max %llu/%llu us\n",
+		name, (unsigned long long)st->reqs, (unsigned long long)st->bytes,
+		span ? (double)st->bytes / span : 0.0,
+		(unsigned long long)(st->wait_us / st->reqs), (unsigned long long)st->wait_max,
+		(unsigned long long)(st->service_us / st->reqs), (unsigned long long)st->service_max);
+}
+
+void fpga_sim_report()
+{
+	if (!sim_on) return;
+
+	uint64_t elapsed = time_us() - stats.start_us;
+
+	printf("SIM: ---- report after %llu ms ----\n", (unsigned long long)(elapsed / 1000));
+	sim_report_dir("read", &stats.sd[0]);
+	sim_report_dir("write", &stats.sd[1]);
+	if (stats.sd[0].reqs) printf("SIM: SD read data hash: %08X\n", stats.read_hash);
+	if (stats.tx_files)
+	{
+		uint64_t bytes = stats.tx_bytes + stats.ddr_bytes;
+		printf("SIM: file tx  %8llu files %10llu bytes (%llu via DDR) %8.2f MB/s\n",
+			(unsigned long long)stats.tx_files, (unsigned long long)bytes, (unsigned long long)stats.ddr_bytes,
+			stats.tx_us ? (double)bytes / stats.tx_us : 0.0);
+	}
+	if (stats.cd_packets)
+	{
+		printf("SIM: CD cmd   %8llu packets, fetch latency avg %llu us\n",
+			(unsigned long long)stats.cd_packets, (unsigned long long)(stats.cd_wait_us / stats.cd_packets));
+	}
+	printf("SIM: bus strobes: %llu (%.0f/s)\n", (unsigned long long)stats.strobes, elapsed ? stats.strobes * 1000000.0 / elapsed : 0.0);
+	fflush(stdout);
+}
+
+#endif // FPGA_SIM
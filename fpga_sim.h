@@ -0,0 +1,32 @@
+#ifndef FPGA_SIM_H
+#define FPGA_SIM_H
+
+#include <stdint.h>
+
+// Simulated HPS<->FPGA bridge.
+// Built in with SIM=1 and selected at run time by setting MISTER_SIM
+// (to "1" or to the path of a virtual core script). When active, the
+// GPO/GPI strobe protocol, the UIO/FIO command channels and the DDR3
+// shared memory window are emulated in process memory, so the HPS-side
+// I/O paths can be exercised and benchmarked without a DE10-Nano.
+
+#ifdef FPGA_SIM
+
+int fpga_sim_init();
+int fpga_sim_active();
+
+void *fpga_sim_map(uint32_t address, uint32_t size);
+int fpga_sim_unmap(void *map, uint32_t size);
+
+void fpga_sim_gpo_write(uint32_t value);
+uint32_t fpga_sim_gpi_read();
+
+int fpga_sim_load_rbf(const void *rbf_data, uint32_t rbf_size);
+
+// runs the virtual core script outside of SPI context.
+void fpga_sim_poll();
+void fpga_sim_report();
+
+#endif // FPGA_SIM
+
+#endif // FPGA_SIM_H
@@ -8,6 +8,7 @@
 #include "user_io.h"
 #include "frame_timer.h"
 #include "video.h"
+#include "scheduler.h"
 
 // frame timer used by autofire; call frame_timer() periodically and use FRAME_TICK().
 // prefers the core's frame counter, otherwise falls back to timerfd.
@@ -45,6 +46,7 @@ static inline bool vtime_changed()
 		if (vtimerfd >= 0) {
 			close(vtimerfd);	// recycle timerfd
 			vtimerfd = -1;
+			scheduler_fds_changed();
 		}
 		printf("frame_timer(): vtime change detected, restarting timer.\n");
 		prev_vtime = current_vtime;
@@ -83,6 +85,7 @@ int start_vtimer(uint64_t interval_ns) {
 		printf("frame_timer(): timerfd setup failed, will retry.\n");
         return 1;
     }
+	scheduler_fds_changed();
 	float hz = 1e9f / interval_ns;
     printf("frame_timer(): core does not offer framecounter. using timerfd.\n");
 	printf("%.2fhz timer started.\n", hz);
@@ -117,6 +120,11 @@ static bool check_vtimer() {
 	return true;
 }
 
+// timerfd backing the frame counter, -1 if the core provides its own.
+int frame_timer_fd() {
+	return vtimerfd;
+}
+
 // prefer core framecounter; fallback to timerfd with minor long-term drift risk.
 // call periodically (e.g., start of input_poll()).
 void frame_timer() {
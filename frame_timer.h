@@ -9,6 +9,7 @@
     ((global_frame_counter != (last)) ? ((last) = global_frame_counter, 1) : 0)
 
 void frame_timer();
+int frame_timer_fd();
 
 // global
 extern uint64_t global_frame_counter; // used by FRAME_TICK()
@@ -2,11 +2,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
 #include "input.h"
 #include "file_io.h"
 #include "user_io.h"
 #include "profiling.h"
+#include "hardware.h"
 
 
 
@@ -55,9 +62,6 @@ typedef struct {
 
 
 
-static controllerdb_entry db_maps[MAX_GCDB_ENTRIES] = {};
-static int last_db_idx = 0;
-
 //platform should be at the end of mapping strings. this function will null the start of platform: if found
 static bool cdb_entry_matches(char *db_str)
 {
@@ -472,98 +476,218 @@ static bool parse_mapping_string(char *map_str, char *guid, int dev_fd, uint32_t
 #define GCDB_DIR  "/media/fat/linux/gamecontrollerdb/"
 
 
-bool read_controller_map_from_file(char *fname, char *guid, int dev_fd, uint32_t *fill_map)
+// Every DB file is compiled into an index of the lines that can match on this
+// platform (Linux or MiSTer), sorted by GUID, and recompiled when the file
+// changes. The mistercore: part depends on the running core, so it is still
+// checked when looking up.
+struct gcdb_line_t
+{
+	char guid[GUID_LEN]; // lower case, len chars
+	uint32_t len;
+	uint32_t line;       // position in the file, later lines win
+	uint32_t text;       // offset of ",name,mapping,platform:..." in text
+};
+
+struct gcdb_index_t
+{
+	const char *name;
+	time_t mtime;
+	off64_t size;
+	bool loaded;
+	std::vector<gcdb_line_t> lines;       // full GUIDs, sorted by guid then line
+	std::vector<gcdb_line_t> short_lines; // shorter GUID fields match as a prefix
+	std::vector<char> text;
+
+	gcdb_index_t(const char *name) : name(name), mtime(0), size(0), loaded(false) {}
+};
+
+// the user file overrides the main one
+static gcdb_index_t gcdb_files[] =
+{
+	GCDB_DIR "gamecontrollerdb_user.txt",
+	GCDB_DIR "gamecontrollerdb.txt",
+};
+
+static bool gcdb_line_less(const gcdb_line_t &a, const gcdb_line_t &b)
+{
+	int r = memcmp(a.guid, b.guid, GUID_LEN - 1);
+	return r ? (r < 0) : (a.line < b.line);
+}
+
+static bool gcdb_guid_less(const gcdb_line_t &a, const gcdb_line_t &b)
+{
+	return memcmp(a.guid, b.guid, GUID_LEN - 1) < 0;
+}
+
+static bool gcdb_platform_possible(const char *str)
+{
+	const char *pl = strcasestr(str, "platform:");
+	if (!pl) return false;
+
+	pl += strlen("platform:");
+	return !strncasecmp(pl, "Linux", 5) || !strncasecmp(pl, "MiSTer", 6);
+}
+
+static void gcdb_compile(gcdb_index_t *idx)
 {
+	uint64_t t = time_us();
+
+	idx->lines.clear();
+	idx->short_lines.clear();
+	idx->text.clear();
+
 	fileTextReader reader;
-	char matched[1024] = {};
-	char *map_start = NULL;
+	if (!FileOpenTextReader(&reader, idx->name)) return;
+
+	const char *line;
+	uint32_t num = 0;
+	while ((line = FileReadLine(&reader)))
+	{
+		num++;
+		if (line[0] == '#') continue;
+
+		// a GUID field longer than a GUID can't match
+		const char *gcom = strchr(line, ',');
+		if (!gcom || gcom - line >= GUID_LEN || !gcdb_platform_possible(gcom)) continue;
+
+		gcdb_line_t l = {};
+		l.len = gcom - line;
+		for (uint32_t i = 0; i < l.len; i++) l.guid[i] = tolower(line[i]);
+		l.line = num;
+		l.text = idx->text.size();
+		idx->text.insert(idx->text.end(), gcom, gcom + strlen(gcom) + 1);
+
+		if (l.len == GUID_LEN - 1) idx->lines.push_back(l);
+		else idx->short_lines.push_back(l);
+	}
+
+	std::sort(idx->lines.begin(), idx->lines.end(), gcdb_line_less);
+
+	printf("Gamecontrollerdb: indexed %s, %d of %u lines in %llu us\n", idx->name,
+		(int)(idx->lines.size() + idx->short_lines.size()), num, time_us() - t);
+}
 
-	if (FileOpenTextReader(&reader, fname))
+static bool gcdb_update(gcdb_index_t *idx)
+{
+	struct stat64 *st = getPathStat(idx->name);
+	if (!st || !S_ISREG(st->st_mode))
 	{
-		const char *line;
-		printf("Gamecontrollerdb: searching for GUID %s in file %s\n", guid, fname);
-		while ((line = FileReadLine(&reader)))
+		if (idx->loaded)
 		{
-			if (line[0] == '#') continue;
-			const char *gcom = strchr(line, ',');
-			if (!strncasecmp(line, guid, gcom-line))
-			{
-				if (cdb_entry_matches((char *)gcom))
-				{
-					map_start = strchr((char *)gcom+1, ',');
-					if (map_start)
-					{
-						strncpy(matched, map_start+1, sizeof(matched));
-					}
-				}
-			}
+			idx->lines.clear();
+			idx->short_lines.clear();
+			idx->text.clear();
+			idx->loaded = false;
 		}
-
+		return false;
 	}
-	if (matched[0] != 0)
+
+	if (!idx->loaded || idx->mtime != st->st_mtime || idx->size != st->st_size)
 	{
-		printf("Gamecontrollerdb: found match, using config %s\n", matched);
-		return parse_mapping_string(matched, guid, dev_fd, fill_map);
+		idx->mtime = st->st_mtime;
+		idx->size = st->st_size;
+		idx->loaded = true;
+		gcdb_compile(idx);
 	}
 
-	return false;
+	return true;
 }
 
-static int gcdb_controller_idx(uint16_t bustype, uint16_t vid, uint16_t pid, uint16_t version)
+static bool gcdb_line_matches(const gcdb_index_t *idx, const gcdb_line_t *l, char *matched, size_t size)
 {
-	for (int i=0; i < MAX_GCDB_ENTRIES; i++)
+	// cdb_entry_matches() cuts the string, so work on a copy
+	char *str = strdup(idx->text.data() + l->text);
+	if (!str) return false;
+
+	bool res = false;
+	if (cdb_entry_matches(str))
 	{
-		if (db_maps[i].id[0] == bustype && db_maps[i].id[1] == vid && db_maps[i].id[2] == pid && db_maps[i].id[3] == version)
+		char *map_start = strchr(str + 1, ',');
+		if (map_start)
 		{
-			return i;
+			snprintf(matched, size, "%s", map_start + 1);
+			res = true;
 		}
 	}
-	return -1;
+
+	free(str);
+	return res;
 }
 
-static void gcdb_cache_controller_map(uint16_t bustype, uint16_t vid, uint16_t pid, uint16_t version, uint32_t *button_map)
+static bool read_controller_map_from_file(gcdb_index_t *idx, const char *guid, int dev_fd, uint32_t *fill_map)
 {
-	if (gcdb_controller_idx(bustype, vid, pid, version) > -1)
+	if (!gcdb_update(idx)) return false;
+
+	char matched[1024] = {};
+	const gcdb_line_t *best = NULL;
+
+	gcdb_line_t key = {};
+	memcpy(key.guid, guid, GUID_LEN - 1);
+
+	// the last matching line of the file is used
+	auto range = std::equal_range(idx->lines.begin(), idx->lines.end(), key, gcdb_guid_less);
+	for (auto it = range.second; it != range.first;)
 	{
-		//Already cached
-		return;
+		--it;
+		if (gcdb_line_matches(idx, &*it, matched, sizeof(matched)))
+		{
+			best = &*it;
+			break;
+		}
+	}
+
+	for (auto it = idx->short_lines.rbegin(); it != idx->short_lines.rend(); ++it)
+	{
+		if (best && it->line < best->line) break;
+		if (!strncmp(it->guid, guid, it->len) && gcdb_line_matches(idx, &*it, matched, sizeof(matched))) break;
 	}
 
-	db_maps[last_db_idx].id[0] = bustype;
-	db_maps[last_db_idx].id[1] = vid;
-	db_maps[last_db_idx].id[2] = pid;
-	db_maps[last_db_idx].id[3] = version;
-	memcpy(db_maps[last_db_idx].map, button_map, sizeof(uint32_t)*NUMBUTTONS);
-	last_db_idx = (last_db_idx +1) % MAX_GCDB_ENTRIES;
+	if (matched[0] != 0)
+	{
+		printf("Gamecontrollerdb: found match for GUID %s in %s, using config %s\n", guid, idx->name, matched);
+		return parse_mapping_string(matched, (char*)guid, dev_fd, fill_map);
+	}
+
+	return false;
+}
+
+static std::unordered_map<uint64_t, controllerdb_entry> db_maps;
+
+static uint64_t gcdb_controller_key(uint16_t bustype, uint16_t vid, uint16_t pid, uint16_t version)
+{
+	return ((uint64_t)bustype << 48) | ((uint64_t)vid << 32) | ((uint32_t)pid << 16) | version;
 }
 
 bool gcdb_map_for_controller(uint16_t bustype, uint16_t vid, uint16_t pid, uint16_t version, int dev_fd, uint32_t *fill_map)
 {
 		PROFILE_FUNCTION();
 		char guid_str[GUID_LEN] = {};
-		int cache_idx = gcdb_controller_idx(bustype, vid, pid, version);
-		if (cache_idx != -1)
+		uint64_t key = gcdb_controller_key(bustype, vid, pid, version);
+		auto cached = db_maps.find(key);
+		if (cached != db_maps.end())
 		{
-			memcpy(fill_map, db_maps[cache_idx].map, sizeof(uint32_t)*NUMBUTTONS);
+			memcpy(fill_map, cached->second.map, sizeof(uint32_t)*NUMBUTTONS);
 
 			return true;
 		}
 		sprintf(guid_str, "%04x0000%04x0000%04x0000%04x0000", (uint16_t)(bustype << 8 | bustype >> 8), (uint16_t)( vid << 8 |  vid >> 8), (uint16_t)(pid << 8 | pid >> 8), (uint16_t)(version << 8 | version >> 8));
 
-		char path[256] = {GCDB_DIR};
-		strcat(path, "gamecontrollerdb_user.txt");
+		uint64_t t = time_us();
 		bool found_entry = false;
-		if (!(found_entry = read_controller_map_from_file(path, guid_str, dev_fd, fill_map)))
+		for (size_t i = 0; i < sizeof(gcdb_files) / sizeof(gcdb_files[0]) && !found_entry; i++)
 		{
-			strcpy(path, GCDB_DIR);
-			strcat(path, "gamecontrollerdb.txt");
-			found_entry = read_controller_map_from_file(path, guid_str, dev_fd, fill_map);
+			found_entry = read_controller_map_from_file(&gcdb_files[i], guid_str, dev_fd, fill_map);
 		}
-
+		printf("Gamecontrollerdb: GUID %s %s in %llu us\n", guid_str, found_entry ? "mapped" : "not found", time_us() - t);
 
 		if (found_entry)
 		{
-			gcdb_cache_controller_map(bustype, vid, pid, version, fill_map);
+			controllerdb_entry &entry = db_maps[key];
+			entry.id[0] = bustype;
+			entry.id[1] = vid;
+			entry.id[2] = pid;
+			entry.id[3] = version;
+			memcpy(entry.map, fill_map, sizeof(uint32_t)*NUMBUTTONS);
 			return true;
 		}
 		return false;
@@ -4,8 +4,6 @@
 #include <sys/types.h>
 #include <stdint.h>
 
-#define MAX_GCDB_ENTRIES 6 
-
 //Including terminating nul
 #define GUID_LEN 33 
 
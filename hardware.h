@@ -3,11 +3,20 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <time.h>
 
 unsigned long GetTimer(unsigned long offset);
 unsigned long CheckTimer(unsigned long t);
 void WaitTimer(unsigned long time);
 
+// Monotonic microseconds, for measuring intervals and stats.
+static inline uint64_t time_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 void hexdump(void *data, uint16_t size, uint16_t offset = 0);
 
 // minimig reset stuff
@@ -20,6 +20,9 @@
 #include "user_io.h"
 #include "file_io.h"
 #include "hardware.h"
+#include "readahead.h"
+#include "writeback.h"
+#include "cfg.h"
 #include "ide.h"
 
 #if 0
@@ -80,6 +83,33 @@ uint8_t ide_buf[ide_io_max_size * 512];
 
 ide_config ide_inst[2] = {};
 
+// IOPS and throughput, printed by ide_print_stats()
+struct ide_stats_t
+{
+	uint64_t rd_cmds;
+	uint64_t rd_sectors;
+	uint64_t wr_cmds;
+	uint64_t wr_sectors;
+	uint64_t flushes;
+};
+
+static ide_stats_t ide_stats[4] = {};
+static ide_stats_t ide_stats_last[4] = {};
+static uint64_t ide_stats_us = 0;
+
+// Writes cached for the drive are on disk and its read-ahead is dropped once
+// this returns; needed before the image file is closed.
+static void ide_cache_flush(int drvnum)
+{
+	writeback_flush(READAHEAD_IDE_DISK + drvnum);
+	readahead_reset(READAHEAD_IDE_DISK + drvnum);
+}
+
+static void ide_cache_flush_all()
+{
+	for (int i = 0; i < 4; i++) ide_cache_flush(i);
+}
+
 uint16_t ide_check()
 {
 	uint16_t res;
@@ -92,6 +122,8 @@ uint16_t ide_check()
 
 int ide_img_mount(fileTYPE *f, const char *name, int rw)
 {
+	// f may be the image of a drive
+	ide_cache_flush_all();
 	FileClose(f);
 	int writable = 0, ret = 0;
 
@@ -417,6 +449,7 @@ void ide_img_set(uint32_t drvnum, fileTYPE *f, int cd, int sectors, int heads, i
 
 	drive_t *drive = &ide_inst[port].drive[drv];
 
+	ide_cache_flush(drvnum & 3);
 	ide_inst[port].base = port ? IDE1_BASE : IDE0_BASE;
 	ide_inst[port].drive[drv].drvnum = drvnum;
 
@@ -761,10 +794,31 @@ inline int readhdd(drive_t *drive, uint32_t lba, int cnt)
 	}
 	else
 	{
-		return FileReadAdv(drive->f, ide_buf, cnt * 512, -1);
+		// sequential reads are prefetched on the offload workers while the
+		// current block goes over SPI
+		int disk = READAHEAD_IDE_DISK + (drive->drvnum & 3);
+		uint64_t off = (uint64_t)(lba - drive->offset) << 9;
+		int ret = readahead_read(disk, drive->f, off, ide_buf, cnt * 512);
+		if (ret > 0) writeback_overlay(disk, off, ide_buf, cnt * 512);
+		return ret;
 	}
 }
 
+// Drives enabled in ide_writeback go through the write-back cache, the others
+// write through.
+inline int writehdd(drive_t *drive, uint32_t lba, int cnt)
+{
+	int disk = READAHEAD_IDE_DISK + (drive->drvnum & 3);
+	uint64_t off = (uint64_t)(lba - drive->offset) << 9;
+
+	readahead_invalidate(disk);
+	if ((cfg.ide_writeback & (1 << (drive->drvnum & 3))) && writeback_write(disk, drive->f, off, ide_buf, cnt * 512)) return 1;
+
+	// older cached data must not land after this write
+	writeback_flush(disk);
+	return FileSeek(drive->f, off, SEEK_SET) && (FileWriteAdv(drive->f, ide_buf, cnt * 512, -1) > 0);
+}
+
 static void process_read(ide_config *ide, int multi)
 {
 	uint32_t lba = get_lba(ide);
@@ -773,8 +827,10 @@ static void process_read(ide_config *ide, int multi)
 	dbg2_printf("  sector_count: %d\n", ide->regs.sector_count);
 
 	uint32_t cnt = multi ? get_cnt(ide) : 1;
-	ide->null = !FileSeekLBA(ide->drive[ide->regs.drv].f, (lba <= ide->drive[ide->regs.drv].offset) ? 0 : (lba - ide->drive[ide->regs.drv].offset));
-	if (!ide->null) ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
+	ide_stats_t *stats = &ide_stats[ide->drive[ide->regs.drv].drvnum & 3];
+	stats->rd_cmds++;
+
+	ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
 	if (ide->null) memset(ide_buf, 0, cnt * 512);
 
 	while (1)
@@ -782,6 +838,7 @@ static void process_read(ide_config *ide, int multi)
 		lba += cnt;
 		ide->regs.sector_count -= cnt;
 		put_lba(ide, lba);
+		stats->rd_sectors += cnt;
 
 		ide->regs.io_size = cnt;
 		ide->regs.status = ATA_STATUS_RDP | ATA_STATUS_RDY | ATA_STATUS_DRQ | ATA_STATUS_IRQ;
@@ -829,7 +886,9 @@ static void process_write(ide_config *ide, int multi)
 	uint32_t cnt = 1;
 	uint16_t ide_req;
 
-	ide->null = (ide->regs.cmd != 0xFA) ? !FileSeekLBA(ide->drive[ide->regs.drv].f, (lba <= ide->drive[ide->regs.drv].offset) ? 0 : (lba - ide->drive[ide->regs.drv].offset)) : 1;
+	ide->null = (ide->regs.cmd == 0xFA);
+	ide_stats_t *stats = &ide_stats[ide->drive[ide->regs.drv].drvnum & 3];
+	if (!ide->null) stats->wr_cmds++;
 	uint8_t irq = 0;
 
 	while (1)
@@ -864,7 +923,8 @@ static void process_write(ide_config *ide, int multi)
 		}
 		else
 		{
-			if (!ide->null) ide->null = (lba < ide->drive[ide->regs.drv].offset) ? 0 : (FileWriteAdv(ide->drive[ide->regs.drv].f, ide_buf, cnt * 512, -1) <= 0);
+			if (!ide->null) ide->null = (lba < ide->drive[ide->regs.drv].offset) ? 0 : !writehdd(&ide->drive[ide->regs.drv], lba, cnt);
+			stats->wr_sectors += cnt;
 			lba += cnt;
 			ide->regs.sector_count -= cnt;
 			put_lba(ide, lba);
@@ -914,6 +974,14 @@ static int handle_hdd(ide_config *ide)
 		process_write(ide, 0);
 		break;
 
+	case 0xE7: // flush cache
+	case 0xEA: // flush cache ext
+		writeback_flush(READAHEAD_IDE_DISK + (ide->drive[ide->regs.drv].drvnum & 3));
+		ide_stats[ide->drive[ide->regs.drv].drvnum & 3].flushes++;
+		ide->regs.status = ATA_STATUS_RDY | ATA_STATUS_IRQ;
+		ide_set_regs(ide);
+		break;
+
 	case 0xFA: // mount image
 		ide->regs.pkt_io_size = 256;
 		process_write(ide, 0);
@@ -1093,6 +1161,8 @@ int ide_open(uint8_t unit, const char* filename)
 	static fileTYPE hdd_file[4] = {};
 	chs_t chs = {};
 
+	ide_cache_flush(unit & 3);
+
 	if (!is_minimig() || ((minimig_config.ide_cfg & 1) && minimig_config.hardfile[unit].cfg))
 	{
 		printf("\nChecking HDD %d\n", unit);
@@ -1133,3 +1203,32 @@ int ide_open(uint8_t unit, const char* filename)
 	FileClose(&hdd_file[unit]);
 	return 0;
 }
+
+void ide_print_stats()
+{
+	uint64_t now = time_us();
+	uint64_t us = (ide_stats_us && now > ide_stats_us) ? now - ide_stats_us : 0;
+	ide_stats_us = now;
+
+	for (int i = 0; i < 4; i++)
+	{
+		ide_stats_t *s = &ide_stats[i];
+		ide_stats_t *l = &ide_stats_last[i];
+
+		if (s->rd_cmds || s->wr_cmds)
+		{
+			printf("ide%d%d: %llu reads (%llu sectors), %llu writes (%llu sectors), %llu flushes, write-back %s\n", i >> 1, i & 1,
+				s->rd_cmds, s->rd_sectors, s->wr_cmds, s->wr_sectors, s->flushes, (cfg.ide_writeback & (1 << i)) ? "on" : "off");
+
+			if (us)
+			{
+				printf("ide%d%d: last %llu ms: %llu IOPS, read %llu KB/s, write %llu KB/s\n", i >> 1, i & 1, us / 1000,
+					(s->rd_cmds + s->wr_cmds - l->rd_cmds - l->wr_cmds) * 1000000 / us,
+					(s->rd_sectors - l->rd_sectors) * 500000 / us,
+					(s->wr_sectors - l->wr_sectors) * 500000 / us);
+			}
+		}
+
+		*l = *s;
+	}
+}
@@ -106,8 +106,6 @@ struct drive_t
 	uint8_t  atapi_ascq_code;
 
 	chd_file *chd_f;
-	int      chd_hunknum;
-	uint8_t	 *chd_hunkbuf;
 	uint32_t  chd_total_size;
 	uint32_t  chd_last_partial_lba;
 
@@ -157,4 +155,7 @@ int ide_open(uint8_t unit, const char* filename);
 
 void ide_io(int num, int req);
 
+// Per drive command and sector counts; rates cover the time since the last call.
+void ide_print_stats();
+
 #endif
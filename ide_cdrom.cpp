@@ -19,6 +19,7 @@
 #include "file_io.h"
 #include "hardware.h"
 #include "cd.h"
+#include "cd_sector.h"
 #include "ide.h"
 
 #if 0
@@ -297,13 +298,6 @@ static const char* load_chd_file(drive_t *drv, const char *chdfile)
 		return 0;
 	}
 
-	if (drv->chd_hunkbuf)
-	{
-		free(drv->chd_hunkbuf);
-	}
-
-	drv->chd_hunkbuf = (uint8_t *)malloc(tmpTOC.chd_hunksize);
-	drv->chd_hunknum = -1;
 	drv->chd_f = tmpTOC.chd_f;
 
 	//don't use add_track, just do it ourselves...
@@ -1064,7 +1058,7 @@ void cdrom_read(ide_config *ide)
 		for (uint32_t i = 0; i < cnt; i++)
 		{
 
-			if (mister_chd_read_sector(drive->chd_f, drive->chd_last_partial_lba + drive->track[drive->data_num].chd_offset, d_offset, hdr, 2048, ide_buf, drive->chd_hunkbuf, &drive->chd_hunknum) != CHDERR_NONE)
+			if (mister_chd_read_sector(drive->chd_f, drive->chd_last_partial_lba + drive->track[drive->data_num].chd_offset, d_offset, hdr, 2048, ide_buf) != CHDERR_NONE)
 			{
 				//I don't think anything else uses this, but set it just in case.
 				ide->null = 1;
@@ -1642,16 +1636,9 @@ void cdrom_close_chd(drive_t *drv)
 
 	if (drv->chd_f)
 	{
-		chd_close(drv->chd_f);
+		mister_chd_close(drv->chd_f);
 		drv->chd_f = NULL;
 	}
-
-	if (drv->chd_hunkbuf)
-	{
-		free(drv->chd_hunkbuf);
-		drv->chd_hunkbuf = NULL;
-	}
-	drv->chd_hunknum = -1;
 }
 
 const char* cdrom_parse(uint32_t num, const char *filename)
@@ -1715,7 +1702,7 @@ void ide_cdda_send_sector()
 	{
 		if (drv->chd_f)
 		{
-			mister_chd_read_sector(drv->chd_f, drv->play_start_lba + drv->track[drv->data_num].chd_offset, 0, 0, BYTES_PER_RAW_REDBOOK_FRAME, cdda_buf, drv->chd_hunkbuf, &drv->chd_hunknum);
+			mister_chd_read_sector(drv->chd_f, drv->play_start_lba + drv->track[drv->data_num].chd_offset, 0, 0, BYTES_PER_RAW_REDBOOK_FRAME, cdda_buf);
 			needs_swap = true;
 		}
 		else
@@ -1746,12 +1733,13 @@ void ide_cdda_send_sector()
 		memset(cdda_buf, 0, sizeof(cdda_buf));
 	}
 
+	if (needs_swap) cd_sector_swap16(cdda_buf, sizeof(cdda_buf));
+
 	int16_t *cdda_buf16 = (int16_t *)cdda_buf;
 	const int buf_wsize = sizeof(cdda_buf) / 2;
 
 	for (int sidx = 0; sidx < buf_wsize; sidx++)
 	{
-		if (needs_swap) cdda_buf16[sidx] = bswap_16(cdda_buf16[sidx]);
 		double tmps = (double)cdda_buf16[sidx];
 		cdda_buf16[sidx] = (int16_t)(tmps*((sidx & 1) ? drv->volume_l : drv->volume_r));
 	}
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <sys/inotify.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/sysinfo.h>
 #include <dirent.h>
 #include <errno.h>
@@ -34,6 +35,18 @@
 #include "gamecontroller_db.h"
 #include "str_util.h"
 #include "frame_timer.h"
+#include "offload.h"
+#include "scheduler.h"
+#include "readahead.h"
+#include "writeback.h"
+#include "ide.h"
+#include "dircache.h"
+#include "share_cache.h"
+#include "support/chd/mister_chd.h"
+#include "support/sram_store/sram_store.h"
+#include "shmem.h"
+#include "capture.h"
+#include "support/snes/msu_stream.h"
 
 #define NUMDEV 30
 #define UINPUT_NAME "MiSTer virtual input"
@@ -4719,6 +4732,224 @@ static void setup_wheels()
 	}
 }
 
+// Events are drained from each evdev node with one read into a per device
+// queue and handed out a whole SYN_REPORT frame at a time. The kernel stamps
+// every event of a frame with the same CLOCK_MONOTONIC time (see
+// EVIOCSCLOCKID below), which is compared with the time the frame reaches the
+// core in input_poll().
+#define EVQ_SIZE 64
+
+struct evq_t
+{
+	struct input_event ev[EVQ_SIZE];
+	uint16_t head;      // next event to hand out
+	uint16_t frame_end; // end of the last complete frame
+	uint16_t tail;      // end of the events read so far
+	uint8_t mono;       // timestamps are CLOCK_MONOTONIC
+};
+
+static evq_t evq[NUMDEV] = {};
+static int epoll_fd = -1;
+static bool epoll_dirty = true;
+
+static const uint32_t lat_bucket_us[] = { 250, 500, 1000, 2000, 4000, 8000, 16000, 32000 };
+#define LAT_BUCKETS (sizeof(lat_bucket_us) / sizeof(lat_bucket_us[0]) + 1)
+
+struct lat_hist_t
+{
+	uint64_t pending_us; // oldest frame not yet forwarded, 0 if none
+	uint64_t samples;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t bucket[LAT_BUCKETS];
+};
+
+static struct
+{
+	uint64_t waits;
+	uint64_t reads;
+	uint64_t events;
+	uint64_t frames;
+	uint64_t split;      // reads that ended inside a frame
+	uint64_t dropped;    // SYN_DROPPED from the kernel
+	uint32_t max_batch;
+	lat_hist_t joy;
+	lat_hist_t mouse;
+} input_stats;
+
+static void input_fds_changed()
+{
+	epoll_dirty = true;
+	scheduler_fds_changed();
+}
+
+// Same set as pool[], keyed by the pool index. Closed fds drop out by
+// themselves, a reused fd number wouldn't be noticed, so the set is rebuilt
+// whenever the devices are reopened.
+static void input_build_epoll()
+{
+	epoll_dirty = false;
+
+	if (epoll_fd >= 0) close(epoll_fd);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+	{
+		printf("input: epoll_create1 failed, using poll.\n");
+		return;
+	}
+
+	for (int i = 0; i < NUMDEV + 3; i++)
+	{
+		if (pool[i].fd < 0) continue;
+
+		struct epoll_event ee = {};
+		ee.events = (pool[i].events & POLLPRI) ? EPOLLPRI : EPOLLIN;
+		ee.data.u32 = i;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pool[i].fd, &ee) < 0) printf("input: cannot watch %d\n", i);
+	}
+}
+
+// Fills revents of pool[] like poll() does.
+static int input_wait(int timeout)
+{
+	input_stats.waits++;
+	if (epoll_dirty) input_build_epoll();
+	if (epoll_fd < 0) return poll(pool, NUMDEV + 3, timeout);
+
+	for (int i = 0; i < NUMDEV + 3; i++) pool[i].revents = 0;
+
+	struct epoll_event ee[NUMDEV + 3];
+	int n = epoll_wait(epoll_fd, ee, NUMDEV + 3, timeout);
+	if (n < 0) return (errno == EINTR) ? 0 : n;
+
+	for (int i = 0; i < n; i++)
+	{
+		uint32_t e = ee[i].events;
+		pool[ee[i].data.u32].revents = ((e & EPOLLIN) ? POLLIN : 0) | ((e & EPOLLPRI) ? POLLPRI : 0) |
+			((e & EPOLLERR) ? POLLERR : 0) | ((e & EPOLLHUP) ? POLLHUP : 0);
+	}
+
+	return n;
+}
+
+static void evq_open(int dev)
+{
+	int clk = CLOCK_MONOTONIC;
+	memset(&evq[dev], 0, sizeof(evq_t));
+	evq[dev].mono = ioctl(pool[dev].fd, EVIOCSCLOCKID, &clk) >= 0;
+}
+
+static void evq_fill(int dev)
+{
+	evq_t *q = &evq[dev];
+
+	if (q->head && q->head == q->tail) q->head = q->frame_end = q->tail = 0;
+	else if (q->head)
+	{
+		memmove(q->ev, q->ev + q->head, (q->tail - q->head) * sizeof(struct input_event));
+		q->tail -= q->head;
+		q->frame_end -= q->head;
+		q->head = 0;
+	}
+
+	if (q->tail == EVQ_SIZE) return;
+
+	int len = read(pool[dev].fd, q->ev + q->tail, (EVQ_SIZE - q->tail) * sizeof(struct input_event));
+	if (len < (int)sizeof(struct input_event)) return;
+
+	uint32_t cnt = len / sizeof(struct input_event);
+	input_stats.reads++;
+	input_stats.events += cnt;
+	if (cnt > input_stats.max_batch) input_stats.max_batch = cnt;
+
+	for (uint32_t i = q->tail; i < q->tail + cnt; i++)
+	{
+		if (q->ev[i].type != EV_SYN) continue;
+		if (q->ev[i].code == SYN_DROPPED) input_stats.dropped++;
+		if (q->ev[i].code == SYN_REPORT || q->ev[i].code == SYN_DROPPED)
+		{
+			q->frame_end = i + 1;
+			input_stats.frames++;
+		}
+	}
+	q->tail += cnt;
+
+	if (q->frame_end != q->tail) input_stats.split++;
+
+	// a device that never reports frames still has to be served
+	if (q->tail == EVQ_SIZE && !q->frame_end) q->frame_end = q->tail;
+}
+
+static int evq_next(int dev, struct input_event *ev)
+{
+	evq_t *q = &evq[dev];
+	if (q->head >= q->frame_end) return 0;
+
+	*ev = q->ev[q->head++];
+	return 1;
+}
+
+static int evq_ready()
+{
+	for (int i = 0; i < NUMDEV; i++) if (evq[i].head < evq[i].frame_end) return 1;
+	return 0;
+}
+
+int input_pending()
+{
+	return evq_ready();
+}
+
+static uint64_t evq_time_us(int dev, const struct input_event *ev)
+{
+	if (!evq[dev].mono) return time_us();
+	return (uint64_t)ev->time.tv_sec * 1000000ULL + ev->time.tv_usec;
+}
+
+static void lat_pending(lat_hist_t *h, uint64_t t)
+{
+	if (!h->pending_us || t < h->pending_us) h->pending_us = t;
+}
+
+static void lat_forwarded(lat_hist_t *h)
+{
+	if (!h->pending_us) return;
+
+	uint64_t now = time_us();
+	uint64_t lat = (now > h->pending_us) ? now - h->pending_us : 0;
+	h->pending_us = 0;
+
+	h->samples++;
+	h->total_us += lat;
+	if (lat > h->max_us) h->max_us = lat;
+
+	uint32_t b = 0;
+	while (b < LAT_BUCKETS - 1 && lat >= lat_bucket_us[b]) b++;
+	h->bucket[b]++;
+}
+
+static void lat_print(const char *name, const lat_hist_t *h)
+{
+	printf("input: %s latency: %llu samples, avg %llu us, max %llu us\n", name, h->samples, h->samples ? h->total_us / h->samples : 0, h->max_us);
+	if (!h->samples) return;
+
+	printf("input:  ");
+	for (uint32_t b = 0; b < LAT_BUCKETS; b++)
+	{
+		if (b < LAT_BUCKETS - 1) printf(" <%uus:%llu", lat_bucket_us[b], h->bucket[b]);
+		else printf(" >=%uus:%llu", lat_bucket_us[b - 1], h->bucket[b]);
+	}
+	printf("\n");
+}
+
+void input_print_stats()
+{
+	printf("input: %llu waits, %llu reads, %llu events in %llu frames, up to %u events per read, %llu reads ended mid frame, %llu drops\n",
+		input_stats.waits, input_stats.reads, input_stats.events, input_stats.frames, input_stats.max_batch, input_stats.split, input_stats.dropped);
+	lat_print("joystick", &input_stats.joy);
+	lat_print("mouse", &input_stats.mouse);
+}
+
 int input_test(int getchar)
 {
 	static char cur_leds = 0;
@@ -4752,6 +4983,7 @@ int input_test(int getchar)
 		pool[NUMDEV + 2].fd = open(LED_MONITOR, O_RDONLY | O_CLOEXEC);
 		pool[NUMDEV + 2].events = POLLPRI;
 
+		input_fds_changed();
 		state++;
 	}
 
@@ -4772,6 +5004,7 @@ int input_test(int getchar)
 		}
 
 		memset(input, 0, sizeof(input));
+		memset(evq, 0, sizeof(evq));
 
 		int n = 0;
 		DIR *d = opendir("/dev/input");
@@ -4792,6 +5025,7 @@ int input_test(int getchar)
 						pool[n].fd = fd;
 						pool[n].events = POLLIN;
 						input[n].mouse = !strncmp(de->d_name, "mouse", 5);
+						if (!input[n].mouse) evq_open(n);
 
 						char uniq[32] = {};
 						if (!input[n].mouse)
@@ -5144,6 +5378,7 @@ int input_test(int getchar)
 			}
 			unflag_players();
 		}
+		input_fds_changed();
 		cur_leds |= 0x80;
 		state++;
 	}
@@ -5197,8 +5432,9 @@ int input_test(int getchar)
 				}
 			}
 
-			int return_value = poll(pool, NUMDEV + 3, timeout);
-			if (!return_value) break;
+			// frames left in the queues are served without waiting
+			int return_value = input_wait(evq_ready() ? 0 : timeout);
+			if (!return_value && !evq_ready()) break;
 
 			if (return_value < 0)
 			{
@@ -5223,14 +5459,28 @@ int input_test(int getchar)
 				int i = pos;
 
 
-				if ((pool[i].fd >= 0) && (pool[i].revents & POLLIN))
+				if ((pool[i].fd >= 0) && ((pool[i].revents & POLLIN) || evq[i].head < evq[i].frame_end))
 				{
 					if (!input[i].mouse)
 					{
+						if (pool[i].revents & POLLIN) evq_fill(i);
 
-						memset(&ev, 0, sizeof(ev));
-						if (read(pool[i].fd, &ev, sizeof(ev)) == sizeof(ev))
+						uint64_t frame_us = 0;
+						while (evq_next(i, &ev))
 						{
+							if (!frame_us) frame_us = evq_time_us(i, &ev);
+							if (ev.type == EV_SYN)
+							{
+								// whatever the frame changed reaches the core in input_poll()
+								if (!getchar)
+								{
+									lat_pending(&input_stats.joy, frame_us);
+									if (mouse_req) lat_pending(&input_stats.mouse, frame_us);
+								}
+								frame_us = 0;
+								continue;
+							}
+
 							if (getchar)
 							{
 								if (ev.type == EV_KEY && ev.value >= 1)
@@ -5708,6 +5958,9 @@ int input_test(int getchar)
 						uint8_t data[4] = {};
 						if (read(pool[i].fd, data, sizeof(data)))
 						{
+							// mousedev packets carry no timestamp
+							if (!getchar) lat_pending(&input_stats.mouse, time_us());
+
 							int edev = i;
 							int dev = i;
 							if (input[i].bind >= 0) edev = input[i].bind; // mouse to event
@@ -5808,12 +6061,78 @@ int input_test(int getchar)
 					{
 						user_io_screenshot_cmd(cmd);
 					}
+					else if (!strncmp(cmd, "record", 6))
+					{
+						capture_record_cmd(cmd);
+					}
 					else if (!strncmp(cmd, "volume ", 7))
 					{
 						if (!strcmp(cmd + 7, "mute")) set_volume(0x81);
 						else if (!strcmp(cmd + 7, "unmute")) set_volume(0x80);
 						else if (cmd[7] >= '0' && cmd[7] <= '7') set_volume(0x40 - 0x30 + cmd[7]);
 					}
+					else if (!strcmp(cmd, "offload_stats"))
+					{
+						offload_print_stats();
+					}
+					else if (!strcmp(cmd, "sched_stats"))
+					{
+						scheduler_print_stats();
+					}
+					else if (!strcmp(cmd, "readahead_stats"))
+					{
+						readahead_print_stats();
+					}
+					else if (!strcmp(cmd, "writeback_stats"))
+					{
+						writeback_print_stats();
+					}
+					else if (!strcmp(cmd, "ide_stats"))
+					{
+						ide_print_stats();
+					}
+					else if (!strcmp(cmd, "dircache_stats"))
+					{
+						dircache_print_stats();
+					}
+					else if (!strcmp(cmd, "share_stats"))
+					{
+						share_cache_print_stats();
+					}
+					else if (!strcmp(cmd, "msu_stats"))
+					{
+						msu_stream_print_stats();
+					}
+					else if (!strcmp(cmd, "chd_stats"))
+					{
+						mister_chd_print_stats();
+					}
+					else if (!strcmp(cmd, "sram_stats"))
+					{
+						sram_store_print_stats();
+					}
+					else if (!strcmp(cmd, "shmem_stats"))
+					{
+						shmem_print_stats();
+					}
+					else if (!strcmp(cmd, "input_stats"))
+					{
+						input_print_stats();
+					}
+					else if (!strcmp(cmd, "capture_stats"))
+					{
+						capture_print_stats();
+					}
+#ifdef PROFILING
+					else if (!strncmp(cmd, "profile_dump", 12))
+					{
+						profiling_dump((cmd[12] == ' ') ? cmd + 13 : nullptr);
+					}
+					else if (!strcmp(cmd, "profile_reset"))
+					{
+						profiling_reset_stats();
+					}
+#endif
 				}
 			}
 
@@ -5932,9 +6251,11 @@ int input_poll(int getchar)
 			{
 				joy_mask_prev[i] = joy_mask[i];
 				user_io_digital_joystick(i, joy_mask[i], newdir);
+				lat_forwarded(&input_stats.joy);
 			}
 		}
 	}
+	input_stats.joy.pending_us = 0;
 
 	if (!grabbed || user_io_osd_is_visible())
 	{
@@ -5953,16 +6274,24 @@ int input_poll(int getchar)
 		{
 			old_time = time;
 			user_io_mouse(mouse_btn | mice_btn, mouse_x, mouse_y, mouse_w);
+			lat_forwarded(&input_stats.mouse);
 			mouse_req = 0;
 			mouse_x = 0;
 			mouse_y = 0;
 			mouse_w = 0;
 		}
 	}
+	else input_stats.mouse.pending_us = 0;
 
 	return 0;
 }
 
+struct pollfd *input_pollfds(int *num)
+{
+	*num = NUMDEV + 3;
+	return pool;
+}
+
 int is_key_pressed(int key)
 {
 	unsigned char bits[(KEY_CNT + 7) / 8];
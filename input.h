@@ -82,6 +82,17 @@ void input_notify_mode();
 int input_poll(int getchar);
 int is_key_pressed(int key);
 
+// pollfd set watched by input_test(); the scheduler sleeps on the same fds.
+struct pollfd *input_pollfds(int *num);
+
+// True while complete event frames are read but not handled yet; these
+// don't show up on the fds, so nothing may sleep on them then.
+int input_pending();
+
+// Batching counters and the input-to-core latency histograms, printed by the
+// input_stats command.
+void input_print_stats();
+
 void start_map_setting(int cnt, int set = 0);
 int get_map_set();
 int get_map_button();
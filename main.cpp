@@ -29,16 +29,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "menu.h"
 #include "user_io.h"
 #include "input.h"
+#include "capture.h"
 #include "frame_timer.h"
 #include "fpga_io.h"
 #include "scheduler.h"
 #include "osd.h"
 #include "offload.h"
+#include "profiling.h"
 
 const char *version = "$VER:" VDATE;
 
 int main(int argc, char *argv[])
 {
+	PROFILE_START();
+
 	// Always pin main worker process to core #1 as core #0 is the
 	// hardware interrupt handler in Linux.  This reduces idle latency
 	// in the main loop by about 6-7x.
@@ -86,6 +90,7 @@ int main(int argc, char *argv[])
 		user_io_poll();
 		frame_timer();
 		input_poll(0);
+		capture_poll();
 		HandleUI();
 		OsdUpdate();
 	}
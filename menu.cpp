@@ -643,7 +643,7 @@ static char* getNet(int spec)
 	}
 
 	freeifaddrs(ifaddr);
-	return spec ? (ifa ? host : 0) : (char*)netType;
+	return spec ? (ifa ? host : 0) : (char*)(intptr_t)netType;
 }
 
 static long sysinfo_timer;
@@ -1,66 +1,115 @@
 #include "offload.h"
 #include "profiling.h"
+#include "hardware.h"
 #include <pthread.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
-static constexpr uint32_t QUEUE_SIZE = 8;
+static constexpr uint32_t QUEUE_SIZE = 16; // per lane
+static constexpr int NUM_WORKERS = 2;
 
-static pthread_t s_thread_handle;
-static pthread_cond_t s_cond_work, s_cond_available;
-static pthread_mutex_t s_queue_lock;
+// Worker #0 serves both lanes, worker #1 only the high priority lane, so a
+// long background task never delays latency critical work and background
+// tasks keep their submission order.
+static const uint32_t s_worker_lanes[NUM_WORKERS] =
+{
+	(1 << OFFLOAD_HIGH) | (1 << OFFLOAD_LOW),
+	(1 << OFFLOAD_HIGH)
+};
 
-struct Work
+enum
 {
-	std::function<void()> handler;
+	SLOT_FREE = 0,
+	SLOT_QUEUED,
+	SLOT_RUNNING
 };
 
-static Work s_queue[QUEUE_SIZE];
-static uint32_t s_queue_head, s_queue_tail;
+struct Slot
+{
+	OffloadTask task;
+	uint32_t state;
+	uint32_t seq;
+	uint32_t done_seq;
+	uint64_t submit_us;
+};
+
+struct Lane
+{
+	Slot slots[QUEUE_SIZE];
+	uint32_t head; // next sequence to submit
+	uint32_t next; // next sequence to dispatch
+	uint32_t tail; // oldest sequence still holding its slot
+	offload_stats_t stats;
+};
+
+static pthread_t s_thread_handle[NUM_WORKERS];
+static pthread_cond_t s_cond_work, s_cond_available;
+static pthread_mutex_t s_queue_lock;
+
+static Lane s_lanes[OFFLOAD_PRIO_NUM];
 static bool s_quit;
 
-static void *worker_thread(void *)
+static Lane *pick_lane(uint32_t mask)
+{
+	for (int i = 0; i < OFFLOAD_PRIO_NUM; i++)
+	{
+		if ((mask & (1 << i)) && s_lanes[i].next != s_lanes[i].head) return &s_lanes[i];
+	}
+	return nullptr;
+}
+
+static void *worker_thread(void *arg)
 {
+	const uint32_t mask = s_worker_lanes[(intptr_t)arg];
+
+	pthread_mutex_lock(&s_queue_lock);
 	while (true)
 	{
-		Work *current_work = nullptr;
-		// Wait for work
-		pthread_mutex_lock(&s_queue_lock);
-		if (s_queue_head == s_queue_tail)
+		Lane *lane = pick_lane(mask);
+		if (!lane)
 		{
 			// queue empty and quit flag set, exit
-			if (s_quit)
-			{
-				pthread_mutex_unlock(&s_queue_lock);
-				break;
-			}
+			if (s_quit) break;
 
 			// wait for work signal
 			pthread_cond_wait(&s_cond_work, &s_queue_lock);
-			
-			// quit flag was set and queue still empty, quit
-			if (s_quit && (s_queue_head == s_queue_tail))
-			{
-				pthread_mutex_unlock(&s_queue_lock);
-				break;
-			}
+			continue;
 		}
 
 		// get work
-		current_work = &s_queue[s_queue_tail % QUEUE_SIZE];
+		Slot *slot = &lane->slots[lane->next % QUEUE_SIZE];
+		lane->next++;
+		slot->state = SLOT_RUNNING;
+
+		uint64_t start = time_us();
+		uint64_t wait = start - slot->submit_us;
+		lane->stats.wait_us += wait;
+		if (wait > lane->stats.wait_max_us) lane->stats.wait_max_us = wait;
 		pthread_mutex_unlock(&s_queue_lock);
 
 		// execute
-		current_work->handler();
-		current_work->handler = nullptr;
+		slot->task.invoke(slot->task.storage);
+		slot->task.destroy(slot->task.storage);
+
+		uint64_t run = time_us() - start;
 
-		// lock and move tail forward
+		// lock and release the slot
 		pthread_mutex_lock(&s_queue_lock);
-		s_queue_tail++;
-		pthread_cond_signal(&s_cond_available);
-		pthread_mutex_unlock(&s_queue_lock);
+		lane->stats.run_us += run;
+		if (run > lane->stats.run_max_us) lane->stats.run_max_us = run;
+		lane->stats.completed++;
+		lane->stats.depth--;
+
+		slot->done_seq = slot->seq;
+		slot->state = SLOT_FREE;
+		while (lane->tail != lane->next && lane->slots[lane->tail % QUEUE_SIZE].state == SLOT_FREE) lane->tail++;
+
+		pthread_cond_broadcast(&s_cond_available);
 	}
+	pthread_mutex_unlock(&s_queue_lock);
+
 	return (void *)0;
 }
 
@@ -70,7 +119,12 @@ void offload_start()
 	pthread_cond_init(&s_cond_work, nullptr);
 	pthread_mutex_init(&s_queue_lock, nullptr);
 
-	s_queue_head = s_queue_tail = 0;
+	memset(s_lanes, 0, sizeof(s_lanes));
+	for (auto &lane : s_lanes)
+	{
+		// sequence N is done once its slot has completed sequence N or later
+		for (uint32_t i = 0; i < QUEUE_SIZE; i++) lane.slots[i].done_seq = i - QUEUE_SIZE;
+	}
 	s_quit = false;
 
 	pthread_attr_t attr;
@@ -83,7 +137,10 @@ void offload_start()
 	CPU_SET(0, &set);
 	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
 
-	pthread_create(&s_thread_handle, &attr, worker_thread, nullptr);
+	for (intptr_t i = 0; i < NUM_WORKERS; i++)
+	{
+		pthread_create(&s_thread_handle[i], &attr, worker_thread, (void *)i);
+	}
 }
 
 void offload_stop()
@@ -91,32 +148,105 @@ void offload_stop()
 	pthread_mutex_lock(&s_queue_lock);
 
 	s_quit = true;
-	pthread_cond_signal(&s_cond_work);
+	pthread_cond_broadcast(&s_cond_work);
 
 	pthread_mutex_unlock(&s_queue_lock);
 
 	printf("Waiting for offloaded work to finish...");
-	pthread_join(s_thread_handle, nullptr);
+	for (int i = 0; i < NUM_WORKERS; i++) pthread_join(s_thread_handle[i], nullptr);
 	printf("Done\n");
 }
 
-void offload_add_work(std::function<void()> handler)
+OffloadTask *offload_acquire(offload_prio_t prio, int block)
 {
 	PROFILE_FUNCTION();
 
+	Lane *lane = &s_lanes[prio];
+
 	pthread_mutex_lock(&s_queue_lock);
 
-	if ((s_queue_head - s_queue_tail) == QUEUE_SIZE)
+	if ((lane->head - lane->tail) == QUEUE_SIZE)
+	{
+		if (!block)
+		{
+			lane->stats.rejected++;
+			pthread_mutex_unlock(&s_queue_lock);
+			return nullptr;
+		}
+
+		lane->stats.blocked++;
+		while ((lane->head - lane->tail) == QUEUE_SIZE) pthread_cond_wait(&s_cond_available, &s_queue_lock);
+	}
+
+	return &lane->slots[lane->head % QUEUE_SIZE].task;
+}
+
+void offload_commit(offload_prio_t prio, offload_handle_t *handle)
+{
+	Lane *lane = &s_lanes[prio];
+	Slot *slot = &lane->slots[lane->head % QUEUE_SIZE];
+
+	slot->seq = lane->head;
+	slot->state = SLOT_QUEUED;
+	slot->submit_us = time_us();
+
+	if (handle)
 	{
-		pthread_cond_wait(&s_cond_available, &s_queue_lock);
+		handle->prio = prio;
+		handle->seq = lane->head;
 	}
 
-	Work *work = &s_queue[s_queue_head % QUEUE_SIZE];
-	work->handler = handler;
+	lane->head++;
+	lane->stats.submitted++;
+	lane->stats.depth++;
+	if (lane->stats.depth > lane->stats.depth_max) lane->stats.depth_max = lane->stats.depth;
+
+	pthread_cond_broadcast(&s_cond_work);
+
+	pthread_mutex_unlock(&s_queue_lock);
+}
+
+int offload_done(const offload_handle_t *handle)
+{
+	if (handle->prio >= OFFLOAD_PRIO_NUM) return 1;
+
+	pthread_mutex_lock(&s_queue_lock);
+	const Slot *slot = &s_lanes[handle->prio].slots[handle->seq % QUEUE_SIZE];
+	int done = (int32_t)(slot->done_seq - handle->seq) >= 0;
+	pthread_mutex_unlock(&s_queue_lock);
+
+	return done;
+}
 
-	s_queue_head++;
+void offload_wait(const offload_handle_t *handle)
+{
+	if (handle->prio >= OFFLOAD_PRIO_NUM) return;
 
-	pthread_cond_signal(&s_cond_work);
+	pthread_mutex_lock(&s_queue_lock);
+	const Slot *slot = &s_lanes[handle->prio].slots[handle->seq % QUEUE_SIZE];
+	while ((int32_t)(slot->done_seq - handle->seq) < 0) pthread_cond_wait(&s_cond_available, &s_queue_lock);
+	pthread_mutex_unlock(&s_queue_lock);
+}
 
+void offload_get_stats(offload_prio_t prio, offload_stats_t *stats)
+{
+	pthread_mutex_lock(&s_queue_lock);
+	*stats = s_lanes[prio].stats;
 	pthread_mutex_unlock(&s_queue_lock);
-}
\ No newline at end of file
+}
+
+void offload_print_stats()
+{
+	static const char *names[OFFLOAD_PRIO_NUM] = { "high", "low" };
+
+	for (int i = 0; i < OFFLOAD_PRIO_NUM; i++)
+	{
+		offload_stats_t st;
+		offload_get_stats((offload_prio_t)i, &st);
+
+		printf("offload %-4s: depth %u (max %u), submitted %llu, rejected %llu, blocked %llu, wait avg/max %llu/%llu us, run avg/max %llu/%llu us\n",
+			names[i], st.depth, st.depth_max, st.submitted, st.rejected, st.blocked,
+			st.completed ? st.wait_us / st.completed : 0, st.wait_max_us,
+			st.completed ? st.run_us / st.completed : 0, st.run_max_us);
+	}
+}
@@ -2,11 +2,95 @@
 #define OFFLOAD_H
 
 #include <stddef.h>
-#include <functional>
+#include <stdint.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+// Offloaded work runs on worker threads pinned to core #0.
+// OFFLOAD_HIGH is for latency critical I/O and may run on any worker, so
+// tasks in that lane can execute concurrently. OFFLOAD_LOW is for background
+// housekeeping; it is served by a single worker and runs in submission order.
+enum offload_prio_t
+{
+	OFFLOAD_HIGH = 0,
+	OFFLOAD_LOW,
+	OFFLOAD_PRIO_NUM
+};
+
+// Task closures are stored inline in the queue slot; captures must fit here.
+#define OFFLOAD_TASK_SIZE 64
+
+struct OffloadTask
+{
+	alignas(8) uint8_t storage[OFFLOAD_TASK_SIZE];
+	void (*invoke)(void *obj);
+	void (*destroy)(void *obj);
+};
+
+// Completion handle; poll with offload_done().
+struct offload_handle_t
+{
+	uint32_t prio;
+	uint32_t seq;
+};
+
+struct offload_stats_t
+{
+	uint32_t depth;       // tasks queued or running now
+	uint32_t depth_max;
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t rejected;    // offload_try_add() on a full lane
+	uint64_t blocked;     // offload_add_work() had to wait for a free slot
+	uint64_t wait_us;     // total time between submit and start
+	uint64_t wait_max_us;
+	uint64_t run_us;      // total execution time
+	uint64_t run_max_us;
+};
 
 void offload_start();
 void offload_stop();
 
-void offload_add_work(std::function<void()> work);
+// internal: returns a free slot with the queue locked, or nullptr if the lane
+// is full and block is 0. offload_commit() queues the slot and unlocks.
+OffloadTask *offload_acquire(offload_prio_t prio, int block);
+void offload_commit(offload_prio_t prio, offload_handle_t *handle);
+
+template <typename F>
+static inline bool offload_submit(F &&work, offload_prio_t prio, int block, offload_handle_t *handle)
+{
+	typedef typename std::decay<F>::type Fn;
+	static_assert(sizeof(Fn) <= OFFLOAD_TASK_SIZE, "offload task captures are too large");
+	static_assert(alignof(Fn) <= 8, "offload task alignment is too large");
+
+	OffloadTask *task = offload_acquire(prio, block);
+	if (!task) return false;
+
+	new (task->storage) Fn(std::forward<F>(work));
+	task->invoke = [](void *obj) { (*(Fn *)obj)(); };
+	task->destroy = [](void *obj) { ((Fn *)obj)->~Fn(); };
+	offload_commit(prio, handle);
+	return true;
+}
+
+// Queue work, waiting for a free slot if the lane is full.
+template <typename F>
+static inline void offload_add_work(F &&work, offload_prio_t prio = OFFLOAD_HIGH, offload_handle_t *handle = nullptr)
+{
+	offload_submit(std::forward<F>(work), prio, 1, handle);
+}
+
+// Queue work without blocking. Returns false if the lane is full.
+template <typename F>
+static inline bool offload_try_add(F &&work, offload_prio_t prio = OFFLOAD_HIGH, offload_handle_t *handle = nullptr)
+{
+	return offload_submit(std::forward<F>(work), prio, 0, handle);
+}
+
+int offload_done(const offload_handle_t *handle);
+void offload_wait(const offload_handle_t *handle);
+void offload_get_stats(offload_prio_t prio, offload_stats_t *stats);
+void offload_print_stats();
 
-#endif
\ No newline at end of file
+#endif
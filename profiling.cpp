@@ -5,8 +5,13 @@
 #include "str_util.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 struct Event
 {
@@ -15,34 +20,93 @@ struct Event
 	struct timespec ts;
 };
 
-static constexpr int MAX_EVENTS = 512; // must be pow2
-static Event s_events[MAX_EVENTS]; // circular buffer
-static uint32_t s_event_tail = 0;
+static constexpr int MAX_EVENTS = 8192; // must be pow2
 
-static constexpr Event *get_event(uint32_t idx)
+// Every thread records into its own circular buffer, so recording needs no
+// locks. Buffers are linked into a global list once and reused by later
+// threads after their owner exits.
+struct ThreadBuffer
 {
-	return &s_events[idx % MAX_EVENTS];
+	Event events[MAX_EVENTS];
+	uint32_t tail;
+	uint32_t in_use;
+	int tid;
+	char thread_name[16];
+	ThreadBuffer *next;
+};
+
+static ThreadBuffer *s_buffers = nullptr;
+static thread_local ThreadBuffer *tls_buffer = nullptr;
+static pthread_key_t s_buffer_key;
+static pthread_once_t s_init_once = PTHREAD_ONCE_INIT;
+static volatile sig_atomic_t s_dump_request = 0;
+static struct timespec s_start_ts;
+
+static void release_buffer(void *buf)
+{
+	__atomic_store_n(&((ThreadBuffer *)buf)->in_use, 0, __ATOMIC_RELEASE);
 }
 
-uint32_t profiling_event_begin(const char *name)
+static void dump_signal(int)
 {
-	Event *newEvent = get_event(s_event_tail);
-	newEvent->begin_idx = s_event_tail;
-	newEvent->name = name;
-	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
+	s_dump_request = 1;
+}
 
-	uint32_t r = s_event_tail;
-	s_event_tail++;
-	return r;
+static void profiling_init()
+{
+	clock_gettime(CLOCK_MONOTONIC, &s_start_ts);
+	pthread_key_create(&s_buffer_key, release_buffer);
+
+	struct sigaction sa = {};
+	sa.sa_handler = dump_signal;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, nullptr);
 }
 
-void profiling_event_end(uint32_t begin_idx, const char *name)
+void profiling_start()
 {
-	Event *newEvent = get_event(s_event_tail);
-	newEvent->begin_idx = begin_idx;
-	newEvent->name = name;
-	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
-	s_event_tail++;
+	pthread_once(&s_init_once, profiling_init);
+}
+
+static ThreadBuffer *get_buffer()
+{
+	if (tls_buffer) return tls_buffer;
+
+	pthread_once(&s_init_once, profiling_init);
+
+	ThreadBuffer *buf = nullptr;
+	for (ThreadBuffer *b = __atomic_load_n(&s_buffers, __ATOMIC_ACQUIRE); b; b = b->next)
+	{
+		uint32_t expected = 0;
+		if (__atomic_compare_exchange_n(&b->in_use, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			buf = b;
+			break;
+		}
+	}
+
+	if (!buf)
+	{
+		buf = (ThreadBuffer *)calloc(1, sizeof(ThreadBuffer));
+		if (!buf) abort();
+		buf->in_use = 1;
+
+		buf->next = __atomic_load_n(&s_buffers, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&s_buffers, &buf->next, buf, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+	}
+
+	buf->tid = (int)syscall(SYS_gettid);
+	memset(buf->thread_name, 0, sizeof(buf->thread_name));
+	pthread_getname_np(pthread_self(), buf->thread_name, sizeof(buf->thread_name));
+
+	pthread_setspecific(s_buffer_key, buf);
+	tls_buffer = buf;
+	return buf;
+}
+
+static inline Event *get_event(ThreadBuffer *buf, uint32_t idx)
+{
+	return &buf->events[idx % MAX_EVENTS];
 }
 
 // result_ns = a - b
@@ -63,27 +127,157 @@ static uint64_t delta_ns(const struct timespec *a, const struct timespec *b)
 	return delta;
 }
 
+/* Per-scope statistics ---------------------------------------------------- */
+
+// Log-linear histogram of durations in us: values below 4 have their own
+// bucket, above that every power of two is split into 4 sub-buckets.
+static constexpr int HIST_BUCKETS = 128;
+static constexpr int MAX_SCOPES = 256; // must be pow2
+
+struct ScopeStats
+{
+	const char *name;
+	uint32_t count;
+	uint32_t max_us;
+	uint64_t total_us;
+	uint32_t hist[HIST_BUCKETS];
+};
+
+static ScopeStats s_scopes[MAX_SCOPES];
+
+static int hist_bucket(uint32_t us)
+{
+	if (us < 4) return us;
+	int msb = 31 - __builtin_clz(us);
+	return ((msb - 1) * 4) + ((us >> (msb - 2)) & 3);
+}
+
+static uint32_t hist_value(int bucket)
+{
+	if (bucket < 4) return bucket;
+	int msb = (bucket / 4) + 1;
+	return (uint32_t)(4 + (bucket & 3)) << (msb - 2);
+}
+
+static ScopeStats *get_scope(const char *name)
+{
+	uint32_t h = (uint32_t)(uintptr_t)name;
+	h = (h ^ (h >> 13)) * 0x9E3779B1;
+
+	for (int i = 0; i < MAX_SCOPES; i++)
+	{
+		ScopeStats *scope = &s_scopes[(h + i) & (MAX_SCOPES - 1)];
+		const char *cur = __atomic_load_n(&scope->name, __ATOMIC_ACQUIRE);
+		if (cur == name) return scope;
+		if (!cur)
+		{
+			const char *expected = nullptr;
+			if (__atomic_compare_exchange_n(&scope->name, &expected, name, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return scope;
+			if (expected == name) return scope;
+		}
+	}
+
+	return nullptr; // table full
+}
+
+static void scope_record(const char *name, uint64_t ns)
+{
+	ScopeStats *scope = get_scope(name);
+	if (!scope) return;
+
+	uint32_t us = (ns / 1000ULL > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (uint32_t)(ns / 1000ULL);
+	__atomic_fetch_add(&scope->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&scope->total_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&scope->hist[hist_bucket(us)], 1, __ATOMIC_RELAXED);
+
+	uint32_t max = __atomic_load_n(&scope->max_us, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&scope->max_us, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+static uint32_t scope_percentile(const ScopeStats *scope, uint32_t count, uint32_t pct)
+{
+	uint64_t target = ((uint64_t)count * pct + 99) / 100;
+	uint64_t sum = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++)
+	{
+		sum += scope->hist[i];
+		if (sum >= target)
+		{
+			// report the upper bound of the bucket
+			uint32_t val = (i + 1 < HIST_BUCKETS) ? hist_value(i + 1) - 1 : scope->max_us;
+			return (val < scope->max_us) ? val : scope->max_us;
+		}
+	}
+	return scope->max_us;
+}
+
+void profiling_reset_stats()
+{
+	for (auto &scope : s_scopes)
+	{
+		scope.count = 0;
+		scope.max_us = 0;
+		scope.total_us = 0;
+		memset(scope.hist, 0, sizeof(scope.hist));
+	}
+}
+
+/* Recording --------------------------------------------------------------- */
+
+uint32_t profiling_event_begin(const char *name)
+{
+	ThreadBuffer *buf = get_buffer();
+	uint32_t idx = buf->tail;
+
+	Event *newEvent = get_event(buf, idx);
+	newEvent->begin_idx = idx;
+	newEvent->name = name;
+	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
+
+	__atomic_store_n(&buf->tail, idx + 1, __ATOMIC_RELEASE);
+	return idx;
+}
+
+void profiling_event_end(uint32_t begin_idx, const char *name)
+{
+	ThreadBuffer *buf = get_buffer();
+	uint32_t idx = buf->tail;
+
+	Event *newEvent = get_event(buf, idx);
+	newEvent->begin_idx = begin_idx;
+	newEvent->name = name;
+	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
+
+	__atomic_store_n(&buf->tail, idx + 1, __ATOMIC_RELEASE);
+
+	if ((idx - begin_idx) < MAX_EVENTS) scope_record(name, delta_ns(&newEvent->ts, &get_event(buf, begin_idx)->ts));
+}
 
 // Bookkeeping data for spike report
 static uint64_t inclusive_times[MAX_EVENTS];
 static uint64_t other_times[MAX_EVENTS];
 static uint32_t pair_stack[MAX_EVENTS / 2];
+static pthread_mutex_t s_report_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 {
+	ThreadBuffer *buf = get_buffer();
+	const uint32_t event_tail = buf->tail;
 	int stack_pos = 0;
 
-	if ((s_event_tail - begin_idx) < 2) return; // not enough events
-	if ((s_event_tail - begin_idx) > MAX_EVENTS) return; // too many events
+	if ((event_tail - begin_idx) < 2) return; // not enough events
+	if ((event_tail - begin_idx) > MAX_EVENTS) return; // too many events
 
-	const uint64_t total_ns = delta_ns(&get_event(s_event_tail - 1)->ts, &get_event(begin_idx)->ts);
+	const uint64_t total_ns = delta_ns(&get_event(buf, event_tail - 1)->ts, &get_event(buf, begin_idx)->ts);
 
 	if (total_ns < (spike_us * 1000ULL)) return; // below threshold
 
-	for (uint32_t idx = begin_idx; idx != s_event_tail; idx++)
+	pthread_mutex_lock(&s_report_lock);
+
+	for (uint32_t idx = begin_idx; idx != event_tail; idx++)
 	{
 		const uint32_t cyc_idx = idx % MAX_EVENTS;
-		Event *event = get_event(idx);
+		Event *event = get_event(buf, idx);
 
 		if (event->begin_idx == idx)
 		{
@@ -96,7 +290,7 @@ void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 		{
 			stack_pos--;
 			uint32_t span_idx = pair_stack[stack_pos];
-			const uint64_t inclusive_ns = delta_ns(&event->ts, &get_event(span_idx)->ts);
+			const uint64_t inclusive_ns = delta_ns(&event->ts, &get_event(buf, span_idx)->ts);
 			inclusive_times[span_idx] = inclusive_ns;
 			if (stack_pos > 0) other_times[pair_stack[stack_pos-1]] += inclusive_ns;
 		}
@@ -106,10 +300,10 @@ void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 	int indent = 0;
 	printf("\n%lluus spike over %uus limit.\n", total_ns / 1000ULL, spike_us);
 	printf("+----- Name -----------------------------------------+ Inc(us) + Exc(us) +\n");
-	for (uint32_t idx = begin_idx; idx != s_event_tail; idx++)
+	for (uint32_t idx = begin_idx; idx != event_tail; idx++)
 	{
 		const uint32_t cyc_idx = idx % MAX_EVENTS;
-		Event *event = get_event(idx);
+		Event *event = get_event(buf, idx);
 
 		if (event->begin_idx == idx)
 		{
@@ -125,6 +319,101 @@ void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 	}
 	printf("+----------------------------------------------------+---------+---------+\n\n");
 	fflush(stdout);
+
+	pthread_mutex_unlock(&s_report_lock);
+}
+
+/* Export ------------------------------------------------------------------ */
+
+static void print_scope_stats()
+{
+	printf("+----- Scope ---------------------------------+--------+---------+---------+---------+---------+\n");
+	printf("| %-43s | %6s | %7s | %7s | %7s | %7s |\n", "Name", "Count", "Avg(us)", "p50(us)", "p99(us)", "Max(us)");
+	printf("+---------------------------------------------+--------+---------+---------+---------+---------+\n");
+	for (auto &scope : s_scopes)
+	{
+		const char *name = __atomic_load_n(&scope.name, __ATOMIC_ACQUIRE);
+		uint32_t count = __atomic_load_n(&scope.count, __ATOMIC_RELAXED);
+		if (!name || !count) continue;
+
+		printf("| %-43.43s | %6u | %7llu | %7u | %7u | %7u |\n", name, count, scope.total_us / count,
+			scope_percentile(&scope, count, 50), scope_percentile(&scope, count, 99), scope.max_us);
+	}
+	printf("+---------------------------------------------+--------+---------+---------+---------+---------+\n");
+}
+
+static void json_string(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\') fputc('\\', fp);
+		if ((unsigned char)*str >= 0x20) fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+void profiling_dump(const char *path)
+{
+	if (!path || !*path) path = "/tmp/MiSTer_trace.json";
+
+	pthread_once(&s_init_once, profiling_init);
+
+	FILE *fp = fopen(path, "wt");
+	if (!fp)
+	{
+		printf("profiling: unable to create %s\n", path);
+		return;
+	}
+
+	int pid = getpid();
+	int first = 1;
+	uint32_t total = 0;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (ThreadBuffer *buf = __atomic_load_n(&s_buffers, __ATOMIC_ACQUIRE); buf; buf = buf->next)
+	{
+		const uint32_t tail = __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE);
+		// skip the oldest part of the ring, the owner may be overwriting it
+		const uint32_t span = (tail > (MAX_EVENTS - 64)) ? (MAX_EVENTS - 64) : tail;
+
+		fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",\n", pid, buf->tid);
+		json_string(fp, buf->thread_name[0] ? buf->thread_name : "thread");
+		fprintf(fp, "}}");
+		first = 0;
+
+		for (uint32_t idx = tail - span; idx != tail; idx++)
+		{
+			Event *event = get_event(buf, idx);
+			if (event->begin_idx == idx || !event->name) continue;
+			if ((idx - event->begin_idx) > (idx - (tail - span))) continue; // begin is gone
+
+			Event *begin = get_event(buf, event->begin_idx);
+			uint64_t ts = delta_ns(&begin->ts, &s_start_ts);
+			uint64_t dur = delta_ns(&event->ts, &begin->ts);
+
+			fprintf(fp, ",\n{\"ph\":\"X\",\"name\":");
+			json_string(fp, event->name);
+			fprintf(fp, ",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}", pid, buf->tid,
+				ts / 1000ULL, ts % 1000ULL, dur / 1000ULL, dur % 1000ULL);
+			total++;
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+
+	printf("profiling: %u events written to %s\n", total, path);
+	print_scope_stats();
+	fflush(stdout);
+}
+
+void profiling_poll()
+{
+	if (s_dump_request)
+	{
+		s_dump_request = 0;
+		profiling_dump(nullptr);
+	}
 }
 
-#endif // PROFILING
\ No newline at end of file
+#endif // PROFILING
@@ -5,10 +5,22 @@
 
 #ifdef PROFILING
 
+// Installs the SIGUSR1 dump handler; call from main() before anything else,
+// so an early SIGUSR1 doesn't take the default action and kill the process.
+void profiling_start();
+
 uint32_t profiling_event_begin(const char *name);
 void profiling_event_end(uint32_t begin_idx, const char *name);
 void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us);
 
+// Writes the recorded events of all threads as Chrome trace-event JSON
+// (chrome://tracing, ui.perfetto.dev) and prints per-scope statistics.
+void profiling_dump(const char *path);
+void profiling_reset_stats();
+
+// Services dump requests raised by SIGUSR1; call periodically from the main loop.
+void profiling_poll();
+
 struct ProfilingScopedEvent
 {
 	const char *name;
@@ -40,13 +52,17 @@ struct ProfilingScopedEvent
 #define PROFILE_FUNCTION() ProfilingScopedEvent __scope_timer(__FUNCTION__)
 #define SPIKE_SCOPE(name, us) ProfilingScopedEvent __scope_timer(name, us)
 #define SPIKE_FUNCTION(us) ProfilingScopedEvent __scope_timer(__FUNCTION__, us)
+#define PROFILE_POLL() profiling_poll()
+#define PROFILE_START() profiling_start()
 
 #else // PROFILING
 
-#define PROFILE_SCOPE(name) 
+#define PROFILE_SCOPE(name)
 #define PROFILE_FUNCTION()
 #define SPIKE_SCOPE(name, us)
 #define SPIKE_FUNCTION(us)
+#define PROFILE_POLL()
+#define PROFILE_START()
 
 #endif // PROFILING
 
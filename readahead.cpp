@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "readahead.h"
+#include "offload.h"
+#include "hardware.h"
+
+#define RA_DISKS 20
+#define RA_SLOTS 8
+#define RA_DEPTH 4   // windows kept in flight ahead of the reader
+
+enum
+{
+	SLOT_FREE = 0,
+	SLOT_PENDING,    // read queued on the offload workers
+	SLOT_READY
+};
+
+struct ra_slot_t
+{
+	uint8_t *data;
+	uint64_t off;
+	uint32_t len;
+	int32_t  result; // written by the worker
+	uint32_t gen;
+	int      state;
+	int      used;
+	offload_handle_t handle;
+};
+
+struct ra_disk_t
+{
+	ra_slot_t slot[RA_SLOTS];
+	uint8_t *mem;
+	uint32_t gen;
+	uint64_t next_off;
+	uint32_t seq;
+};
+
+static ra_disk_t disks[RA_DISKS] = {};
+
+static struct
+{
+	uint64_t reads;
+	uint64_t hits;        // served from a finished prefetch
+	uint64_t waits;       // prefetch was still in flight
+	uint64_t misses;
+	uint64_t prefetched;
+	uint64_t wasted;      // prefetched but evicted or invalidated unused
+	uint64_t wait_us;
+	uint64_t wait_max_us;
+	uint64_t miss_us;
+	uint64_t miss_max_us;
+} stats;
+
+static int sync_read(fileTYPE *f, uint64_t off, void *buf, uint32_t len)
+{
+	if (!FileSeek(f, off, SEEK_SET)) return 0;
+	return FileReadAdv(f, buf, len);
+}
+
+// collect finished prefetches
+static void reap(ra_disk_t *ra)
+{
+	for (int i = 0; i < RA_SLOTS; i++)
+	{
+		ra_slot_t *s = &ra->slot[i];
+		if (s->state == SLOT_PENDING && offload_done(&s->handle)) s->state = SLOT_READY;
+	}
+}
+
+static ra_slot_t *find(ra_disk_t *ra, uint64_t off, uint32_t len)
+{
+	for (int i = 0; i < RA_SLOTS; i++)
+	{
+		ra_slot_t *s = &ra->slot[i];
+		if (s->state != SLOT_FREE && s->gen == ra->gen && s->off == off && s->len >= len) return s;
+	}
+	return NULL;
+}
+
+// a slot can be recycled once it is consumed, stale or behind the reader
+static ra_slot_t *get_slot(ra_disk_t *ra, uint64_t pos)
+{
+	for (int i = 0; i < RA_SLOTS; i++)
+	{
+		ra_slot_t *s = &ra->slot[i];
+		if (s->state == SLOT_PENDING) continue;
+		if (s->state == SLOT_FREE) return s;
+		if (s->gen != ra->gen || s->used || s->off < pos)
+		{
+			if (!s->used) stats.wasted++;
+			s->state = SLOT_FREE;
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static void prefetch(ra_disk_t *ra, int fd, uint64_t size, uint64_t start, uint32_t len)
+{
+	for (int i = 0; i < RA_DEPTH; i++)
+	{
+		uint64_t off = start + (uint64_t)i * len;
+		if (off >= size) break;
+		if (find(ra, off, len)) continue;
+
+		ra_slot_t *s = get_slot(ra, start);
+		if (!s) break;
+
+		s->off = off;
+		s->len = len;
+		s->gen = ra->gen;
+		s->result = 0;
+		s->used = 0;
+		s->state = SLOT_PENDING;
+
+		if (!offload_try_add([s, fd]() { s->result = pread(fd, s->data, s->len, s->off); }, OFFLOAD_HIGH, &s->handle))
+		{
+			s->state = SLOT_FREE;
+			break;
+		}
+		stats.prefetched++;
+	}
+}
+
+int readahead_read(int disk, fileTYPE *f, uint64_t off, void *buf, uint32_t len)
+{
+	int fd = f->filp ? fileno(f->filp) : -1;
+	if (disk < 0 || disk >= RA_DISKS || len > READAHEAD_WINDOW || fd < 0) return sync_read(f, off, buf, len);
+
+	ra_disk_t *ra = &disks[disk];
+	stats.reads++;
+
+	int res;
+	reap(ra);
+	ra_slot_t *s = find(ra, off, len);
+	if (s)
+	{
+		if (s->state == SLOT_PENDING)
+		{
+			uint64_t t = time_us();
+			offload_wait(&s->handle);
+			s->state = SLOT_READY;
+
+			t = time_us() - t;
+			stats.waits++;
+			stats.wait_us += t;
+			if (t > stats.wait_max_us) stats.wait_max_us = t;
+		}
+		else
+		{
+			stats.hits++;
+		}
+
+		res = s->result;
+		if (res > (int)len) res = len;
+		if (res > 0) memcpy(buf, s->data, res);
+		s->used = 1;
+	}
+	else
+	{
+		uint64_t t = time_us();
+		res = pread(fd, buf, len, off);
+
+		t = time_us() - t;
+		stats.misses++;
+		stats.miss_us += t;
+		if (t > stats.miss_max_us) stats.miss_max_us = t;
+	}
+
+	// second window in a row starts the read-ahead
+	ra->seq = (off == ra->next_off) ? ra->seq + 1 : 0;
+	ra->next_off = off + len;
+
+	if (ra->seq && res == (int)len)
+	{
+		if (!ra->mem)
+		{
+			ra->mem = (uint8_t*)malloc(RA_SLOTS * READAHEAD_WINDOW);
+			if (ra->mem) for (int i = 0; i < RA_SLOTS; i++) ra->slot[i].data = ra->mem + i * READAHEAD_WINDOW;
+		}
+
+		if (ra->mem) prefetch(ra, fd, f->size, off + len, len);
+	}
+
+	return (res < 0) ? 0 : res;
+}
+
+void readahead_invalidate(int disk)
+{
+	if (disk < 0 || disk >= RA_DISKS) return;
+
+	ra_disk_t *ra = &disks[disk];
+	for (int i = 0; i < RA_SLOTS; i++)
+	{
+		if (ra->slot[i].state != SLOT_FREE && ra->slot[i].gen == ra->gen && !ra->slot[i].used) stats.wasted++;
+	}
+
+	// reads still in flight finish into slots of the old generation
+	ra->gen++;
+	ra->seq = 0;
+}
+
+void readahead_reset(int disk)
+{
+	if (disk < 0 || disk >= RA_DISKS) return;
+
+	readahead_invalidate(disk);
+
+	ra_disk_t *ra = &disks[disk];
+	for (int i = 0; i < RA_SLOTS; i++)
+	{
+		if (ra->slot[i].state == SLOT_PENDING) offload_wait(&ra->slot[i].handle);
+		ra->slot[i].state = SLOT_FREE;
+		ra->slot[i].data = NULL;
+	}
+
+	free(ra->mem);
+	ra->mem = NULL;
+}
+
+void readahead_print_stats()
+{
+	printf("readahead: %llu reads, %llu hits, %llu waited (avg/max %llu/%llu us), %llu misses (avg/max %llu/%llu us)\n",
+		stats.reads, stats.hits,
+		stats.waits, stats.waits ? stats.wait_us / stats.waits : 0, stats.wait_max_us,
+		stats.misses, stats.misses ? stats.miss_us / stats.misses : 0, stats.miss_max_us);
+	printf("readahead: %llu windows prefetched, %llu unused, hit rate %llu%%\n",
+		stats.prefetched, stats.wasted, stats.reads ? (stats.hits + stats.waits) * 100 / stats.reads : 0);
+}
@@ -0,0 +1,30 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+#include "file_io.h"
+
+// Read-ahead for the SD card emulation in user_io_poll(). Once a disk is read
+// sequentially, the following windows are fetched on the offload workers so
+// the next request is served from memory.
+
+#define READAHEAD_WINDOW 16384 // largest window served by the engine
+
+// Disk numbers 0-15 are the SD image slots, 16-19 the IDE drives (ide.cpp).
+// The write-back cache uses the same numbering.
+#define READAHEAD_IDE_DISK 16
+
+// Read len bytes at off. Falls back to a plain FileSeek()/FileReadAdv() for
+// images without a file descriptor (zip, memory). Returns bytes read, 0 on error.
+int readahead_read(int disk, fileTYPE *f, uint64_t off, void *buf, uint32_t len);
+
+// Drop buffered data after the image was written.
+void readahead_invalidate(int disk);
+
+// Wait for outstanding reads and release the buffers; call before the image
+// is closed or replaced.
+void readahead_reset(int disk);
+
+void readahead_print_stats();
+
+#endif
@@ -16,10 +16,29 @@ with help from the MiSTer contributors including Grabulosaure
 #include <sys/types.h>
 #include <err.h>
 
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #include "scaler.h"
 #include "shmem.h"
 
 
+// Header fields are big-endian words at the start of the scaler buffer.
+static int read_header(mister_scaler *ms)
+{
+    unsigned char *buffer = (unsigned char *)(ms->map+ms->map_off);
+    if (buffer[0]!=1 || buffer[1]!=1) return 0;
+
+    ms->header=buffer[2]<<8 | buffer[3];
+    ms->width =buffer[6]<<8 | buffer[7];
+    ms->height=buffer[8]<<8 | buffer[9];
+    ms->line  =buffer[10]<<8 | buffer[11];
+    ms->output_width =buffer[12]<<8 | buffer[13];
+    ms->output_height=buffer[14]<<8 | buffer[15];
+    return 1;
+}
+
 mister_scaler * mister_scaler_init()
 {
     mister_scaler *ms =(mister_scaler *) calloc(sizeof(mister_scaler),1);
@@ -42,19 +61,12 @@ mister_scaler * mister_scaler_init()
     printf (" 1: %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X\n",
             buffer[0],buffer[1],buffer[2],buffer[3],buffer[4],buffer[5],buffer[6],buffer[7],
             buffer[8],buffer[9],buffer[10],buffer[11],buffer[12],buffer[13],buffer[14],buffer[15]);
-    if (buffer[0]!=1 || buffer[1]!=1) {
+    if (!read_header(ms)) {
         printf("problem\n");
         mister_scaler_free(ms);
         return NULL;
     }
 
-    ms->header=buffer[2]<<8 | buffer[3];
-    ms->width =buffer[6]<<8 | buffer[7];
-    ms->height=buffer[8]<<8 | buffer[9];
-    ms->line  =buffer[10]<<8 | buffer[11];
-    ms->output_width =buffer[12]<<8 | buffer[13];
-    ms->output_height=buffer[14]<<8 | buffer[15];
-
     printf ("Image: Width=%i Height=%i  Line=%i  Header=%i output_width=%i output_height=%i \n",ms->width,ms->height,ms->line,ms->header,ms->output_width,ms->output_height);
    /*
     printf (" 1: %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X\n",
@@ -66,44 +78,96 @@ mister_scaler * mister_scaler_init()
 
 }
 
+int mister_scaler_refresh(mister_scaler *ms)
+{
+    return read_header(ms);
+}
+
 void mister_scaler_free(mister_scaler *ms)
 {
    shmem_unmap(ms->map,ms->num_bytes+ms->map_off);
    free(ms);
 }
 
+// The scaler buffer is mapped uncached, so every load is a bus transaction:
+// read it with the widest loads available and never byte by byte.
+static void copy_row(unsigned char *dst, const unsigned char *src, int len)
+{
+#ifdef __ARM_NEON
+    for (; len >= 64; len -= 64, src += 64, dst += 64)
+    {
+        uint8x16_t a = vld1q_u8(src);
+        uint8x16_t b = vld1q_u8(src + 16);
+        uint8x16_t c = vld1q_u8(src + 32);
+        uint8x16_t d = vld1q_u8(src + 48);
+        vst1q_u8(dst, a);
+        vst1q_u8(dst + 16, b);
+        vst1q_u8(dst + 32, c);
+        vst1q_u8(dst + 48, d);
+    }
+#endif
+    memcpy(dst, src, len);
+}
+
+// BT.601 studio range, 8 bit fixed point:
+// Y = ( 66R + 129G +  25B + 128) / 256 + 16
+// U = (-38R -  74G + 112B + 128) / 256 + 128
+// V = (112R -  94G -  18B + 128) / 256 + 128
+// The sums are arranged so they never go negative in 16 bits.
+void mister_scaler_rgb_to_yuv(const unsigned char *rgb, int width, unsigned char *y, unsigned char *u, unsigned char *v)
+{
+    int x = 0;
+
+#ifdef __ARM_NEON
+    for (; x + 8 <= width; x += 8, rgb += 24)
+    {
+        uint8x8x3_t p = vld3_u8(rgb);
+
+        uint16x8_t ay = vmull_u8(p.val[0], vdup_n_u8(66));
+        ay = vmlal_u8(ay, p.val[1], vdup_n_u8(129));
+        ay = vmlal_u8(ay, p.val[2], vdup_n_u8(25));
+        ay = vaddq_u16(ay, vdupq_n_u16(128 + (16 << 8)));
+
+        uint16x8_t au = vmull_u8(p.val[2], vdup_n_u8(112));
+        au = vaddq_u16(au, vdupq_n_u16(128 + (128 << 8)));
+        au = vmlsl_u8(au, p.val[0], vdup_n_u8(38));
+        au = vmlsl_u8(au, p.val[1], vdup_n_u8(74));
+
+        uint16x8_t av = vmull_u8(p.val[0], vdup_n_u8(112));
+        av = vaddq_u16(av, vdupq_n_u16(128 + (128 << 8)));
+        av = vmlsl_u8(av, p.val[1], vdup_n_u8(94));
+        av = vmlsl_u8(av, p.val[2], vdup_n_u8(18));
+
+        vst1_u8(y + x, vshrn_n_u16(ay, 8));
+        vst1_u8(u + x, vshrn_n_u16(au, 8));
+        vst1_u8(v + x, vshrn_n_u16(av, 8));
+    }
+#endif
+
+    for (; x < width; x++, rgb += 3)
+    {
+        int R = rgb[0], G = rgb[1], B = rgb[2];
+        y[x] = (66 * R + 129 * G + 25 * B + 128 + (16 << 8)) >> 8;
+        u[x] = (112 * B + 128 + (128 << 8) - 38 * R - 74 * G) >> 8;
+        v[x] = (112 * R + 128 + (128 << 8) - 94 * G - 18 * B) >> 8;
+    }
+}
+
 int mister_scaler_read_yuv(mister_scaler *ms,int lineY,unsigned char *bufY, int lineU, unsigned char *bufU, int lineV, unsigned char *bufV)
 {
     unsigned char *buffer;
     buffer = (unsigned char *)(ms->map+ms->map_off);
 
-    // do this slow way for now..
-    unsigned char *pixbuf;
-    unsigned char *outbufy;
-    unsigned char *outbufU;
-    unsigned char *outbufV;
+    unsigned char *row = (unsigned char *)malloc(ms->width * 3);
+    if (!row) return -1;
+
     for (int  y=0; y< ms->height ; y++)
-	{
-        pixbuf=&buffer[ms->header + y*ms->line];
-        outbufy=&bufY[y*(lineY)];
-        outbufU=&bufU[y*(lineU)];
-        outbufV=&bufV[y*(lineV)];
-        for (int x = 0; x < ms->width ; x++)
-		{
-			int R,G,B;
-			R = *pixbuf++;
-			G = *pixbuf++;
-			B = *pixbuf++;
-			int Y =  (0.257 * R) + (0.504 * G) + (0.098 * B) + 16;
-			int U = -(0.148 * R) - (0.291 * G) + (0.439 * B) + 128;
-			int V =  (0.439 * R) - (0.368 * G) - (0.071 * B) + 128;
-
-			*outbufy++ = Y;
-			*outbufU++ = U;
-			*outbufV++ = V;
-        }
+    {
+        copy_row(row, &buffer[ms->header + y*ms->line], ms->width * 3);
+        mister_scaler_rgb_to_yuv(row, ms->width, &bufY[y*lineY], &bufU[y*lineU], &bufV[y*lineV]);
     }
 
+    free(row);
     return 0;
 }
 
@@ -112,17 +176,9 @@ int mister_scaler_read(mister_scaler *ms,unsigned char *gbuf)
     unsigned char *buffer;
     buffer = (unsigned char *)(ms->map+ms->map_off);
 
-    // do this slow way for now..  - could use a memcpy?
-    unsigned char *pixbuf;
-    unsigned char *outbuf;
-    for (int  y=0; y< ms->height ; y++) {
-          pixbuf=&buffer[ms->header + y*ms->line];
-          outbuf=&gbuf[y*(ms->width*3)];
-          for (int x = 0; x < ms->width ; x++) {
-            *outbuf++ = *pixbuf++;
-            *outbuf++ = *pixbuf++;
-            *outbuf++ = *pixbuf++;
-          }
+    for (int  y=0; y< ms->height ; y++)
+    {
+        copy_row(&gbuf[y*(ms->width*3)], &buffer[ms->header + y*ms->line], ms->width * 3);
     }
 
     return 0;
@@ -132,13 +188,24 @@ int mister_scaler_read_32(mister_scaler *ms, unsigned char *gbuf) {
     unsigned char *buffer;
     buffer = (unsigned char *)(ms->map+ms->map_off);
 
-    // do this slow way for now..  - could use a memcpy?
     unsigned char *pixbuf;
     unsigned char *outbuf;
     for (int  y=0; y< ms->height ; y++) {
           pixbuf=&buffer[ms->header + y*ms->line];
           outbuf=&gbuf[y*(ms->width*4)];
-          for (int x = 0; x < ms->width ; x++) {
+          int x = 0;
+#ifdef __ARM_NEON
+          for (; x + 16 <= ms->width; x += 16, pixbuf += 48, outbuf += 64) {
+            uint8x16x3_t p = vld3q_u8(pixbuf);
+            uint8x16x4_t o;
+            o.val[0] = p.val[2];
+            o.val[1] = p.val[1];
+            o.val[2] = p.val[0];
+            o.val[3] = vdupq_n_u8(0xFF);
+            vst4q_u8(outbuf, o);
+          }
+#endif
+          for (; x < ms->width ; x++) {
             outbuf[2] = *pixbuf++;
             outbuf[1] = *pixbuf++;
             outbuf[0] = *pixbuf++;
@@ -23,9 +23,16 @@ typedef struct {
 #define MISTER_SCALER_BUFFERSIZE   2048*3*1024
 
 mister_scaler *mister_scaler_init();
+// Re-reads the header of an open scaler, e.g. after a resolution change.
+// Returns 0 if the buffer doesn't hold a valid frame.
+int mister_scaler_refresh(mister_scaler *ms);
+// Packed RGB24, width*3 bytes per line.
 int mister_scaler_read(mister_scaler *,unsigned char *buffer);
 int mister_scaler_read_32(mister_scaler *ms, unsigned char *buffer);
 int mister_scaler_read_yuv(mister_scaler *ms,int,unsigned char *y,int, unsigned char *U,int, unsigned char *V);
 void mister_scaler_free(mister_scaler *);
 
+// One line of packed RGB24 to BT.601 studio range Y, U and V (4:4:4).
+void mister_scaler_rgb_to_yuv(const unsigned char *rgb, int width, unsigned char *y, unsigned char *u, unsigned char *v);
+
 #endif
@@ -1,19 +1,171 @@
 #include "scheduler.h"
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include "libco.h"
 #include "menu.h"
 #include "user_io.h"
 #include "input.h"
+#include "capture.h"
 #include "frame_timer.h"
 #include "fpga_io.h"
 #include "osd.h"
 #include "profiling.h"
+#include "fpga_sim.h"
+#include "hardware.h"
+#include "cfg.h"
 
 static cothread_t co_scheduler = nullptr;
 static cothread_t co_poll = nullptr;
 static cothread_t co_ui = nullptr;
 static cothread_t co_last = nullptr;
 
+// Idle handling: once both coroutines completed a pass without serving a
+// request, the main loop sleeps in epoll_wait() on the input devices, the
+// inotify watch, MiSTer_cmd, the frame timer and a deadline timerfd. The FPGA
+// can't raise an interrupt, so its requests are still found by polling: the
+// poll period is zero while requests keep coming and doubles up to
+// IDLE_SLEEP_US once the core goes quiet.
+#define LINGER_US    2000 // keep spinning this long after the last request
+#define MIN_SLEEP_US 50
+
+#define PASS_POLL 1
+#define PASS_UI   2
+
+uint32_t scheduler_activity_cnt = 0;
+
+static int epoll_fd = -1;
+static int deadline_fd = -1;
+static bool fds_dirty = true;
+static uint32_t pass_done = 0;
+
+static uint32_t sleep_us = 0;
+static uint32_t last_activity_cnt = 0;
+static uint64_t last_activity_us = 0;
+static uint64_t last_poll_us = 0;
+
+static struct
+{
+	uint64_t start_us;
+	uint64_t passes;
+	uint64_t sleeps;
+	uint64_t fd_wakeups;   // woken by an fd rather than the deadline
+	uint64_t slept_us;
+	uint64_t served;       // poll passes that served an FPGA request
+	uint64_t latency_us;   // time since the previous request check, summed over served passes
+	uint64_t latency_max_us;
+} stats;
+
+static void epoll_add(int fd, uint32_t events)
+{
+	struct epoll_event ev = {};
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) printf("scheduler: cannot watch fd %d\n", fd);
+}
+
+// Closed fds drop out of an epoll set by themselves, but a reused fd number
+// would not be noticed, so the whole set is rebuilt on every change.
+static int scheduler_build_epoll(void)
+{
+	fds_dirty = false;
+
+	if (deadline_fd < 0)
+	{
+		deadline_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (deadline_fd < 0) return 0;
+	}
+
+	if (epoll_fd >= 0) close(epoll_fd);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+	{
+		printf("scheduler: epoll_create1 failed, idle sleep disabled.\n");
+		return 0;
+	}
+
+	epoll_add(deadline_fd, EPOLLIN);
+
+	int num;
+	struct pollfd *fds = input_pollfds(&num);
+	for (int i = 0; i < num; i++)
+	{
+		if (fds[i].fd >= 0) epoll_add(fds[i].fd, (fds[i].events & POLLPRI) ? EPOLLPRI : EPOLLIN);
+	}
+
+	int frame_fd = frame_timer_fd();
+	if (frame_fd >= 0) epoll_add(frame_fd, EPOLLIN);
+
+	return 1;
+}
+
+static void scheduler_poll_begin(void)
+{
+	if (!last_poll_us) last_poll_us = time_us();
+	last_activity_cnt = scheduler_activity_cnt;
+}
+
+static void scheduler_poll_end(void)
+{
+	uint64_t now = time_us();
+
+	// a request can arrive right after the previous check, so the time between
+	// two checks bounds how long it waited for service
+	if (scheduler_activity_cnt != last_activity_cnt)
+	{
+		uint64_t latency = now - last_poll_us;
+		stats.served++;
+		stats.latency_us += latency;
+		if (latency > stats.latency_max_us) stats.latency_max_us = latency;
+
+		last_activity_us = now;
+		sleep_us = 0;
+	}
+
+	last_poll_us = now;
+}
+
+static void scheduler_idle(void)
+{
+	if (!cfg.idle_sleep_us) return;
+
+	if (fds_dirty) scheduler_build_epoll();
+	if (epoll_fd < 0) return;
+
+	uint64_t now = time_us();
+	if (now - last_activity_us < LINGER_US) return;
+
+	// queued input frames are handled on the next pass, not after the sleep
+	if (input_pending()) return;
+
+	sleep_us = sleep_us ? sleep_us * 2 : MIN_SLEEP_US;
+	if (sleep_us > cfg.idle_sleep_us) sleep_us = cfg.idle_sleep_us;
+
+	// one-shot; re-arming also clears a stale expiration
+	struct itimerspec its = {};
+	its.it_value.tv_sec = sleep_us / 1000000;
+	its.it_value.tv_nsec = (sleep_us % 1000000) * 1000;
+	timerfd_settime(deadline_fd, 0, &its, NULL);
+
+	struct epoll_event ev[8];
+	int n = epoll_wait(epoll_fd, ev, 8, -1);
+
+	stats.sleeps++;
+	stats.slept_us += time_us() - now;
+	for (int i = 0; i < n; i++)
+	{
+		if (ev[i].data.fd != deadline_fd)
+		{
+			stats.fd_wakeups++;
+			break;
+		}
+	}
+}
+
 static void scheduler_wait_fpga_ready(void)
 {
 	while (!is_fpga_ready(1))
@@ -28,13 +180,23 @@ static void scheduler_co_poll(void)
 	{
 		scheduler_wait_fpga_ready();
 
+		scheduler_poll_begin();
+
 		{
 			SPIKE_SCOPE("co_poll", 1000);
 			user_io_poll();
 			frame_timer();
 			input_poll(0);
+			capture_poll();
+#ifdef FPGA_SIM
+			fpga_sim_poll();
+#endif
 		}
 
+		scheduler_poll_end();
+		PROFILE_POLL();
+
+		pass_done |= PASS_POLL;
 		scheduler_yield();
 	}
 }
@@ -49,6 +211,7 @@ static void scheduler_co_ui(void)
 			OsdUpdate();
 		}
 
+		pass_done |= PASS_UI;
 		scheduler_yield();
 	}
 }
@@ -78,10 +241,19 @@ void scheduler_init(void)
 void scheduler_run(void)
 {
 	co_scheduler = co_active();
+	stats.start_us = time_us();
 
 	for (;;)
 	{
 		scheduler_schedule();
+
+		// only sleep when neither coroutine yielded from the middle of its work
+		if (co_last == co_ui)
+		{
+			stats.passes++;
+			if (pass_done == (PASS_POLL | PASS_UI)) scheduler_idle();
+			pass_done = 0;
+		}
 	}
 
 	co_delete(co_ui);
@@ -93,3 +265,25 @@ void scheduler_yield(void)
 {
 	co_switch(co_scheduler);
 }
+
+void scheduler_fds_changed(void)
+{
+	fds_dirty = true;
+}
+
+void scheduler_print_stats(void)
+{
+	uint64_t now = time_us();
+	uint64_t span = now - stats.start_us;
+	if (!span) span = 1;
+
+	printf("scheduler: %llu.%03llus, %llu passes/s, %llu sleeps/s (%llu by fd), %llu%% asleep, idle period %u us (max %u)\n",
+		span / 1000000, (span / 1000) % 1000, stats.passes * 1000000 / span, stats.sleeps * 1000000 / span, stats.fd_wakeups,
+		stats.slept_us * 100 / span, sleep_us, cfg.idle_sleep_us);
+	printf("scheduler: %llu requests served, check-to-check latency avg/max %llu/%llu us\n",
+		stats.served, stats.served ? stats.latency_us / stats.served : 0, stats.latency_max_us);
+
+	// every call reports the interval since the previous one
+	memset(&stats, 0, sizeof(stats));
+	stats.start_us = now;
+}
@@ -1,10 +1,21 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 
+#include <stdint.h>
+
 #define USE_SCHEDULER
 
 void scheduler_init(void);
 void scheduler_run(void);
 void scheduler_yield(void);
 
+// Call when an FPGA request has been served; keeps the main loop polling
+// without sleeping while the core is busy.
+extern uint32_t scheduler_activity_cnt;
+static inline void scheduler_activity(void) { scheduler_activity_cnt++; }
+
+// Call whenever an fd in the input poll set or the frame timer changes.
+void scheduler_fds_changed(void);
+void scheduler_print_stats(void);
+
 #endif
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+
+#include "share_cache.h"
+#include "file_io.h"
+#include "hardware.h"
+
+#define SC_DIRS       32    // snapshots kept, least recently used are dropped
+#define SC_RECHECK_MS 1000  // directory mtime is compared when the last check is older
+#define SC_WATCH      (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t  d_off;
+	uint16_t d_reclen;
+	uint8_t  d_type;
+	char     d_name[];
+};
+
+struct sc_dir_t
+{
+	std::string path;  // full path
+	share_dir_ptr dir;
+	int wd;
+	int64_t mtime;
+	uint32_t mtime_ns;
+	uint64_t checked_us;
+	uint64_t used;
+};
+
+static std::vector<sc_dir_t> dirs;
+static int ino_fd = -2;  // -1 if inotify isn't available; nothing is cached then
+static uint64_t use_count = 0;
+
+static struct
+{
+	uint64_t reads;
+	uint64_t entries;
+	uint64_t read_us;
+	uint64_t read_max_us;
+	uint64_t hits;
+	uint64_t changed;     // dropped after an inotify event
+	uint64_t stale;       // dropped after the directory mtime changed
+	uint64_t evicted;
+	uint64_t stat_hits;
+	uint64_t stat_misses;
+} stats;
+
+void share_name83(const char *src, char *dst)
+{
+	int namelen = 0;
+	int extlen = 0;
+
+	const char *p = strrchr(src, '/');
+	if (p) src = p + 1;
+
+	if (!strcmp(src, ".") || !strcmp(src, ".."))
+	{
+		namelen = strlen(src);
+	}
+	else
+	{
+		p = strrchr(src, '.');
+		if (!p) namelen = strlen(src);
+		else
+		{
+			namelen = p - src;
+			extlen = strlen(src) - namelen - 1;
+		}
+	}
+
+	// dst holds 11 characters
+	if (namelen > 8) namelen = 8;
+	if (extlen > 3) extlen = 3;
+
+	char ext[4] = { ' ', ' ', ' ', 0 };
+	if (p) memcpy(ext, p + 1, extlen);
+	for (int i = 0; i < namelen; i++) dst[i] = toupper(src[i]);
+	while (namelen < 8) dst[namelen++] = ' ';
+	for (int i = 0; i < 3; i++) dst[8 + i] = toupper(ext[i]);
+}
+
+static int fits83(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+	if (!ext) return strlen(name) <= 8;
+	return (ext - name) <= 8 && strlen(ext + 1) <= 3;
+}
+
+static void stat_at(int dfd, const char *name, share_stat_t *st)
+{
+#ifdef STATX_BASIC_STATS
+	struct statx sx;
+	if (!statx(dfd, name, AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &sx))
+	{
+		st->mode = sx.stx_mode;
+		st->size = sx.stx_size;
+		st->mtime = sx.stx_mtime.tv_sec;
+		return;
+	}
+#endif
+
+	// kernels before 4.11 have no statx()
+	struct stat64 s;
+	if (!fstatat64(dfd, name, &s, 0))
+	{
+		st->mode = s.st_mode;
+		st->size = s.st_size;
+		st->mtime = s.st_mtime;
+		return;
+	}
+
+	memset(st, 0, sizeof(*st));
+}
+
+static share_dir_ptr read_dir(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) return nullptr;
+
+	uint64_t t = time_us();
+	std::shared_ptr<share_dir_t> dir = std::make_shared<share_dir_t>();
+
+	alignas(8) static char buf[32768];
+	long n;
+	while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+	{
+		for (long off = 0; off < n;)
+		{
+			linux_dirent64 *de = (linux_dirent64*)(buf + off);
+			off += de->d_reclen;
+
+			share_entry_t e = {};
+			e.name = dir->names.size();
+			e.d_type = de->d_type;
+			stat_at(fd, de->d_name, &e.st);
+
+			e.fits83 = fits83(de->d_name);
+			if (e.fits83) share_name83(de->d_name, e.name83);
+			else memset(e.name83, ' ', sizeof(e.name83));
+
+			dir->names.insert(dir->names.end(), de->d_name, de->d_name + strlen(de->d_name) + 1);
+			dir->index.emplace(de->d_name, dir->entries.size());
+			dir->entries.push_back(e);
+		}
+	}
+	close(fd);
+
+	t = time_us() - t;
+	stats.reads++;
+	stats.entries += dir->entries.size();
+	stats.read_us += t;
+	if (t > stats.read_max_us) stats.read_max_us = t;
+
+	return dir;
+}
+
+static void drop(size_t i)
+{
+	int wd = dirs[i].wd;
+	dirs.erase(dirs.begin() + i);
+
+	// the same directory may be cached under another path
+	for (const sc_dir_t &d : dirs) if (d.wd == wd) return;
+	inotify_rm_watch(ino_fd, wd);
+}
+
+// applies the queued inotify events
+static void drain()
+{
+	if (ino_fd == -2)
+	{
+		ino_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (ino_fd < 0) printf("share_cache: inotify is not available, shared folders are not cached.\n");
+	}
+
+	if (ino_fd < 0) return;
+
+	alignas(struct inotify_event) char buf[4096];
+	ssize_t len;
+	while ((len = read(ino_fd, buf, sizeof(buf))) > 0)
+	{
+		for (char *p = buf; p < buf + len;)
+		{
+			struct inotify_event *ev = (struct inotify_event*)p;
+			p += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				stats.changed += dirs.size();
+				while (!dirs.empty()) drop(dirs.size() - 1);
+				continue;
+			}
+
+			for (size_t i = 0; i < dirs.size();)
+			{
+				if (dirs[i].wd == ev->wd)
+				{
+					stats.changed++;
+					drop(i);
+				}
+				else i++;
+			}
+		}
+	}
+}
+
+// cached snapshot of the full path, checked against the directory mtime now
+// and then; -1 if there is none
+static int find_dir(const std::string &path)
+{
+	for (size_t i = 0; i < dirs.size(); i++)
+	{
+		sc_dir_t *d = &dirs[i];
+		if (d->path != path) continue;
+
+		uint64_t now = time_us();
+		if (now - d->checked_us > SC_RECHECK_MS * 1000)
+		{
+			struct stat64 st;
+			if (stat64(path.c_str(), &st) < 0 || st.st_mtim.tv_sec != d->mtime || (uint32_t)st.st_mtim.tv_nsec != d->mtime_ns)
+			{
+				stats.stale++;
+				drop(i);
+				return -1;
+			}
+			d->checked_us = now;
+		}
+
+		d->used = ++use_count;
+		return i;
+	}
+
+	return -1;
+}
+
+share_dir_ptr share_cache_dir(const char *path)
+{
+	std::string full = getFullPath(path);
+	while (full.size() > 1 && full.back() == '/') full.pop_back();
+
+	drain();
+	int i = find_dir(full);
+	if (i >= 0)
+	{
+		stats.hits++;
+		return dirs[i].dir;
+	}
+
+	// watch first, so changes made while reading are not missed
+	int wd = (ino_fd >= 0) ? inotify_add_watch(ino_fd, full.c_str(), SC_WATCH) : -1;
+
+	struct stat64 st;
+	share_dir_ptr dir = (stat64(full.c_str(), &st) < 0) ? nullptr : read_dir(full.c_str());
+	if (wd < 0 || !dir)
+	{
+		if (wd >= 0)
+		{
+			int shared = 0;
+			for (const sc_dir_t &d : dirs) shared |= (d.wd == wd);
+			if (!shared) inotify_rm_watch(ino_fd, wd);
+		}
+		return dir;
+	}
+
+	if (dirs.size() >= SC_DIRS)
+	{
+		size_t lru = 0;
+		for (size_t j = 1; j < dirs.size(); j++) if (dirs[j].used < dirs[lru].used) lru = j;
+		stats.evicted++;
+		drop(lru);
+	}
+
+	dirs.push_back({ full, dir, wd, (int64_t)st.st_mtim.tv_sec, (uint32_t)st.st_mtim.tv_nsec, time_us(), ++use_count });
+	return dir;
+}
+
+int share_cache_stat(const char *path, share_stat_t *st)
+{
+	std::string full = getFullPath(path);
+	while (full.size() > 1 && full.back() == '/') full.pop_back();
+
+	drain();
+
+	size_t sl = full.rfind('/');
+	if (sl != std::string::npos && sl > 0)
+	{
+		int i = find_dir(full.substr(0, sl));
+		if (i >= 0)
+		{
+			const share_dir_t *dir = dirs[i].dir.get();
+			auto it = dir->index.find(full.substr(sl + 1));
+			if (it != dir->index.end())
+			{
+				stats.stat_hits++;
+				*st = dir->entries[it->second].st;
+				return st->mode != 0;
+			}
+		}
+	}
+
+	// not cached, or a name that only matches on a case-insensitive file system
+	stats.stat_misses++;
+	struct stat64 s;
+	if (stat64(full.c_str(), &s) < 0)
+	{
+		memset(st, 0, sizeof(*st));
+		return 0;
+	}
+
+	st->mode = s.st_mode;
+	st->size = s.st_size;
+	st->mtime = s.st_mtime;
+	return 1;
+}
+
+int share_cache_isdir(const char *path)
+{
+	share_stat_t st;
+	return share_cache_stat(path, &st) && S_ISDIR(st.mode);
+}
+
+int share_cache_isfile(const char *path)
+{
+	share_stat_t st;
+	return share_cache_stat(path, &st) && S_ISREG(st.mode);
+}
+
+void share_cache_print_stats()
+{
+	size_t entries = 0;
+	for (const sc_dir_t &d : dirs) entries += d.dir->entries.size();
+
+	printf("share_cache: %u folders cached (%u entries), inotify %s\n", (uint32_t)dirs.size(), (uint32_t)entries, (ino_fd >= 0) ? "on" : "off");
+	printf("share_cache: %llu listings served from cache, %llu read (%llu entries, avg/max %llu/%llu us)\n",
+		stats.hits, stats.reads, stats.entries, stats.reads ? stats.read_us / stats.reads : 0, stats.read_max_us);
+	printf("share_cache: %llu dropped on change, %llu on mtime, %llu evicted; lookups %llu cached, %llu stat()\n",
+		stats.changed, stats.stale, stats.evicted, stats.stat_hits, stats.stat_misses);
+}
@@ -0,0 +1,126 @@
+#ifndef SHARE_CACHE_H
+#define SHARE_CACHE_H
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Metadata cache for the x86 and Minimig shared folders. A directory is read
+// once with getdents64() and statx() relative to the directory into a
+// snapshot holding every entry with its mode, size, mtime and 8.3 name. The
+// snapshot is kept until inotify reports a change in the directory (or its
+// mtime changes, for file systems inotify can't see into). Listings and
+// per-entry lookups of the guest file managers are then served from memory.
+//
+// Paths are given as for getFullPath().
+
+struct share_stat_t
+{
+	uint32_t mode;     // st_mode, 0 if the entry couldn't be stat'ed
+	uint64_t size;
+	int64_t  mtime;
+};
+
+struct share_entry_t
+{
+	share_stat_t st;
+	uint32_t name;     // offset in share_dir_t::names
+	uint8_t  d_type;
+	uint8_t  fits83;   // name has at most 8 + 3 characters
+	char     name83[11];
+};
+
+struct share_dir_t
+{
+	std::vector<share_entry_t> entries; // in directory order, "." and ".." included
+	std::vector<char> names;
+	std::unordered_map<std::string, uint32_t> index;
+
+	const char *name(const share_entry_t &e) const { return names.data() + e.name; }
+};
+
+// A snapshot stays valid for its holders after it was replaced in the cache.
+typedef std::shared_ptr<const share_dir_t> share_dir_ptr;
+
+// Snapshot of the directory, read if it isn't cached or has changed. NULL if
+// the directory can't be opened.
+share_dir_ptr share_cache_dir(const char *path);
+
+// Mode, size and mtime of path, taken from the snapshot of its directory if
+// that is cached, otherwise from stat(). Returns 0 if path doesn't exist.
+int share_cache_stat(const char *path, share_stat_t *st);
+int share_cache_isdir(const char *path);
+int share_cache_isfile(const char *path);
+
+// FAT directory entry form of the last path component: name padded or cut
+// to 8 characters, extension to 3, upper case.
+void share_name83(const char *src, char *dst);
+
+void share_cache_print_stats();
+
+// Lock keys handed out to the guest. A key is a slot index plus a generation
+// count, so lookups don't search and a stale key doesn't find a new owner of
+// the slot. IDX_BITS + GEN_BITS must fit the key type of the guest protocol.
+template <typename T, int IDX_BITS, int GEN_BITS>
+struct share_handles_t
+{
+	struct slot_t
+	{
+		T item;
+		uint32_t gen;
+		bool used;
+	};
+
+	std::vector<slot_t> slots;
+	std::vector<uint32_t> free_slots;
+
+	T *get(uint32_t key)
+	{
+		uint32_t idx = (key & ((1 << IDX_BITS) - 1)) - 1;
+		if (idx >= slots.size() || !slots[idx].used || slots[idx].gen != (key >> IDX_BITS)) return nullptr;
+		return &slots[idx].item;
+	}
+
+	// 0 if all keys are in use
+	uint32_t add(const T &item)
+	{
+		uint32_t idx;
+		if (!free_slots.empty())
+		{
+			idx = free_slots.back();
+			free_slots.pop_back();
+		}
+		else
+		{
+			if (slots.size() >= (1 << IDX_BITS) - 1) return 0;
+			idx = slots.size();
+			slots.push_back({ T(), 0, false });
+		}
+
+		slot_t *s = &slots[idx];
+		s->item = item;
+		s->gen = (s->gen + 1) & ((1 << GEN_BITS) - 1);
+		s->used = true;
+		return (s->gen << IDX_BITS) | (idx + 1);
+	}
+
+	void erase(uint32_t key)
+	{
+		if (!get(key)) return;
+
+		uint32_t idx = (key & ((1 << IDX_BITS) - 1)) - 1;
+		slots[idx].item = T();
+		slots[idx].used = false;
+		free_slots.push_back(idx);
+	}
+
+	void clear()
+	{
+		slots.clear();
+		free_slots.clear();
+	}
+};
+
+#endif
@@ -10,12 +10,51 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "shmem.h"
+#include "fpga_sim.h"
+#include "hardware.h"
+
+#define WINDOWS        32
+#define PAGE_SZ        4096
+#define DDR_START      0x20000000ULL
+#define DDR_END        0x40000000ULL
+#define DDR_ALIGN      (4 * 1024 * 1024)   // chunked loaders walking through DDR share one window per 4 MB
+#define IDLE_MAX       (64 * 1024 * 1024)  // address space kept mapped by windows nobody uses
+
+// Mappings are kept after shmem_unmap() and handed out again to any request
+// that falls inside them, so callers mapping the same range for every sector
+// or chunk don't pay for mmap/munmap and the TLB flush each time.
+struct window_t
+{
+	uint8_t *map;
+	uint64_t address;
+	uint64_t size;
+	int refs;
+	uint64_t used;
+};
 
 static int memfd = -1;
+static window_t windows[WINDOWS] = {};
+static uint64_t tick = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
-void *shmem_map(uint32_t address, uint32_t size)
+static struct
+{
+	uint64_t maps;
+	uint64_t reused;
+	uint64_t mmaps;
+	uint64_t munmaps;
+	uint64_t untracked;   // no free window slot, mapped the old way
+
+	uint64_t last_us;
+	uint64_t last_maps;
+	uint64_t last_mmaps;
+} stats;
+
+static void *map_range(uint64_t address, uint64_t size)
 {
 	if (memfd < 0)
 	{
@@ -30,18 +69,127 @@ void *shmem_map(uint32_t address, uint32_t size)
 	void *res = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, address);
 	if (res == (void *)-1)
 	{
-		printf("Error: Unable to mmap (0x%X, %d)!\n", address, size);
+		printf("Error: Unable to mmap (0x%X, %d)!\n", (uint32_t)address, (uint32_t)size);
 		return 0;
 	}
 
+	stats.mmaps++;
+	return res;
+}
+
+static void unmap_window(window_t *w)
+{
+	if (munmap(w->map, w->size) < 0) printf("Error: Unable to unmap(0x%X, %d)!\n", (uint32_t)(uintptr_t)w->map, (uint32_t)w->size);
+	stats.munmaps++;
+	w->map = 0;
+}
+
+// least recently used window nobody holds
+static window_t *idle_lru()
+{
+	window_t *lru = 0;
+	for (int i = 0; i < WINDOWS; i++)
+	{
+		window_t *w = &windows[i];
+		if (w->map && !w->refs && (!lru || w->used < lru->used)) lru = w;
+	}
+	return lru;
+}
+
+static void trim_idle()
+{
+	while (1)
+	{
+		uint64_t idle = 0;
+		for (int i = 0; i < WINDOWS; i++) if (windows[i].map && !windows[i].refs) idle += windows[i].size;
+		if (idle <= IDLE_MAX) break;
+		unmap_window(idle_lru());
+	}
+}
+
+void *shmem_map(uint32_t address, uint32_t size)
+{
+#ifdef FPGA_SIM
+	if (fpga_sim_active()) return fpga_sim_map(address, size);
+#endif
+
+	const uint64_t end = (uint64_t)address + size;
+
+	pthread_mutex_lock(&lock);
+	stats.maps++;
+
+	for (int i = 0; i < WINDOWS; i++)
+	{
+		window_t *w = &windows[i];
+		if (w->map && address >= w->address && end <= w->address + w->size)
+		{
+			w->refs++;
+			w->used = ++tick;
+			stats.reused++;
+			pthread_mutex_unlock(&lock);
+			return w->map + (address - w->address);
+		}
+	}
+
+	window_t *w = 0;
+	for (int i = 0; i < WINDOWS && !w; i++) if (!windows[i].map) w = &windows[i];
+	if (!w && (w = idle_lru())) unmap_window(w);
+
+	void *res;
+	if (!w)
+	{
+		stats.untracked++;
+		res = map_range(address, size);
+	}
+	else
+	{
+		uint64_t start = address & ~(uint64_t)(PAGE_SZ - 1);
+		uint64_t stop = (end + PAGE_SZ - 1) & ~(uint64_t)(PAGE_SZ - 1);
+		if (address >= DDR_START && end <= DDR_END)
+		{
+			start = address & ~(uint64_t)(DDR_ALIGN - 1);
+			stop = (end + DDR_ALIGN - 1) & ~(uint64_t)(DDR_ALIGN - 1);
+		}
+
+		res = map_range(start, stop - start);
+		if (res)
+		{
+			w->map = (uint8_t*)res;
+			w->address = start;
+			w->size = stop - start;
+			w->refs = 1;
+			w->used = ++tick;
+			res = w->map + (address - start);
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
 	return res;
 }
 
 int shmem_unmap(void* map, uint32_t size)
 {
+#ifdef FPGA_SIM
+	if (fpga_sim_active()) return fpga_sim_unmap(map, size);
+#endif
+
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < WINDOWS; i++)
+	{
+		window_t *w = &windows[i];
+		if (w->map && w->refs && (uint8_t*)map >= w->map && (uint8_t*)map < w->map + w->size)
+		{
+			w->refs--;
+			if (!w->refs) trim_idle();
+			pthread_mutex_unlock(&lock);
+			return 1;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
 	if (munmap(map, size) < 0)
 	{
-		printf("Error: Unable to unmap(0x%X, %d)!\n", (uint32_t)map, size);
+		printf("Error: Unable to unmap(0x%X, %d)!\n", (uint32_t)(uintptr_t)map, size);
 		return 0;
 	}
 
@@ -71,3 +219,36 @@ int shmem_get(uint32_t address, uint32_t size, void *buf)
 
 	return shmem != 0;
 }
+
+void shmem_print_stats()
+{
+	pthread_mutex_lock(&lock);
+
+	int count = 0, busy = 0;
+	uint64_t mapped = 0;
+	for (int i = 0; i < WINDOWS; i++)
+	{
+		if (!windows[i].map) continue;
+		count++;
+		if (windows[i].refs) busy++;
+		mapped += windows[i].size;
+	}
+
+	uint64_t now = time_us();
+	uint64_t dt = now - stats.last_us;
+	if (!stats.last_us || !dt) dt = 1;
+
+	printf("shmem: %llu maps (%llu reused), %llu mmap, %llu munmap, %llu untracked\n",
+		stats.maps, stats.reused, stats.mmaps, stats.munmaps, stats.untracked);
+	if (stats.last_us)
+	{
+		printf("shmem: since last stats %llu maps/s, %llu mmap/s\n",
+			(stats.maps - stats.last_maps) * 1000000 / dt, (stats.mmaps - stats.last_mmaps) * 1000000 / dt);
+	}
+	printf("shmem: %d windows (%d in use), %llu KB mapped\n", count, busy, mapped / 1024);
+
+	stats.last_us = now;
+	stats.last_maps = stats.maps;
+	stats.last_mmaps = stats.mmaps;
+	pthread_mutex_unlock(&lock);
+}
@@ -4,10 +4,15 @@
 #ifndef SHMEM_H
 #define SHMEM_H
 
+// Mappings are uncached. They are reference counted and kept open after
+// shmem_unmap(), so mapping the same range again is cheap. Bulk writers
+// should prepare data in cached memory and copy it in large blocks
+// (shmem_put() or one memcpy) instead of storing element by element.
 void *shmem_map(uint32_t address, uint32_t size);
 int shmem_unmap(void* map, uint32_t size);
 int shmem_put(uint32_t address, uint32_t size, void *buf);
 int shmem_get(uint32_t address, uint32_t size, void *buf);
+void shmem_print_stats();
 
 #define fpga_mem(x) (0x20000000 | ((x) & 0x1FFFFFFF))
 #endif
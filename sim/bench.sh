@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Builds the host binary and runs the virtual core scripts in this folder
+# (or the ones given) against the simulated FPGA bridge.
+#   sim/bench.sh [script.sim ...]
+
+set -e
+set -o pipefail
+
+cd "$(dirname "$0")/.."
+WORK=/tmp/mister_sim
+
+make HOST=1
+
+mkdir -p $WORK
+[ -f $WORK/disk.img ] || dd if=/dev/urandom of=$WORK/disk.img bs=1M count=64 status=none
+[ -f $WORK/rom.bin ] || dd if=/dev/urandom of=$WORK/rom.bin bs=1M count=8 status=none
+
+SCRIPTS="$@"
+[ -n "$SCRIPTS" ] || SCRIPTS=$(ls sim/*.sim)
+
+for s in $SCRIPTS; do
+	echo "==== $s"
+	MISTER_SIM=$(realpath $s) bin/MiSTer 2>&1 | grep '^SIM:'
+done
@@ -1,6 +1,7 @@
 #include "spi.h"
 #include "hardware.h"
 #include "fpga_io.h"
+#include "scheduler.h"
 
 #define SSPI_FPGA_EN (1<<18)
 #define SSPI_OSD_EN  (1<<19)
@@ -164,6 +165,7 @@ void spi_n(uint8_t value, uint16_t cnt)
 
 void spi_read(uint8_t *addr, uint32_t len, int wide)
 {
+	scheduler_activity();
 	if (wide)
 	{
 		uint32_t len16 = len >> 1;
@@ -179,6 +181,7 @@ void spi_read(uint8_t *addr, uint32_t len, int wide)
 
 void spi_write(const uint8_t *addr, uint32_t len, int wide)
 {
+	scheduler_activity();
 	if (wide)
 	{
 		uint32_t len16 = len >> 1;
@@ -4,6 +4,8 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <time.h>
+#include <vector>
 
 #include "../../sxmlc.h"
 #include "../../user_io.h"
@@ -15,6 +17,7 @@
 #include "../../shmem.h"
 #include "../../str_util.h"
 #include "../../cheats.h"
+#include "../../offload.h"
 
 #include "buffer.h"
 #include "mra_loader.h"
@@ -43,6 +46,9 @@ struct arc_struct {
 	int ito;
 	int imap;
 	int file_size;
+	int romcount;
+	int verified;
+	int part_failed;
 	uint32_t address;
 	uint32_t crc;
 	buffer_data *data;
@@ -211,10 +217,9 @@ static int rom_checksz(int idx, int chunk)
 {
 	if ((romlen[idx] + chunk) > romblkl)
 	{
-		if (romlen[idx] + chunk > romblkl + BLKL)
-		  romblkl += (chunk + BLKL);
-		else
-		  romblkl += BLKL;
+		// grow by half at least, so big sets aren't copied over and over
+		int need = romlen[idx] + chunk + BLKL;
+		romblkl = (need > romblkl + romblkl / 2) ? need : romblkl + romblkl / 2;
 		romdata = (uint8_t*)realloc(romdata, romblkl);
 		if (!romdata)
 		{
@@ -254,11 +259,13 @@ static int rom_data(const uint8_t *buf, int chunk, int map, struct MD5Context *m
 	map_reg = map;
 	bool first = true;
 	int gaps = 0;
+	int straight = 1;
 	for (int i = 0; i < unitlen; i++)
 	{
 		if (map_reg & 0xf)
 		{
 			offsets[bytes_in_iter] = idx + (map_reg & 0xf) - 1 + gaps;
+			if (offsets[bytes_in_iter] != bytes_in_iter) straight = 0;
 			bytes_in_iter++;
 			first = false;
 		}
@@ -269,21 +276,134 @@ static int rom_data(const uint8_t *buf, int chunk, int map, struct MD5Context *m
 		map_reg >>= 4;
 	}
 
-	while (chunk)
+	uint8_t *dst = romdata + romlen[idx];
+	int units = chunk / bytes_in_iter;
+	int tail = chunk % bytes_in_iter;
+
+	if (straight && bytes_in_iter == unitlen)
+	{
+		memcpy(dst, buf, units * unitlen);
+	}
+	else if (bytes_in_iter == 1)
+	{
+		// one byte per unit: unit 2/4 maps like 01, 10, 0010
+		uint8_t *d = dst + offsets[0];
+		for (int i = 0; i < units; i++, d += unitlen) *d = buf[i];
+	}
+	else if (bytes_in_iter == 2)
+	{
+		// byte pairs: swapped words, unit 4 maps like 0021
+		const uint8_t *b = buf;
+		uint8_t *d0 = dst + offsets[0], *d1 = dst + offsets[1];
+		for (int i = 0; i < units; i++, b += 2, d0 += unitlen, d1 += unitlen)
+		{
+			*d0 = b[0];
+			*d1 = b[1];
+		}
+	}
+	else
 	{
-		for (int i = 0; i < bytes_in_iter; i++)
+		const uint8_t *b = buf;
+		uint8_t *d = dst;
+		for (int i = 0; i < units; i++, d += unitlen)
 		{
-			*(romdata + romlen[idx] + offsets[i]) = *buf++;
-			chunk--;
+			for (int j = 0; j < bytes_in_iter; j++) d[offsets[j]] = *b++;
 		}
-		romlen[idx] += unitlen;
 	}
 
+	// a part ending in the middle of a unit still takes the whole unit
+	for (int j = 0; j < tail; j++) dst[units * unitlen + offsets[j]] = buf[units * bytes_in_iter + j];
+	romlen[idx] += (units + (tail ? 1 : 0)) * unitlen;
+
 	return 1;
 }
 
+/*
+Parts are inflated ahead on the offload workers. arcade_send_rom() lists the
+parts in a first pass over the MRA, in the order the main pass asks for them,
+and rom_file() takes the prefetched data if it is there.
+*/
+
+#define MRA_PREFETCH 4   // parts inflated ahead of the one being assembled
+
+struct part_fetch_t
+{
+	char fname[kBigTextSize * 2 + 16];
+	uint32_t crc;
+	int ok;
+	int queued;
+	uint8_t *data;
+	uint32_t size;
+	offload_handle_t handle;
+};
+
+static std::vector<part_fetch_t> fetches;
+static size_t fetch_next = 0;   // next one to queue
+static size_t fetch_used = 0;   // the ones before are released
+
+static void fetch_queue(size_t upto)
+{
+	for (; fetch_next < fetches.size() && fetch_next < upto; fetch_next++)
+	{
+		part_fetch_t *p = &fetches[fetch_next];
+		p->queued = 1;
+		offload_add_work([p]() { p->ok = FileLoadZip(p->fname, p->crc, &p->data, &p->size); }, OFFLOAD_HIGH, &p->handle);
+	}
+}
+
+static void fetch_release(part_fetch_t *p)
+{
+	if (p->queued) offload_wait(&p->handle);
+	free(p->data);
+	p->data = 0;
+	p->queued = 0;
+}
+
+static void fetch_reset()
+{
+	for (size_t i = fetch_used; i < fetches.size(); i++) fetch_release(&fetches[i]);
+	fetches.clear();
+	fetch_next = 0;
+	fetch_used = 0;
+}
+
+static part_fetch_t *fetch_get(const char *name, uint32_t crc32)
+{
+	for (size_t i = fetch_used; i < fetches.size(); i++)
+	{
+		if (fetches[i].crc != crc32 || strcmp(fetches[i].fname, name)) continue;
+
+		// parts skipped by the main pass (suppressed rom0, other zips) are dropped
+		for (; fetch_used < i; fetch_used++) fetch_release(&fetches[fetch_used]);
+
+		fetch_queue(i + 1 + MRA_PREFETCH);
+		offload_wait(&fetches[i].handle);
+		return &fetches[i];
+	}
+
+	return NULL;
+}
+
 static int rom_file(const char *name, uint32_t crc32, int start, int len, int map, struct MD5Context *md5context)
 {
+	part_fetch_t *p = fetch_get(name, crc32);
+	if (p && !p->ok)
+	{
+		// whole part inflate failed (short of memory), stream it instead
+		fetch_release(p);
+		p = NULL;
+	}
+
+	if (p)
+	{
+		uint32_t pos = (start > 0) ? start : 0;
+		if (pos > p->size) pos = p->size;
+		uint32_t bytes2send = p->size - pos;
+		if (len > 0 && len < (int)bytes2send) bytes2send = len;
+
+		return !bytes2send || rom_data(p->data + pos, bytes2send, map, md5context);
+	}
+
 	fileTYPE f = {};
 	static uint8_t buf[8192];
 	if (!FileOpenZip(&f, name, crc32)) return 0;
@@ -309,6 +429,94 @@ static int rom_file(const char *name, uint32_t crc32, int start, int len, int ma
 	return 1;
 }
 
+/*
+Verified checksums. A ROM whose md5 matched is remembered under a key made
+of the MRA file and every zip its parts come from (path, mtime, size), so
+the next start of the same set skips hashing it. A missing part still fails
+the ROM.
+*/
+
+#define MD5_CACHE_MAX 4096
+
+struct rom_key_t
+{
+	char key[33];
+};
+
+static std::vector<rom_key_t> rom_keys;   // by ROM order in the MRA
+static std::vector<rom_key_t> md5_cache;  // key, md5 pairs
+
+static void md5_hex(struct MD5Context *ctx, char *hex)
+{
+	unsigned char checksum[16];
+	MD5Final(checksum, ctx);
+	for (int i = 0; i < 16; i++) sprintf(hex + i * 2, "%02x", (unsigned int)checksum[i]);
+}
+
+// returns 1 if the file exists
+static int md5_key_file(struct MD5Context *ctx, const char *path)
+{
+	struct stat64 *st = getPathStat(path);
+	int64_t id[2] = { st ? (int64_t)st->st_mtime : 0, st ? (int64_t)st->st_size : -1 };
+	MD5Update(ctx, (const unsigned char*)path, strlen(path) + 1);
+	MD5Update(ctx, (const unsigned char*)id, sizeof(id));
+	return st != NULL;
+}
+
+static void md5_cache_name(char *path, size_t size)
+{
+	snprintf(path, size, "%s/" CONFIG_DIR "/mra_md5.txt", getRootDir());
+}
+
+static void md5_cache_load()
+{
+	md5_cache.clear();
+
+	char path[1024];
+	md5_cache_name(path, sizeof(path));
+	FILE *fp = fopen(path, "r");
+	if (!fp) return;
+
+	char line[128];
+	while (fgets(line, sizeof(line), fp) && md5_cache.size() < MD5_CACHE_MAX * 2)
+	{
+		rom_key_t key, md5;
+		if (sscanf(line, "%32s %32s", key.key, md5.key) != 2) continue;
+		md5_cache.push_back(key);
+		md5_cache.push_back(md5);
+	}
+	fclose(fp);
+}
+
+static const char *md5_cache_get(int rom)
+{
+	if (rom < 0 || rom >= (int)rom_keys.size()) return NULL;
+	for (size_t i = 0; i + 1 < md5_cache.size(); i += 2)
+	{
+		if (!strcmp(md5_cache[i].key, rom_keys[rom].key)) return md5_cache[i + 1].key;
+	}
+	return NULL;
+}
+
+static void md5_cache_put(int rom, const char *md5)
+{
+	if (rom < 0 || rom >= (int)rom_keys.size() || md5_cache_get(rom)) return;
+
+	char path[1024];
+	md5_cache_name(path, sizeof(path));
+
+	// start over once the file gets long
+	FILE *fp = fopen(path, (md5_cache.size() >= MD5_CACHE_MAX * 2) ? "w" : "a");
+	if (!fp) return;
+	fprintf(fp, "%s %s\n", rom_keys[rom].key, md5);
+	fclose(fp);
+
+	rom_key_t v;
+	snprintf(v.key, sizeof(v.key), "%s", md5);
+	md5_cache.push_back(rom_keys[rom]);
+	md5_cache.push_back(v);
+}
+
 static int rom_patch(const uint8_t *buf, int offset, uint16_t len, int dataop)
 {
 	if ((offset + len) > romlen[0]) return 0;
@@ -738,6 +946,11 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 				arc_info->error_msg[0] = 0;
 
 			rom_start(arc_info->romindex);
+
+			// same files as when the md5 last matched: skip hashing
+			const char *md5 = md5_cache_get(arc_info->romcount++);
+			arc_info->verified = md5 && strlen(arc_info->md5) && !strcasecmp(md5, arc_info->md5);
+			arc_info->part_failed = 0;
 		}
 
 		if (!strcasecmp(node->tag, "cheats"))
@@ -803,15 +1016,13 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 
 			if (arc_info->insiderom)
 			{
-				unsigned char checksum[16];
-				MD5Final(checksum, &arc_info->context);
-
 				char hex[40];
-				char *p = hex;
-				for (int i = 0; i < 16; i++)
+				md5_hex(&arc_info->context, hex);
+
+				if (arc_info->verified)
 				{
-					sprintf(p, "%02x", (unsigned int)checksum[i]);
-					p += 2;
+					printf("md5 of rom %d matched before with the same files.\n", arc_info->romindex);
+					strcpy(hex, arc_info->part_failed ? "-" : arc_info->md5);
 				}
 
 				int checksumsame = !strlen(arc_info->zipname) || !strcasecmp(arc_info->md5, hex);
@@ -841,6 +1052,8 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 					}
 				}
 
+				if (!no_checksum && !arc_info->verified && !strcasecmp(arc_info->md5, hex)) md5_cache_put(arc_info->romcount - 1, hex);
+
 				checksumsame |= no_checksum;
 
 				rom_finish(checksumsame, arc_info->address, arc_info->romindex);
@@ -899,7 +1112,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 
 					for (int i = 0; i < repeat; i++)
 					{
-						result = rom_file(fname, crc32, start, length, arc_info->imap, &arc_info->context);
+						result = rom_file(fname, crc32, start, length, arc_info->imap, arc_info->verified ? NULL : &arc_info->context);
 
 						// we should check file not found error for the zip
 						if (result == 0)
@@ -916,6 +1129,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 				if (result == 0)
 				{
 					printf("%s does not exist\n", arc_info->partname);
+					arc_info->part_failed = 1;
 					snprintf(arc_info->error_msg, kBigTextSize, "%s\n%s not found", fname, arc_info->partname);
 				}
 			}
@@ -927,7 +1141,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 				printf("data: ");
 				if (binary)
 				{
-					for (int i = 0; i < repeat; i++) rom_data(binary, len, arc_info->imap, &arc_info->context);
+					for (int i = 0; i < repeat; i++) rom_data(binary, len, arc_info->imap, arc_info->verified ? NULL : &arc_info->context);
 					free(binary);
 				}
 				printf("%d(0x%X) bytes from xml\n", romlen[0] - prev_len, romlen[0] - prev_len);
@@ -1130,6 +1344,114 @@ static int xml_read_pre_parse(XMLEvent evt, const XMLNode* node, SXML_CHAR* text
 	return true;
 }
 
+struct mra_scan_t
+{
+	const char *xml;
+	int insiderom;
+	int romcount;
+	uint32_t crc;
+	char zipname[kBigTextSize];
+	char partzipname[kBigTextSize];
+	char partname[kBigTextSize];
+	struct MD5Context key;
+};
+
+// First pass: the parts to prefetch and the checksum cache key of every ROM.
+static int xml_scan_parts(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
+{
+	(void)(text);
+	(void)(n);
+	mra_scan_t *scan = (mra_scan_t*)sd->user;
+
+	switch (evt)
+	{
+	case XML_EVENT_START_NODE:
+		if (!strcasecmp(node->tag, "rom"))
+		{
+			scan->insiderom = 1;
+			scan->zipname[0] = 0;
+
+			MD5Init(&scan->key);
+			md5_key_file(&scan->key, scan->xml);
+			MD5Update(&scan->key, (const unsigned char*)&scan->romcount, sizeof(scan->romcount));
+			scan->romcount++;
+		}
+
+		if (!strcasecmp(node->tag, "part"))
+		{
+			scan->partzipname[0] = 0;
+			scan->partname[0] = 0;
+			scan->crc = 0;
+		}
+
+		for (int i = 0; i < node->n_attributes; i++)
+		{
+			const char *name = node->attributes[i].name;
+			const char *value = node->attributes[i].value;
+
+			if (!strcasecmp(node->tag, "rom") && !strcasecmp(name, "zip")) snprintf(scan->zipname, sizeof(scan->zipname), "%s", value);
+			if (!strcasecmp(node->tag, "part"))
+			{
+				if (!strcasecmp(name, "zip")) snprintf(scan->partzipname, sizeof(scan->partzipname), "%s", value);
+				if (!strcasecmp(name, "name")) snprintf(scan->partname, sizeof(scan->partname), "%s", value);
+				if (!strcasecmp(name, "crc")) scan->crc = strtoul(value, NULL, 16);
+			}
+		}
+		break;
+
+	case XML_EVENT_END_NODE:
+		if (scan->insiderom && !strcasecmp(node->tag, "part") && scan->partname[0])
+		{
+			char zipnames_list[kBigTextSize];
+			strcpy(zipnames_list, scan->partzipname[0] ? scan->partzipname : scan->zipname);
+
+			char *zipname = NULL;
+			char *zipptr = zipnames_list;
+			const char *root = get_arcade_root(0);
+			int found = 0;
+			while ((zipname = strsep(&zipptr, "|")) != NULL)
+			{
+				part_fetch_t p = {};
+				snprintf(p.fname, sizeof(p.fname), (zipname[0] == '/') ? "%s%s/%s" : "%s/mame/%s/%s", root, zipname, scan->partname);
+				p.crc = scan->crc;
+
+				char zip[sizeof(p.fname)];
+				strcpy(zip, p.fname);
+				char *z = strcasestr(zip, ".zip");
+				if (z) z[4] = 0;
+
+				// the main pass takes the first zip that has the part
+				if (md5_key_file(&scan->key, zip) && !found)
+				{
+					fetches.push_back(p);
+					found = 1;
+				}
+			}
+		}
+
+		if (scan->insiderom && !strcasecmp(node->tag, "rom"))
+		{
+			rom_key_t k;
+			md5_hex(&scan->key, k.key);
+			rom_keys.push_back(k);
+			scan->insiderom = 0;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return true;
+}
+
+static uint64_t time_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
 int arcade_send_rom(const char *xml)
 {
 	const char *p = strrchr(xml, '/');
@@ -1156,10 +1478,31 @@ int arcade_send_rom(const char *xml)
 	arc_info.validrom0 = 0;
 	struct stat64 *st = getPathStat(xml);
 	if (st) arc_info.file_size = (int)st->st_size;
+	arc_info.romcount = 0;
 	ProgressMessage(0, 0, 0, 0);
 
+	uint64_t start = time_ms();
+
+	// list the parts and start inflating the first ones
+	SAX_Callbacks scan_sax;
+	SAX_Callbacks_init(&scan_sax);
+	scan_sax.all_event = xml_scan_parts;
+
+	static mra_scan_t scan;
+	memset(&scan, 0, sizeof(scan));
+	scan.xml = xml;
+	fetch_reset();
+	rom_keys.clear();
+	XMLDoc_parse_file_SAX(xml, &scan_sax, &scan);
+	md5_cache_load();
+	fetch_queue(MRA_PREFETCH);
+
 	// parse
 	XMLDoc_parse_file_SAX(xml, &sax, &arc_info);
+
+	size_t parts = fetches.size();
+	fetch_reset();
+	printf("arcade_send_rom: %u parts prefetched, %llu ms\n", (uint32_t)parts, time_ms() - start);
 	if (arc_info.validrom0 == 0 && strlen(arc_info.error_msg))
 	{
 		strcpy(arcade_error_msg, arc_info.error_msg);
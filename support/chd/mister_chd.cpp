@@ -5,18 +5,84 @@
 #include <string.h>
 #include <inttypes.h>
 #include <time.h>
+#include <pthread.h>
 #include "../../file_io.h"
 #include "../../cd.h"
+#include "../../offload.h"
+#include "../../hardware.h"
 #include "mister_chd.h"
 
-void lba_to_hunkinfo(chd_file *chd_f, int lba, int *hunknumber, int *hunkoffset)
+#define CHD_CACHE_HUNKS 32 // decompressed hunks kept per image (~600KB for CD images)
+#define CHD_READAHEAD   4  // hunks decompressed ahead of a sequential stream
+#define CHD_MAX_OPEN    8
+
+enum
 {
-	const chd_header *chd_header = chd_get_header(chd_f);
-	int sectors_per_hunk = chd_header->hunkbytes / chd_header->unitbytes;
-	*hunknumber = lba / sectors_per_hunk;
-	*hunkoffset = lba % sectors_per_hunk;
-	return;
-}
+	HUNK_FREE = 0,
+	HUNK_PENDING,          // queued on the offload workers
+	HUNK_READY
+};
+
+enum
+{
+	STREAM_DATA = 0,
+	STREAM_AUDIO,
+	STREAM_NUM
+};
+
+struct chd_hunk_t
+{
+	uint8_t *data;
+	int num;
+	int state;
+	int prefetched;        // decompressed ahead and not read yet
+	uint32_t used;         // LRU tick
+	chd_error err;         // written by the worker
+	uint32_t decode_us;    // written by the worker
+	offload_handle_t handle;
+};
+
+struct chd_stream_t
+{
+	int last;              // last hunk read
+	int seq;               // consecutive hunks read in order
+};
+
+struct chd_cache_t
+{
+	chd_file *chd;
+	uint8_t *mem;
+	uint32_t hunkbytes;
+	int sectors_per_hunk;
+	int total_hunks;
+	uint32_t tick;
+	pthread_mutex_t lock;  // chd_read() isn't reentrant for the same file
+	chd_hunk_t hunk[CHD_CACHE_HUNKS];
+	chd_stream_t stream[STREAM_NUM];
+	int audio_num;
+	struct
+	{
+		int start, end;
+	} audio[100];          // CHD lba ranges of the audio tracks
+};
+
+static chd_cache_t *caches[CHD_MAX_OPEN] = {};
+
+static struct
+{
+	uint64_t reads[STREAM_NUM];
+	uint64_t hits[STREAM_NUM];
+	uint64_t misses[STREAM_NUM];
+	uint64_t prefetched;
+	uint64_t prefetch_used;
+	uint64_t prefetch_waits;   // read hit a hunk still being decompressed
+	uint64_t prefetch_wait_us;
+	uint64_t decode_us;        // decompression on the caller's thread
+	uint64_t decode_max_us;
+	uint64_t bg_decode_us;     // decompression on the workers
+	uint64_t bg_decode_max_us;
+	uint64_t errors;
+} stats;
 
 int mister_chd_log(const char *format, ...)
 {
@@ -28,6 +94,166 @@ int mister_chd_log(const char *format, ...)
 	return printf("\x1b[32m%s\x1b[0m", logline);
 }
 
+static chd_cache_t *cache_find(chd_file *chd_f)
+{
+	for (int i = 0; i < CHD_MAX_OPEN; i++)
+	{
+		if (caches[i] && caches[i]->chd == chd_f) return caches[i];
+	}
+	return NULL;
+}
+
+static chd_cache_t *cache_create(chd_file *chd_f)
+{
+	const chd_header *chd_header = chd_get_header(chd_f);
+
+	int slot = 0;
+	while (slot < CHD_MAX_OPEN && caches[slot]) slot++;
+	if (slot == CHD_MAX_OPEN)
+	{
+		mister_chd_log("Too many open CHD files\n");
+		return NULL;
+	}
+
+	chd_cache_t *c = (chd_cache_t *)calloc(1, sizeof(chd_cache_t));
+	if (!c) return NULL;
+
+	c->mem = (uint8_t *)malloc(CHD_CACHE_HUNKS * chd_header->hunkbytes);
+	if (!c->mem)
+	{
+		free(c);
+		return NULL;
+	}
+
+	c->chd = chd_f;
+	c->hunkbytes = chd_header->hunkbytes;
+	c->sectors_per_hunk = chd_header->hunkbytes / chd_header->unitbytes;
+	c->total_hunks = chd_header->totalhunks;
+	pthread_mutex_init(&c->lock, NULL);
+
+	for (int i = 0; i < CHD_CACHE_HUNKS; i++)
+	{
+		c->hunk[i].data = c->mem + i * c->hunkbytes;
+		c->hunk[i].num = -1;
+	}
+
+	for (int i = 0; i < STREAM_NUM; i++) c->stream[i].last = -1;
+
+	caches[slot] = c;
+	return c;
+}
+
+static int is_audio(chd_cache_t *c, int lba)
+{
+	for (int i = 0; i < c->audio_num; i++)
+	{
+		if (lba >= c->audio[i].start && lba < c->audio[i].end) return 1;
+	}
+	return 0;
+}
+
+static chd_error decode(chd_cache_t *c, chd_hunk_t *h)
+{
+	pthread_mutex_lock(&c->lock);
+	chd_error err = chd_read(c->chd, h->num, h->data);
+	pthread_mutex_unlock(&c->lock);
+	return err;
+}
+
+// runs on a worker
+static void decode_ahead(chd_cache_t *c, chd_hunk_t *h)
+{
+	uint64_t t = time_us();
+	h->err = decode(c, h);
+	h->decode_us = time_us() - t;
+}
+
+// Finishes a read-ahead once the worker is done (or, with wait set, after
+// waiting for it).
+static void reap(chd_hunk_t *h, int wait)
+{
+	if (h->state != HUNK_PENDING) return;
+
+	if (!offload_done(&h->handle))
+	{
+		if (!wait) return;
+
+		uint64_t t = time_us();
+		offload_wait(&h->handle);
+		stats.prefetch_waits++;
+		stats.prefetch_wait_us += time_us() - t;
+	}
+
+	stats.bg_decode_us += h->decode_us;
+	if (h->decode_us > stats.bg_decode_max_us) stats.bg_decode_max_us = h->decode_us;
+
+	if (h->err != CHDERR_NONE)
+	{
+		stats.errors++;
+		h->state = HUNK_FREE;
+		h->num = -1;
+	}
+	else
+	{
+		h->state = HUNK_READY;
+	}
+}
+
+static chd_hunk_t *hunk_find(chd_cache_t *c, int num)
+{
+	for (int i = 0; i < CHD_CACHE_HUNKS; i++)
+	{
+		if (c->hunk[i].num == num && c->hunk[i].state != HUNK_FREE) return &c->hunk[i];
+	}
+	return NULL;
+}
+
+// least recently used hunk that isn't being decompressed
+static chd_hunk_t *hunk_victim(chd_cache_t *c)
+{
+	chd_hunk_t *victim = NULL;
+	for (int i = 0; i < CHD_CACHE_HUNKS; i++)
+	{
+		chd_hunk_t *h = &c->hunk[i];
+		reap(h, 0);
+		if (h->state == HUNK_PENDING) continue;
+		if (h->state == HUNK_FREE) return h;
+		if (!victim || (int32_t)(h->used - victim->used) < 0) victim = h;
+	}
+
+	if (!victim)
+	{
+		victim = &c->hunk[0];
+		reap(victim, 1);
+	}
+
+	victim->state = HUNK_FREE;
+	victim->num = -1;
+	return victim;
+}
+
+static void prefetch(chd_cache_t *c, int num)
+{
+	for (int n = num + 1; n <= num + CHD_READAHEAD && n < c->total_hunks; n++)
+	{
+		if (hunk_find(c, n)) continue;
+
+		chd_hunk_t *h = hunk_victim(c);
+		h->num = n;
+		h->prefetched = 1;
+		h->state = HUNK_PENDING;
+		h->used = c->tick;
+
+		if (!offload_try_add([c, h]() { decode_ahead(c, h); }, OFFLOAD_HIGH, &h->handle))
+		{
+			h->state = HUNK_FREE;
+			h->num = -1;
+			break;
+		}
+		stats.prefetched++;
+	}
+}
+
 chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 {
 	cd_toc->last = -1;
@@ -50,6 +276,14 @@ chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 	mister_chd_log("hunkbytes %d unitbytes %d logical length %llu\n", chd_header->hunkbytes, chd_header->unitbytes, chd_header->logicalbytes);
 	cd_toc->chd_hunksize = chd_header->hunkbytes;
 
+	chd_cache_t *cache = cache_create(cd_toc->chd_f);
+	if (!cache)
+	{
+		chd_close(cd_toc->chd_f);
+		cd_toc->chd_f = NULL;
+		return CHDERR_OUT_OF_MEMORY;
+	}
+
 	//Set CLOEXEC on underlying FD
 	int chd_fd = fileno((FILE *)chd_core_file(cd_toc->chd_f)->argp);
 	if (chd_fd) fcntl(chd_fd, F_SETFD, FD_CLOEXEC);
@@ -149,6 +383,13 @@ chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 			cd_toc->tracks[cd_toc->last].sbc_type = SUBCODE_RW_RAW;
 		}
 
+		if (cd_toc->tracks[cd_toc->last].type == TT_CDDA)
+		{
+			cache->audio[cache->audio_num].start = sector_cnt;
+			cache->audio[cache->audio_num].end = sector_cnt + frames;
+			cache->audio_num++;
+		}
+
 		//CHD pads tracks to a multiple of 4 sectors, keep track of the overall sector count and calculate the difference between the cdrom lba and the effective chd lba
 		cd_toc->tracks[cd_toc->last].offset = (sector_cnt + pregap - cd_toc->tracks[cd_toc->last].start);
 		cd_toc->tracks[cd_toc->last].end = cd_toc->tracks[cd_toc->last].start + frames - pregap;
@@ -160,27 +401,97 @@ chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 	return CHDERR_NONE;
 }
 
-chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf, uint8_t *hunkbuf, int *hunknum)
+chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf)
 {
+	chd_cache_t *c = cache_find(chd_f);
+	if (!c) return CHDERR_INVALID_PARAMETER;
 
-	int tmphnum = 0;
-	int hunkofs = 0;
-
-	lba_to_hunkinfo(chd_f, lba, &tmphnum, &hunkofs);
-
+	int num = lba / c->sectors_per_hunk;
+	int hunkofs = lba % c->sectors_per_hunk;
+	int s = is_audio(c, lba) ? STREAM_AUDIO : STREAM_DATA;
+	stats.reads[s]++;
 
 	//mister_chd_log("READ LBA: %d, dest_offset: %d sector offset: %d length %d chd_f %p\n", lba, d_offset, s_offset, length, chd_f);
-	if (tmphnum != *hunknum)
+	chd_hunk_t *h = hunk_find(c, num);
+	if (h && h->state == HUNK_PENDING) reap(h, 1);
+
+	if (h && h->state == HUNK_READY)
+	{
+		stats.hits[s]++;
+		if (h->prefetched) stats.prefetch_used++;
+		h->prefetched = 0;
+	}
+	else
 	{
-		chd_error err = chd_read(chd_f, tmphnum, hunkbuf);
+		stats.misses[s]++;
+
+		h = hunk_victim(c);
+		h->num = num;
+		h->prefetched = 0;
+
+		uint64_t t = time_us();
+		chd_error err = decode(c, h);
+		t = time_us() - t;
+		stats.decode_us += t;
+		if (t > stats.decode_max_us) stats.decode_max_us = t;
+
 		if (err != CHDERR_NONE)
 		{
 			mister_chd_log("ERROR %s\n", chd_error_string(err));
+			stats.errors++;
+			h->state = HUNK_FREE;
 			return err;
 		}
-		*hunknum = tmphnum;
+		h->state = HUNK_READY;
 	}
+
+	h->used = ++c->tick;
 	int sector_offset = hunkofs * CD_FRAME_SIZE;
-	memcpy(destbuf + d_offset, hunkbuf + sector_offset + s_offset, length);
+	memcpy(destbuf + d_offset, h->data + sector_offset + s_offset, length);
+
+	// decompress ahead once a stream crossed into the following hunk
+	chd_stream_t *st = &c->stream[s];
+	if (num != st->last)
+	{
+		st->seq = (num == st->last + 1) ? st->seq + 1 : 0;
+		st->last = num;
+		if (st->seq) prefetch(c, num);
+	}
+
 	return CHDERR_NONE;
 }
+
+void mister_chd_close(chd_file *chd_f)
+{
+	if (!chd_f) return;
+
+	for (int i = 0; i < CHD_MAX_OPEN; i++)
+	{
+		chd_cache_t *c = caches[i];
+		if (!c || c->chd != chd_f) continue;
+
+		for (int n = 0; n < CHD_CACHE_HUNKS; n++) reap(&c->hunk[n], 1);
+		pthread_mutex_destroy(&c->lock);
+		free(c->mem);
+		free(c);
+		caches[i] = NULL;
+	}
+
+	chd_close(chd_f);
+}
+
+void mister_chd_print_stats()
+{
+	static const char *names[STREAM_NUM] = { "data", "audio" };
+	for (int s = 0; s < STREAM_NUM; s++)
+	{
+		printf("chd %s: %llu reads, %llu hits, %llu misses\n", names[s], stats.reads[s], stats.hits[s], stats.misses[s]);
+	}
+
+	uint64_t misses = stats.misses[STREAM_DATA] + stats.misses[STREAM_AUDIO];
+	printf("chd: decode avg/max %llu/%llu us, %llu errors\n",
+		misses ? stats.decode_us / misses : 0, stats.decode_max_us, stats.errors);
+	printf("chd: %llu hunks decoded ahead (avg/max %llu/%llu us), %llu used, %llu waited for (%llu us)\n",
+		stats.prefetched, stats.prefetched ? stats.bg_decode_us / stats.prefetched : 0, stats.bg_decode_max_us,
+		stats.prefetch_used, stats.prefetch_waits, stats.prefetch_wait_us);
+}
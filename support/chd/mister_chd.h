@@ -5,7 +5,12 @@
 #include <libchdr/cdrom.h>
 #include "../../cd.h"
 
-chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf, uint8_t *hunkbuf, int *hunknum);
+// All CD drivers share one cache of decompressed hunks per image. Hunks
+// following a sequential data or audio stream are decompressed ahead on the
+// offload workers.
+chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf);
 chd_error mister_load_chd(const char *filename, toc_t *cd_toc);
+void mister_chd_close(chd_file *chd_f);
+void mister_chd_print_stats();
 
 #endif
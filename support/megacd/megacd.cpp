@@ -7,6 +7,7 @@
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../spi.h"
+#include "../../scheduler.h"
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "../../cheats.h"
@@ -58,6 +59,7 @@ void mcd_poll()
 	if (req != last_req)
 	{
 		last_req = req;
+		scheduler_activity();
 
 		spi_w(MCD_GET_CMD);
 
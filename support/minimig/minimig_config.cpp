@@ -101,7 +101,7 @@ static char UploadKickstart(char *name)
 	BootPrint("Checking for Amiga Forever key file:");
 	if (FileOpen(&file, user_io_make_filepath(HomeDir(), "ROM.KEY")) || FileOpen(&file, "ROM.KEY")) {
 		keysize = file.size;
-		if (file.size<sizeof(romkey))
+		if (file.size<(int)sizeof(romkey))
 		{
 			FileReadAdv(&file, romkey, keysize);
 			BootPrint("Loaded Amiga Forever key file");
@@ -9,6 +9,7 @@
 
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "../../hardware.h"
@@ -17,6 +18,7 @@
 #include "../../spi.h"
 #include "../../cfg.h"
 #include "../../shmem.h"
+#include "../../share_cache.h"
 #include "miminig_fs_messages.h"
 
 #define SHMEM_ADDR      0x27FF4000
@@ -50,57 +52,41 @@ struct lock
 {
 	uint16_t mode;
 	std::string path;
-	std::vector<dirent64> dir_items;
+	share_dir_ptr dir;
+	std::vector<uint32_t> items; // entries of dir being examined
 };
 
-static std::map<uint32_t, lock> locks;
-static uint32_t next_key = 1;
+static share_handles_t<lock, 16, 15> locks;
+static lock root_lock; // examine state of key 0
+static std::unordered_map<std::string, int> lock_paths;
 
-static uint32_t get_key()
+// 0 if all keys are in use
+static uint32_t add_lock(uint16_t mode, const char* path)
 {
-	uint32_t key;
-
-	do
-	{
-		key = next_key;
-		if (next_key == INT32_MAX) next_key = 1; else next_key++;
-
-	} while (locks.find(key) != locks.end());
+	uint32_t key = locks.add({ mode, path, nullptr, {} });
+	if (key) lock_paths[path]++;
 
+	dbg_print("+ add lock: %d, %s\n", key, path);
 	return key;
 }
 
-static uint32_t add_lock(uint16_t mode, const char* path)
+static void free_lock(uint32_t key)
 {
-	uint32_t key = get_key();
-	locks[key] = { mode, path, {} };
+	lock *l = locks.get(key);
+	if (!l) return;
 
-	dbg_print("+ add lock: %d, %s\n", key, path);
-	return key;
+	auto it = lock_paths.find(l->path);
+	if (it != lock_paths.end() && !--it->second) lock_paths.erase(it);
+	locks.erase(key);
 }
 
 static int has_locks(const char* path)
 {
-	int has = 0;
-	for (const auto &pair : locks)
-	{
-		if (pair.second.path == path)
-		{
-			if (!has)
-			{
-				dbg_print("! path %s has locks:", path);
-			}
+	auto it = lock_paths.find(path);
+	if (it == lock_paths.end()) return 0;
 
-			has = 1;
-			dbg_print(" %d", pair.first);
-		}
-	}
-
-	if (has)
-	{
-		dbg_print("\n");
-	}
-	return has;
+	dbg_print("! path %s has %d locks\n", path, it->second);
+	return 1;
 }
 
 static std::map<uint32_t, fileTYPE> open_file_handles;
@@ -140,8 +126,8 @@ static char* find_path(uint32_t key, const char *name)
 	strcpy(str, basepath);
 	if (key)
 	{
-		auto it = locks.find(key);
-		if (it != locks.end()) strcpy(str, it->second.path.c_str());
+		lock *l = locks.get(key);
+		if (l) strcpy(str, l->path.c_str());
 	}
 
 	if (strlen(name))
@@ -218,7 +204,7 @@ static char* find_path(uint32_t key, const char *name)
 		else
 		{
 			*p = 0;
-			if (!PathIsDir(str, 0)) str[0] = 0;
+			if (!share_cache_isdir(str)) str[0] = 0;
 			else *p = '/';
 		}
 	}
@@ -305,13 +291,20 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
-			if (!FileExists(str, 0) && !PathIsDir(str, 0))
+			share_stat_t st;
+			if (!share_cache_stat(str, &st) || !(S_ISREG(st.mode) || S_ISDIR(st.mode)))
 			{
 				ret = ERROR_OBJECT_NOT_FOUND;
 				break;
 			}
 
 			uint32_t key = add_lock(req->mode, str);
+			if (!key)
+			{
+				ret = ERROR_NO_FREE_STORE;
+				break;
+			}
+
 			res->key = SWAP_INT(key);
 			ret = 0;
 		}
@@ -323,7 +316,7 @@ static int process_request(void *reqres_buffer)
 			FreeLockRequest *req = (FreeLockRequest*)reqres_buffer;
 
 			uint32_t key = SWAP_INT(req->key);
-			locks.erase(key);
+			free_lock(key);
 			dbg_print("  lock: %d\n", key);
 
 			ret = 0;
@@ -338,14 +331,21 @@ static int process_request(void *reqres_buffer)
 			sz_res = sizeof(CopyDirResponse);
 
 			uint32_t key = SWAP_INT(req->key);
-			if (locks.find(key) == locks.end())
+			lock *l = locks.get(key);
+			if (!l)
 			{
 				ret = ERROR_OBJECT_NOT_FOUND;
 				break;
 			}
 
-			uint32_t new_key = add_lock(locks[key].mode, locks[key].path.c_str());
-			dbg_print("CopyDir: %s: %d -> %d\n", locks[new_key].path.c_str(), key, new_key);
+			std::string path = l->path;
+			uint32_t new_key = add_lock(l->mode, path.c_str());
+			if (!new_key)
+			{
+				ret = ERROR_NO_FREE_STORE;
+				break;
+			}
+			dbg_print("CopyDir: %s: %d -> %d\n", path.c_str(), key, new_key);
 
 			res->key = SWAP_INT(new_key);
 			ret = 0;
@@ -362,7 +362,8 @@ static int process_request(void *reqres_buffer)
 			uint32_t key = SWAP_INT(req->key);
 			dbg_print("  current key: %d\n", key);
 
-			if (locks.find(key) == locks.end())
+			lock *l = locks.get(key);
+			if (!l)
 			{
 				ret = ERROR_OBJECT_NOT_FOUND;
 				break;
@@ -372,7 +373,7 @@ static int process_request(void *reqres_buffer)
 			res->key = 0;
 
 			char *name = buf;
-			strcpy(name, locks[key].path.c_str());
+			strcpy(name, l->path.c_str());
 			dbg_print("  current path: %s\n", name);
 
 			if (!strncasecmp(basepath, name, baselen)) name += baselen;
@@ -384,6 +385,7 @@ static int process_request(void *reqres_buffer)
 				{
 					*p = 0;
 					uint32_t key = add_lock(SHARED_LOCK, buf);
+					if (!key) ret = ERROR_NO_FREE_STORE;
 					res->key = SWAP_INT(key);
 					dbg_print("  parent path: %s\n", buf);
 				}
@@ -402,13 +404,16 @@ static int process_request(void *reqres_buffer)
 			uint32_t key = SWAP_INT(req->key);
 			dbg_print("  key: %d\n", key);
 
+			lock *l = locks.get(key);
+			if (!l) l = &root_lock;
+
 			char *name = buf;
-			name[0] = 0;
-			if (locks.find(key) != locks.end()) strcpy(name, locks[key].path.c_str());
+			strcpy(name, l->path.c_str());
 			if (!strlen(name)) strcpy(name, basepath);
 
 			int disk_key = 666;
 			static char fn[256];
+			share_stat_t st;
 			if (rtype == ACTION_EXAMINE_OBJECT)
 			{
 				dbg_print("  examine first\n");
@@ -420,25 +425,25 @@ static int process_request(void *reqres_buffer)
 					strcpy(fn, p ? p + 1 : name);
 				}
 
-				locks[key].dir_items.clear();
-				if (PathIsDir(name, 0))
+				l->dir.reset();
+				l->items.clear();
+				share_cache_stat(name, &st);
+				if (S_ISDIR(st.mode))
 				{
-					const char* full_path = getFullPath(name);
-					DIR *d = opendir(full_path);
-					if (!d)
+					l->dir = share_cache_dir(name);
+					if (!l->dir)
 					{
-						printf("Couldn't open dir: %s\n", full_path);
+						printf("Couldn't open dir: %s\n", getFullPath(name));
 						ret = ERROR_OBJECT_WRONG_TYPE;
 						break;
 					}
 
-					struct dirent64 *de;
-					while ((de = readdir64(d)))
+					for (uint32_t i = 0; i < l->dir->entries.size(); i++)
 					{
-						if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) continue;
-						locks[key].dir_items.push_back(*de);
+						const char *de_name = l->dir->name(l->dir->entries[i]);
+						if (!strcmp(de_name, "..") || !strcmp(de_name, ".")) continue;
+						l->items.push_back(i);
 					}
-					closedir(d);
 				}
 			}
 			else
@@ -450,16 +455,19 @@ static int process_request(void *reqres_buffer)
 				uint32_t listed = disk_key - 666;
 				disk_key++;
 
-				if (listed >= locks[key].dir_items.size())
+				if (listed >= l->items.size())
 				{
-					locks[key].dir_items.clear();
+					l->dir.reset();
+					l->items.clear();
 					ret = ERROR_NO_MORE_ENTRIES;
 					break;
 				}
 
+				const share_entry_t &e = l->dir->entries[l->items[listed]];
 				strcat(name, "/");
-				strcat(name, locks[key].dir_items[listed].d_name);
-				memcpy(fn, locks[key].dir_items[listed].d_name, sizeof(fn));
+				strcat(name, l->dir->name(e));
+				strncpy(fn, l->dir->name(e), sizeof(fn) - 1);
+				st = e.st;
 				ret = 0;
 			}
 
@@ -467,26 +475,20 @@ static int process_request(void *reqres_buffer)
 			dbg_print("    fn: %s\n", fn);
 
 			int type = 0;
-			if (FileExists(name, 0)) type = ST_FILE;
-			else if (PathIsDir(name, 0)) type = ST_USERDIR;
+			if (S_ISREG(st.mode)) type = ST_FILE;
+			else if (S_ISDIR(st.mode)) type = ST_USERDIR;
 			else
 			{
 				ret = ERROR_OBJECT_NOT_FOUND;
 				break;
 			}
 
-			time_t time = 0;
+			time_t time = st.mtime;
 			uint32_t size = 0;
-
-			struct stat64 *st = getPathStat(name);
-			if (st)
+			if (type == ST_FILE)
 			{
-				time = st->st_mtime;
-				if (type == ST_FILE)
-				{
-					if (st->st_size > UINT32_MAX) size = UINT32_MAX;
-					else size = (uint32_t)st->st_size;
-				}
+				if (st.size > UINT32_MAX) size = UINT32_MAX;
+				else size = (uint32_t)st.size;
 			}
 
 			res->disk_key = SWAP_INT(disk_key);
@@ -529,7 +531,7 @@ static int process_request(void *reqres_buffer)
 			if (fstat64(fileno(open_file_handles[key].filp), &st) == 0)
 			{
 				time = st.st_mtime;
-				if (st.st_mode & S_IFDIR) type = ST_USERDIR;
+				if (S_ISDIR(st.st_mode)) type = ST_USERDIR;
 				else
 				{
 					type = ST_FILE;
@@ -579,7 +581,7 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
-			if (PathIsDir(name, 0))
+			if (share_cache_isdir(name))
 			{
 				ret = ERROR_OBJECT_WRONG_TYPE;
 				break;
@@ -722,14 +724,17 @@ static int process_request(void *reqres_buffer)
 					break;
 				}
 
+				share_stat_t st;
+				share_cache_stat(name, &st);
+
 				DISKLED_ON;
-				if (PathIsDir(name, 0))
+				if (S_ISDIR(st.mode))
 				{
 					ret = DirDelete(name) ? 0 : ERROR_DIRECTORY_NOT_EMPTY;
 					break;
 				}
 
-				if (FileExists(name, 0))
+				if (S_ISREG(st.mode))
 				{
 					ret = FileDelete(name) ? 0 : ERROR_OBJECT_NOT_FOUND;
 					break;
@@ -756,7 +761,8 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
-			if (!FileExists(cp1, 0) && !PathIsDir(cp1, 0))
+			share_stat_t st;
+			if (!share_cache_stat(cp1, &st) || !(S_ISREG(st.mode) || S_ISDIR(st.mode)))
 			{
 				ret = ERROR_OBJECT_NOT_FOUND;
 				break;
@@ -781,7 +787,7 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
-			if (FileExists(cp2, 0) || PathIsDir(cp2, 0))
+			if (share_cache_stat(cp2, &st) && (S_ISREG(st.mode) || S_ISDIR(st.mode)))
 			{
 				ret = ERROR_OBJECT_EXISTS;
 				break;
@@ -814,8 +820,13 @@ static int process_request(void *reqres_buffer)
 			}
 
 			uint32_t key = add_lock(SHARED_LOCK, name);
-			res->key = SWAP_INT(key);
+			if (!key)
+			{
+				ret = ERROR_NO_FREE_STORE;
+				break;
+			}
 
+			res->key = SWAP_INT(key);
 			ret = 0;
 		}
 		break;
@@ -868,13 +879,15 @@ static int process_request(void *reqres_buffer)
 			uint32_t key1 = SWAP_INT(req->key1);
 			uint32_t key2 = SWAP_INT(req->key2);
 
-			if ((locks.find(key1) == locks.end()) || (locks.find(key2) == locks.end()))
+			lock *l1 = locks.get(key1);
+			lock *l2 = locks.get(key2);
+			if (!l1 || !l2)
 			{
 				ret = LOCK_DIFFERENT;
 				break;
 			}
 
-			if (locks[key1].path == locks[key2].path)
+			if (l1->path == l2->path)
 			{
 				ret = LOCK_SAME;
 				break;
@@ -925,6 +938,7 @@ void minimig_share_reset()
 {
 	open_file_handles.clear();
 	locks.clear();
+	lock_paths.clear();
+	root_lock = {};
 	next_fp = 1;
-	next_key = 1;
 }
@@ -0,0 +1,198 @@
+// Part of Neogeo_MiSTer
+// (C) 2019 Sean 'furrtek' Gonsalves
+
+#include <string.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "neogeo_convert.h"
+
+static inline uint32_t ld32(const void *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline void st32(void *p, uint32_t v)
+{
+	memcpy(p, &v, 4);
+}
+
+static inline uint32_t rot16(uint32_t v)
+{
+	return (v >> 16) | (v << 16);
+}
+
+static inline uint32_t bswap_mid(uint32_t v)
+{
+	return (v & 0xFF0000FF) | ((v & 0xFF00) << 8) | ((v & 0xFF0000) >> 8);
+}
+
+// The original per element loops, used for partial blocks.
+static void ref_spr_convert(const uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	/*
+	In C ROMs, a word provides two bitplanes for an 8-pixel wide line
+	They're used in pairs to provide 32 bits at once (all four bitplanes)
+	For one sprite tile, bytes are used like this: ([...] represents one 8-pixel wide line)
+	Even ROM					Odd ROM
+	[  40 41  ][  00 01  ]		[  42 43  ][  02 03  ]
+	[  44 45  ][  04 05  ]  	[  46 47  ][  06 07  ]
+	[  48 49  ][  08 09  ]  	[  4A 4B  ][  0A 0B  ]
+	[  4C 4D  ][  0C 0D  ]  	[  4E 4F  ][  0E 0F  ]
+	[  50 51  ][  10 11  ]  	[  52 53  ][  12 13  ]
+	...							...
+	The data read for a given tile line (16 pixels) is always the same, only the rendering order of the pixels can change
+	To take advantage of the SDRAM burst read feature, the data can be loaded so that all 16 pixels of a tile
+	line can be read sequentially: () are 16-bit words, [] is the 4-word burst read
+	[(40 41) (00 01) (42 43) (02 03)]
+	[(44 45) (04 05) (46 47) (06 07)]...
+	Word interleaving is done on the FPGA side to mix the two C ROMs data (even/odd)
+
+	In:  FEDCBA9876 54321 0
+	Out: FEDCBA9876 15432 0
+	*/
+
+	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+}
+
+static void ref_spr_convert_dbl(const uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
+}
+
+static void ref_fix_convert(const uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
+{
+	/*
+	In S ROMs, a byte provides two pixels
+	For one fix tile, bytes are used like this: ([...] represents a pair of pixels)
+	[10][18][00][08]
+	[11][19][01][09]
+	[12][1A][02][0A]
+	[13][1B][03][0B]
+	[14][1C][04][0C]
+	[15][1D][05][0D]
+	[16][1E][06][0E]
+	[17][1F][07][0F]
+	The data read for a given tile line (8 pixels) is always the same
+	To take advantage of the SDRAM burst read feature, the data can be loaded so that all 8 pixels of a tile
+	line can be read sequentially: () are 16-bit words, [] is the 2-word burst read
+	[(10 18) (00 08)]
+	[(11 19) (01 09)]...
+
+	In:  FEDCBA9876543210
+	Out: FEDCBA9876510432
+	*/
+	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 2) & 7) | ((i & 1) << 3) | (((i & 2) << 3) ^ 0x10)];
+}
+
+static void ref_spr_bswap(void* buf, uint32_t size)
+{
+	uint8_t *p = (uint8_t*)buf;
+	for (uint32_t i = 0; i < size; i++) st32(p + i * 4, bswap_mid(ld32(p + i * 4)));
+}
+
+/*
+Per block the reorderings are plain interleaves:
+spr: out words 2k, 2k+1 = in words 16+k, k
+dbl: out dwords 2k, 2k+1 = in dwords 16+k, k with their halves swapped
+fix: out bytes 4r..4r+3 = in bytes 16+r, 24+r, r, 8+r
+*/
+
+void neogeo_spr_convert(const uint16_t *buf_in, uint16_t *buf_out, uint32_t size)
+{
+	uint32_t full = size & ~0x1F;
+
+	for (uint32_t b = 0; b < full; b += 32)
+	{
+		const uint16_t *in = buf_in + b;
+		uint16_t *out = buf_out + b;
+
+#ifdef __ARM_NEON
+		uint16x8x2_t lo = { { vld1q_u16(in + 16), vld1q_u16(in) } };
+		uint16x8x2_t hi = { { vld1q_u16(in + 24), vld1q_u16(in + 8) } };
+		vst2q_u16(out, lo);
+		vst2q_u16(out + 16, hi);
+#else
+		for (int k = 0; k < 16; k++) st32(out + k * 2, in[16 + k] | (in[k] << 16));
+#endif
+	}
+
+	if (full < size) ref_spr_convert(buf_in + full, buf_out + full, size - full);
+}
+
+void neogeo_spr_convert_dbl(const uint16_t *buf_in, uint16_t *buf_out, uint32_t size, int swap)
+{
+	uint32_t full = size & ~0x3F;
+
+#ifdef __ARM_NEON
+	// byte shuffle per dword: halves exchanged, middle bytes too with swap
+	static const uint8_t idx_rot[8] = { 2, 3, 0, 1, 6, 7, 4, 5 };
+	static const uint8_t idx_swap[8] = { 1, 3, 0, 2, 5, 7, 4, 6 };
+	const uint8x8_t idx = vld1_u8(swap ? idx_swap : idx_rot);
+#endif
+
+	for (uint32_t b = 0; b < full; b += 64)
+	{
+		const uint8_t *in = (const uint8_t*)(buf_in + b);
+		uint8_t *out = (uint8_t*)(buf_out + b);
+
+#ifdef __ARM_NEON
+		for (int k = 0; k < 64; k += 16)
+		{
+			uint8x16_t h = vld1q_u8(in + 64 + k);
+			uint8x16_t l = vld1q_u8(in + k);
+			h = vcombine_u8(vtbl1_u8(vget_low_u8(h), idx), vtbl1_u8(vget_high_u8(h), idx));
+			l = vcombine_u8(vtbl1_u8(vget_low_u8(l), idx), vtbl1_u8(vget_high_u8(l), idx));
+			uint32x4x2_t v = { { vreinterpretq_u32_u8(h), vreinterpretq_u32_u8(l) } };
+			vst2q_u32((uint32_t*)(out + k * 2), v);
+		}
+#else
+		for (int k = 0; k < 16; k++)
+		{
+			uint32_t h = ld32(in + 64 + k * 4);
+			uint32_t l = ld32(in + k * 4);
+			if (swap)
+			{
+				h = bswap_mid(h);
+				l = bswap_mid(l);
+			}
+			st32(out + k * 8, rot16(h));
+			st32(out + k * 8 + 4, rot16(l));
+		}
+#endif
+	}
+
+	if (full < size)
+	{
+		uint16_t tmp[64];
+		memcpy(tmp, buf_in + full, sizeof(tmp));
+		if (swap) ref_spr_bswap(tmp, 32);
+		ref_spr_convert_dbl(tmp, buf_out + full, size - full);
+	}
+}
+
+void neogeo_fix_convert(const uint8_t *buf_in, uint8_t *buf_out, uint32_t size)
+{
+	uint32_t full = size & ~0x1F;
+
+	for (uint32_t b = 0; b < full; b += 32)
+	{
+		const uint8_t *in = buf_in + b;
+		uint8_t *out = buf_out + b;
+
+#ifdef __ARM_NEON
+		uint8x16_t q0 = vld1q_u8(in);
+		uint8x16_t q1 = vld1q_u8(in + 16);
+		uint8x8x4_t v = { { vget_low_u8(q1), vget_high_u8(q1), vget_low_u8(q0), vget_high_u8(q0) } };
+		vst4_u8(out, v);
+#else
+		for (int r = 0; r < 8; r++) st32(out + r * 4, in[16 + r] | (in[24 + r] << 8) | (in[r] << 16) | (in[8 + r] << 24));
+#endif
+	}
+
+	if (full < size) ref_fix_convert(buf_in + full, buf_out + full, size - full);
+}
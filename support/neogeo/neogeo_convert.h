@@ -0,0 +1,21 @@
+#ifndef NEOGEO_CONVERT_H
+#define NEOGEO_CONVERT_H
+
+#include <stdint.h>
+
+// Graphics ROM reordering done while loading. The kernels work on whole
+// blocks (32 bytes for fix data, 64 bytes for spr, 128 bytes for dbl); a
+// partial last block reads up to the end of its block from buf_in.
+// Output and input are the same size and must not overlap.
+
+// C ROM words, 16-pixel tile lines in burst order.
+void neogeo_spr_convert(const uint16_t *buf_in, uint16_t *buf_out, uint32_t size);
+
+// Interleaved C ROM pairs (.neo files and index 15). swap first exchanges
+// the middle bytes of every 32-bit word, for byte swapped sets.
+void neogeo_spr_convert_dbl(const uint16_t *buf_in, uint16_t *buf_out, uint32_t size, int swap);
+
+// S ROM bytes, 8-pixel fix tile lines in burst order.
+void neogeo_fix_convert(const uint8_t *buf_in, uint8_t *buf_out, uint32_t size);
+
+#endif
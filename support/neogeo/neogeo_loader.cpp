@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <time.h>   // clock_gettime, CLOCK_REALTIME
 #include "neogeo_loader.h"
+#include "neogeo_convert.h"
 #include "neogeocd.h"
 #include "../../sxmlc.h"
 #include "../../user_io.h"
@@ -13,6 +14,8 @@
 #include "../../osd.h"
 #include "../../menu.h"
 #include "../../shmem.h"
+#include "../../offload.h"
+#include "../../hardware.h"
 
 struct NeoFile
 {
@@ -28,86 +31,6 @@ struct NeoFile
 	uint8_t Filler2[4096 - 512];	//fill to 4096
 };
 
-static inline void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
-{
-	/*
-	In C ROMs, a word provides two bitplanes for an 8-pixel wide line
-	They're used in pairs to provide 32 bits at once (all four bitplanes)
-	For one sprite tile, bytes are used like this: ([...] represents one 8-pixel wide line)
-	Even ROM					Odd ROM
-	[  40 41  ][  00 01  ]		[  42 43  ][  02 03  ]
-	[  44 45  ][  04 05  ]  	[  46 47  ][  06 07  ]
-	[  48 49  ][  08 09  ]  	[  4A 4B  ][  0A 0B  ]
-	[  4C 4D  ][  0C 0D  ]  	[  4E 4F  ][  0E 0F  ]
-	[  50 51  ][  10 11  ]  	[  52 53  ][  12 13  ]
-	...							...
-	The data read for a given tile line (16 pixels) is always the same, only the rendering order of the pixels can change
-	To take advantage of the SDRAM burst read feature, the data can be loaded so that all 16 pixels of a tile
-	line can be read sequentially: () are 16-bit words, [] is the 4-word burst read
-	[(40 41) (00 01) (42 43) (02 03)]
-	[(44 45) (04 05) (46 47) (06 07)]...
-	Word interleaving is done on the FPGA side to mix the two C ROMs data (even/odd)
-
-	In:  FEDCBA9876 54321 0
-	Out: FEDCBA9876 15432 0
-	*/
-
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
-
-	/*
-	0 <- 20
-	1 <- 21
-	2 <- 00
-	3 <- 01
-	4 <- 22
-	5 <- 23
-	6 <- 02
-	7 <- 03
-	...
-
-	00 -> 02
-	01 -> 03
-	02 -> 06
-	03 -> 07
-	...
-	*/
-}
-
-static inline void spr_convert_skp(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
-{
-	for (uint32_t i = 0; i < size; i++) buf_out[i << 1] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
-}
-
-static inline void spr_convert_dbl(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
-{
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
-}
-
-static void fix_convert(uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
-{
-	/*
-	In S ROMs, a byte provides two pixels
-	For one fix tile, bytes are used like this: ([...] represents a pair of pixels)
-	[10][18][00][08]
-	[11][19][01][09]
-	[12][1A][02][0A]
-	[13][1B][03][0B]
-	[14][1C][04][0C]
-	[15][1D][05][0D]
-	[16][1E][06][0E]
-	[17][1F][07][0F]
-	The data read for a given tile line (8 pixels) is always the same
-	To take advantage of the SDRAM burst read feature, the data can be loaded so that all 8 pixels of a tile
-	line can be read sequentially: () are 16-bit words, [] is the 2-word burst read
-	[(10 18) (00 08)]
-	[(11 19) (01 09)]...
-
-	In:  FEDCBA9876543210
-	Out: FEDCBA9876510432
-	*/
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 2) & 7) | ((i & 1) << 3) | (((i & 2) << 3) ^ 0x10)];
-}
-
 static const char *get_name(const char *path, const char *name)
 {
 	static char buf[1024];
@@ -176,11 +99,11 @@ static uint32_t neogeo_file_tx(const char* path, const char* name, uint8_t neo_f
 		}
 		else
 		{
-			if (neo_file_type == NEO_FILE_FIX) fix_convert(buf, buf_out, sizeof(buf_out));
+			if (neo_file_type == NEO_FILE_FIX) neogeo_fix_convert(buf, buf_out, sizeof(buf_out));
 			else if (neo_file_type == NEO_FILE_SPR)
 			{
-				if (index == 15) spr_convert_dbl((uint16_t*)buf, (uint16_t*)buf_out, sizeof(buf_out)/2);
-				else spr_convert((uint16_t*)buf, (uint16_t*)buf_out, sizeof(buf_out)/2);
+				if (index == 15) neogeo_spr_convert_dbl((uint16_t*)buf, (uint16_t*)buf_out, sizeof(buf_out)/2, 0);
+				else neogeo_spr_convert((uint16_t*)buf, (uint16_t*)buf_out, sizeof(buf_out)/2);
 			}
 
 			spi_write(buf_out, chunk, 1);
@@ -213,7 +136,186 @@ static void make_path(const char *root, const char *name, char *path)
 	strcat(path, name);
 }
 
-extern uint8_t loadbuf[];
+/*
+Loading to DDR runs as a pipeline over LOADBUF_SZ chunks: while chunk n is
+converted (half of it on an offload worker, half here) the next one is read
+from the file and the previous one is copied into the uncached DDR window,
+both on the workers. All conversion happens in cached buffers; DDR only sees
+one sequential copy per chunk.
+*/
+
+#define NEO_SLACK 128   // conversions read whole 128 byte blocks
+
+enum
+{
+	NEO_CONV_NONE = 0,
+	NEO_CONV_FIX,
+	NEO_CONV_SPR,
+	NEO_CONV_SPR_SWAP,
+	NEO_CONV_CROM
+};
+
+struct neo_pipe_t
+{
+	fileTYPE *f;
+	int conv;
+	int odd;        // CROM: fills the odd words, the other ROM of the pair the even ones
+	uint8_t pad;    // fills what the file doesn't cover
+	int error;
+
+	uint8_t *in[2];
+	uint8_t *out[2];
+
+	uint64_t read_us;
+	uint64_t write_us;
+};
+
+static uint8_t *pipe_buf = 0;
+
+static void pipe_read(neo_pipe_t *p, int idx, uint32_t in_size, uint32_t read_size)
+{
+	uint64_t t = time_us();
+	uint8_t *dst = p->in[idx];
+
+	int got = read_size ? FileReadAdv(p->f, dst, read_size) : 0;
+	if (got < 0) got = 0;
+	memset(dst + got, p->pad, in_size - got);
+	memset(dst + in_size, 0, NEO_SLACK);
+
+	p->read_us += time_us() - t;
+}
+
+static void pipe_convert(neo_pipe_t *p, int idx, uint32_t from, uint32_t to)
+{
+	const uint8_t *in = p->in[idx] + from;
+	uint8_t *out = p->out[idx] + from;
+
+	if (p->conv == NEO_CONV_FIX) neogeo_fix_convert(in, out, to - from);
+	else if (p->conv == NEO_CONV_CROM) neogeo_spr_convert((const uint16_t*)in, (uint16_t*)out, (to - from) / 2);
+	else neogeo_spr_convert_dbl((const uint16_t*)in, (uint16_t*)out, (to - from) / 2, p->conv == NEO_CONV_SPR_SWAP);
+}
+
+static void pipe_write(neo_pipe_t *p, int idx, uint32_t addr, uint32_t size)
+{
+	uint64_t t = time_us();
+
+	void *base = shmem_map(addr, size);
+	if (!base)
+	{
+		p->error = 1;
+		return;
+	}
+
+	if (p->conv == NEO_CONV_CROM)
+	{
+		const uint16_t *src = (const uint16_t*)p->out[idx];
+		uint16_t *dst = ((uint16_t*)base) + p->odd;
+		for (uint32_t i = 0; i < size / 4; i++) dst[i << 1] = src[i];
+	}
+	else
+	{
+		memcpy(base, p->conv == NEO_CONV_NONE ? p->in[idx] : p->out[idx], size);
+	}
+
+	shmem_unmap(base, size);
+	p->write_us += time_us() - t;
+}
+
+// Writes size bytes to DDR at map_addr. readsz limits the file data read per
+// chunk; the rest of a chunk is padded. CROM chunks take half their size
+// from the file. Returns 0 on error.
+static int pipe_load(neo_pipe_t *p, uint32_t map_addr, uint32_t size, uint32_t readsz, const char *dispname)
+{
+	if (!pipe_buf)
+	{
+		// kept for the following files of the set
+		pipe_buf = (uint8_t*)malloc((LOADBUF_SZ + NEO_SLACK) * 4);
+		if (!pipe_buf) return 0;
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		p->in[i] = pipe_buf + (LOADBUF_SZ + NEO_SLACK) * i;
+		p->out[i] = pipe_buf + (LOADBUF_SZ + NEO_SLACK) * (i + 2);
+	}
+
+	uint64_t start = time_us(), conv_us = 0;
+	const offload_handle_t none = { OFFLOAD_PRIO_NUM, 0 };
+	offload_handle_t read_h = none, write_h = none, conv_h = none;
+
+	uint32_t pos = 0;
+	uint32_t part = (size > LOADBUF_SZ) ? LOADBUF_SZ : size;
+	uint32_t in_size = (p->conv == NEO_CONV_CROM) ? part / 2 : part;
+	uint32_t read_size = (p->conv == NEO_CONV_CROM || readsz > part) ? in_size : readsz;
+	int cur = 0;
+
+	ProgressMessage();
+	pipe_read(p, cur, in_size, read_size);
+
+	while (pos < size)
+	{
+		uint32_t next = pos + part;
+		uint32_t next_part = 0, next_in = 0;
+
+		// without conversion the previous write still reads the other input buffer
+		if (p->conv == NEO_CONV_NONE) offload_wait(&write_h);
+
+		if (p->conv != NEO_CONV_NONE)
+		{
+			neo_pipe_t *pp = p;
+			int c = cur;
+			uint32_t mid = (in_size / 2) & ~(NEO_SLACK - 1);
+			offload_add_work([pp, c, mid]() { pipe_convert(pp, c, 0, mid); }, OFFLOAD_HIGH, &conv_h);
+		}
+
+		if (next < size)
+		{
+			next_part = (size - next > LOADBUF_SZ) ? LOADBUF_SZ : size - next;
+			next_in = (p->conv == NEO_CONV_CROM) ? next_part / 2 : next_part;
+			uint32_t next_read = (p->conv == NEO_CONV_CROM || readsz > next_part) ? next_in : readsz;
+
+			neo_pipe_t *pp = p;
+			int n = cur ^ 1;
+			offload_add_work([pp, n, next_in, next_read]() { pipe_read(pp, n, next_in, next_read); }, OFFLOAD_HIGH, &read_h);
+		}
+
+		if (p->conv != NEO_CONV_NONE)
+		{
+			uint64_t t = time_us();
+			pipe_convert(p, cur, (in_size / 2) & ~(NEO_SLACK - 1), in_size);
+			offload_wait(&conv_h);
+			conv_us += time_us() - t;
+		}
+
+		offload_wait(&write_h);
+		if (p->error) break;
+
+		{
+			neo_pipe_t *pp = p;
+			int c = cur;
+			uint32_t addr = map_addr + pos, len = part;
+			offload_add_work([pp, c, addr, len]() { pipe_write(pp, c, addr, len); }, OFFLOAD_HIGH, &write_h);
+		}
+
+		ProgressMessage("Loading", dispname, next, size);
+
+		offload_wait(&read_h);
+		pos = next;
+		part = next_part;
+		in_size = next_in;
+		cur ^= 1;
+	}
+
+	offload_wait(&write_h);
+	offload_wait(&read_h);
+	ProgressMessage();
+
+	printf("  %u KB in %llu ms (read %llu ms, convert %llu ms, write %llu ms)\n", size / 1024,
+		(time_us() - start) / 1000, p->read_us / 1000, conv_us / 1000, p->write_us / 1000);
+
+	return !p->error;
+}
+
 static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t index, uint32_t offset, uint32_t size)
 {
 	fileTYPE f = {};
@@ -235,43 +337,17 @@ static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t ind
 	const char *dispname = get_name(path, name);
 
 	// Put pairs of bitplanes in the correct order for the core
-
-	uint32_t remain = size;
 	uint32_t map_addr = 0x38000000 + (((index - 64) >> 1) * 1024 * 1024);
 
-	ProgressMessage();
-	while (remain)
-	{
-		uint32_t partsz = remain;
-		if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
-
-		//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
-		void *base = shmem_map(map_addr, partsz);
-		if (!base)
-		{
-			FileClose(&f);
-			return 0;
-		}
-
-		FileReadAdv(&f, loadbuf, partsz/2);
-		spr_convert_skp((uint16_t*)loadbuf, ((uint16_t*)base) + ((index ^ 1) & 1), partsz / 4);
-
-		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
-
-		shmem_unmap(base, partsz);
-		remain -= partsz;
-		map_addr += partsz;
-	}
+	neo_pipe_t p = {};
+	p.f = &f;
+	p.conv = NEO_CONV_CROM;
+	p.odd = (index ^ 1) & 1;
 
+	int ok = pipe_load(&p, map_addr, size, 0, dispname);
 	FileClose(&f);
-	ProgressMessage();
 
-	return map_addr - 0x38000000;
-}
-
-static inline void spr_bswap(uint32_t* buf, uint32_t size)
-{
-	for (uint32_t i = 0; i < size; i++) buf[i] = (buf[i] & 0xFF0000FF) | ((buf[i] & 0xFF00) << 8) | ((buf[i] & 0xFF0000) >> 8);
+	return ok ? map_addr + size - 0x38000000 : 0;
 }
 
 static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_file_type, uint8_t index, uint32_t offset, uint32_t size, uint32_t expand, int swap, uint32_t addr)
@@ -292,60 +368,23 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 	printf("ROM %s (offset %u, size %u, exp %u, type %u, addr %u) with index %u\n", name, offset, size, expand, neo_file_type, addr, index);
 	const char *dispname = get_name(path, name);
 
-	uint32_t remainf = size;
+	// every chunk reads up to the original size, the file end pads the expansion
+	uint32_t readsz = size;
 
 	if(expand) size = expand;
-	uint32_t remain = size;
 
 	uint32_t map_addr = 0x30000000 + (addr ? (addr + 0x8000000) : ((index >= 16) && (index < 64)) ? (index - 16) * 0x80000 : (index == 9) ? 0x2000000 : 0x8000000);
 
-	ProgressMessage();
-	while (remain)
-	{
-		uint32_t partsz = remain;
-		if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
-
-		uint32_t partszf = remainf;
-		if (partszf > LOADBUF_SZ) partszf = LOADBUF_SZ;
-
-		//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
-		void *base = shmem_map(map_addr, partsz);
-		if (!base)
-		{
-			FileClose(&f);
-			return 0;
-		}
-
-		if (neo_file_type == NEO_FILE_FIX)
-		{
-			memset(loadbuf, 0, partsz);
-			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			fix_convert(loadbuf, (uint8_t*)base, partsz);
-		}
-		else if (neo_file_type == NEO_FILE_SPR)
-		{
-			memset(loadbuf, 0, partsz);
-			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			if (swap) spr_bswap((uint32_t*)loadbuf, partsz / 4);
-			spr_convert_dbl((uint16_t*)loadbuf, (uint16_t*)base, partsz / 2);
-		}
-		else
-		{
-			memset(base, ((index>=16) && (index<64)) ? 8 : 0, partsz);
-			if (partszf) FileReadAdv(&f, base, partszf);
-		}
-
-		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
-
-		shmem_unmap(base, partsz);
-		remain -= partsz;
-		map_addr += partsz;
-	}
+	neo_pipe_t p = {};
+	p.f = &f;
+	if (neo_file_type == NEO_FILE_FIX) p.conv = NEO_CONV_FIX;
+	else if (neo_file_type == NEO_FILE_SPR) p.conv = swap ? NEO_CONV_SPR_SWAP : NEO_CONV_SPR;
+	else p.pad = ((index >= 16) && (index < 64)) ? 8 : 0;
 
+	int ok = pipe_load(&p, map_addr, size, readsz, dispname);
 	FileClose(&f);
-	ProgressMessage();
 
-	return size;
+	return ok ? size : 0;
 }
 
 static uint32_t crom_sz_max = 0;
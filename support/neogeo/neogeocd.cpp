@@ -7,6 +7,7 @@
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../spi.h"
+#include "../../scheduler.h"
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "../../cheats.h"
@@ -56,6 +57,7 @@ void neocd_poll()
 	if (req != last_req)
 	{
 		last_req = req;
+		scheduler_activity();
 
 		spi_w(NEOCD_GET_CMD);
 
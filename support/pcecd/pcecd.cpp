@@ -7,6 +7,7 @@
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../spi.h"
+#include "../../scheduler.h"
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "pcecd.h"
@@ -52,6 +53,7 @@ void pcecd_poll()
 	if (req != last_req)
 	{
 		last_req = req;
+		scheduler_activity();
 
 		uint16_t data_in[7];
 		data_in[0] = spi_w(0);
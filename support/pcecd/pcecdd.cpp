@@ -6,8 +6,10 @@
 
 #include "../../file_io.h"
 #include "../../user_io.h"
+#include "../../scheduler.h"
 
 #include "../chd/mister_chd.h"
+#include "../../cd_sector.h"
 #include "pcecd.h"
 
 #define PCECD_DATA_IO_INDEX 2
@@ -263,14 +265,6 @@ int pcecdd_t::Load(const char *filename)
 		if (LoadCUE(filename)) return -1;
 	} else if (!strncasecmp(".chd", ext, 4)) {
 		mister_load_chd(filename, &this->toc);
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
 	} else {
 		return -1;
 	}
@@ -305,14 +299,8 @@ void pcecdd_t::Unload()
 	{
 		if (this->toc.chd_f)
 		{
-			chd_close(this->toc.chd_f);
+			mister_chd_close(this->toc.chd_f);
 			this->toc.chd_f = NULL;
-			if (this->chd_hunkbuf)
-			{
-				free(this->chd_hunkbuf);
-				this->chd_hunkbuf = NULL;
-				this->chd_hunknum = -1;
-			}
 		} else {
 			for (int i = 0; i < this->toc.last; i++)
 			{
@@ -863,6 +851,7 @@ void pcecdd_t::PendStatus(uint16_t status) {
 
 void pcecdd_t::SendStatus(uint16_t status) {
 
+	scheduler_activity();
 	spi_uio_cmd_cont(UIO_CD_SET);
 	spi_w(status);
 	spi_w(region ? 2 : 0);
@@ -873,6 +862,7 @@ void pcecdd_t::SendStatus(uint16_t status) {
 
 void pcecdd_t::SendDataRequest() {
 
+	scheduler_activity();
 	spi_uio_cmd_cont(UIO_CD_SET);
 	spi_w(0);
 	spi_w((region ? 2 : 0) | 1);
@@ -917,7 +907,7 @@ void pcecdd_t::ReadData(uint8_t *buf)
 				s_offset += 16;
 			}
 
-			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, s_offset, 2048, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, s_offset, 2048, buf);
 		} else {
 			if (this->toc.tracks[this->index].sector_size == 2048)
 			{
@@ -938,13 +928,8 @@ int pcecdd_t::ReadCDDA(uint8_t *buf)
 
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, 0, this->audioLength, buf, this->chd_hunkbuf, &this->chd_hunknum);
-		for (int swapidx = 0; swapidx < this->audioLength; swapidx += 2)
-		{
-			uint8_t temp = buf[swapidx];
-			buf[swapidx] = buf[swapidx+1];
-			buf[swapidx+1] = temp;
-		}
+		mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, 0, this->audioLength, buf);
+		cd_sector_swap16(buf, this->audioLength);
 	} else if (this->toc.tracks[this->index].f.opened()) {
 		FileReadAdv(&this->toc.tracks[this->index].f, buf, this->audioLength);
 	}
@@ -12,12 +12,11 @@
 #include "psx.h"
 #include "mcdheader.h"
 #include "../../cd.h"
+#include "../../cd_sector.h"
 #include "../chd/mister_chd.h"
 #include <libchdr/chd.h>
 
 static char buf[1024];
-static uint8_t *chd_hunkbuf = NULL;
-static int chd_hunknum;
 static int noreset = 0;
 
 static int sgets(char *out, int sz, char **in)
@@ -107,11 +106,9 @@ static void unload_chd(toc_t *table)
 {
 	if (table->chd_f)
 	{
-		chd_close(table->chd_f);
+		mister_chd_close(table->chd_f);
 	}
-	if (chd_hunkbuf) free(chd_hunkbuf);
 	memset(table, 0, sizeof(toc_t));
-	chd_hunknum = -1;
 
 }
 
@@ -155,9 +152,6 @@ static int load_chd(const char *filename, toc_t *table)
 
 	table->end = table->tracks[table->last - 1].end + 1;
 
-	chd_hunkbuf = (uint8_t *)malloc(table->chd_hunksize);
-	chd_hunknum = -1;
-
 	return 1;
 }
 
@@ -516,16 +510,11 @@ void psx_read_cd(uint8_t *buffer, int lba, int cnt)
 
 							// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
 							int read_lba = lba - toc.tracks[0].indexes[1];
-							if (mister_chd_read_sector(toc.chd_f, (read_lba + toc.tracks[i].offset), 0, 0, CD_SECTOR_LEN, buffer, chd_hunkbuf, &chd_hunknum) == CHDERR_NONE)
+							if (mister_chd_read_sector(toc.chd_f, (read_lba + toc.tracks[i].offset), 0, 0, CD_SECTOR_LEN, buffer) == CHDERR_NONE)
 							{
 								if (!toc.tracks[i].type) //CHD requires byteswap of audio data
 								{
-									for (int swapidx = 0; swapidx < CD_SECTOR_LEN; swapidx += 2)
-									{
-										uint8_t temp = buffer[swapidx];
-										buffer[swapidx] = buffer[swapidx + 1];
-										buffer[swapidx + 1] = temp;
-									}
+									cd_sector_swap16(buffer, CD_SECTOR_LEN);
 								}
 							}
 							else {
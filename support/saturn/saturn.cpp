@@ -6,6 +6,7 @@
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../spi.h"
+#include "../../scheduler.h"
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "../../cheats.h"
@@ -54,6 +55,7 @@ void saturn_poll()
 		if (req != last_req)
 		{
 			last_req = req;
+			scheduler_activity();
 
 			for (int i = 0; i < 6; i++) data_in[i] = spi_w(0);
 			DisableIO();
@@ -86,8 +86,6 @@ private:
 	uint8_t cd_buf[4096 + 2];
 	int audioLength;
 	int audioFirst;
-	int chd_hunknum;
-	uint8_t *chd_hunkbuf;
 	int chd_audio_read_lba;
 
 
@@ -100,8 +98,6 @@ private:
 	int CheckCommand(uint8_t* cmd);
 	void ReadData(uint8_t *buf);
 	int ReadCDDA(uint8_t *buf, int first);
-	void MakeSecureRingData(uint8_t *buf);
-	uint32_t DataSectorCalcCRC(uint8_t* buf, int len);
 	int DataSectorSend(uint8_t* header, int speed);
 	int AudioSectorSend(int first);
 	int RingDataSend(uint8_t* header, int speed);
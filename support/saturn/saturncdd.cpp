@@ -7,6 +7,7 @@
 #include "saturn.h"
 #include "../../shmem.h"
 #include "../chd/mister_chd.h"
+#include "../../cd_sector.h"
 
 #define SHMEM_ADDR  0x31000000
 
@@ -28,8 +29,6 @@ satcdd_t::satcdd_t() {
 	speed = 0;
 	audioLength = 0;
 	audioFirst = 0;
-	chd_hunkbuf = NULL;
-	chd_hunknum = -1;
 	SendData = NULL;
 
 	stat[0] = SATURN_STAT_OPEN;
@@ -335,14 +334,6 @@ int satcdd_t::Load(const char *filename)
 			printf("ERROR %s\n", chd_error_string(err));
 			return -1;
 		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
 		if (this->toc.tracks[0].sector_size)
 		{
 			this->sectorSize = this->toc.tracks[0].sector_size;
@@ -355,7 +346,7 @@ int satcdd_t::Load(const char *filename)
 
 	/*if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header);
 	}
 	else {
 		fd_img = &this->toc.tracks[0].f;
@@ -400,13 +391,7 @@ void satcdd_t::Unload()
 	{
 		if (this->toc.chd_f)
 		{
-			chd_close(this->toc.chd_f);
-		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
+			mister_chd_close(this->toc.chd_f);
 		}
 
 		for (int i = 0; i < this->toc.last; i++)
@@ -441,7 +426,7 @@ int satcdd_t::GetBootHeader(uint8_t *buf) {
 
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, offset, 256, buf, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, offset, 256, buf);
 	}
 	else 
 	{
@@ -1144,49 +1129,6 @@ int satcdd_t::SetCommand(uint8_t* data) {
 	return 0;
 }
 
-void satcdd_t::MakeSecureRingData(uint8_t *buf) {
-	int i, j;
-	uint16_t lfsr = 1;
-	uint8_t a;
-	for (i = 12; i < 2348; i++)
-	{
-		a = (i & 1) ? 0x59 : 0xa8;
-		for (j = 0; j < 8; j++)
-		{
-			a ^= (lfsr & 1);
-			a = (a >> 1) | (a << (7));
-
-			uint16_t x = (lfsr >> 1) ^ lfsr;
-			lfsr |= x << 15;
-			lfsr >>= 1;
-		}
-		buf[i] = a;
-	}
-}
-
-uint32_t satcdd_t::DataSectorCalcCRC(uint8_t* buf, int len)
-{
-	static uint32_t crc_tab[256];
-	for (int i = 0; i < 256; i++)
-	{
-		uint32_t c = i;
-
-		for (unsigned j = 0; j < 8; j++)
-			c = (c >> 1) ^ ((c & 0x1) ? 0xD8018001 : 0);
-
-		crc_tab[i] = c;
-	}
-
-	uint32_t crc = 0;
-	for (int i = 0; i < len; i++)
-	{
-		crc ^= buf[i];
-		crc = (crc >> 8) ^ crc_tab[crc & 0xFF];
-	}
-
-	return crc;
-}
-
 void satcdd_t::ReadData(uint8_t *buf)
 {
 	int offs = 0; 
@@ -1202,7 +1144,7 @@ void satcdd_t::ReadData(uint8_t *buf)
 				read_offset += 16;
 			}
 
-			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->toc.tracks[this->track].sector_size, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->toc.tracks[this->track].sector_size, buf);
 		}
 		else {
 			if (this->toc.tracks[this->track].sector_size == 2048)
@@ -1234,15 +1176,10 @@ int satcdd_t::ReadCDDA(uint8_t *buf, int first)
 	{
 		for (int i = sec_offs; i < 2; i++, dest += 4096)
 		{
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->track].offset + i, 0, 0, 2352, dest, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->track].offset + i, 0, 0, 2352, dest);
 
-			//CHD audio requires byteswap. There's probably a better way to do this...
-			for (int swapidx = 0; swapidx < 2352; swapidx += 2)
-			{
-				uint8_t temp = dest[swapidx];
-				dest[swapidx] = dest[swapidx + 1];
-				dest[swapidx + 1] = temp;
-			}
+			//CHD audio requires byteswap
+			cd_sector_swap16(dest, 2352);
 		}
 
 		/*if ((len / 2352) > 1)
@@ -1272,31 +1209,35 @@ int satcdd_t::DataSectorSend(uint8_t* header, int speed)
 {
 	static int buf_num_read = 0, buf_num_write = 0;
 
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
-	uint8_t *data_ptr = shmem_ptr + (buf_num_write * 4096);
+	// the sector is built in cached memory; shared memory is uncached
+	static uint8_t sector[2352];
 
-	ReadData(data_ptr);
+	ReadData(sector);
 	if (header) {
-		memcpy(data_ptr, header, 16);
+		memcpy(sector, header, 16);
 	}
-	uint8_t sec_mode = data_ptr[15];
+	uint8_t sec_mode = sector[15];
 
-	uint32_t crc = DataSectorCalcCRC(data_ptr, (sec_mode == 2 ? 2348 : 2064));
 	if (sec_mode == 0x02) {
-		/*data_ptr[2348] = crc >> 0;
-		data_ptr[2349] = crc >> 8;
-		data_ptr[2350] = crc >> 16;
-		data_ptr[2351] = crc >> 24;*/
+		/*uint32_t crc = cd_sector_edc(0, sector, 2348);
+		sector[2348] = crc >> 0;
+		sector[2349] = crc >> 8;
+		sector[2350] = crc >> 16;
+		sector[2351] = crc >> 24;*/
 	}
 	else {
-		data_ptr[2064] = crc >> 0;
-		data_ptr[2065] = crc >> 8;
-		data_ptr[2066] = crc >> 16;
-		data_ptr[2067] = crc >> 24;
-		memset(data_ptr + 2068, 0, 2352 - 2068);
+		uint32_t crc = cd_sector_edc(0, sector, 2064);
+		sector[2064] = crc >> 0;
+		sector[2065] = crc >> 8;
+		sector[2066] = crc >> 16;
+		sector[2067] = crc >> 24;
+		memset(sector + 2068, 0, 2352 - 2068);
 	}
 
-	int boot = (data_ptr[12] == 0x00 && data_ptr[13] == 0x02 && data_ptr[14] == 0x00 && data_ptr[15] == 0x01);
+	int boot = (sector[12] == 0x00 && sector[13] == 0x02 && sector[14] == 0x00 && sector[15] == 0x01);
+
+	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
+	memcpy(shmem_ptr + (buf_num_write * 4096), sector, sizeof(sector));
 	shmem_unmap(shmem_ptr, 4096 * 4);
 
 
@@ -1319,7 +1260,7 @@ int satcdd_t::RingDataSend(uint8_t* header, int speed)
 	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
 	uint8_t *data_ptr = shmem_ptr;
 	if (header) {
-		MakeSecureRingData(data_ptr);
+		cd_sector_ring_data(data_ptr);
 		memcpy(data_ptr + 12, header, 12);
 		memset(data_ptr + 2348, 0, 4);
 	}
@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../../file_io.h"
+#include "../../offload.h"
+#include "../../hardware.h"
+#include "msu_stream.h"
+
+#define MSU_SECTOR  1024
+#define MSU_WINDOW  16384  // ring read size
+#define MSU_SLOTS   12
+#define MSU_DEPTH   8      // windows kept ahead of the core, about 0.7s of audio
+#define MSU_PRELOAD 32768  // read at the start and at the loop point of an opened track
+#define MSU_TRACKS  4      // the current track, its neighbours and the previous one
+
+enum
+{
+	MSU_FREE = 0,
+	MSU_PENDING,   // queued on the offload workers
+	MSU_READY
+};
+
+struct msu_track_t
+{
+	int state;
+	uint32_t track;
+	char path[1024];
+	uint64_t used;
+	offload_handle_t handle;
+
+	// written by the worker
+	int fd;
+	int err;
+	uint64_t size;
+	int32_t head_len;
+	int32_t loop_len;
+	uint64_t loop_off;
+	uint8_t head[MSU_PRELOAD];
+	uint8_t loop[MSU_PRELOAD];
+};
+
+struct msu_slot_t
+{
+	uint64_t off;
+	int fd;          // descriptor the read uses
+	int32_t result;  // written by the worker
+	uint32_t gen;
+	int state;
+	int used;
+	offload_handle_t handle;
+	uint8_t data[MSU_WINDOW];
+};
+
+static msu_track_t tracks[MSU_TRACKS] = {};
+static msu_slot_t slots[MSU_SLOTS] = {};
+static msu_track_t *cur = NULL;
+static fileTYPE f_direct = {};  // tracks that can only be opened through file_io (zip)
+static char base_path[1024] = {};
+static uint64_t pos = 0;
+static uint32_t gen = 0;
+static uint64_t use_count = 0;
+static int seeked = 0;
+
+static struct
+{
+	uint64_t reads;
+	uint64_t hits;        // served from memory
+	uint64_t waits;       // window was still in flight
+	uint64_t misses;      // read on the main loop
+	uint64_t wait_us;
+	uint64_t wait_max_us;
+	uint64_t miss_us;
+	uint64_t miss_max_us;
+	uint64_t selects;
+	uint64_t select_hits; // track was open already
+	uint64_t select_waits;
+	uint64_t select_us;
+	uint64_t select_max_us;
+	uint64_t seeks;
+	uint64_t seek_stalls;
+	uint64_t prefetched;
+	uint64_t wasted;
+	uint64_t opened;
+} stats;
+
+// runs on a worker
+static void open_track(msu_track_t *t)
+{
+	t->fd = open(t->path, O_RDONLY | O_CLOEXEC);
+	if (t->fd < 0)
+	{
+		t->err = errno;
+		return;
+	}
+
+	struct stat64 st;
+	t->size = fstat64(t->fd, &st) ? 0 : st.st_size;
+
+	t->head_len = pread(t->fd, t->head, MSU_PRELOAD, 0);
+	if (t->head_len < 0) t->head_len = 0;
+
+	// "MSU1" header followed by the loop point in 4 byte samples
+	if (t->head_len >= 8 && !memcmp(t->head, "MSU1", 4))
+	{
+		uint32_t loop;
+		memcpy(&loop, t->head + 4, sizeof(loop));
+
+		uint64_t off = (8 + (uint64_t)loop * 4) & ~(uint64_t)(MSU_SECTOR - 1);
+		if (off >= (uint64_t)t->head_len && off < t->size)
+		{
+			t->loop_off = off;
+			t->loop_len = pread(t->fd, t->loop, MSU_PRELOAD, off);
+			if (t->loop_len < 0) t->loop_len = 0;
+		}
+	}
+}
+
+static void reap()
+{
+	for (int i = 0; i < MSU_TRACKS; i++)
+	{
+		msu_track_t *t = &tracks[i];
+		if (t->state == MSU_PENDING && offload_done(&t->handle)) t->state = MSU_READY;
+	}
+
+	for (int i = 0; i < MSU_SLOTS; i++)
+	{
+		msu_slot_t *s = &slots[i];
+		if (s->state == MSU_PENDING && offload_done(&s->handle)) s->state = MSU_READY;
+	}
+}
+
+// ring reads may still use the descriptor of a track that was switched away
+// from; waits for those on fd, or for all of them with -1
+static void wait_slots(int fd)
+{
+	for (int i = 0; i < MSU_SLOTS; i++)
+	{
+		msu_slot_t *s = &slots[i];
+		if (s->state == MSU_PENDING && (fd < 0 || s->fd == fd))
+		{
+			offload_wait(&s->handle);
+			s->state = MSU_READY;
+		}
+	}
+}
+
+static void close_track(msu_track_t *t)
+{
+	if (t->state == MSU_PENDING) offload_wait(&t->handle);
+	if (t->state != MSU_FREE && t->fd >= 0)
+	{
+		wait_slots(t->fd);
+		close(t->fd);
+	}
+
+	t->fd = -1;
+	t->state = MSU_FREE;
+}
+
+static msu_track_t *find_track(uint32_t track)
+{
+	for (int i = 0; i < MSU_TRACKS; i++)
+	{
+		if (tracks[i].state != MSU_FREE && tracks[i].track == track) return &tracks[i];
+	}
+	return NULL;
+}
+
+// queues the open of a track unless it is open already; NULL if no entry is free
+static msu_track_t *queue_track(uint32_t track)
+{
+	msu_track_t *t = find_track(track);
+	if (t) return t;
+
+	for (int i = 0; i < MSU_TRACKS; i++)
+	{
+		msu_track_t *e = &tracks[i];
+		if (e == cur || e->state == MSU_PENDING) continue;
+		if (e->state == MSU_FREE)
+		{
+			t = e;
+			break;
+		}
+		if (!t || e->used < t->used) t = e;
+	}
+
+	if (!t) return NULL;
+	close_track(t);
+
+	char name[1024];
+	snprintf(name, sizeof(name), "%s-%d.pcm", base_path, track);
+	snprintf(t->path, sizeof(t->path), "%s", getFullPath(name));
+
+	t->track = track;
+	t->fd = -1;
+	t->err = 0;
+	t->size = 0;
+	t->head_len = 0;
+	t->loop_len = 0;
+	t->loop_off = 0;
+	t->used = ++use_count;
+	t->state = MSU_PENDING;
+
+	if (!offload_try_add([t]() { open_track(t); }, OFFLOAD_HIGH, &t->handle))
+	{
+		t->state = MSU_FREE;
+		return NULL;
+	}
+
+	stats.opened++;
+	return t;
+}
+
+static msu_slot_t *find_slot(uint64_t off)
+{
+	for (int i = 0; i < MSU_SLOTS; i++)
+	{
+		msu_slot_t *s = &slots[i];
+		if (s->state != MSU_FREE && s->gen == gen && s->off <= off && off < s->off + MSU_WINDOW) return s;
+	}
+	return NULL;
+}
+
+// a slot can be recycled once it is stale or outside of the windows ahead of the core
+static msu_slot_t *get_slot(uint64_t lo, uint64_t hi)
+{
+	for (int i = 0; i < MSU_SLOTS; i++)
+	{
+		msu_slot_t *s = &slots[i];
+		if (s->state == MSU_PENDING) continue;
+		if (s->state == MSU_FREE) return s;
+		if (s->gen != gen || s->off + MSU_WINDOW <= lo || s->off >= hi)
+		{
+			if (!s->used && s->gen == gen) stats.wasted++;
+			s->state = MSU_FREE;
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static int preloaded(uint64_t off, uint32_t len)
+{
+	if (off + len <= (uint64_t)cur->head_len) return 1;
+	return cur->loop_len > 0 && off >= cur->loop_off && off + len <= cur->loop_off + cur->loop_len;
+}
+
+static void prefetch()
+{
+	uint64_t lo = pos & ~(uint64_t)(MSU_WINDOW - 1);
+	uint64_t hi = lo + (uint64_t)MSU_DEPTH * MSU_WINDOW;
+
+	for (uint64_t off = lo; off < hi && off < cur->size; off += MSU_WINDOW)
+	{
+		if (find_slot(off) || preloaded(off, MSU_WINDOW)) continue;
+
+		msu_slot_t *s = get_slot(lo, hi);
+		if (!s) break;
+
+		s->off = off;
+		s->fd = cur->fd;
+		s->gen = gen;
+		s->result = 0;
+		s->used = 0;
+		s->state = MSU_PENDING;
+
+		if (!offload_try_add([s]() { s->result = pread(s->fd, s->data, MSU_WINDOW, s->off); }, OFFLOAD_HIGH, &s->handle))
+		{
+			s->state = MSU_FREE;
+			break;
+		}
+		stats.prefetched++;
+	}
+}
+
+void msu_stream_reset(const char *base)
+{
+	wait_slots(-1);
+	for (int i = 0; i < MSU_TRACKS; i++) close_track(&tracks[i]);
+	for (int i = 0; i < MSU_SLOTS; i++) slots[i].state = MSU_FREE;
+
+	FileClose(&f_direct);
+	snprintf(base_path, sizeof(base_path), "%s", base);
+	cur = NULL;
+	pos = 0;
+	gen++;
+}
+
+uint64_t msu_stream_select(uint32_t track)
+{
+	uint64_t t0 = time_us();
+
+	stats.selects++;
+	FileClose(&f_direct);
+	cur = NULL;
+	pos = 0;
+	seeked = 0;
+	gen++;
+
+	reap();
+	msu_track_t *t = find_track(track);
+	if (t && t->state == MSU_READY) stats.select_hits++;
+	else if (t) stats.select_waits++;
+	else t = queue_track(track);
+
+	if (t)
+	{
+		if (t->state == MSU_PENDING)
+		{
+			offload_wait(&t->handle);
+			t->state = MSU_READY;
+		}
+		t->used = ++use_count;
+		if (t->fd >= 0) cur = t;
+	}
+
+	uint64_t size = 0;
+	if (cur)
+	{
+		size = cur->size;
+	}
+	else if (!t || t->err != ENOENT)
+	{
+		// zip archives and the like go through file_io
+		char name[1024];
+		snprintf(name, sizeof(name), "%s-%d.pcm", base_path, track);
+		if (FileOpen(&f_direct, name)) size = f_direct.size;
+	}
+
+	uint64_t t1 = time_us() - t0;
+	stats.select_us += t1;
+	if (t1 > stats.select_max_us) stats.select_max_us = t1;
+
+	// likely next: the neighbours of this track
+	queue_track(track + 1);
+	if (track) queue_track(track - 1);
+
+	if (cur) prefetch();
+	return size;
+}
+
+void msu_stream_seek(uint64_t off)
+{
+	stats.seeks++;
+	pos = off;
+	seeked = 1;
+
+	if (cur) prefetch();
+	else if (f_direct.opened()) FileSeek(&f_direct, off, SEEK_SET);
+}
+
+void msu_stream_read(uint8_t *buf, uint32_t len)
+{
+	memset(buf, 0, len);
+
+	if (!cur)
+	{
+		if (f_direct.size) FileReadAdv(&f_direct, buf, len);
+		return;
+	}
+
+	stats.reads++;
+	reap();
+
+	uint64_t t0 = time_us();
+	int waited = 0;
+	int missed = 0;
+
+	uint32_t n = (pos >= cur->size) ? 0 : (cur->size - pos < len) ? (uint32_t)(cur->size - pos) : len;
+	uint32_t done = 0;
+	while (done < n)
+	{
+		uint64_t off = pos + done;
+		const uint8_t *src = NULL;
+		uint64_t avail = 0;
+
+		if (off < (uint64_t)cur->head_len)
+		{
+			src = cur->head + off;
+			avail = cur->head_len - off;
+		}
+		else if (cur->loop_len > 0 && off >= cur->loop_off && off < cur->loop_off + cur->loop_len)
+		{
+			src = cur->loop + (off - cur->loop_off);
+			avail = cur->loop_off + cur->loop_len - off;
+		}
+		else
+		{
+			msu_slot_t *s = find_slot(off);
+			if (s && s->state == MSU_PENDING)
+			{
+				offload_wait(&s->handle);
+				s->state = MSU_READY;
+				waited = 1;
+			}
+
+			if (s && s->result > 0 && off < s->off + s->result)
+			{
+				src = s->data + (off - s->off);
+				avail = s->off + s->result - off;
+				s->used = 1;
+			}
+		}
+
+		if (!src)
+		{
+			int res = pread(cur->fd, buf + done, n - done, off);
+			missed = 1;
+			if (res <= 0) break;
+			done += res;
+			continue;
+		}
+
+		uint32_t c = (avail < n - done) ? (uint32_t)avail : n - done;
+		memcpy(buf + done, src, c);
+		done += c;
+	}
+
+	pos += done;
+
+	uint64_t t = time_us() - t0;
+	if (missed)
+	{
+		stats.misses++;
+		stats.miss_us += t;
+		if (t > stats.miss_max_us) stats.miss_max_us = t;
+	}
+	else if (waited)
+	{
+		stats.waits++;
+		stats.wait_us += t;
+		if (t > stats.wait_max_us) stats.wait_max_us = t;
+	}
+	else
+	{
+		stats.hits++;
+	}
+
+	if (seeked && (missed || waited)) stats.seek_stalls++;
+	seeked = 0;
+
+	prefetch();
+}
+
+void msu_stream_print_stats()
+{
+	printf("msu: %llu sectors, %llu from memory, %llu waited (avg/max %llu/%llu us), %llu read directly (avg/max %llu/%llu us)\n",
+		stats.reads, stats.hits,
+		stats.waits, stats.waits ? stats.wait_us / stats.waits : 0, stats.wait_max_us,
+		stats.misses, stats.misses ? stats.miss_us / stats.misses : 0, stats.miss_max_us);
+	printf("msu: %llu track changes, %llu pre-opened, %llu waited, avg/max %llu/%llu us; %llu seeks, %llu stalled\n",
+		stats.selects, stats.select_hits, stats.select_waits,
+		stats.selects ? stats.select_us / stats.selects : 0, stats.select_max_us,
+		stats.seeks, stats.seek_stalls);
+	printf("msu: %llu tracks opened, %llu windows prefetched, %llu unused\n",
+		stats.opened, stats.prefetched, stats.wasted);
+}
@@ -0,0 +1,25 @@
+#ifndef MSU_STREAM_H
+#define MSU_STREAM_H
+
+#include <stdint.h>
+
+// MSU-1 audio streaming for snes_poll(). The selected .pcm track is read
+// ahead into a ring of windows on the offload workers. The tracks next to it
+// are opened in the background together with their first sectors and the
+// sectors at their loop point, so track changes and loops are served from
+// memory.
+
+// Closes all tracks; base is the rom path without extension.
+void msu_stream_reset(const char *base);
+
+// Selects <base>-<track>.pcm. Returns its size, 0 if there is no such track.
+uint64_t msu_stream_select(uint32_t track);
+
+void msu_stream_seek(uint64_t off);
+
+// Next len bytes of the track; the part past its end is zero filled.
+void msu_stream_read(uint8_t *buf, uint32_t len);
+
+void msu_stream_print_stats();
+
+#endif
@@ -9,6 +9,8 @@
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../spi.h"
+#include "../../scheduler.h"
+#include "msu_stream.h"
 
 static uint8_t hdr[512];
 
@@ -392,7 +394,6 @@ static char snes_romFileName[1024] = {};
 static char SelectedPath[1024] = {};
 static uint8_t buf[1024];
 static char has_cd = 0;
-static fileTYPE f_audio = {};
 
 static void msu_send_command(uint64_t cmd)
 {
@@ -403,12 +404,11 @@ static void msu_send_command(uint64_t cmd)
 	DisableIO();
 }
 
-static int msu_send_data(fileTYPE *f, int idx)
+static int msu_send_data(int idx)
 {
 	int chunk = sizeof(buf);
 
-	memset(buf, 0, chunk);
-	if (f->size) FileReadAdv(f, buf, chunk);
+	msu_stream_read(buf, chunk);
 
 	user_io_set_index(idx);
 	user_io_set_download(1);
@@ -421,12 +421,12 @@ static int msu_send_data(fileTYPE *f, int idx)
 void snes_msu_init(const char* name)
 {
 	static fileTYPE f = {};
-	FileClose(&f_audio);
 
 	memset(snes_romFileName, 0, 1024);
 	int extSize = strlen(strrchr(name, '.'));
 	strncpy(snes_romFileName, name, strlen(name) - extSize);
 	printf("MSU: Rom named '%s' initialised\n", name);
+	msu_stream_reset(snes_romFileName);
 
 	snprintf(SelectedPath, sizeof(SelectedPath), "%s.msu", snes_romFileName);
 	has_cd = FileOpen(&f, SelectedPath) ? 1 : 0;
@@ -454,6 +454,7 @@ void snes_poll(void)
 	if (req != last_req)
 	{
 		last_req = req;
+		scheduler_activity();
 
 		uint16_t command = spi_w(0);
 		uint32_t data = spi_w(0);
@@ -467,21 +468,23 @@ void snes_poll(void)
 			break;
 
 		case 0x35:
+		{
 			snprintf(SelectedPath, sizeof(SelectedPath), "%s-%d.pcm", snes_romFileName, data);
 			printf("MSU: New track selected: %s\n", SelectedPath);
-			FileOpen(&f_audio, SelectedPath);
-			printf(f_audio.size ? "MSU: Track mounted\n" : "MSU: Track not found!\n");
-			msu_send_command((f_audio.size << 16) | MSU_AUDIO_TRACK_MOUNTED);
-			break;
+			uint64_t size = msu_stream_select(data);
+			printf(size ? "MSU: Track mounted\n" : "MSU: Track not found!\n");
+			msu_send_command((size << 16) | MSU_AUDIO_TRACK_MOUNTED);
+		}
+		break;
 
 		case 0x36:
 			printf("MSU: Jump to offset: 0x%X\n", data * 1024);
-			FileSeek(&f_audio, data * 1024, SEEK_SET);
+			msu_stream_seek((uint64_t)data * 1024);
 			// fallthrough
 
 		case 0x34:
 			// Next sector requested
-			msu_send_data(&f_audio, 2);
+			msu_send_data(2);
 			break;
 		}
 	}
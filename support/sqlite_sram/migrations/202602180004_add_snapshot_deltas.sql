@@ -0,0 +1,4 @@
+ALTER TABLE snapshots ADD COLUMN base_id INTEGER DEFAULT NULL;
+ALTER TABLE snapshots ADD COLUMN size INTEGER DEFAULT NULL;
+UPDATE snapshots SET size = length(sram);
+CREATE INDEX IF NOT EXISTS snapshots_base_id ON snapshots(base_id) WHERE base_id IS NOT NULL;
@@ -16,6 +16,7 @@
 #include "hardware.h"
 #include "file_io.h"
 #include "user_io.h"
+#include "offload.h"
 #include "miniz.h"
 
 #if SQLITE_SRAM_SNAPSHOTS
@@ -25,6 +26,13 @@
 #define SQLITE_SRAM_HISTORY_LIMIT  50
 #define SQLITE_SRAM_RETRY_MS       60000
 
+// Snapshots are stored as keyframes holding the full image and delta rows
+// holding the changes against their keyframe (base_id).
+#define SQLITE_SRAM_KEYFRAME_DELTAS  16   // deltas stored against one keyframe
+#define SQLITE_SRAM_DELTA_MAX_DIV    4    // a delta above 1/4 of the image starts a new keyframe
+#define SQLITE_SRAM_DELTA_MIN_RUN    8    // shorter unchanged runs are stored as changed bytes
+#define SQLITE_SRAM_DELTA_MIGRATION  "202602180005_delta_encode_history"
+
 struct sqlite_sram_slot_t
 {
 	bool enabled = false;
@@ -45,7 +53,73 @@ struct sqlite_sram_autosave_t
 	char label[96] = {};
 };
 
+// Each mounted slot keeps its database open with the schema checked and the
+// statements prepared. The connection belongs to the flush worker while a job
+// is in flight and to the main thread otherwise.
+struct sqlite_sram_conn_t
+{
+	sqlite3 *db = nullptr;
+	bool have_crc32 = false;
+	bool have_tombstones = false;
+	bool have_deltas = false;
+	sqlite3_stmt *latest = nullptr;
+	sqlite3_stmt *keyframe = nullptr;
+	sqlite3_stmt *insert = nullptr;
+	sqlite3_stmt *trim = nullptr;
+	sqlite3_stmt *gc_snapshots = nullptr;
+	sqlite3_stmt *gc_tombstones = nullptr;
+	bool last_valid = false;
+	std::vector<uint8_t> last;     // image of the latest snapshot, for dedupe
+	std::vector<uint8_t> key;      // image of the keyframe new deltas refer to
+	int64_t key_id = 0;
+	int key_deltas = 0;
+	std::vector<uint8_t> delta;
+
+	// result of the last sqlite_sram_store()
+	size_t stored = 0;
+	bool stored_keyframe = false;
+};
+
+struct sqlite_sram_worker_t
+{
+	sqlite_sram_conn_t conn;
+	char db_path[2080] = {};
+	std::vector<uint8_t> data;     // image owned by the job in flight
+	std::vector<uint8_t> next;     // newer image waiting for that job to finish
+	bool next_valid = false;
+	bool in_flight = false;
+	bool gc_in_flight = false;
+	offload_handle_t handle = {};
+	offload_handle_t gc_handle = {};
+
+	// written by the worker
+	bool ok = false;
+	bool unchanged = false;
+	uint32_t flush_us = 0;
+	uint32_t gc_us = 0;
+};
+
+static struct
+{
+	uint64_t queued;
+	uint64_t coalesced;            // images replaced before the worker got to them
+	uint64_t saved;
+	uint64_t unchanged;
+	uint64_t failed;
+	uint64_t keyframes;
+	uint64_t deltas;
+	uint64_t image_bytes;          // size of the saved images
+	uint64_t stored_bytes;         // what went into the database for them
+	uint64_t flush_us;
+	uint64_t flush_max_us;
+	uint64_t gc;
+	uint64_t gc_us;
+	uint64_t drains;               // main thread waited for the worker
+	uint64_t drain_us;
+} g_stats = {};
+
 static sqlite_sram_slot_t g_slots[SQLITE_SRAM_MAX_SLOTS] = {};
+static sqlite_sram_worker_t g_workers[SQLITE_SRAM_MAX_SLOTS];
 static sqlite_sram_autosave_t g_autosave = {};
 
 static uint32_t sqlite_sram_interval_ms()
@@ -63,12 +137,114 @@ static int64_t sqlite_sram_timestamp_ms()
 	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+static uint64_t sqlite_sram_time_us()
+{
+	struct timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 static uint32_t sqlite_sram_crc32(const uint8_t *data, size_t size)
 {
 	if (!data || !size) return 0;
 	return (uint32_t)mz_crc32(MZ_CRC32_INIT, data, size);
 }
 
+static void sqlite_sram_put_len(std::vector<uint8_t> &out, size_t len)
+{
+	while (len >= 0x80)
+	{
+		out.push_back((uint8_t)(len | 0x80));
+		len >>= 7;
+	}
+	out.push_back((uint8_t)len);
+}
+
+static bool sqlite_sram_get_len(const uint8_t *&p, const uint8_t *end, size_t *len)
+{
+	*len = 0;
+	for (int shift = 0; p < end && shift < 32; shift += 7)
+	{
+		const uint8_t b = *p++;
+		*len |= (size_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) return true;
+	}
+	return false;
+}
+
+// A delta is a list of (unchanged length, changed length, changed bytes)
+// against the keyframe, lengths in LEB128. Unchanged runs shorter than
+// SQLITE_SRAM_DELTA_MIN_RUN are folded into the changed bytes.
+static void sqlite_sram_delta_encode(const uint8_t *key, const uint8_t *data, size_t size, std::vector<uint8_t> &out)
+{
+	out.clear();
+
+	size_t pos = 0;
+	while (pos < size)
+	{
+		size_t start = pos;
+		while (start + 8 <= size && !memcmp(key + start, data + start, 8)) start += 8;
+		while (start < size && key[start] == data[start]) start++;
+		if (start == size) break;
+
+		size_t end = start + 1;
+		size_t run = 0;
+		for (size_t i = end; i < size && run < SQLITE_SRAM_DELTA_MIN_RUN; i++)
+		{
+			if (key[i] == data[i]) run++;
+			else
+			{
+				run = 0;
+				end = i + 1;
+			}
+		}
+
+		sqlite_sram_put_len(out, start - pos);
+		sqlite_sram_put_len(out, end - start);
+		out.insert(out.end(), data + start, data + end);
+		pos = end;
+	}
+}
+
+static bool sqlite_sram_delta_apply(const std::vector<uint8_t> &key, const uint8_t *delta, size_t delta_size, std::vector<uint8_t> &out)
+{
+	out = key;
+
+	const uint8_t *p = delta;
+	const uint8_t *end = delta + delta_size;
+	size_t pos = 0;
+	while (p < end)
+	{
+		size_t skip = 0, len = 0;
+		if (!sqlite_sram_get_len(p, end, &skip) || !sqlite_sram_get_len(p, end, &len)) return false;
+		if (skip > out.size() - pos || len > out.size() - pos - skip || len > (size_t)(end - p)) return false;
+
+		pos += skip;
+		memcpy(out.data() + pos, p, len);
+		pos += len;
+		p += len;
+	}
+
+	return true;
+}
+
+// stmt selects the sram of a keyframe row by id (?1).
+static bool sqlite_sram_read_keyframe(sqlite3_stmt *stmt, int64_t id, std::vector<uint8_t> &key)
+{
+	sqlite3_bind_int64(stmt, 1, id);
+	const bool ok = sqlite3_step(stmt) == SQLITE_ROW;
+	if (ok)
+	{
+		const int blob_size = sqlite3_column_bytes(stmt, 0);
+		const uint8_t *blob = (const uint8_t*)sqlite3_column_blob(stmt, 0);
+		if (blob_size > 0 && blob) key.assign(blob, blob + blob_size);
+		else key.clear();
+	}
+
+	sqlite3_reset(stmt);
+	return ok;
+}
+
 static bool sqlite_sram_exec(sqlite3 *db, const char *sql)
 {
 	char *err = nullptr;
@@ -237,14 +413,149 @@ static bool sqlite_sram_apply_migrations(sqlite3 *db)
 	return true;
 }
 
+// One-time rewrite of the full images stored before delta rows existed. Rows
+// that fail their CRC are left alone and never used as a keyframe.
+static bool sqlite_sram_delta_encode_history(sqlite3 *db)
+{
+	bool applied = false;
+	if (!sqlite_sram_migration_applied(db, SQLITE_SRAM_DELTA_MIGRATION, &applied)) return false;
+	if (applied) return true;
+
+	bool have_deltas = false;
+	bool have_crc32 = false;
+	bool have_tombstones = false;
+	if (!sqlite_sram_column_exists(db, "snapshots", "base_id", &have_deltas) ||
+		!sqlite_sram_column_exists(db, "snapshots", "crc32", &have_crc32) ||
+		!sqlite_sram_table_exists(db, "snapshot_tombstones", &have_tombstones)) return false;
+	if (!have_deltas || !have_crc32) return true;
+
+	if (!sqlite_sram_exec(db, "BEGIN IMMEDIATE;")) return false;
+
+	std::vector<int64_t> ids;
+	sqlite3_stmt *stmt = nullptr;
+	bool ok = sqlite3_prepare_v2(db, have_tombstones
+		? "SELECT id FROM snapshots s WHERE base_id IS NULL AND NOT EXISTS (SELECT 1 FROM snapshot_tombstones t WHERE t.snapshot_id = s.id) ORDER BY id;"
+		: "SELECT id FROM snapshots WHERE base_id IS NULL ORDER BY id;", -1, &stmt, 0) == SQLITE_OK;
+	while (ok && sqlite3_step(stmt) == SQLITE_ROW) ids.push_back(sqlite3_column_int64(stmt, 0));
+	sqlite3_finalize(stmt);
+
+	// rows are read one at a time as they are rewritten
+	sqlite3_stmt *row = nullptr;
+	sqlite3_stmt *update = nullptr;
+	if (ok && !ids.empty())
+	{
+		ok = sqlite3_prepare_v2(db, "SELECT sram, crc32 FROM snapshots WHERE id = ?1;", -1, &row, 0) == SQLITE_OK &&
+			sqlite3_prepare_v2(db, "UPDATE snapshots SET sram = ?1, base_id = ?2 WHERE id = ?3;", -1, &update, 0) == SQLITE_OK;
+	}
+
+	std::vector<uint8_t> key;
+	std::vector<uint8_t> delta;
+	int64_t key_id = 0;
+	int key_deltas = 0;
+	int converted = 0;
+	for (size_t i = 0; ok && i < ids.size(); i++)
+	{
+		sqlite3_bind_int64(row, 1, ids[i]);
+		if (sqlite3_step(row) != SQLITE_ROW)
+		{
+			ok = false;
+			break;
+		}
+
+		const int blob_size = sqlite3_column_bytes(row, 0);
+		const uint8_t *blob = (const uint8_t*)sqlite3_column_blob(row, 0);
+		const uint32_t stored_crc = (uint32_t)sqlite3_column_int64(row, 1);
+		if (blob_size <= 0 || !blob || sqlite_sram_crc32(blob, blob_size) != stored_crc)
+		{
+			sqlite3_reset(row);
+			continue;
+		}
+
+		bool is_delta = false;
+		if (key_id && key.size() == (size_t)blob_size && key_deltas < SQLITE_SRAM_KEYFRAME_DELTAS)
+		{
+			sqlite_sram_delta_encode(key.data(), blob, blob_size, delta);
+			is_delta = delta.size() <= (size_t)blob_size / SQLITE_SRAM_DELTA_MAX_DIV;
+		}
+
+		if (!is_delta)
+		{
+			key.assign(blob, blob + blob_size);
+			key_id = ids[i];
+			key_deltas = 0;
+			sqlite3_reset(row);
+			continue;
+		}
+		sqlite3_reset(row);
+
+		if (delta.empty()) sqlite3_bind_zeroblob(update, 1, 0);
+		else sqlite3_bind_blob(update, 1, delta.data(), (int)delta.size(), SQLITE_STATIC);
+		sqlite3_bind_int64(update, 2, key_id);
+		sqlite3_bind_int64(update, 3, ids[i]);
+		ok = sqlite3_step(update) == SQLITE_DONE;
+		sqlite3_reset(update);
+
+		key_deltas++;
+		converted++;
+	}
+
+	sqlite3_finalize(row);
+	sqlite3_finalize(update);
+
+	if (ok) ok = sqlite_sram_record_migration(db, SQLITE_SRAM_DELTA_MIGRATION);
+	if (ok) ok = sqlite_sram_exec(db, "COMMIT;");
+	if (!ok)
+	{
+		sqlite_sram_exec(db, "ROLLBACK;");
+		return false;
+	}
+
+	if (converted)
+	{
+		// give the space of the replaced images back to the filesystem
+		sqlite_sram_exec(db, "VACUUM;");
+		fprintf(stderr, "SQLite SRAM migration: stored %d of %d snapshots as deltas\n", converted, (int)ids.size());
+	}
+
+	return true;
+}
+
+static bool sqlite_sram_set_journal_mode(sqlite3 *db)
+{
+	// WAL needs a single fsync per commit; keep the old journal where the
+	// filesystem can't provide the shared memory file.
+	char mode[16] = {};
+	sqlite3_stmt *stmt = nullptr;
+	if (sqlite3_prepare_v2(db, "PRAGMA journal_mode=WAL;", -1, &stmt, 0) == SQLITE_OK)
+	{
+		if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0))
+		{
+			snprintf(mode, sizeof(mode), "%s", (const char*)sqlite3_column_text(stmt, 0));
+		}
+		sqlite3_finalize(stmt);
+	}
+
+	if (!strcasecmp(mode, "wal")) return true;
+
+	fprintf(stderr, "SQLite SRAM warning: WAL journal not available (%s), using PERSIST.\n", mode[0] ? mode : "error");
+	return sqlite_sram_exec(db, "PRAGMA journal_mode=PERSIST;");
+}
+
 static bool sqlite_sram_prepare_db(sqlite3 *db)
 {
-	if (!sqlite_sram_exec(db, "PRAGMA journal_mode=PERSIST;")) return false;
+	if (!sqlite_sram_set_journal_mode(db)) return false;
 	if (!sqlite_sram_exec(db, "PRAGMA synchronous=FULL;")) return false;
 	if (!sqlite_sram_exec(db, "PRAGMA auto_vacuum=NONE;")) return false;
 	if (!sqlite_sram_exec(db, "PRAGMA temp_store=MEMORY;")) return false;
 	if (!sqlite_sram_exec(db, "PRAGMA journal_size_limit=1048576;")) return false;
-	return sqlite_sram_apply_migrations(db);
+	if (!sqlite_sram_apply_migrations(db)) return false;
+
+	// full images keep working, so a failed conversion is retried on the next open
+	if (!sqlite_sram_delta_encode_history(db))
+	{
+		fprintf(stderr, "SQLite SRAM migration warning: failed to convert history to deltas.\n");
+	}
+	return true;
 }
 
 static bool sqlite_sram_open_db(const char *db_path, sqlite3 **db)
@@ -274,128 +585,248 @@ static bool sqlite_sram_open_db(const char *db_path, sqlite3 **db)
 	return true;
 }
 
-static bool sqlite_sram_latest_matches(sqlite3 *db, const std::vector<uint8_t> &data, bool *matches)
+static bool sqlite_sram_prepare(sqlite3 *db, const char *sql, sqlite3_stmt **stmt)
 {
-	if (!db || !matches) return false;
-	*matches = false;
+	if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, 0) == SQLITE_OK) return true;
 
-	const uint32_t data_crc = sqlite_sram_crc32(data.data(), data.size());
+	fprintf(stderr, "SQLite SRAM sqlite error: %s [%s]\n", sqlite3_errmsg(db), sql);
+	return false;
+}
 
-	bool have_crc32 = false;
-	if (!sqlite_sram_column_exists(db, "snapshots", "crc32", &have_crc32))
+static bool sqlite_sram_run(sqlite3_stmt *stmt)
+{
+	if (!stmt) return true;
+
+	const int rc = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	return rc == SQLITE_DONE;
+}
+
+static void sqlite_sram_conn_close(sqlite_sram_conn_t &conn)
+{
+	sqlite3_finalize(conn.latest);
+	sqlite3_finalize(conn.keyframe);
+	sqlite3_finalize(conn.insert);
+	sqlite3_finalize(conn.trim);
+	sqlite3_finalize(conn.gc_snapshots);
+	sqlite3_finalize(conn.gc_tombstones);
+	if (conn.db) sqlite3_close(conn.db);
+
+	conn.db = nullptr;
+	conn.latest = conn.keyframe = conn.insert = conn.trim = conn.gc_snapshots = conn.gc_tombstones = nullptr;
+	conn.last_valid = false;
+	conn.key_id = 0;
+	std::vector<uint8_t>().swap(conn.last);
+	std::vector<uint8_t>().swap(conn.key);
+	std::vector<uint8_t>().swap(conn.delta);
+}
+
+static bool sqlite_sram_conn_open(sqlite_sram_conn_t &conn, const char *db_path)
+{
+	if (conn.db) return true;
+	if (!sqlite_sram_open_db(db_path, &conn.db)) return false;
+
+	bool have_base_id = false;
+	bool ok = sqlite_sram_column_exists(conn.db, "snapshots", "crc32", &conn.have_crc32) &&
+		sqlite_sram_table_exists(conn.db, "snapshot_tombstones", &conn.have_tombstones) &&
+		sqlite_sram_column_exists(conn.db, "snapshots", "base_id", &have_base_id);
+	conn.have_deltas = have_base_id && conn.have_crc32;
+
+	char sql[512] = {};
+	snprintf(sql, sizeof(sql), "SELECT id, sram, %s FROM snapshots s%s ORDER BY id DESC LIMIT 1;",
+		conn.have_deltas ? "base_id" : "NULL",
+		conn.have_tombstones ? " WHERE NOT EXISTS (SELECT 1 FROM snapshot_tombstones t WHERE t.snapshot_id = s.id)" : "");
+	if (ok) ok = sqlite_sram_prepare(conn.db, sql, &conn.latest);
+
+	if (ok) ok = sqlite_sram_prepare(conn.db, conn.have_deltas
+		? "INSERT INTO snapshots(ts_ms, sram, crc32, base_id, size) VALUES(?1, ?2, ?3, ?4, ?5);"
+		: conn.have_crc32
+		? "INSERT INTO snapshots(ts_ms, sram, crc32) VALUES(?1, ?2, ?3);"
+		: "INSERT INTO snapshots(ts_ms, sram) VALUES(?1, ?2);", &conn.insert);
+
+	if (ok && conn.have_deltas)
 	{
-		fprintf(stderr, "SQLite SRAM warning: failed to check crc32 column for dedupe; assuming changed.\n");
-		return true;
+		ok = sqlite_sram_prepare(conn.db, "SELECT sram FROM snapshots WHERE id = ?1 AND base_id IS NULL;", &conn.keyframe);
 	}
-	if (!have_crc32) return true;
 
-	bool have_tombstones = false;
-	if (!sqlite_sram_table_exists(db, "snapshot_tombstones", &have_tombstones))
+	// keyframes stay while a snapshot that is kept refers to them
+	if (conn.have_deltas)
 	{
-		fprintf(stderr, "SQLite SRAM warning: failed to check tombstone table for dedupe, proceeding without tombstone filter.\n");
-		have_tombstones = false;
+		snprintf(sql, sizeof(sql),
+			"WITH keep AS (SELECT id FROM snapshots WHERE tag IS NULL ORDER BY id DESC LIMIT %d) "
+			"DELETE FROM snapshots "
+			"WHERE tag IS NULL "
+			"AND id NOT IN keep "
+			"AND id NOT IN (SELECT base_id FROM snapshots WHERE base_id IS NOT NULL AND (tag IS NOT NULL OR id IN keep));",
+				SQLITE_SRAM_HISTORY_LIMIT);
 	}
-
-	const char *latest_sql = have_tombstones
-		? "SELECT crc32, sram FROM snapshots s WHERE NOT EXISTS (SELECT 1 FROM snapshot_tombstones t WHERE t.snapshot_id = s.id) ORDER BY id DESC LIMIT 1;"
-		: "SELECT crc32, sram FROM snapshots ORDER BY id DESC LIMIT 1;";
-
-	sqlite3_stmt *stmt = nullptr;
-	if (sqlite3_prepare_v2(db, latest_sql, -1, &stmt, 0) != SQLITE_OK)
+	else
 	{
-		return false;
+		snprintf(sql, sizeof(sql),
+			"DELETE FROM snapshots "
+			"WHERE tag IS NULL "
+			"AND id NOT IN (SELECT id FROM snapshots WHERE tag IS NULL ORDER BY id DESC LIMIT %d);",
+				SQLITE_SRAM_HISTORY_LIMIT);
 	}
+	if (ok) ok = sqlite_sram_prepare(conn.db, sql, &conn.trim);
 
-	int rc = sqlite3_step(stmt);
-	if (rc == SQLITE_ROW)
+	if (ok && conn.have_tombstones)
 	{
-		const uint32_t stored_crc = (uint32_t)sqlite3_column_int64(stmt, 0);
-		const int blob_size = sqlite3_column_bytes(stmt, 1);
-		const void *blob = sqlite3_column_blob(stmt, 1);
-		if (stored_crc == data_crc && blob_size == (int)data.size() && (!blob_size || (blob && !memcmp(blob, data.data(), blob_size))))
-		{
-			*matches = true;
-		}
+		ok = sqlite_sram_prepare(conn.db, conn.have_deltas
+			? "DELETE FROM snapshots WHERE id IN (SELECT snapshot_id FROM snapshot_tombstones) "
+				"AND id NOT IN (SELECT base_id FROM snapshots s WHERE base_id IS NOT NULL AND NOT EXISTS (SELECT 1 FROM snapshot_tombstones t WHERE t.snapshot_id = s.id));"
+			: "DELETE FROM snapshots WHERE id IN (SELECT snapshot_id FROM snapshot_tombstones);", &conn.gc_snapshots) &&
+			sqlite_sram_prepare(conn.db, "DELETE FROM snapshot_tombstones WHERE snapshot_id NOT IN (SELECT id FROM snapshots);", &conn.gc_tombstones);
 	}
-	else if (rc != SQLITE_DONE)
+
+	if (!ok)
 	{
-		sqlite3_finalize(stmt);
-		return false;
+		fprintf(stderr, "SQLite SRAM error: failed to set up %s\n", db_path);
+		sqlite_sram_conn_close(conn);
 	}
 
-	sqlite3_finalize(stmt);
-	return true;
+	return ok;
 }
 
-static bool sqlite_sram_insert(sqlite3 *db, const std::vector<uint8_t> &data)
+static int sqlite_sram_count_deltas(sqlite3 *db, int64_t key_id)
 {
-	if (!db) return false;
-	if (!sqlite_sram_exec(db, "BEGIN IMMEDIATE;")) return false;
-
-	const uint32_t data_crc = sqlite_sram_crc32(data.data(), data.size());
-	bool have_crc32 = false;
-	if (!sqlite_sram_column_exists(db, "snapshots", "crc32", &have_crc32))
+	int count = 0;
+	sqlite3_stmt *stmt = nullptr;
+	if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM snapshots WHERE base_id = ?1;", -1, &stmt, 0) == SQLITE_OK)
 	{
-		sqlite_sram_exec(db, "ROLLBACK;");
-		return false;
+		sqlite3_bind_int64(stmt, 1, key_id);
+		if (sqlite3_step(stmt) == SQLITE_ROW) count = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
 	}
+	return count;
+}
 
+// Rebuilds the latest image and its keyframe. A latest row that can't be
+// rebuilt only costs the dedupe: the next snapshot is stored as a keyframe.
+static bool sqlite_sram_load_last(sqlite_sram_conn_t &conn)
+{
 	bool ok = true;
-	sqlite3_stmt *stmt = nullptr;
-	const char *insert_sql = have_crc32
-		? "INSERT INTO snapshots(ts_ms, crc32, sram) VALUES(?, ?, ?);"
-		: "INSERT INTO snapshots(ts_ms, sram) VALUES(?, ?);";
-	if (sqlite3_prepare_v2(db, insert_sql, -1, &stmt, 0) != SQLITE_OK)
-	{
-		ok = false;
-	}
-	else
+	conn.key_id = 0;
+	conn.key_deltas = 0;
+
+	const int rc = sqlite3_step(conn.latest);
+	if (rc == SQLITE_ROW)
 	{
-		sqlite3_bind_int64(stmt, 1, sqlite_sram_timestamp_ms());
-		if (have_crc32)
+		const int64_t row_id = sqlite3_column_int64(conn.latest, 0);
+		const int blob_size = sqlite3_column_bytes(conn.latest, 1);
+		const uint8_t *blob = (const uint8_t*)sqlite3_column_blob(conn.latest, 1);
+		const int64_t base_id = sqlite3_column_int64(conn.latest, 2);
+
+		if (!base_id)
 		{
-			sqlite3_bind_int64(stmt, 2, data_crc);
-			sqlite3_bind_blob(stmt, 3, data.data(), (int)data.size(), SQLITE_TRANSIENT);
+			if (blob_size > 0 && blob) conn.last.assign(blob, blob + blob_size);
+			else conn.last.clear();
+			if (conn.have_deltas)
+			{
+				conn.key = conn.last;
+				conn.key_id = row_id;
+			}
+		}
+		else if (sqlite_sram_read_keyframe(conn.keyframe, base_id, conn.key) &&
+			sqlite_sram_delta_apply(conn.key, blob, blob_size > 0 ? (size_t)blob_size : 0, conn.last))
+		{
+			conn.key_id = base_id;
 		}
 		else
 		{
-			sqlite3_bind_blob(stmt, 2, data.data(), (int)data.size(), SQLITE_TRANSIENT);
+			fprintf(stderr, "SQLite SRAM warning: can't rebuild snapshot %lld, next one is stored in full.\n", (long long)row_id);
+			conn.last.clear();
 		}
-		const int rc = sqlite3_step(stmt);
-		ok = (rc == SQLITE_DONE);
-		sqlite3_finalize(stmt);
+
+		if (conn.key_id) conn.key_deltas = sqlite_sram_count_deltas(conn.db, conn.key_id);
+		conn.last_valid = true;
+	}
+	else if (rc == SQLITE_DONE)
+	{
+		conn.last.clear();
+		conn.last_valid = true;
+	}
+	else
+	{
+		ok = false;
 	}
 
-	if (ok)
+	sqlite3_reset(conn.latest);
+	return ok;
+}
+
+// Adds a snapshot unless it matches the latest one. History and tombstone
+// cleanup is left to sqlite_sram_gc().
+static bool sqlite_sram_store(sqlite_sram_conn_t &conn, const std::vector<uint8_t> &data, bool *unchanged)
+{
+	*unchanged = false;
+	if (!conn.last_valid && !sqlite_sram_load_last(conn)) return false;
+	if (conn.last_valid && conn.last == data)
 	{
-		char sql[320] = {};
-		snprintf(sql, sizeof(sql),
-			"DELETE FROM snapshots "
-			"WHERE tag IS NULL "
-			"AND id NOT IN (SELECT id FROM snapshots WHERE tag IS NULL ORDER BY id DESC LIMIT %d);",
-				SQLITE_SRAM_HISTORY_LIMIT);
-		if (!sqlite_sram_exec(db, sql)) ok = false;
+		*unchanged = true;
+		return true;
 	}
 
-	bool have_tombstones = false;
-	if (ok && !sqlite_sram_table_exists(db, "snapshot_tombstones", &have_tombstones))
+	// a new keyframe when the size changed, the keyframe has enough deltas
+	// or the changes got too big
+	bool is_delta = false;
+	if (conn.have_deltas && conn.key_id && !data.empty() && conn.key.size() == data.size() &&
+		conn.key_deltas < SQLITE_SRAM_KEYFRAME_DELTAS)
 	{
-		fprintf(stderr, "SQLite SRAM warning: failed to check tombstone table, skipping tombstone GC.\n");
-		have_tombstones = false;
+		sqlite_sram_delta_encode(conn.key.data(), data.data(), data.size(), conn.delta);
+		is_delta = conn.delta.size() <= data.size() / SQLITE_SRAM_DELTA_MAX_DIV;
 	}
-	if (ok && have_tombstones && !sqlite_sram_exec(db, "DELETE FROM snapshots WHERE id IN (SELECT snapshot_id FROM snapshot_tombstones);")) ok = false;
-	if (ok && have_tombstones && !sqlite_sram_exec(db, "DELETE FROM snapshot_tombstones WHERE snapshot_id NOT IN (SELECT id FROM snapshots);")) ok = false;
-	if (ok && !sqlite_sram_exec(db, "COMMIT;")) ok = false;
 
+	if (!sqlite_sram_exec(conn.db, "BEGIN IMMEDIATE;")) return false;
+
+	sqlite3_bind_int64(conn.insert, 1, sqlite_sram_timestamp_ms());
+	if (!is_delta) sqlite3_bind_blob(conn.insert, 2, data.data(), (int)data.size(), SQLITE_STATIC);
+	else if (conn.delta.empty()) sqlite3_bind_zeroblob(conn.insert, 2, 0);
+	else sqlite3_bind_blob(conn.insert, 2, conn.delta.data(), (int)conn.delta.size(), SQLITE_STATIC);
+	if (conn.have_crc32) sqlite3_bind_int64(conn.insert, 3, sqlite_sram_crc32(data.data(), data.size()));
+	if (conn.have_deltas)
+	{
+		if (is_delta) sqlite3_bind_int64(conn.insert, 4, conn.key_id);
+		sqlite3_bind_int64(conn.insert, 5, (sqlite3_int64)data.size());
+	}
+
+	bool ok = sqlite_sram_run(conn.insert);
+	sqlite3_clear_bindings(conn.insert);
+	if (ok) ok = sqlite_sram_exec(conn.db, "COMMIT;");
 	if (!ok)
 	{
-		sqlite_sram_exec(db, "ROLLBACK;");
+		sqlite_sram_exec(conn.db, "ROLLBACK;");
 		return false;
 	}
 
+	if (is_delta)
+	{
+		conn.key_deltas++;
+	}
+	else if (conn.have_deltas)
+	{
+		conn.key = data;
+		conn.key_id = sqlite3_last_insert_rowid(conn.db);
+		conn.key_deltas = 0;
+	}
+
+	conn.stored = is_delta ? conn.delta.size() : data.size();
+	conn.stored_keyframe = !is_delta;
+	conn.last = data;
+	conn.last_valid = true;
 	return true;
 }
 
+static bool sqlite_sram_gc(sqlite_sram_conn_t &conn)
+{
+	if (!sqlite_sram_exec(conn.db, "BEGIN IMMEDIATE;")) return false;
+
+	bool ok = sqlite_sram_run(conn.trim) && sqlite_sram_run(conn.gc_snapshots) && sqlite_sram_run(conn.gc_tombstones);
+	if (ok) ok = sqlite_sram_exec(conn.db, "COMMIT;");
+	if (!ok) sqlite_sram_exec(conn.db, "ROLLBACK;");
+	return ok;
+}
+
 static bool sqlite_sram_load_latest(const char *db_path, int expected_size, std::vector<uint8_t> &data, bool *found)
 {
 	if (!db_path || !found) return false;
@@ -411,13 +842,14 @@ static bool sqlite_sram_load_latest(const char *db_path, int expected_size, std:
 		return true;
 	}
 
+	// read-write first: a database left in WAL mode may need recovery
 	sqlite3 *db = nullptr;
-	int rc = sqlite3_open_v2(full_db_path, &db, SQLITE_OPEN_READONLY, 0);
+	int rc = sqlite3_open_v2(full_db_path, &db, SQLITE_OPEN_READWRITE, 0);
 	if (rc != SQLITE_OK)
 	{
 		if (db) sqlite3_close(db);
 		db = nullptr;
-		rc = sqlite3_open_v2(full_db_path, &db, SQLITE_OPEN_READWRITE, 0);
+		rc = sqlite3_open_v2(full_db_path, &db, SQLITE_OPEN_READONLY, 0);
 	}
 	if (rc != SQLITE_OK)
 	{
@@ -442,20 +874,25 @@ static bool sqlite_sram_load_latest(const char *db_path, int expected_size, std:
 		have_tombstones = false;
 	}
 
-	const char *load_sql = nullptr;
-	if (have_crc32)
+	bool have_deltas = false;
+	if (!sqlite_sram_column_exists(db, "snapshots", "base_id", &have_deltas))
 	{
-		load_sql = have_tombstones
-			? "SELECT id, sram, crc32 FROM snapshots s WHERE NOT EXISTS (SELECT 1 FROM snapshot_tombstones t WHERE t.snapshot_id = s.id) ORDER BY id DESC;"
-			: "SELECT id, sram, crc32 FROM snapshots ORDER BY id DESC;";
+		have_deltas = false;
 	}
-	else
+
+	char load_sql[512] = {};
+	snprintf(load_sql, sizeof(load_sql), "SELECT id, sram, %s, %s FROM snapshots s%s ORDER BY id DESC;",
+		have_crc32 ? "crc32" : "NULL",
+		have_deltas ? "base_id" : "NULL",
+		have_tombstones ? " WHERE NOT EXISTS (SELECT 1 FROM snapshot_tombstones t WHERE t.snapshot_id = s.id)" : "");
+
+	sqlite3_stmt *key_stmt = nullptr;
+	if (have_deltas && sqlite3_prepare_v2(db, "SELECT sram FROM snapshots WHERE id = ?1 AND base_id IS NULL;", -1, &key_stmt, 0) != SQLITE_OK)
 	{
-		load_sql = have_tombstones
-			? "SELECT id, sram, NULL FROM snapshots s WHERE NOT EXISTS (SELECT 1 FROM snapshot_tombstones t WHERE t.snapshot_id = s.id) ORDER BY id DESC;"
-			: "SELECT id, sram, NULL FROM snapshots ORDER BY id DESC;";
+		fprintf(stderr, "SQLite SRAM sqlite error: failed preparing keyframe query for %s (%s)\n", db_path, sqlite3_errmsg(db));
+		ok = false;
 	}
-	if (sqlite3_prepare_v2(db, load_sql, -1, &stmt, 0) != SQLITE_OK)
+	else if (sqlite3_prepare_v2(db, load_sql, -1, &stmt, 0) != SQLITE_OK)
 	{
 		fprintf(stderr, "SQLite SRAM sqlite error: failed preparing load query for %s (%s)\n", db_path, sqlite3_errmsg(db));
 		ok = false;
@@ -467,6 +904,9 @@ static bool sqlite_sram_load_latest(const char *db_path, int expected_size, std:
 		int best_size = -1;
 		uint32_t best_crc = 0;
 		std::vector<uint8_t> best_data;
+		std::vector<uint8_t> key;
+		std::vector<uint8_t> image;
+		int64_t key_id = 0;
 
 		while (1)
 		{
@@ -479,10 +919,11 @@ static bool sqlite_sram_load_latest(const char *db_path, int expected_size, std:
 			}
 
 				const int64_t row_id = sqlite3_column_int64(stmt, 0);
-				const int blob_size = sqlite3_column_bytes(stmt, 1);
+				int blob_size = sqlite3_column_bytes(stmt, 1);
 				const uint8_t *blob = (const uint8_t*)sqlite3_column_blob(stmt, 1);
 				const bool crc_is_null = (sqlite3_column_type(stmt, 2) == SQLITE_NULL);
 				const uint32_t stored_crc = (uint32_t)sqlite3_column_int64(stmt, 2);
+			const int64_t base_id = sqlite3_column_int64(stmt, 3);
 
 			if (blob_size > 0 && !blob)
 			{
@@ -490,6 +931,20 @@ static bool sqlite_sram_load_latest(const char *db_path, int expected_size, std:
 				continue;
 			}
 
+			if (base_id)
+			{
+				if (key_id != base_id) key_id = sqlite_sram_read_keyframe(key_stmt, base_id, key) ? base_id : 0;
+				if (key_id != base_id || !sqlite_sram_delta_apply(key, blob, blob_size > 0 ? (size_t)blob_size : 0, image))
+				{
+					fprintf(stderr, "SQLite SRAM load skip: %s row=%lld (can't rebuild from keyframe %lld)\n",
+						db_path, (long long)row_id, (long long)base_id);
+					continue;
+				}
+
+				blob = image.data();
+				blob_size = (int)image.size();
+			}
+
 				const uint32_t calc_crc = sqlite_sram_crc32(blob, blob_size > 0 ? (size_t)blob_size : 0);
 				if (have_crc32 && !crc_is_null && calc_crc != stored_crc)
 				{
@@ -561,6 +1016,7 @@ static bool sqlite_sram_load_latest(const char *db_path, int expected_size, std:
 		sqlite3_finalize(stmt);
 	}
 
+	sqlite3_finalize(key_stmt);
 	sqlite3_close(db);
 	return ok;
 }
@@ -668,15 +1124,16 @@ static bool sqlite_sram_migrate_legacy_save(const char *save_path, const char *d
 		return false;
 	}
 
-	sqlite3 *db = nullptr;
-	if (!sqlite_sram_open_db(db_path, &db))
+	sqlite_sram_conn_t conn;
+	if (!sqlite_sram_conn_open(conn, db_path))
 	{
 		fprintf(stderr, "SQLite SRAM migration warning: failed to open sqlite DB %s\n", db_path);
 		return false;
 	}
 
-	bool ok = sqlite_sram_insert(db, legacy_data);
-	sqlite3_close(db);
+	bool unchanged = false;
+	bool ok = sqlite_sram_store(conn, legacy_data, &unchanged) && sqlite_sram_gc(conn);
+	sqlite_sram_conn_close(conn);
 
 	if (!ok)
 	{
@@ -707,19 +1164,167 @@ static bool sqlite_sram_run_db_migrations(const char *db_path)
 	return true;
 }
 
+// runs on the offload worker
+static void sqlite_sram_flush_job(sqlite_sram_worker_t *w)
+{
+	const uint64_t t = sqlite_sram_time_us();
+	w->ok = sqlite_sram_conn_open(w->conn, w->db_path) && sqlite_sram_store(w->conn, w->data, &w->unchanged);
+	w->flush_us = (uint32_t)(sqlite_sram_time_us() - t);
+}
+
+// runs on the offload worker
+static void sqlite_sram_gc_job(sqlite_sram_worker_t *w)
+{
+	const uint64_t t = sqlite_sram_time_us();
+	if (w->conn.db && !sqlite_sram_gc(w->conn)) fprintf(stderr, "SQLite SRAM warning: history cleanup failed for %s\n", w->db_path);
+	w->gc_us = (uint32_t)(sqlite_sram_time_us() - t);
+}
+
+// Collects finished jobs and hands the next queued image to the worker. With
+// wait set, blocks until the jobs in flight are done.
+static void sqlite_sram_reap(uint8_t slot, bool wait)
+{
+	sqlite_sram_slot_t &state = g_slots[slot];
+	sqlite_sram_worker_t *w = &g_workers[slot];
+
+	if (w->in_flight && (wait || offload_done(&w->handle)))
+	{
+		offload_wait(&w->handle);
+		w->in_flight = false;
+
+		g_stats.flush_us += w->flush_us;
+		if (w->flush_us > g_stats.flush_max_us) g_stats.flush_max_us = w->flush_us;
+
+		if (!w->ok)
+		{
+			// the image stays dirty and is read again on retry
+			g_stats.failed++;
+			w->next_valid = false;
+			state.dirty = true;
+			state.flush_timer = GetTimer(SQLITE_SRAM_RETRY_MS);
+		}
+		else
+		{
+			if (!w->unchanged)
+			{
+				g_stats.saved++;
+				if (w->conn.stored_keyframe) g_stats.keyframes++;
+				else g_stats.deltas++;
+				g_stats.image_bytes += w->data.size();
+				g_stats.stored_bytes += w->conn.stored;
+			}
+			else g_stats.unchanged++;
+
+			if (!w->unchanged) fprintf(stderr, "SQLite SRAM saved: %s (%d bytes, %u us)\n", state.save_path, (int)w->data.size(), w->flush_us);
+			else fprintf(stderr, "SQLite SRAM unchanged: %s (%d bytes)\n", state.save_path, (int)w->data.size());
+
+			if (!w->unchanged && !w->gc_in_flight)
+			{
+				w->gc_in_flight = true;
+				offload_add_work([w]() { sqlite_sram_gc_job(w); }, OFFLOAD_LOW, &w->gc_handle);
+			}
+		}
+	}
+
+	if (w->gc_in_flight && (wait || offload_done(&w->gc_handle)))
+	{
+		offload_wait(&w->gc_handle);
+		w->gc_in_flight = false;
+		g_stats.gc++;
+		g_stats.gc_us += w->gc_us;
+	}
+
+	if (!w->in_flight && w->next_valid)
+	{
+		w->data.swap(w->next);
+		w->next_valid = false;
+		w->in_flight = true;
+		offload_add_work([w]() { sqlite_sram_flush_job(w); }, OFFLOAD_LOW, &w->handle);
+	}
+}
+
+// Barrier: returns once everything queued for the slot is in the database.
+static void sqlite_sram_drain(uint8_t slot)
+{
+	sqlite_sram_worker_t *w = &g_workers[slot];
+	if (!w->in_flight && !w->gc_in_flight && !w->next_valid) return;
+
+	const uint64_t t = sqlite_sram_time_us();
+	while (w->in_flight || w->gc_in_flight || w->next_valid) sqlite_sram_reap(slot, true);
+
+	g_stats.drains++;
+	g_stats.drain_us += sqlite_sram_time_us() - t;
+}
+
+// Copies the image and queues it for the worker. While a job is in flight only
+// the newest image is kept, so a burst of sector writes becomes one snapshot.
+static void sqlite_sram_queue_flush(uint8_t slot)
+{
+	if (slot >= SQLITE_SRAM_MAX_SLOTS) return;
+
+	sqlite_sram_slot_t &state = g_slots[slot];
+	if (!state.enabled || !state.dirty || !state.img) return;
+
+	sqlite_sram_worker_t *w = &g_workers[slot];
+	sqlite_sram_reap(slot, false);
+
+	if (!sqlite_sram_read_image(state.img, w->next))
+	{
+		state.flush_timer = GetTimer(SQLITE_SRAM_RETRY_MS);
+		return;
+	}
+
+	// writes from here on dirty the slot again
+	state.dirty = false;
+	state.flush_timer = 0;
+
+	g_stats.queued++;
+	if (w->next_valid) g_stats.coalesced++;
+	w->next_valid = true;
+	sqlite_sram_reap(slot, false);
+}
+
+static void sqlite_sram_poll_flush()
+{
+	for (uint8_t i = 0; i < SQLITE_SRAM_MAX_SLOTS; i++)
+	{
+		sqlite_sram_reap(i, false);
+
+		sqlite_sram_slot_t &state = g_slots[i];
+		if (!state.enabled || !state.dirty || !state.flush_timer) continue;
+		if (!CheckTimer(state.flush_timer)) continue;
+		sqlite_sram_queue_flush(i);
+	}
+}
+
+// Connection for the menu; waits for the worker first.
+static sqlite_sram_conn_t *sqlite_sram_ui_conn(int slot)
+{
+	sqlite_sram_drain((uint8_t)slot);
+
+	sqlite_sram_conn_t *conn = &g_workers[slot].conn;
+	if (!sqlite_sram_conn_open(*conn, g_workers[slot].db_path)) return nullptr;
+	return conn;
+}
+
 static void sqlite_sram_configure_slot(uint8_t slot, fileTYPE *img, const char *save_path)
 {
 	if (slot >= SQLITE_SRAM_MAX_SLOTS) return;
 
+	sqlite_sram_drain(slot);
+	sqlite_sram_conn_close(g_workers[slot].conn);
+
 	sqlite_sram_slot_t &state = g_slots[slot];
 	memset(&state, 0, sizeof(state));
 	state.img = img;
+	g_workers[slot].db_path[0] = 0;
 
 	if (!save_path || !save_path[0]) return;
 
 	state.enabled = true;
 	snprintf(state.save_path, sizeof(state.save_path), "%s", save_path);
 	snprintf(state.db_path, sizeof(state.db_path), "%s.sqlite3", save_path);
+	snprintf(g_workers[slot].db_path, sizeof(g_workers[slot].db_path), "%s", state.db_path);
 }
 
 static bool sqlite_sram_any_slot_enabled()
@@ -863,57 +1468,6 @@ static void sqlite_sram_poll_export_trigger()
 	fprintf(stderr, "SQLite SRAM autosave trigger fired: opt=%s label=%s\n", g_autosave.opt, g_autosave.label);
 }
 
-static void sqlite_sram_try_flush(uint8_t slot)
-{
-	if (slot >= SQLITE_SRAM_MAX_SLOTS) return;
-
-	sqlite_sram_slot_t &state = g_slots[slot];
-	if (!state.enabled || !state.dirty || !state.img) return;
-
-	std::vector<uint8_t> data;
-	if (!sqlite_sram_read_image(state.img, data))
-	{
-		state.flush_timer = GetTimer(SQLITE_SRAM_RETRY_MS);
-		return;
-	}
-
-	sqlite3 *db = nullptr;
-	if (!sqlite_sram_open_db(state.db_path, &db))
-	{
-		state.flush_timer = GetTimer(SQLITE_SRAM_RETRY_MS);
-		return;
-	}
-
-	bool ok = true;
-	bool unchanged = false;
-	if (ok) ok = sqlite_sram_latest_matches(db, data, &unchanged);
-	if (ok && !unchanged) ok = sqlite_sram_insert(db, data);
-	sqlite3_close(db);
-
-	if (!ok)
-	{
-		state.flush_timer = GetTimer(SQLITE_SRAM_RETRY_MS);
-		return;
-	}
-
-	state.dirty = false;
-	state.flush_timer = 0;
-
-	if (!unchanged) fprintf(stderr, "SQLite SRAM saved: %s (%d bytes)\n", state.save_path, (int)data.size());
-	else fprintf(stderr, "SQLite SRAM unchanged: %s (%d bytes)\n", state.save_path, (int)data.size());
-}
-
-static void sqlite_sram_poll_flush()
-{
-	for (uint8_t i = 0; i < SQLITE_SRAM_MAX_SLOTS; i++)
-	{
-		sqlite_sram_slot_t &state = g_slots[i];
-		if (!state.enabled || !state.dirty || !state.flush_timer) continue;
-		if (!CheckTimer(state.flush_timer)) continue;
-		sqlite_sram_try_flush(i);
-	}
-}
-
 static int sqlite_sram_find_ui_slot()
 {
 	for (int i = 0; i < SQLITE_SRAM_MAX_SLOTS; i++)
@@ -939,6 +1493,11 @@ int sqlite_sram_runtime_enabled()
 void sqlite_sram_reset()
 {
 #if SQLITE_SRAM_SNAPSHOTS
+	for (uint8_t i = 0; i < SQLITE_SRAM_MAX_SLOTS; i++)
+	{
+		sqlite_sram_drain(i);
+		sqlite_sram_conn_close(g_workers[i].conn);
+	}
 	memset(g_slots, 0, sizeof(g_slots));
 	memset(&g_autosave, 0, sizeof(g_autosave));
 #endif
@@ -1081,7 +1640,7 @@ void sqlite_sram_flush_slot(uint8_t slot)
 #if SQLITE_SRAM_SNAPSHOTS
 	if (!sqlite_sram_runtime_enabled()) return;
 	if (slot >= SQLITE_SRAM_MAX_SLOTS) return;
-	sqlite_sram_try_flush(slot);
+	sqlite_sram_queue_flush(slot);
 #else
 	(void)slot;
 #endif
@@ -1114,27 +1673,19 @@ bool sqlite_sram_tag_latest(const char *tag)
 	const int slot = sqlite_sram_find_ui_slot();
 	if (slot < 0) return false;
 
-	sqlite_sram_try_flush((uint8_t)slot);
+	sqlite_sram_queue_flush((uint8_t)slot);
 
-	sqlite3 *db = nullptr;
-	if (!sqlite_sram_open_db(g_slots[slot].db_path, &db)) return false;
-	if (!sqlite_sram_exec(db, "BEGIN IMMEDIATE;"))
-	{
-		sqlite3_close(db);
-		return false;
-	}
+	sqlite_sram_conn_t *conn = sqlite_sram_ui_conn(slot);
+	if (!conn) return false;
+
+	sqlite3 *db = conn->db;
+	if (!sqlite_sram_exec(db, "BEGIN IMMEDIATE;")) return false;
 
 	bool ok = false;
 	sqlite3_stmt *stmt = nullptr;
-	bool have_crc32 = false;
-	if (!sqlite_sram_column_exists(db, "snapshots", "crc32", &have_crc32))
-	{
-		sqlite_sram_exec(db, "ROLLBACK;");
-		sqlite3_close(db);
-		return false;
-	}
-
-	const char *tag_sql = have_crc32
+	const char *tag_sql = conn->have_deltas
+		? "INSERT INTO snapshots(ts_ms, crc32, sram, tag, base_id, size) SELECT ?, crc32, sram, ?, base_id, size FROM snapshots ORDER BY id DESC LIMIT 1;"
+		: conn->have_crc32
 		? "INSERT INTO snapshots(ts_ms, crc32, sram, tag) SELECT ?, crc32, sram, ? FROM snapshots ORDER BY id DESC LIMIT 1;"
 		: "INSERT INTO snapshots(ts_ms, sram, tag) SELECT ?, sram, ? FROM snapshots ORDER BY id DESC LIMIT 1;";
 	if (sqlite3_prepare_v2(db, tag_sql, -1, &stmt, 0) == SQLITE_OK)
@@ -1148,7 +1699,7 @@ bool sqlite_sram_tag_latest(const char *tag)
 	if (ok) ok = sqlite_sram_exec(db, "COMMIT;");
 	if (!ok) sqlite_sram_exec(db, "ROLLBACK;");
 
-	sqlite3_close(db);
+	conn->last_valid = false;
 	return ok;
 #else
 	(void)tag;
@@ -1164,20 +1715,14 @@ int sqlite_sram_list_tagged(sram_store_tagged_snapshot_t *out, int max_items)
 	const int slot = sqlite_sram_find_ui_slot();
 	if (slot < 0) return 0;
 
-	sqlite3 *db = nullptr;
-	if (!sqlite_sram_open_db(g_slots[slot].db_path, &db)) return 0;
+	sqlite_sram_conn_t *conn = sqlite_sram_ui_conn(slot);
+	if (!conn) return 0;
 
+	sqlite3 *db = conn->db;
 	int count = 0;
 	sqlite3_stmt *stmt = nullptr;
 
-	bool have_tombstones = false;
-	if (!sqlite_sram_table_exists(db, "snapshot_tombstones", &have_tombstones))
-	{
-		fprintf(stderr, "SQLite SRAM warning: failed to check tombstone table for tagged list, proceeding without tombstone filter.\n");
-		have_tombstones = false;
-	}
-
-	const char *list_sql = have_tombstones
+	const char *list_sql = conn->have_tombstones
 		? "SELECT id, ts_ms, tag FROM snapshots s WHERE tag IS NOT NULL AND tag <> '' AND NOT EXISTS (SELECT 1 FROM snapshot_tombstones t WHERE t.snapshot_id = s.id) ORDER BY id DESC LIMIT ?1;"
 		: "SELECT id, ts_ms, tag FROM snapshots WHERE tag IS NOT NULL AND tag <> '' ORDER BY id DESC LIMIT ?1;";
 	if (sqlite3_prepare_v2(db, list_sql, -1, &stmt, 0) == SQLITE_OK)
@@ -1199,7 +1744,6 @@ int sqlite_sram_list_tagged(sram_store_tagged_snapshot_t *out, int max_items)
 		sqlite3_finalize(stmt);
 	}
 
-	sqlite3_close(db);
 	return count;
 #else
 	(void)out;
@@ -1216,33 +1760,23 @@ bool sqlite_sram_restore_tagged(int64_t snapshot_id)
 	const int slot = sqlite_sram_find_ui_slot();
 	if (slot < 0) return false;
 
-	sqlite3 *db = nullptr;
-	if (!sqlite_sram_open_db(g_slots[slot].db_path, &db)) return false;
-	if (!sqlite_sram_exec(db, "BEGIN IMMEDIATE;"))
-	{
-		sqlite3_close(db);
-		return false;
-	}
+	sqlite_sram_conn_t *conn = sqlite_sram_ui_conn(slot);
+	if (!conn) return false;
+
+	sqlite3 *db = conn->db;
+	if (!sqlite_sram_exec(db, "BEGIN IMMEDIATE;")) return false;
 
 	bool ok = false;
 	sqlite3_stmt *stmt = nullptr;
-	bool have_crc32 = false;
-	if (!sqlite_sram_column_exists(db, "snapshots", "crc32", &have_crc32))
-	{
-		sqlite_sram_exec(db, "ROLLBACK;");
-		sqlite3_close(db);
-		return false;
-	}
-
-	bool have_tombstones = false;
-	if (!sqlite_sram_table_exists(db, "snapshot_tombstones", &have_tombstones))
+	const bool have_tombstones = conn->have_tombstones;
+	const char *restore_sql = nullptr;
+	if (conn->have_deltas)
 	{
-		fprintf(stderr, "SQLite SRAM warning: failed to check tombstone table for tagged restore, proceeding without tombstone filter.\n");
-		have_tombstones = false;
+		restore_sql = have_tombstones
+			? "INSERT INTO snapshots(ts_ms, crc32, sram, tag, base_id, size) SELECT ?1, crc32, sram, NULL, base_id, size FROM snapshots s WHERE id = ?2 AND tag IS NOT NULL AND NOT EXISTS (SELECT 1 FROM snapshot_tombstones t WHERE t.snapshot_id = s.id) LIMIT 1;"
+			: "INSERT INTO snapshots(ts_ms, crc32, sram, tag, base_id, size) SELECT ?1, crc32, sram, NULL, base_id, size FROM snapshots WHERE id = ?2 AND tag IS NOT NULL LIMIT 1;";
 	}
-
-	const char *restore_sql = nullptr;
-	if (have_crc32)
+	else if (conn->have_crc32)
 	{
 		restore_sql = have_tombstones
 			? "INSERT INTO snapshots(ts_ms, crc32, sram, tag) SELECT ?1, crc32, sram, NULL FROM snapshots s WHERE id = ?2 AND tag IS NOT NULL AND NOT EXISTS (SELECT 1 FROM snapshot_tombstones t WHERE t.snapshot_id = s.id) LIMIT 1;"
@@ -1265,7 +1799,7 @@ bool sqlite_sram_restore_tagged(int64_t snapshot_id)
 	if (ok) ok = sqlite_sram_exec(db, "COMMIT;");
 	if (!ok) sqlite_sram_exec(db, "ROLLBACK;");
 
-	sqlite3_close(db);
+	conn->last_valid = false;
 	return ok;
 #else
 	(void)snapshot_id;
@@ -1281,22 +1815,19 @@ bool sqlite_sram_delete_tagged(int64_t snapshot_id)
 	const int slot = sqlite_sram_find_ui_slot();
 	if (slot < 0) return false;
 
-	sqlite3 *db = nullptr;
-	if (!sqlite_sram_open_db(g_slots[slot].db_path, &db)) return false;
-	if (!sqlite_sram_exec(db, "BEGIN IMMEDIATE;"))
-	{
-		sqlite3_close(db);
-		return false;
-	}
+	sqlite_sram_conn_t *conn = sqlite_sram_ui_conn(slot);
+	if (!conn) return false;
+
+	sqlite3 *db = conn->db;
+	if (!sqlite_sram_exec(db, "BEGIN IMMEDIATE;")) return false;
 
 	bool ok = false;
 	sqlite3_stmt *stmt = nullptr;
 
-	bool have_tombstones = false;
-	if (!sqlite_sram_table_exists(db, "snapshot_tombstones", &have_tombstones))
+	const bool have_tombstones = conn->have_tombstones;
+	if (!have_tombstones)
 	{
 		fprintf(stderr, "SQLite SRAM warning: tombstone table missing; cannot delete tagged snapshot yet.\n");
-		have_tombstones = false;
 	}
 
 	if (have_tombstones && sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO snapshot_tombstones(snapshot_id, ts_ms) SELECT id, ?1 FROM snapshots WHERE id = ?2 AND tag IS NOT NULL LIMIT 1;", -1, &stmt, 0) == SQLITE_OK)
@@ -1323,10 +1854,35 @@ bool sqlite_sram_delete_tagged(int64_t snapshot_id)
 	if (ok) ok = sqlite_sram_exec(db, "COMMIT;");
 	if (!ok) sqlite_sram_exec(db, "ROLLBACK;");
 
-	sqlite3_close(db);
+	conn->last_valid = false;
 	return ok;
 #else
 	(void)snapshot_id;
 	return false;
 #endif
 }
+
+void sqlite_sram_flush_all()
+{
+#if SQLITE_SRAM_SNAPSHOTS
+	for (uint8_t i = 0; i < SQLITE_SRAM_MAX_SLOTS; i++)
+	{
+		sqlite_sram_queue_flush(i);
+		sqlite_sram_drain(i);
+	}
+#endif
+}
+
+void sqlite_sram_print_stats()
+{
+#if SQLITE_SRAM_SNAPSHOTS
+	const uint64_t jobs = g_stats.saved + g_stats.unchanged + g_stats.failed;
+	printf("sqlite_sram: %llu images queued (%llu coalesced), %llu saved, %llu unchanged, %llu failed\n",
+		g_stats.queued, g_stats.coalesced, g_stats.saved, g_stats.unchanged, g_stats.failed);
+	printf("sqlite_sram: %llu keyframes, %llu deltas, %llu KB of images stored in %llu KB\n",
+		g_stats.keyframes, g_stats.deltas, g_stats.image_bytes / 1024, g_stats.stored_bytes / 1024);
+	printf("sqlite_sram: flush avg/max %llu/%llu us, %llu history cleanups (avg %llu us), %llu waits for the worker (%llu us)\n",
+		jobs ? g_stats.flush_us / jobs : 0, g_stats.flush_max_us, g_stats.gc, g_stats.gc ? g_stats.gc_us / g_stats.gc : 0,
+		g_stats.drains, g_stats.drain_us);
+#endif
+}
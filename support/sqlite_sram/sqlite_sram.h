@@ -19,5 +19,7 @@ bool sqlite_sram_tag_latest(const char *tag);
 int sqlite_sram_list_tagged(sram_store_tagged_snapshot_t *out, int max_items);
 bool sqlite_sram_restore_tagged(int64_t snapshot_id);
 bool sqlite_sram_delete_tagged(int64_t snapshot_id);
+void sqlite_sram_flush_all();
+void sqlite_sram_print_stats();
 
 #endif
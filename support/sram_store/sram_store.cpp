@@ -53,3 +53,13 @@ bool sram_store_delete_tagged(int64_t snapshot_id)
 {
 	return sqlite_sram_delete_tagged(snapshot_id);
 }
+
+void sram_store_flush_all()
+{
+	sqlite_sram_flush_all();
+}
+
+void sram_store_print_stats()
+{
+	sqlite_sram_print_stats();
+}
@@ -26,4 +26,8 @@ int sram_store_list_tagged(sram_store_tagged_snapshot_t *out, int max_items);
 bool sram_store_restore_tagged(int64_t snapshot_id);
 bool sram_store_delete_tagged(int64_t snapshot_id);
 
+// Waits until all saves queued for the background writer are stored.
+void sram_store_flush_all();
+void sram_store_print_stats();
+
 #endif
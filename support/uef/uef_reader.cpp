@@ -29,6 +29,8 @@
 #include <time.h>
 #include <assert.h>
 
+#include <vector>
+
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../menu.h"
@@ -58,271 +60,236 @@ typedef struct {
     uint32_t    pre_carrier;
 } __attribute__((packed)) ChunkInfo;
 
-// TODO - allocate this as part of the desc structure
-static ChunkInfo s_ChunkData = { 0,0,0,0,0,0 };
-
-
-
-static uint16_t ReadChunkHeader(FILE* f, ChunkInfo* chunk)
+static bool ReadTape(const std::vector<uint8_t> &tape, uint64_t offset, void *dst, uint32_t len)
 {
-    chunk->id = -1;
-    chunk->length = 0;
-
-    if (fread(chunk, 1, UEF_ChunkHeaderSize, f) != UEF_ChunkHeaderSize) {
-        return (-1);
+    if (offset + len > tape.size()) {
+        return false;
     }
 
-    //fprintf(stderr, "ReadChunkHeader: chunk->id %d chunk->length %d\n", chunk->id,chunk->length);
-    return chunk->id;
+    memcpy(dst, tape.data() + offset, len);
+    return true;
 }
 
-static ChunkInfo* GetChunkAtPosFile(FILE *f, uint32_t* p_bit_pos)
+// Walks the chunk list once and keeps the chunks that produce bits, with
+// their bit ranges. Returns the length of the tape in bits.
+static uint32_t ParseChunks(const std::vector<uint8_t> &tape, std::vector<ChunkInfo> &chunks)
 {
-    uint32_t bit_pos = *p_bit_pos;
-    uint8_t length_check = (bit_pos == 0xffffffff);
-    ChunkInfo* chunk = &s_ChunkData;
-
-    //fprintf(stderr, "Find pos : %d\n", bit_pos);
-
-    if (chunk->bit_offset_start <= bit_pos && bit_pos < chunk->bit_offset_end) {
-        bit_pos -= chunk->bit_offset_start;
-        *p_bit_pos = bit_pos;
-        return chunk;
-    }
-
+    uint64_t offset = 12;     // sizeof(UEF_header)
     uint32_t chunk_start = 0;
-    uint32_t chunk_bitlen = 0;
-
-    if (chunk->bit_offset_end != 0 && bit_pos >= chunk->bit_offset_end) {
-        fseek(f, chunk->file_offset + chunk->length, SEEK_SET);
-        chunk_start = chunk->bit_offset_end;
-        bit_pos -= chunk_start;
-
-    } else {
-        fseek(f, 12, SEEK_SET);     // sizeof(UEF_header)
-    }
-
-    chunk->bit_offset_end = 0;
 
-    while (!feof(f)) {
-        uint16_t id = ReadChunkHeader(f, chunk);
+    while (1) {
+        ChunkInfo chunk = {};
 
-        if (id == (uint16_t) - 1) {
+        if (!ReadTape(tape, offset, &chunk, UEF_ChunkHeaderSize)) {
             break;
         }
 
-        //fprintf(stderr, "Parse ChunkID : %04x - Length : %4d bytes (%04x) - Offset = %d\n", chunk->id, chunk->length, chunk->length, (uint32_t)ftell(f));
-        chunk->file_offset = ftell(f);
+        //fprintf(stderr, "Parse ChunkID : %04x - Length : %4d bytes (%04x) - Offset = %d\n", chunk.id, chunk.length, chunk.length, (uint32_t)offset);
+        chunk.file_offset = offset + UEF_ChunkHeaderSize;
+        offset = (uint64_t)chunk.file_offset + chunk.length;
+
+        uint16_t id = chunk.id;
 
         if (UEF_tapeID == id || UEF_gapID == id || UEF_highToneID == id || UEF_highDummyID == id) {
 
+            uint32_t chunk_bitlen = 0;
+
             if (id == UEF_tapeID) {
-                chunk_bitlen = chunk->length * 10;
+                chunk_bitlen = chunk.length * 10;
 
             } else if (id == UEF_gapID || id == UEF_highToneID) {
                 uint16_t ms;
 
-                if (fread(&ms, 1, sizeof(ms), f) != sizeof(ms)) {
+                if (!ReadTape(tape, chunk.file_offset, &ms, sizeof(ms))) {
                     break;
                 }
 
                 chunk_bitlen = ms * (UEF_Baud / 1000.0);
-                fseek(f, -sizeof(ms), SEEK_CUR);
 
             } else if (id == UEF_highDummyID) {
-                uint16_t ms;
-
-                if (fread(&ms, 1, sizeof(ms), f) != sizeof(ms)) {
-                    break;
-                }
-
-                chunk->pre_carrier = ms * (UEF_Baud / 1000.0);
+                uint16_t ms[2];
 
-                if (fread(&ms, 1, sizeof(ms), f) != sizeof(ms)) {
+                if (!ReadTape(tape, chunk.file_offset, ms, sizeof(ms))) {
                     break;
                 }
 
-                uint32_t post_carrier = ms * (UEF_Baud / 1000.0);
-                chunk_bitlen = chunk->pre_carrier + 20 + post_carrier;
-                fseek(f, -sizeof(ms) * 2, SEEK_CUR);
+                chunk.pre_carrier = ms[0] * (UEF_Baud / 1000.0);
+                uint32_t post_carrier = ms[1] * (UEF_Baud / 1000.0);
+                chunk_bitlen = chunk.pre_carrier + 20 + post_carrier;
             }
 
-            if (bit_pos < chunk_bitlen) {
-                chunk->bit_offset_start = chunk_start;
-                chunk->bit_offset_end = chunk_start + chunk_bitlen;
-                break;
+            if (chunk_bitlen) {
+                chunk.bit_offset_start = chunk_start;
+                chunk.bit_offset_end = chunk_start + chunk_bitlen;
+                chunks.push_back(chunk);
             }
 
-            bit_pos -= chunk_bitlen;
             chunk_start += chunk_bitlen;
 
-        } else if (length_check) {
-
-            if (UEF_infoID == id) {
-                char buffer[64];
-                uint32_t length = chunk->length;
+        } else if (UEF_infoID == id) {
+            uint32_t length = chunk.length;
 
-                while (length > 0) {
-                    uint32_t read_len = length;
+            if (chunk.file_offset + length > tape.size()) {
+                length = (chunk.file_offset < tape.size()) ? tape.size() - chunk.file_offset : 0;
+            }
 
-                    if (read_len > sizeof(buffer) - 1) {
-                        read_len = sizeof(buffer) - 1;
-                    }
+            fprintf(stderr, "Drv02:UEF Info : '%.*s'", (int)length, (const char *)tape.data() + chunk.file_offset);
 
-                    if (fread(buffer, 1, read_len, f) != read_len) {
-                        break;
-                    }
+        } else if (UEF_freqChgID == id) {
+            float freq;
 
-                    buffer[read_len] = '\0';
-                    fprintf(stderr, "Drv02:UEF Info : '%s'", buffer);
+            if (!ReadTape(tape, chunk.file_offset, &freq, sizeof(freq))) {
+                break;
+            }
 
-                    length -= read_len;
-                }
+            fprintf(stderr, "Drv02:Ignoring base frequency change : %d", (int)freq);
 
-            } else if (UEF_freqChgID == id) {
-                float freq;
+        } else if (UEF_floatGapID == id) {
+            float gap;
 
-                if (fread(&freq, 1, sizeof(freq), f) != sizeof(freq)) {
-                    break;
-                }
+            if (!ReadTape(tape, chunk.file_offset, &gap, sizeof(gap))) {
+                break;
+            }
 
-                fprintf(stderr, "Drv02:Ignoring base frequency change : %d", (int)freq);
+            fprintf(stderr, "Drv02:Ignoring floating point gap : %d ms", (int)(gap * 1000.f));
 
-            } else if (UEF_floatGapID == id) {
-                float gap;
+        } else if (UEF_securityID == id) {
 
-                if (fread(&gap, 1, sizeof(gap), f) != sizeof(gap)) {
-                    break;
-                }
+            fprintf(stderr, "Drv02:UEF security block ignored");
 
-                fprintf(stderr, "Drv02:Ignoring floating point gap : %d ms", (int)(gap * 1000.f));
+        } else {
+            fprintf(stderr, "Drv02:Unknown UEF block ID %04x", id);
+        }
+    }
 
-            } else if (UEF_securityID == id) {
+    return chunk_start;
+}
 
-                fprintf(stderr, "Drv02:UEF security block ignored");
+#define BUFLEN      16384
+#define CHUNK 16384
 
-            } else {
-                fprintf(stderr, "Drv02:Unknown UEF block ID %04x", id);
-            }
+#define kBufferSize 4096
 
-            fseek(f, chunk->file_offset, SEEK_SET);
-        }
+// Packs the tape bits MSB first and sends them in kBufferSize blocks.
+typedef struct {
+    uint8_t     buf[kBufferSize];
+    uint32_t    len;
+    uint64_t    acc;
+    uint32_t    acc_bits;
+    uint32_t    sent;
+    uint32_t    size;
+    fileTYPE    *file;
+    int         use_progress;
+} BitWriter;
+
+static void FlushBits(BitWriter *w)
+{
+    if (w->use_progress) ProgressMessage("Loading", w->file->name, w->sent, w->size);
+    user_io_file_tx_data(w->buf, w->len);
+    w->sent += w->len;
+    w->len = 0;
+}
 
-        fseek(f, chunk->length, SEEK_CUR);
-    }
+// n <= 32, first bit in bit n-1 of bits
+static void PutBits(BitWriter *w, uint32_t bits, uint32_t n)
+{
+    w->acc = (w->acc << n) | bits;
+    w->acc_bits += n;
 
-    /*DEBUG(1, "OK!");*/
+    while (w->acc_bits >= 8) {
+        w->acc_bits -= 8;
+        w->buf[w->len++] = w->acc >> w->acc_bits;
 
-    *p_bit_pos = bit_pos;
-    return chunk->bit_offset_end ? chunk : 0;
+        if (w->len == kBufferSize) {
+            FlushBits(w);
+        }
+    }
 }
 
-static uint8_t GetBitAtPos(FILE *f, uint32_t bit_pos)
+static void PutRun(BitWriter *w, uint8_t bit, uint32_t n)
 {
-    ChunkInfo* info = GetChunkAtPosFile(f, &bit_pos);
-
-    if (!info) {
-        return 0;
+    while (n >= 32) {
+        PutBits(w, bit ? 0xffffffff : 0, 32);
+        n -= 32;
     }
 
-    uint16_t id = info->id;
-
-    if (id == UEF_gapID) {
-        return 0;
-
-    } else if (id == UEF_highToneID) {
-        return 1;
+    if (n) {
+        PutBits(w, bit ? (1 << n) - 1 : 0, n);
     }
+}
 
-    if (id == UEF_tapeID) {
+// start bit, data bits LSB first, stop bit
+static void PutByte(BitWriter *w, uint8_t byte)
+{
+    uint32_t rev = byte;
+    rev = ((rev & 0xf0) >> 4) | ((rev & 0x0f) << 4);
+    rev = ((rev & 0xcc) >> 2) | ((rev & 0x33) << 2);
+    rev = ((rev & 0xaa) >> 1) | ((rev & 0x55) << 1);
 
-        uint32_t byte_offset = bit_pos / 10;
-        uint32_t bit_offset = bit_pos - byte_offset * 10;
+    PutBits(w, (UEF_startBit << 9) | (rev << 1) | UEF_stopBit, 10);
+}
 
-        if (bit_offset == 0) {
-            return UEF_startBit;
-        }
+static void RenderChunk(BitWriter *w, const std::vector<uint8_t> &tape, const ChunkInfo *info)
+{
+    uint32_t bitlen = info->bit_offset_end - info->bit_offset_start;
 
-        if (bit_offset == 9) {
-            return UEF_stopBit;
-        }
+    if (info->id == UEF_gapID) {
+        PutRun(w, 0, bitlen);
 
-        uint8_t byte;
-        fseek(f, info->file_offset + byte_offset, SEEK_SET);
-        int ret=fread(&byte, 1, sizeof(byte), f);
-        if (ret<0) fprintf(stderr,"uef: error reading byte\n");
+    } else if (info->id == UEF_highToneID) {
+        PutRun(w, 1, bitlen);
 
-        bit_offset -= 1;        // E (0,7)
-        assert(bit_offset < 8);
+    } else if (info->id == UEF_tapeID) {
+        const uint8_t *data = tape.data() + info->file_offset;
+        uint32_t avail = (info->file_offset < tape.size()) ? tape.size() - info->file_offset : 0;
 
-        return (byte & (1 << bit_offset)) ? 1 : 0;
-    }
+        for (uint32_t i = 0; i < info->length; i++) {
+            // bytes past the end of a truncated tape are sent as 0
+            PutByte(w, (i < avail) ? data[i] : 0);
+        }
 
-    assert(id == UEF_highDummyID);
+    } else {
+        assert(info->id == UEF_highDummyID);
 
-    if ((bit_pos < info->pre_carrier) || (bit_pos >= info->pre_carrier + 20)) {
-        return 1;
+        PutRun(w, 1, info->pre_carrier);
+        PutByte(w, 'A');
+        PutByte(w, 'A');
+        PutRun(w, 1, bitlen - info->pre_carrier - 20);
     }
+}
 
-    bit_pos -= info->pre_carrier;
-    bit_pos %= 10;
+static int uef_copy_file(fileTYPE *source, std::vector<uint8_t> &dest)
+{
+    dest.resize(source->size);
 
-    if (bit_pos == 0) {
-        return UEF_startBit;
+    // whatever was read before an error is kept and rendered, as before
+    size_t have = 0;
+    int num_bytes = 0;
+    while (have < dest.size() && (num_bytes = FileReadAdv(source, dest.data() + have, dest.size() - have, -1)) > 0) {
+        have += num_bytes;
     }
+    dest.resize(have);
 
-    if (bit_pos == 9) {
-        return UEF_stopBit;
+    if (num_bytes < 0) {
+        fprintf(stderr,"uef_copy_file: error reading data\n");
+        return -1;
     }
 
-    bit_pos -= 1;       // E (0,7)
-    assert(bit_pos < 8);
-    uint8_t byte = 'A';
-
-    return (byte & (1 << bit_pos)) ? 1 : 0;
-}
-
-#define BUFLEN      16384
-#define CHUNK 16384
-
-#define kBufferSize 4096
-
-static int uef_copy_file(fileTYPE *source, FILE *dest)
-{
-unsigned char in[CHUNK];
-int num_bytes;
-
-
-  do {
-       num_bytes = FileReadAdv(source, in, CHUNK,-1);
-       fprintf(stderr,"fread: %d\n",num_bytes);
-       if (num_bytes<0) {
-           fprintf(stderr,"uef_copy_file: error reading data\n");
-           return -1;
-       }
-       if (fwrite(in, 1, num_bytes, dest) != (size_t)num_bytes || ferror(dest)) {
-           fprintf(stderr,"uef_copy_file: error writing data\n");
-           return -1;
-       }
-   } while (num_bytes!=0);
-
-  return 0;
+    return 0;
 }
 
-/* Decompress from file source to file dest until stream ends or EOF.
+/* Decompress from file source to dest until stream ends or EOF.
    inf() returns Z_OK on success, Z_MEM_ERROR if memory could not be
    allocated for processing, Z_DATA_ERROR if the deflate data is
    invalid or incomplete, Z_VERSION_ERROR if the version of zlib.h and
    the version of the library linked do not match, or Z_ERRNO if there
-   is an error reading or writing the files. */
-static int uef_inflate_file(fileTYPE *source, FILE *dest)
+   is an error reading the file. */
+static int uef_inflate_file(fileTYPE *source, std::vector<uint8_t> &dest)
 {
 
     int ret;
-    unsigned have;
     z_stream strm;
     unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
 
     /* allocate inflate state */
     strm.zalloc = Z_NULL;
@@ -351,13 +318,14 @@ static int uef_inflate_file(fileTYPE *source, FILE *dest)
         /* run inflate() on input until output buffer not full */
         do {
 
+            size_t have = dest.size();
+            dest.resize(have + CHUNK);
             strm.avail_out = CHUNK;
-            strm.next_out = out;
-
-
+            strm.next_out = dest.data() + have;
 
             ret = inflate(&strm, Z_NO_FLUSH);
             assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
+            dest.resize(dest.size() - strm.avail_out);
             switch (ret) {
             case Z_NEED_DICT:
                 ret = Z_DATA_ERROR;     /* and fall through */
@@ -374,12 +342,6 @@ static int uef_inflate_file(fileTYPE *source, FILE *dest)
             break;
             }
 
-            have = CHUNK - strm.avail_out;
-            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
-                (void)inflateEnd(&strm);
-                return Z_ERRNO;
-            }
-
         } while (strm.avail_out == 0);
 
         /* done when inflate() says it's done */
@@ -392,9 +354,7 @@ static int uef_inflate_file(fileTYPE *source, FILE *dest)
 
 int UEF_FileSend(fileTYPE *inputfile,int use_progress)
 {
-        uint32_t buf_size=kBufferSize;
-        unsigned char fbuf[kBufferSize];
-        int addr=0;
+        uint8_t magic[2];
 
         typedef struct {
             char    ueftag[10];
@@ -403,12 +363,9 @@ int UEF_FileSend(fileTYPE *inputfile,int use_progress)
         } UEF_header;
         UEF_header header;
 
-
-
-
         // the UAE file might be gzipped, if so we need to ungzip it
         // gzip : 1f 8b
-        if ( FileReadAdv(inputfile, &fbuf,2) !=2)
+        if ( FileReadAdv(inputfile, &magic,2) !=2)
         {
                 fprintf(stderr,"error reading 2 bytes of file\n");
                 return 0;
@@ -416,21 +373,20 @@ int UEF_FileSend(fileTYPE *inputfile,int use_progress)
         // we need to rewind to the beginning
         FileSeek(inputfile, 0, SEEK_SET);
 
-        FILE *uncompressed_file= tmpfile();
+        // the whole tape is kept in memory, they are a few hundred KB at most
+        std::vector<uint8_t> tape;
 
         // 1f 8b is the gzip magic number
-        if (fbuf[0]==0x1f && fbuf[1]==0x8b) {
+        if (magic[0]==0x1f && magic[1]==0x8b) {
             fprintf(stderr,"UEF is compressed\n");
-            uef_inflate_file(inputfile, uncompressed_file);
+            uef_inflate_file(inputfile, tape);
         }
         else {
-            uef_copy_file(inputfile,uncompressed_file);
+            uef_copy_file(inputfile, tape);
             fprintf(stderr,"UEF is not compressed\n");
         }
 
-        rewind(uncompressed_file);
-
-        if (fread(&header, 1, sizeof(UEF_header), uncompressed_file) != sizeof(UEF_header)) {
+        if (!ReadTape(tape, 0, &header, sizeof(UEF_header))) {
             fprintf(stderr,"Couldn't read file header\n");
 
         } else if (memcmp(header.ueftag, "UEF File!\0", sizeof(header.ueftag)) != 0) {
@@ -439,23 +395,13 @@ int UEF_FileSend(fileTYPE *inputfile,int use_progress)
 
         } else {
             fprintf(stderr,"UEF: %s %d %d\n",header.ueftag,header.minor_version,header.major_version);
-
-            // figure out how big the file is
-            fseek(uncompressed_file, 0L, SEEK_END);
-            uint32_t size =ftell(uncompressed_file);
-            fprintf(stderr,"size: %d\n",size);
-            rewind(uncompressed_file);
-//FILE *outfile = fopen("tape.raw","wb");
-
+            fprintf(stderr,"size: %d\n",(uint32_t)tape.size());
 
             //
-            //  Read the header to find out how big the audio file should be
+            //  Walk the chunks to find out how big the audio file should be
             //
-            memset(&s_ChunkData, 0x00, sizeof(ChunkInfo));
-            uint32_t numbits = 0xffffffff;
-            GetChunkAtPosFile(uncompressed_file,&numbits);
-
-            numbits = ~numbits;
+            std::vector<ChunkInfo> chunks;
+            uint32_t numbits = ParseChunks(tape, chunks);
 
             uint32_t bits_per_second = 1225;
             fprintf(stderr, "Bit length  : %d\n", numbits);
@@ -463,49 +409,26 @@ int UEF_FileSend(fileTYPE *inputfile,int use_progress)
             fprintf(stderr, "Byte length : %d\n", (numbits + 7) / 8);
 
             // size is the output size of the file we are creating (or dynamically sending)
-            size= (numbits + 7) / 8;
-            uint32_t  orig_size=size;
-
+            uint32_t size = (numbits + 7) / 8;
             fprintf(stderr,"output size: %d\n",size);
 
-            // clear the header
-            memset(&s_ChunkData, 0x00, sizeof(ChunkInfo));
-            uint32_t tot_size=0;
-            uint32_t cur_size=0;
-            uint32_t act_size=0;
-
-            while (size) {
-                cur_size= size;
-                if (cur_size>  buf_size) cur_size=buf_size;
-                act_size=cur_size;
-                // artifically clamp size to the end of the bit stream
-                if (addr + act_size >  orig_size)
-                   act_size = orig_size  - addr;
-
-               tot_size+=act_size;
-               // this is a very naive conversion, but it'll have to do for now..
-               for (uint32_t pos = 0; pos < act_size; ++pos) {
-                   uint8_t val = 0;
-                   for (uint32_t bit = 0; bit < 8; ++bit) {
-                      val = val << 1;
-                      val = val | GetBitAtPos(uncompressed_file, ((addr + pos) << 3) + bit);
-                   }
-
-                   fbuf[pos] = val;
-               }
-               if (use_progress) ProgressMessage("Loading", inputfile->name, orig_size-size  , orig_size);
-               user_io_file_tx_data(fbuf, act_size);
-               if (act_size!=cur_size)
-                  fprintf(stderr,"truncated?\n");
-//fwrite(fbuf,1,act_size,outfile);
-               size -= cur_size;
-               addr += cur_size;
+            BitWriter w = {};
+            w.size = size;
+            w.file = inputfile;
+            w.use_progress = use_progress;
+
+            for (const ChunkInfo &chunk : chunks) {
+                RenderChunk(&w, tape, &chunk);
             }
-         fclose(uncompressed_file);
 
-//fclose(outfile);
+            // the last byte is padded with 0
+            if (w.acc_bits) {
+                PutBits(&w, 0, 8 - w.acc_bits);
+            }
+
+            if (w.len) {
+                FlushBits(&w);
+            }
       }
   return 0;
 }
-
-
@@ -30,11 +30,13 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <time.h>
 
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "../../hardware.h"
@@ -42,6 +44,7 @@
 #include "../../file_io.h"
 #include "../../cfg.h"
 #include "../../shmem.h"
+#include "../../share_cache.h"
 
 #define SHMEM_ADDR      0x300CE000
 #define SHMEM_SIZE      0x2000
@@ -96,65 +99,54 @@ enum AL_SUBFUNCTIONS {
 static char basepath[1024] = {};
 static int baselen = 0;
 
-struct dir_item_t
-{
-	dirent64 de;
-	stat64 st;
-};
-
 struct lock
 {
 	uint16_t token;
-	std::vector<dir_item_t> dir_items;
+	share_dir_ptr dir;
+	std::vector<uint32_t> items; // matching entries of dir, UINT32_MAX for the volume label
 };
 
-static std::map<short, lock> locks;
-static short next_key = 0;
-
-static short get_key()
-{
-	short key;
-
-	do
-	{
-		next_key++;
-		if (!next_key) next_key++;
-		key = next_key;
-
-	} while (locks.find(key) != locks.end());
-
-	return key;
-}
+// 10 bits of slot and 5 of generation keep the keys positive shorts
+static share_handles_t<lock, 10, 5> locks;
+static std::unordered_map<uint16_t, short> lock_tokens;
 
 static short get_lock(const uint16_t token)
 {
-	for (const auto &pair : locks)
-	{
-		if (pair.second.token == token)
-		{
-			dbg_print("! token %u has lock: %d\n", token, pair.first);
-			return pair.first;
-		}
-	}
-	return 0;
+	auto it = lock_tokens.find(token);
+	if (it == lock_tokens.end()) return 0;
+
+	dbg_print("! token %u has lock: %d\n", token, it->second);
+	return it->second;
 }
 
+// 0 if all keys are in use
 static short add_lock(const uint16_t token)
 {
 	short key = get_lock(token);
 	if (key)
 	{
-		locks[key].dir_items.clear();
+		lock *l = locks.get(key);
+		l->dir.reset();
+		l->items.clear();
 	}
 	else
 	{
-		key = get_key();
-		locks[key] = { token, {} };
+		key = locks.add({ token, nullptr, {} });
+		if (key) lock_tokens[token] = key;
 		dbg_print("+ add lock: %d, %u\n", key, token);
 	}
 	return key;
 }
 
+static void del_lock(short key)
+{
+	lock *l = locks.get(key);
+	if (!l) return;
+
+	lock_tokens.erase(l->token);
+	locks.erase(key);
+}
+
 static std::map<short, fileTYPE> open_file_handles;
 static short next_fp = 1;
 
@@ -259,7 +251,7 @@ static char* find_path(const char *name)
 		else
 		{
 			*p = 0;
-			if (!PathIsDir(str, 0)) str[0] = 0;
+			if (!share_cache_isdir(str)) str[0] = 0;
 			else *p = '/';
 		}
 	}
@@ -291,78 +283,23 @@ static uint32_t get_attr(char *path, uint16_t *time, uint16_t *date, uint32_t *s
 	if (date) *date = 0;
 	if (size) *size = 0;
 
-	stat64 *st = getPathStat(path);
-	if (!st) return 0;
+	share_stat_t st;
+	if (!share_cache_stat(path, &st)) return 0;
 
-	tm *t = localtime(&st->st_mtime);
+	time_t mtime = st.mtime;
+	tm *t = localtime(&mtime);
 	if (time) *time = (t->tm_sec / 2) | (t->tm_min << 5) | (t->tm_hour << 11);
 	if (date) *date = t->tm_mday | ((t->tm_mon + 1) << 5) | ((t->tm_year - 80) << 9);
-	if (size) *size = st->st_size;
-	return st->st_mode;
+	if (size) *size = st.size;
+	return st.mode;
 }
 
-static void name83(const char *src, char *dst)
+// name and flt in the 8.3 form of share_name83()
+static int match83(const char *name, const char *flt)
 {
-	int namelen = 0;
-	int extlen = 0;
-
-	const char *p = strrchr(src, '/');
-	if (p) src = p + 1;
-
-	if (!strcmp(src, ".") || !strcmp(src, ".."))
-	{
-		namelen = strlen(src);
-	}
-	else
-	{
-		p = strrchr(src, '.');
-		if (!p) namelen = strlen(src);
-		else
-		{
-			namelen = p - src;
-			extlen = strlen(src) - namelen - 1;
-		}
-	}
-
-
-	char ext[4] = { ' ', ' ', ' ', 0 };
-	if (p) memcpy(ext, p + 1, extlen);
-	for (int i = 0; i < namelen; i++) dst[i] = toupper(src[i]);
-	while (namelen < 8) dst[namelen++] = ' ';
-	for (int i = 0; i < 3; i++) dst[8 + i] = toupper(ext[i]);
-}
-
-static int cmp_name(const char *name, const char *flt)
-{
-	int namelen = 0;
-	int extlen = 0;
-
-	const char *ext = strrchr(name, '.');
-	if (!ext)
-	{
-		namelen = strlen(name);
-		ext = name + namelen;
-	}
-	else
-	{
-		namelen = ext - name;
-		ext++;
-		extlen = strlen(ext);
-	}
-
-	if (namelen > 8 || extlen > 3) return 0;
-
-	char testname[16];
-	char fltname[16];
-	name83(name, testname);
-	name83(flt, fltname);
-
-	testname[11] = 0;
-	fltname[11] = 0;
-
-	char *cmpname = fltname;
-	char *cmpend = fltname + 8;
-	char *cur = testname;
+	const char *cmpname = flt;
+	const char *cmpend = flt + 8;
+	const char *cur = name;
 
 	while (cmpname < cmpend)
 	{
@@ -381,9 +318,9 @@ static int cmp_name(const char *name, const char *flt)
 		}
 	}
 
-	cmpname = fltname + 8;
-	cmpend = fltname + 11;
-	cur = testname + 8;
+	cmpname = flt + 8;
+	cmpend = flt + 11;
+	cur = name + 8;
 
 	while (cmpname < cmpend)
 	{
@@ -523,7 +460,7 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
-		if (!FileExists(path, 0))
+		if (!share_cache_isfile(path))
 		{
 			res = 2;
 			break;
@@ -544,7 +481,7 @@ static int process_request(void *reqres_buffer)
 		dbg_print("opened handle: %d\n", key);
 
 		*buf++ = 0;
-		name83(path, buf);
+		share_name83(path, buf);
 		buf += 11;
 		get_attr(path, (uint16_t*)buf, (uint16_t*)(buf + 2), (uint32_t*)(buf + 4));
 		buf += 8;
@@ -604,7 +541,7 @@ static int process_request(void *reqres_buffer)
 		dbg_print("opened handle: %d\n", key);
 
 		*buf++ = 0;
-		name83(path, buf);
+		share_name83(path, buf);
 		buf += 11;
 		get_attr(path, (uint16_t*)buf, (uint16_t*)(buf + 2), (uint32_t*)(buf + 4));
 		buf += 8;
@@ -645,7 +582,7 @@ static int process_request(void *reqres_buffer)
 		int mode = openmode & 0x3;
 		uint16_t spopres = 0;
 
-		if (FileExists(path, 0))
+		if (share_cache_isfile(path))
 		{
 			if ((actioncode & 0xF) == 1)
 			{
@@ -691,7 +628,7 @@ static int process_request(void *reqres_buffer)
 		dbg_print("opened handle: %d\n", key);
 
 		*buf++ = 0;
-		name83(path, buf);
+		share_name83(path, buf);
 		buf += 11;
 		get_attr(path, (uint16_t*)buf, (uint16_t*)(buf + 2), (uint32_t*)(buf + 4)); // 12 14 16
 		buf += 8;
@@ -883,7 +820,7 @@ static int process_request(void *reqres_buffer)
 		*buf++ = sz >> 8;
 		*buf++ = sz >> 16;
 		*buf++ = sz >> 24;
-		*buf++ = (mode & S_IFDIR) ? FAT_DIR : 0;
+		*buf++ = S_ISDIR(mode) ? FAT_DIR : 0;
 		*buf++ = 0;
 
 		res = 0;
@@ -973,22 +910,26 @@ static int process_request(void *reqres_buffer)
 
 		*flt++ = 0;
 		key = add_lock(token);
+		if (!key)
+		{
+			printf("No free search keys\n");
+			res = 0x12;
+			break;
+		}
 
-		const char* full_path = getFullPath(path);
-		DIR *d = opendir(full_path);
-		if (!d)
+		share_dir_ptr dir = share_cache_dir(path);
+		if (!dir)
 		{
-			locks.erase(key);
-			printf("Couldn't open dir: %s\n", full_path);
+			del_lock(key);
+			printf("Couldn't open dir: %s\n", getFullPath(path));
 			res = 0x12;
 			break;
 		}
 
+		lock *l = locks.get(key);
 		if (attr == 8)
 		{
-			struct dirent64 de = {};
-			strcpy(de.d_name, "MiSTer");
-			locks[key].dir_items.push_back({ de, {} });
+			l->items.push_back(UINT32_MAX);
 
 			*buf++ = 8;
 			memcpyb(buf, "MiSTer     ", 11);
@@ -1007,24 +948,18 @@ static int process_request(void *reqres_buffer)
 		}
 		else
 		{
-			struct dirent64 de, *de2;
-			while ((de2 = readdir64(d)))
+			char fltname[11];
+			share_name83(flt, fltname);
+
+			for (uint32_t i = 0; i < dir->entries.size(); i++)
 			{
-				if (de2->d_type == DT_REG || (attr & FAT_DIR))
+				const share_entry_t &e = dir->entries[i];
+				if ((e.d_type == DT_REG || (attr & FAT_DIR)) && e.st.mode && e.fits83 && match83(e.name83, fltname))
 				{
-					memcpy(&de, de2, sizeof(dirent64));
-					sprintf(str, "%s/%s", path, de.d_name);
-					stat64 *st = getPathStat(str);
-
-					if (st && cmp_name(de.d_name, flt))
-					{
-						name83(de2->d_name, de.d_name);
-						de.d_name[11] = 0;
-						locks[key].dir_items.push_back({ de, *st });
-					}
+					l->items.push_back(i);
 				}
 			}
-			closedir(d);
+			l->dir = dir;
 		}
 	}
 	// fall through
@@ -1039,7 +974,7 @@ static int process_request(void *reqres_buffer)
 			idx = *(short *)(buf+2);
 			idx++;
 
-			if (locks.find(key) == locks.end())
+			if (!locks.get(key))
 			{
 				dbg_print("Key %d not found\n", key);
 				res = 0x12;
@@ -1047,20 +982,23 @@ static int process_request(void *reqres_buffer)
 			}
 		}
 
-		if (idx >= locks[key].dir_items.size())
+		lock *l = locks.get(key);
+		if (idx >= l->items.size() || l->items[idx] == UINT32_MAX)
 		{
-			if (locks.find(key) != locks.end()) locks.erase(key);
+			del_lock(key);
 
 			dbg_print("No more items\n");
 			res = 0x12;
 			break;
 		}
 
-		*buf++ = (locks[key].dir_items[idx].de.d_type == DT_DIR) ? FAT_DIR : 0;
-		memcpyb(buf, locks[key].dir_items[idx].de.d_name, 11);
+		const share_entry_t &e = l->dir->entries[l->items[idx]];
+		*buf++ = (e.d_type == DT_DIR) ? FAT_DIR : 0;
+		memcpyb(buf, e.name83, 11);
 		buf += 11;
 
-		tm *t = localtime(&locks[key].dir_items[idx].st.st_mtime);
+		time_t mtime = e.st.mtime;
+		tm *t = localtime(&mtime);
 		uint16_t time = (t->tm_sec / 2) | (t->tm_min << 5) | (t->tm_hour << 11);
 		uint16_t date = t->tm_mday | ((t->tm_mon + 1) << 5) | ((t->tm_year - 80) << 9);
 
@@ -1069,7 +1007,8 @@ static int process_request(void *reqres_buffer)
 		*buf++ = date;
 		*buf++ = date >> 8;
 
-		memcpyb(buf, &locks[key].dir_items[idx].st.st_size, 4);
+		uint32_t size = e.st.size;
+		memcpyb(buf, &size, 4);
 		buf += 4;
 		*buf++ = key;
 		*buf++ = key >> 8;
@@ -1158,6 +1097,6 @@ void x86_share_reset()
 {
 	open_file_handles.clear();
 	locks.clear();
+	lock_tokens.clear();
 	next_fp = 1;
-	next_key = 1;
 }
@@ -0,0 +1,29 @@
+#!/usr/bin/env python3
+
+# Generates the UEF test tape: a random mix of the chunk types the renderer
+# handles, plus an unknown one.
+#   gen_uef.py <out.uef> <seed> <chunks>
+# uef_tape.uef is "gen_uef.py uef_tape.uef 24 200", uef_tape.uef.gz is the
+# same file through "gzip -9 -n". uef_tape.out is what the renderer before
+# the single pass one (GetBitAtPos per bit) sent for it.
+
+import struct, random, sys
+
+def chunk(i, d):
+    return struct.pack('<HI', i, len(d)) + d
+
+random.seed(int(sys.argv[2]))
+
+body = chunk(0, b'Test tape generated for comparison')
+for k in range(int(sys.argv[3])):
+    r = random.random()
+    if r < 0.4: body += chunk(0x100, bytes(random.getrandbits(8) for _ in range(random.randint(0, 300))))
+    elif r < 0.55: body += chunk(0x110, struct.pack('<H', random.randint(0, 3000)))
+    elif r < 0.7: body += chunk(0x112, struct.pack('<H', random.randint(0, 3000)))
+    elif r < 0.8: body += chunk(0x111, struct.pack('<HH', random.randint(0, 500), random.randint(0, 500)))
+    elif r < 0.85: body += chunk(0x113, struct.pack('<f', 1200.0))
+    elif r < 0.9: body += chunk(0x116, struct.pack('<f', 0.25))
+    elif r < 0.95: body += chunk(0x114, b'\x01\x02\x03')
+    else: body += chunk(0x1234, b'xyz')
+
+open(sys.argv[1], 'wb').write(b'UEF File!\x00\x0a\x00' + body)
@@ -0,0 +1,141 @@
+// Host check for the Neo Geo ROM conversion kernels: bit for bit against
+// the per element loops neogeo_loader.cpp used before, at whole and partial
+// block sizes, then the throughput of both.
+// Built and run by make HOST=1; the optional argument is the size in MB.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "support/neogeo/neogeo_convert.h"
+
+static void ref_spr_convert(const uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+}
+
+static void ref_spr_convert_dbl(const uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
+}
+
+static void ref_fix_convert(const uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 2) & 7) | ((i & 1) << 3) | (((i & 2) << 3) ^ 0x10)];
+}
+
+static void ref_spr_bswap(uint32_t* buf, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) buf[i] = (buf[i] & 0xFF0000FF) | ((buf[i] & 0xFF00) << 8) | ((buf[i] & 0xFF0000) >> 8);
+}
+
+static uint64_t time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t mbps(uint64_t bytes, uint64_t ns)
+{
+	return ns ? bytes * 1000 / ns : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int mb = (argc > 1) ? atoi(argv[1]) : 0;
+	if (mb <= 0) mb = 4;
+
+	const uint32_t len = 1024 * 1024;
+	uint8_t *in = (uint8_t*)malloc(len * 4);
+	if (!in)
+	{
+		printf("neogeo: no memory for the test.\n");
+		return 1;
+	}
+
+	uint8_t *tmp = in + len;
+	uint8_t *ref = tmp + len;
+	uint8_t *out = ref + len;
+
+	uint32_t seed = 0x12345678;
+	for (uint32_t i = 0; i < len; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		in[i] = seed >> 24;
+	}
+
+	// whole chunks plus partial last blocks, at an unaligned start
+	static const uint32_t sizes[] = { len - 256, 4096, 200, 130, 66, 34, 2 };
+	int ok = 1;
+	for (uint32_t s : sizes)
+	{
+		const uint8_t *src = in + 2;
+
+		memset(out, 0, s);
+		ref_fix_convert(src, ref, s);
+		neogeo_fix_convert(src, out, s);
+		ok &= !memcmp(out, ref, s);
+
+		memset(out, 0, s);
+		ref_spr_convert((const uint16_t*)src, (uint16_t*)ref, s / 2);
+		neogeo_spr_convert((const uint16_t*)src, (uint16_t*)out, s / 2);
+		ok &= !memcmp(out, ref, s & ~1);
+
+		for (int swap = 0; swap < 2; swap++)
+		{
+			memcpy(tmp, src, (s + 127) & ~127);
+			if (swap) ref_spr_bswap((uint32_t*)tmp, ((s + 127) & ~127) / 4);
+			ref_spr_convert_dbl((const uint16_t*)tmp, (uint16_t*)ref, s / 2);
+
+			memset(out, 0, s);
+			neogeo_spr_convert_dbl((const uint16_t*)src, (uint16_t*)out, s / 2, swap);
+			ok &= !memcmp(out, ref, s & ~1);
+		}
+	}
+
+	printf("neogeo: kernels %s the reference loops\n", ok ? "match" : "DO NOT match");
+
+	uint64_t t, ns[8];
+	uint64_t bytes = (uint64_t)mb * len;
+
+	t = time_ns();
+	for (int i = 0; i < mb; i++) ref_fix_convert(in, out, len);
+	ns[0] = time_ns() - t;
+	t = time_ns();
+	for (int i = 0; i < mb; i++) neogeo_fix_convert(in, out, len);
+	ns[1] = time_ns() - t;
+
+	t = time_ns();
+	for (int i = 0; i < mb; i++) ref_spr_convert((const uint16_t*)in, (uint16_t*)out, len / 2);
+	ns[2] = time_ns() - t;
+	t = time_ns();
+	for (int i = 0; i < mb; i++) neogeo_spr_convert((const uint16_t*)in, (uint16_t*)out, len / 2);
+	ns[3] = time_ns() - t;
+
+	t = time_ns();
+	for (int i = 0; i < mb; i++) ref_spr_convert_dbl((const uint16_t*)in, (uint16_t*)out, len / 2);
+	ns[4] = time_ns() - t;
+	t = time_ns();
+	for (int i = 0; i < mb; i++) neogeo_spr_convert_dbl((const uint16_t*)in, (uint16_t*)out, len / 2, 0);
+	ns[5] = time_ns() - t;
+
+	t = time_ns();
+	for (int i = 0; i < mb; i++)
+	{
+		ref_spr_bswap((uint32_t*)in, len / 4);
+		ref_spr_convert_dbl((const uint16_t*)in, (uint16_t*)out, len / 2);
+	}
+	ns[6] = time_ns() - t;
+	t = time_ns();
+	for (int i = 0; i < mb; i++) neogeo_spr_convert_dbl((const uint16_t*)in, (uint16_t*)out, len / 2, 1);
+	ns[7] = time_ns() - t;
+
+	printf("neogeo: MB/s over %d MB, reference/new: fix %llu/%llu, spr %llu/%llu, dbl %llu/%llu, swap+dbl %llu/%llu\n", mb,
+		mbps(bytes, ns[0]), mbps(bytes, ns[1]), mbps(bytes, ns[2]), mbps(bytes, ns[3]),
+		mbps(bytes, ns[4]), mbps(bytes, ns[5]), mbps(bytes, ns[6]), mbps(bytes, ns[7]));
+
+	free(in);
+	return ok ? 0 : 1;
+}
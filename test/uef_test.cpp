@@ -0,0 +1,124 @@
+// Host check for the UEF tape renderer: the bits sent for test/data/uef_tape.uef,
+// plain and gzipped, must match uef_tape.out byte for byte. That output was
+// captured from the per bit GetBitAtPos renderer, which took about 17 ms for
+// this tape on x86-64; the time of the current one is printed.
+// Built and run by make HOST=1; the optional argument is the data folder.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <string>
+
+#include "file_io.h"
+#include "user_io.h"
+#include "menu.h"
+#include "hardware.h"
+#include "support/uef/uef_reader.h"
+
+// The parts of file_io, user_io and menu the renderer uses.
+fileTYPE::fileTYPE()
+{
+	filp = 0;
+	mode = 0;
+	type = 0;
+	zip = 0;
+	size = 0;
+	offset = 0;
+	path[0] = 0;
+	name[0] = 0;
+}
+
+fileTYPE::~fileTYPE()
+{
+	if (filp) fclose(filp);
+}
+
+int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres)
+{
+	size_t ret = fread(pBuffer, 1, length, file->filp);
+	return ferror(file->filp) ? failres : (int)ret;
+}
+
+int FileSeek(fileTYPE *file, __off64_t offset, int origin)
+{
+	return !fseeko(file->filp, offset, origin);
+}
+
+static std::vector<uint8_t> sent;
+
+void user_io_file_tx_data(const uint8_t *addr, uint32_t len)
+{
+	sent.insert(sent.end(), addr, addr + len);
+}
+
+void ProgressMessage(const char*, const char*, int, int)
+{
+}
+
+static int load(const std::string &path, std::vector<uint8_t> &data)
+{
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (!fp)
+	{
+		printf("uef: cannot open %s\n", path.c_str());
+		return 0;
+	}
+
+	uint8_t buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) data.insert(data.end(), buf, buf + n);
+	fclose(fp);
+	return 1;
+}
+
+// renders the tape a few times, returns the fastest run in us
+static uint64_t render(const std::string &path)
+{
+	uint64_t best = 0;
+	for (int i = 0; i < 5; i++)
+	{
+		fileTYPE f;
+		f.filp = fopen(path.c_str(), "rb");
+		if (!f.filp) return 0;
+
+		fseeko(f.filp, 0, SEEK_END);
+		f.size = ftello(f.filp);
+		rewind(f.filp);
+		snprintf(f.name, sizeof(f.name), "%s", path.c_str());
+
+		sent.clear();
+		uint64_t t = time_us();
+		UEF_FileSend(&f, 1);
+		t = time_us() - t;
+		if (!i || t < best) best = t;
+	}
+
+	return best;
+}
+
+int main(int argc, char *argv[])
+{
+	std::string dir = (argc > 1) ? argv[1] : "test/data";
+
+	// the renderer logs to stderr
+	if (!freopen("/dev/null", "w", stderr)) return 1;
+
+	std::vector<uint8_t> golden;
+	if (!load(dir + "/uef_tape.out", golden)) return 1;
+
+	int ok = 1;
+	static const char *tapes[] = { "uef_tape.uef", "uef_tape.uef.gz" };
+	for (const char *name : tapes)
+	{
+		uint64_t us = render(dir + "/" + name);
+		int same = (sent == golden);
+		ok &= same;
+
+		printf("uef: %-16s %u bytes sent, %s, %llu.%03llu ms\n", name, (uint32_t)sent.size(), same ? "identical" : "DIFFERENT",
+			(unsigned long long)(us / 1000), (unsigned long long)(us % 1000));
+	}
+
+	return ok ? 0 : 1;
+}
@@ -10,8 +10,6 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 
-#include "lib/imlib2/Imlib2.h"
-
 #include "hardware.h"
 #include "osd.h"
 #include "user_io.h"
@@ -27,7 +25,7 @@
 #include "sxmlc.h"
 #include "bootcore.h"
 #include "charrom.h"
-#include "scaler.h"
+#include "capture.h"
 #include "miniz.h"
 #include "cheats.h"
 #include "video.h"
@@ -36,6 +34,10 @@
 #include "ide.h"
 #include "ide_cdrom.h"
 #include "profiling.h"
+#include "scheduler.h"
+#include "readahead.h"
+#include "writeback.h"
+#include "file_pipe.h"
 
 #include "support.h"
 #include "support/sram_store/sram_store.h"
@@ -107,6 +109,22 @@ fileTYPE *get_image(int i)
 	return &sd_image[i];
 }
 
+// Save images are also written outside of user_io_poll(), so they bypass the read-ahead.
+static int sd_read_window(int disk, uint64_t off, uint8_t *buf, uint32_t len)
+{
+	int ret = readahead_read(sd_image_cangrow[disk] ? -1 : disk, &sd_image[disk], off, buf, len);
+	if (ret) writeback_overlay(disk, off, buf, len);
+	return ret;
+}
+
+// Save images always write through; other images use the write-back cache if
+// their slot is enabled in sd_writeback.
+static int sd_write_cached(int disk, uint64_t off, uint8_t *buf, uint32_t len)
+{
+	if (sd_image_cangrow[disk] || !(cfg.sd_writeback & (1 << disk))) return 0;
+	return writeback_write(disk, &sd_image[disk], off, buf, len);
+}
+
 static uint32_t uart_mode;
 uint32_t user_io_get_uart_mode()
 {
@@ -2036,6 +2054,8 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 	int len = strlen(name);
 	int img_type = 0; // disk image type (for C128 core): bit 0=dual sided, 1=raw GCR supported, 2=raw MFM supported, 3=high density
 
+	writeback_flush(index);
+	readahead_reset(index);
 	sram_store_before_mount(index);
 	if (pre && sram_store_mount_virtual(index, name, pre_size, &sd_image[index]))
 	{
@@ -2172,6 +2192,7 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 void user_io_bufferinvalidate(unsigned char index)
 {
 	buffer_lba[index] = -1;
+	readahead_invalidate(index);
 }
 
 static unsigned char col_attr[1025];
@@ -2765,6 +2786,28 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 		uint8_t *mem = (uint8_t *)shmem_map(fpga_mem(load_addr), map_size);
 		if (mem)
 		{
+			// the reader thread fills cached buffers and computes the CRC there,
+			// the uncached window only gets written
+			file_pipe_t *pipe = file_pipe_open(&f, bytes2send, !is_snes() && use_cheats, skip);
+			if (pipe)
+			{
+				const uint8_t *data;
+				uint32_t chunk;
+				while ((data = file_pipe_next(pipe, &chunk)))
+				{
+					uint32_t gap = (is_snes() && (load_addr < 0x22000000) && (load_addr + size - bytes2send) >= 0x22000000) ? 0x800000 : 0;
+
+					memcpy(mem + size - bytes2send + gap, data, chunk);
+					file_pipe_release(pipe);
+
+					if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
+					bytes2send -= chunk;
+				}
+
+				file_crc = file_pipe_close(pipe);
+			}
+
+			// no memory for the pipe buffers: read straight into the window
 			while (bytes2send)
 			{
 				uint32_t gap = (is_snes() && (load_addr < 0x22000000) && (load_addr + size - bytes2send) >= 0x22000000) ? 0x800000 : 0;
@@ -2772,7 +2815,7 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 				uint32_t chunk = (bytes2send > (256 * 1024)) ? (256 * 1024) : bytes2send;
 				FileReadAdv(&f, mem + size - bytes2send + gap, chunk);
 
-				if(!is_snes() && use_cheats) file_crc = crc32(file_crc, mem + skip + size - bytes2send, chunk - skip);
+				if (!is_snes() && use_cheats) file_crc = crc32(file_crc, mem + skip + size - bytes2send, chunk - skip);
 				skip = 0;
 
 				if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
@@ -2784,6 +2827,26 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 	}
 	else
 	{
+		file_pipe_t *pipe = NULL;
+		if (dosend && bytes2send && !(is_snes() && (snes_file == SNES_FILE_BS))) pipe = file_pipe_open(&f, bytes2send, 1, skip);
+		if (pipe)
+		{
+			const uint8_t *data;
+			uint32_t chunk;
+			while ((data = file_pipe_next(pipe, &chunk)))
+			{
+				user_io_file_tx_data(data, chunk);
+				file_pipe_release(pipe);
+
+				if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
+				bytes2send -= chunk;
+			}
+
+			file_crc = file_pipe_close(pipe);
+		}
+
+		// BS-X header patching works on the 4K chunks read in place. This is
+		// also the fallback when the pipe buffers can't be allocated.
 		while (dosend && bytes2send)
 		{
 			uint32_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
@@ -3172,6 +3235,8 @@ void user_io_poll()
 				blks = 1;
 			}
 			DisableIO();
+			if (op) scheduler_activity();
+
 			if ( sd_type[disk] == SD_TYPE_A2)
 			{
 				//if (op) printf("A2 %x %llu on %d\n", op,lba, disk);
@@ -3198,6 +3263,7 @@ void user_io_poll()
 				if (use_save) menu_process_save();
 
 				buffer_lba[disk] = -1;
+				readahead_invalidate(disk);
 
 				// Fetch sector data from FPGA ...
 				EnableIO();
@@ -3228,15 +3294,13 @@ void user_io_poll()
 					if (sz && lba <= size)
 					{
 						diskled_on();
-						if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET))
-						{
-							if (!sd_image_cangrow[disk])
-							{
-								__off64_t rem = sd_image[disk].size - sd_image[disk].offset;
-								sz = (rem >= sz) ? sz : (int)rem;
-							}
+						__off64_t rem = sd_image[disk].size - lba * blksz;
+						if (!sd_image_cangrow[disk] && rem < sz) sz = (int)rem;
 
-							if (sz) FileWriteAdv(&sd_image[disk], buffer[disk], sz);
+						if (sz && !sd_write_cached(disk, lba * blksz, buffer[disk], sz) &&
+							FileSeek(&sd_image[disk], lba * blksz, SEEK_SET))
+						{
+							FileWriteAdv(&sd_image[disk], buffer[disk], sz);
 						}
 					}
 				}
@@ -3283,13 +3347,10 @@ void user_io_poll()
 					else if (sd_image[disk].size)
 					{
 						diskled_on();
-						if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET))
+						if (sd_read_window(disk, lba * blksz, buffer[disk], sizeof(buffer[disk])))
 						{
-							if (FileReadAdv(&sd_image[disk], buffer[disk], sizeof(buffer[disk])))
-							{
-								done = 1;
-								buffer_lba[disk] = lba;
-							}
+							done = 1;
+							buffer_lba[disk] = lba;
 						}
 					}
 
@@ -3362,8 +3423,7 @@ void user_io_poll()
 						cdi_read_cd(buffer[disk], lba, buf_n);
 						buffer_lba[disk] = lba;
 					}
-					else if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET) &&
-						FileReadAdv(&sd_image[disk], buffer[disk], sizeof(buffer[disk])))
+					else if (sd_read_window(disk, lba * blksz, buffer[disk], sizeof(buffer[disk])))
 					{
 						buffer_lba[disk] = lba;
 					}
@@ -3680,6 +3740,7 @@ void user_io_poll()
 	}
 	process_ss(0);
 	sram_store_poll();
+	writeback_poll();
 }
 
 static void send_keycode(unsigned short key, int press)
@@ -4227,94 +4288,13 @@ uint16_t user_io_get_sdram_cfg()
 	return sdram_cfg;
 }
 
-static struct { const char *fmtstr; Imlib_Load_Error errno; } err_strings[] = {
-  {"file '%s' does not exist", IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST},
-  {"file '%s' is a directory", IMLIB_LOAD_ERROR_FILE_IS_DIRECTORY},
-  {"permission denied to read file '%s'", IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_READ},
-  {"no loader for the file format used in file '%s'", IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT},
-  {"path for file '%s' is too long", IMLIB_LOAD_ERROR_PATH_TOO_LONG},
-  {"a component of path '%s' does not exist", IMLIB_LOAD_ERROR_PATH_COMPONENT_NON_EXISTANT},
-  {"a component of path '%s' is not a directory", IMLIB_LOAD_ERROR_PATH_COMPONENT_NOT_DIRECTORY},
-  {"path '%s' has too many symbolic links", IMLIB_LOAD_ERROR_TOO_MANY_SYMBOLIC_LINKS},
-  {"ran out of file descriptors trying to access file '%s'", IMLIB_LOAD_ERROR_OUT_OF_FILE_DESCRIPTORS},
-  {"denied write permission for file '%s'", IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_WRITE},
-  {"out of disk space writing to file '%s'", IMLIB_LOAD_ERROR_OUT_OF_DISK_SPACE},
-  {(const char *)NULL, (Imlib_Load_Error) 0}
-};
-
-static void print_imlib_load_error (Imlib_Load_Error err, const char *filepath) {
-  int i;
-  for (i = 0; err_strings[i].fmtstr != NULL; i++) {
-    if (err == err_strings[i].errno) {
-	printf("Screenshot Error (%d): ",err);
-	printf(err_strings[i].fmtstr,filepath);
-	printf("\n");
-      return ;
-    }
-  }
-  /* Unrecognised error */
-    printf("Screenshot Error (%d): unrecognized error accessing file '%s'\n",err,filepath);
-  return ;
-}
-
-bool user_io_screenshot(const char *pngname, int rescale)
+bool user_io_screenshot(const char *pngname, int rescale, capture_done_t done)
 {
-	mister_scaler *ms = mister_scaler_init();
-	if (ms == NULL)
-	{
-		printf("problem with scaler, maybe not a new enough version\n");
-		Info("Scaler not compatible");
-		return false;
-	}
-	else
-	{
-    int scwidth = ms->output_width;
-    int scheight = ms->output_height;
-
-    if (video_get_rotated())
-    {
-
-      //If the video is rotated, the scaled output resolution results in a squished image.
-      //Calculate the scaled output res using the original AR
-      scwidth = scheight * ((float)ms->width/ms->height);
-    }
+	const char *basename = last_filename;
+	if( pngname && *pngname )
+		basename = pngname;
 
-		const char *basename = last_filename;
-		if( pngname && *pngname )
-			basename = pngname;
-		unsigned char *outputbuf = (unsigned char *)calloc(ms->width*ms->height * 4, 1);
-		// read the image into the outpubuf - RGBA format
-		mister_scaler_read_32(ms,outputbuf);
-		// using_data will keep a pointer and dispose of the outbuf
-		Imlib_Image im = imlib_create_image_using_data(ms->width,ms->height,(unsigned int *)outputbuf);
-		imlib_context_set_image(im);
-
-		static char filename[1024];
-		FileGenerateScreenshotName(basename, filename, 1024);
-
-		/* do we want to save a rescaled image? */
-		if (rescale)
-		{
-			Imlib_Image im_scaled=imlib_create_cropped_scaled_image(0,0,ms->width,ms->height,scwidth,scheight);
-			imlib_free_image_and_decache();
-			imlib_context_set_image(im_scaled);
-		}
-		Imlib_Load_Error error;
-		imlib_save_image_with_error_return(getFullPath(filename),&error);
-		if (error != IMLIB_LOAD_ERROR_NONE)
-		{
-			print_imlib_load_error (error, filename);
-			Info("error in saving png");
-			return false;
-		}
-		imlib_free_image_and_decache();
-		mister_scaler_free(ms);
-		free(outputbuf);
-		char msg[1024];
-		snprintf(msg, 1024, "Screen saved to\n%s", filename + strlen(SCREENSHOT_DIR"/"));
-		Info(msg);
-	}
-	return true;
+	return capture_screenshot(basename, rescale, done);
 }
 
 void user_io_screenshot_cmd(const char *cmd)
@@ -8,6 +8,7 @@
 
 #include <inttypes.h>
 #include "file_io.h"
+#include "capture.h"
 
 #define UIO_STATUS      0x00
 #define UIO_BUT_SW      0x01
@@ -235,7 +236,8 @@ void user_io_check_reset(unsigned short modifiers, char useKeys);
 void user_io_rtc_reset();
 
 void user_io_screenshot_cmd(const char *cmd);
-bool user_io_screenshot(const char *pngname, int rescale);
+// True once queued, the result is reported as for capture_screenshot().
+bool user_io_screenshot(const char *pngname, int rescale, capture_done_t done = NULL);
 
 const char* get_rbf_dir();
 const char* get_rbf_name();
@@ -3122,7 +3122,7 @@ static void fb_write_module_params()
 			fprintf(fp, "%d %d %d %d %d\n", 8888, 1, width, height, width * 4);
 			fclose(fp);
 		}
-	});
+	}, OFFLOAD_LOW);
 }
 
 void video_fb_enable(int enable, int n)
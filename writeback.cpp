@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "writeback.h"
+#include "readahead.h"
+#include "offload.h"
+#include "hardware.h"
+
+#define WB_DISKS       20
+#define WB_EXTENTS     256
+#define WB_MAX_DIRTY   (4 * 1024 * 1024) // per disk; larger backlogs are flushed right away
+#define WB_IDLE_MS     100               // flush after the core stopped writing for this long
+#define WB_DEADLINE_MS 2000              // oldest dirty data is written within this time
+
+struct wb_extent_t
+{
+	uint64_t off;
+	uint32_t len;
+	uint32_t cap;
+	uint8_t *data;
+};
+
+struct wb_list_t
+{
+	wb_extent_t ext[WB_EXTENTS];
+	int num;
+	uint32_t bytes;
+};
+
+struct wb_disk_t
+{
+	wb_list_t dirty;
+	wb_list_t flushing; // owned by the worker while a flush is in flight
+	int fd;
+	int in_flight;
+	int error;          // set by the worker
+	uint64_t flush_us;  // set by the worker
+	offload_handle_t handle;
+	unsigned long idle_timer;
+	unsigned long deadline;
+};
+
+static wb_disk_t disks[WB_DISKS] = {};
+
+static struct
+{
+	uint64_t writes;
+	uint64_t merged;     // writes that extended or overwrote a cached extent
+	uint64_t bytes;
+	uint64_t flushes;
+	uint64_t extents;    // file writes issued by flushes
+	uint64_t flush_us;
+	uint64_t flush_max_us;
+	uint64_t barriers;   // flushes the main loop had to wait for
+	uint64_t barrier_us;
+	uint64_t barrier_max_us;
+	uint64_t errors;
+} stats;
+
+static void list_free(wb_list_t *list)
+{
+	for (int i = 0; i < list->num; i++) free(list->ext[i].data);
+	list->num = 0;
+	list->bytes = 0;
+}
+
+// runs on a worker
+static void flush_list(wb_disk_t *wb)
+{
+	uint64_t t = time_us();
+
+	for (int i = 0; i < wb->flushing.num; i++)
+	{
+		wb_extent_t *e = &wb->flushing.ext[i];
+		if (pwrite(wb->fd, e->data, e->len, e->off) != (ssize_t)e->len)
+		{
+			printf("writeback: failed to write %u bytes at %llu\n", e->len, (unsigned long long)e->off);
+			wb->error = 1;
+		}
+	}
+
+	wb->flush_us = time_us() - t;
+}
+
+static void reap(int disk, int wait)
+{
+	wb_disk_t *wb = &disks[disk];
+	if (!wb->in_flight) return;
+
+	if (!offload_done(&wb->handle))
+	{
+		if (!wait) return;
+
+		uint64_t t = time_us();
+		offload_wait(&wb->handle);
+
+		t = time_us() - t;
+		stats.barriers++;
+		stats.barrier_us += t;
+		if (t > stats.barrier_max_us) stats.barrier_max_us = t;
+	}
+
+	if (wb->error) stats.errors++;
+	wb->error = 0;
+
+	stats.flush_us += wb->flush_us;
+	if (wb->flush_us > stats.flush_max_us) stats.flush_max_us = wb->flush_us;
+
+	wb->in_flight = 0;
+	list_free(&wb->flushing);
+
+	// prefetches issued during the flush may hold data older than the image
+	readahead_invalidate(disk);
+}
+
+static void start_flush(int disk)
+{
+	wb_disk_t *wb = &disks[disk];
+	if (wb->in_flight || !wb->dirty.num) return;
+
+	memcpy(&wb->flushing, &wb->dirty, sizeof(wb->flushing));
+	wb->dirty.num = 0;
+	wb->dirty.bytes = 0;
+
+	stats.flushes++;
+	stats.extents += wb->flushing.num;
+
+	wb->in_flight = 1;
+	offload_add_work([wb]() { flush_list(wb); }, OFFLOAD_LOW, &wb->handle);
+}
+
+static int insert(wb_list_t *list, uint64_t off, const void *buf, uint32_t len)
+{
+	uint64_t end = off + len;
+
+	// extents are sorted; find the ones that overlap or touch [off, end)
+	int i = 0;
+	while (i < list->num && list->ext[i].off + list->ext[i].len < off) i++;
+	int j = i;
+	while (j < list->num && list->ext[j].off <= end) j++;
+
+	if (i == j)
+	{
+		if (list->num >= WB_EXTENTS) return 0;
+
+		uint8_t *data = (uint8_t*)malloc(len);
+		if (!data) return 0;
+		memcpy(data, buf, len);
+
+		memmove(&list->ext[i + 1], &list->ext[i], (list->num - i) * sizeof(wb_extent_t));
+		list->ext[i] = { off, len, len, data };
+		list->num++;
+		list->bytes += len;
+		return 1;
+	}
+
+	stats.merged++;
+
+	uint64_t start = (list->ext[i].off < off) ? list->ext[i].off : off;
+	uint64_t last = list->ext[j - 1].off + list->ext[j - 1].len;
+	if (last < end) last = end;
+	uint32_t size = last - start;
+
+	wb_extent_t *e = &list->ext[i];
+	if (j == i + 1 && e->off == start)
+	{
+		// the common case: appending to or overwriting one extent
+		if (size > e->cap)
+		{
+			uint32_t cap = e->cap * 2;
+			if (cap < size) cap = size;
+			uint8_t *data = (uint8_t*)realloc(e->data, cap);
+			if (!data) return 0;
+			e->data = data;
+			e->cap = cap;
+		}
+
+		memcpy(e->data + (off - start), buf, len);
+		list->bytes += size - e->len;
+		e->len = size;
+		return 1;
+	}
+
+	uint8_t *data = (uint8_t*)malloc(size);
+	if (!data) return 0;
+
+	for (int n = i; n < j; n++)
+	{
+		wb_extent_t *src = &list->ext[n];
+		memcpy(data + (src->off - start), src->data, src->len);
+		list->bytes -= src->len;
+		free(src->data);
+	}
+	memcpy(data + (off - start), buf, len);
+
+	list->ext[i] = { start, size, size, data };
+	memmove(&list->ext[i + 1], &list->ext[j], (list->num - j) * sizeof(wb_extent_t));
+	list->num -= j - i - 1;
+	list->bytes += size;
+	return 1;
+}
+
+int writeback_write(int disk, fileTYPE *f, uint64_t off, const void *buf, uint32_t len)
+{
+	int fd = f->filp ? fileno(f->filp) : -1;
+	if (disk < 0 || disk >= WB_DISKS || fd < 0) return 0;
+
+	wb_disk_t *wb = &disks[disk];
+	if (wb->fd != fd)
+	{
+		writeback_flush(disk);
+		wb->fd = fd;
+	}
+
+	reap(disk, 0);
+	if (!wb->dirty.num) wb->deadline = GetTimer(WB_DEADLINE_MS);
+	wb->idle_timer = GetTimer(WB_IDLE_MS);
+
+	// make room: wait for the flush in flight and send the backlog after it
+	if (wb->dirty.bytes + len > WB_MAX_DIRTY || !insert(&wb->dirty, off, buf, len))
+	{
+		reap(disk, 1);
+		start_flush(disk);
+		if (!insert(&wb->dirty, off, buf, len))
+		{
+			reap(disk, 1);
+			return 0;
+		}
+	}
+
+	stats.writes++;
+	stats.bytes += len;
+	return 1;
+}
+
+static void overlay(const wb_list_t *list, uint64_t off, uint8_t *buf, uint32_t len)
+{
+	uint64_t end = off + len;
+	for (int i = 0; i < list->num; i++)
+	{
+		const wb_extent_t *e = &list->ext[i];
+		if (e->off >= end) break;
+
+		uint64_t s = (e->off > off) ? e->off : off;
+		uint64_t t = (e->off + e->len < end) ? e->off + e->len : end;
+		if (s < t) memcpy(buf + (s - off), e->data + (s - e->off), t - s);
+	}
+}
+
+void writeback_overlay(int disk, uint64_t off, void *buf, uint32_t len)
+{
+	if (disk < 0 || disk >= WB_DISKS) return;
+
+	// older data first
+	overlay(&disks[disk].flushing, off, (uint8_t*)buf, len);
+	overlay(&disks[disk].dirty, off, (uint8_t*)buf, len);
+}
+
+void writeback_poll()
+{
+	for (int i = 0; i < WB_DISKS; i++)
+	{
+		wb_disk_t *wb = &disks[i];
+		if (!wb->in_flight && !wb->dirty.num) continue;
+
+		reap(i, 0);
+		if (wb->dirty.num && (CheckTimer(wb->idle_timer) || CheckTimer(wb->deadline))) start_flush(i);
+	}
+}
+
+void writeback_flush(int disk)
+{
+	if (disk < 0 || disk >= WB_DISKS) return;
+
+	reap(disk, 1);
+	start_flush(disk);
+	reap(disk, 1);
+}
+
+void writeback_flush_all()
+{
+	for (int i = 0; i < WB_DISKS; i++) writeback_flush(i);
+}
+
+void writeback_print_stats()
+{
+	uint32_t dirty = 0;
+	for (int i = 0; i < WB_DISKS; i++) dirty += disks[i].dirty.bytes;
+
+	printf("writeback: %llu writes (%llu merged, %llu bytes), %u bytes dirty, %llu errors\n",
+		stats.writes, stats.merged, stats.bytes, dirty, stats.errors);
+	printf("writeback: %llu flushes, %llu file writes, flush avg/max %llu/%llu us, %llu waited (avg/max %llu/%llu us)\n",
+		stats.flushes, stats.extents,
+		stats.flushes ? stats.flush_us / stats.flushes : 0, stats.flush_max_us,
+		stats.barriers, stats.barriers ? stats.barrier_us / stats.barriers : 0, stats.barrier_max_us);
+}
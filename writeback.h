@@ -0,0 +1,27 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdint.h>
+#include "file_io.h"
+
+// Write-back cache for the SD card emulation in user_io_poll(). Sector writes
+// are kept in memory, adjacent ones are merged, and the result is written by
+// the offload workers once the disk is idle or the data gets too old.
+
+// Buffers a write of len bytes at off. Returns 0 if the image can't be cached
+// (no file descriptor); the caller then writes synchronously.
+int writeback_write(int disk, fileTYPE *f, uint64_t off, const void *buf, uint32_t len);
+
+// Copies cached data over a buffer just read from the image.
+void writeback_overlay(int disk, uint64_t off, void *buf, uint32_t len);
+
+// Starts flushes that are due; call periodically from the main loop.
+void writeback_poll();
+
+// Barrier: returns once all cached data of the disk is written to the image.
+void writeback_flush(int disk);
+void writeback_flush_all();
+
+void writeback_print_stats();
+
+#endif